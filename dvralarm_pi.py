@@ -22,6 +22,12 @@
 # WITH ANY OTHER PROGRAMS), EVEN IF THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
 
 ## Version history
+# 0.3   2026-10-16
+#   Clips are mailed as zmodopipe closes them, streamed from the files by dvrmail.py
+#   The most active cameras are attached first, MIN_ACTIVITY leaves out the quiet ones
+#   MAIL_BUDGET caps the size of the mail, clips are cut to the GOPs nearest the trigger
+#   -t checks the alarm path against dvremu and a stand-in mail relay, no Pi needed
+#   -l measures the time from trigger to mail with 1 to 16 channels
 # 0.2   2015-07-18
 #   Implemented external configuration file, streamlined installation
 # 0.1   2015-06-19
@@ -31,7 +37,6 @@
 ## Todo List
 # 
 # Natively implement DVR Streaming, remove zmodopipe
-# Use alternative mp4 encapsulation technique, remove ffmpeg requirement
 #
 ##
 
@@ -44,30 +49,39 @@ import glob                                 # unix file pattern matching library
 import subprocess                           # to spawn new processes
 import shutil                               # utility to join movie clips together
 import signal
+import struct                               # malformed clips raise struct.error
 import shlex                                # split strings
-import RPi.GPIO as GPIO                     # library for handling Rpi GPIO
+try:
+    import RPi.GPIO as GPIO                 # library for handling Rpi GPIO
+except ImportError:
+    GPIO = None                             # not on a Pi, only the self-test (-t) runs
 import json                                 # for json configuration file
 import threading                            # handle multiple threads, used for each channel
 import io
 import logging                              # library to log to log file
 import getopt                               # for parsing command-line options
 import termios, tty
-from collections import deque
+import socket                               # stand-in mail relay of the self-test
+import tempfile
+import contextlib
+import multiprocessing                      # CPU count, bounds the latency test
 
-import smtplib                              # libraries required for sending email
+import dvrmail                              # sends the mail, attachments are streamed from the files
+import dvrclip                              # trims the clips to whole GOPs to fit MAIL_BUDGET
 from os.path import basename
-from email.mime.base import MIMEBase
-from email.mime.multipart import MIMEMultipart
-from email.mime.text import MIMEText
-from email.utils import COMMASPACE, formatdate
-from email import encoders
 
 # General Variables
 LEVEL = logging.INFO                        # Default Log Level, debug, info, warning, error and critical
 DAEMONIZE = False                           # Do not suppress CLI output by default override with -d arg
 INIT_C = False                              # Configuration Initialisation flag
 PIDS = []                                   # List to keep track of all subprocesses
-GPIO.setmode(GPIO.BCM)                      # Rpi GPIO PIN Layout settings
+ZPROC = None                                # zmodopipe subprocess, holds the pre-alarm buffers
+INCIDENT = threading.Lock()                 # held until zmodopipe closes the incident being mailed
+LAST_TRIGGER = 0                            # time of the latest trigger, extends the open incident
+TRIGGERS = []                               # times of the triggers since that incident opened
+TRIGGER_LOCK = threading.Lock()             # orders a trigger against the incident closing, see claimIncident()
+MAILED = set()                              # manifests and clips of the closed incidents
+if GPIO: GPIO.setmode(GPIO.BCM)             # Rpi GPIO PIN Layout settings
 CONFIG = {}                                 # Config variables array
 
 ''' Have been implemented in the configuration file
@@ -87,9 +101,17 @@ MAIL_SERVER = '127.0.0.1'
 
 # Other potentially configurable variables
 SEG_TIME = 8                                # length in sec of each video segment created
+POST_TIME = 4                               # sec of video after the last trigger added to each clip
+CH_POST = {}                                # per channel POST_TIME, config 'CH_POST': "ch:sec,ch:sec"
+MIN_ACTIVITY = None                         # only attach clips this active, config 'MIN_ACTIVITY', see incidentClips()
+MAIL_BUDGET = None                          # max bytes of an alert mail, config 'MAIL_BUDGET', see budgetClips()
+MAIL_THIN = False                           # drop non-reference frames before whole channels to fit, config 'MAIL_THIN'
+DUMP_TIMEOUT = 5                            # max sec to wait for zmodopipe to dump its buffers
+DUMP_THREADS = 8                            # most threads zmodopipe muxes the clips on, one per CPU
+MAIL_PORT = 25                              # port of MAIL_SERVER, 465 doesn't seem to work
 TMP_PATH = '/tmp/dvralert'                  # path to tmp folders
+RING_PATH = '/run/dvralarm'                 # zmodopipe keeps its pre-alarm buffers here, config 'RING_PATH', see -P
 LOGFILE = '/var/log/dvralarm.log'           # Path to logfile
-FFMPEG_PATH = '/usr/bin/ffmpeg'             # path to ffmpeg bin
 ZMOD = '/usr/bin/zmodopipe'                 # path to zmodopipe bin
 CONF_FILE = '/etc/dvralarm/config.json'   # dvralarm config file
 
@@ -97,80 +119,18 @@ def usage():
   """ Print the usage text from the main() docstring."""
   print main.__doc__
 
-class RingBuffer:
-    '''
-        ringbuffer to keep only last few bytes from h264 stream using array
-    '''
-    def __init__(self, size):
-        self.data = [None for i in xrange(size)]
-
-    def append(self, x):
-        self.data.pop(0)
-        self.data.append(x)
-
-    def get(self):
-        return self.data
-
-class CircularBuffer(deque):
-    '''
-        Circular buffer to keep only last few bytes from h264 stream using deque
-    '''
-    def __init__(self, size):
-         deque.__init__(self)
-
-         assert size > 0
-         self.capacity = size
-
-    def append(self, x):
-        while len(self) >= self.capacity:
-            self.popleft()
-        deque.append(self, x)
-
-    def get(self):
-        return self
-
 def send_mail(send_from, send_to, subject, text, files, server):
     '''
-        Function to send email with attachments
+        Function to send email with attachments, files yields the clips as they become ready.
+        The mail goes out once the first one is there, each is base64 encoded chunk by chunk
+        straight onto the socket as soon as it comes, nothing is held in memory.
     '''
     logger.debug('sending mail\nFrom: %s\nTo: %s\nSubject: %s\nText: %s\nServer: %s' % (send_from, send_to, subject, text, server))
     
-    msg = MIMEMultipart()
-    msg['Subject'] = subject 
-    msg['From'] = send_from
-    msg['To'] = send_to
-    msg.attach(MIMEText(text))
-
-    for f in files:
-        
-        try:
-            part = MIMEBase('application', "octet-stream")
-            part.set_payload( open(f,"rb").read() )
-            encoders.encode_base64(part)
-            part.add_header('Content-Disposition', 'attachment; filename="{0}"'.format(os.path.basename(f)))
-            msg.attach(part)
-        except Exception:
-            msg.attach(MIMEText('\nFailed to attach %s, skipping' % f))
-            logger.warning('failed to attach %s, skipping' % f, exc_info=True)
-        
-        '''
-        with open(f, "rb") as fil:
-            msg.attach(MIMEApplication(
-                fil.read(),
-                Content_Disposition='attachment; filename="%s"' % basename(f)
-            ))
-        '''
-        
     try:
-        server = smtplib.SMTP(server, 25) #or port 465 doesn't seem to work!
-        #server.ehlo()
-        #server.starttls()
-        #server.login(user, pwd)
-        server.sendmail(send_from, send_to, msg.as_string())
-        #server.quit()
-        server.close()
+        attached = dvrmail.send(server, send_from, send_to, subject, text, files, MAIL_PORT)
         #print 'successfully sent the mail'
-        logger.info('successfully sent the mail')
+        logger.info('successfully sent the mail with %s attachment(s)' % attached)
     except Exception:
         #print "failed to send mail"
         logger.warning('failed to send mail', exc_info=True)
@@ -372,174 +332,314 @@ def clean_processes(PROCS):
             os.killpg(proc.pid, signal.SIGTERM)
     logger.info('Completed cleaning up sub-processes')    
 
-def transcodeVid(inputf):
+def buildAlert():
     '''
-        Function to encaptulate raw h264 streams with mp4 container
-        File created from ringbuffer can be transcoded using the following ffmpeg command.
-        ffmpeg -f h264 -i /tmp/dvralert/2015-05-03_14-10-52_ch01.h264 -reset_timestamps 1 -c copy -an /tmp/dvralert/2015-05-03_14-10-52_ch01.mp4
-        ffmpeg -f h264 -i /tmp/test.h264 -reset_timestamps 1 -y -c copy -an /tmp/test.mp4
-    
+    Function to have zmodopipe dump its pre-alarm buffers as mp4 and mail them
     '''
-    dst = []
     
-    #print inputf
-    logger.debug('Transcoding captured h264 files to mp4')
-    logger.debug(inputf)
-    
-    for fi in inputf:                        # Run ffmpeg for each channel
-    
-        file = os.path.splitext(fi)
-        dst.append('%s.%s' % (file[0], 'mp4'))
-        #print dst
-    
-        ffmpeg = '%s -f h264 -i %s -reset_timestamps 1 -y -c copy -an %s' % (FFMPEG_PATH, fi, dst[-1])
-    
-        command = shlex.split(ffmpeg)       # split str by spaces for Popen    
-    
-        try:
-            #print 'Spawning: %s' % ffmpeg
-            logger.debug('Spawning: %s' % ffmpeg)
-
-            PIDS.append(subprocess.Popen(command, shell=False, stdout=subprocess.PIPE,
-                           stderr=subprocess.PIPE))
-            PIDS[-1].wait()
-            stdout, stderr = PIDS[-1].communicate()
-            if PIDS[-1].returncode != 0:
-                #print '\tstderr: ', repr(stderr)
-                #print 'failed to transcode alarm video %s' % dst[-1]
-                logger.debug('ffmpeg output:\n', repr(stderr))
-                logger.error('failed to transcode alarm video %s' % dst[-1])
-            else:
-                #print 'completed transcoding %s' % (dst[-1])
-                logger.info('Completed transcoding %s' % (dst[-1]))
-                #break
-        
-        except Exception:
-            #print 'cannot spawn ffmpeg to transcode %s' % fi          
-            logger.debug('%s' % ffmpeg)
-            logger.error('cannot spawn ffmpeg to transcode %s' % fi, exc_info=True)
-    
-        if not is_locked(fi):
-            logger.debug('deleting temp file %s' % fi)
-            if LEVEL != logging.DEBUG: os.remove(fi)
-    
-    send_mail(CONFIG['MAIL_FROM'], CONFIG['MAIL_TO'], 'DVR Alarm %s' \
-        % time.strftime("%Y-%m-%d_%H-%M-%S"), CONFIG['MAIL_BODY'], dst, CONFIG['MAIL_SERVER'])
-    
-def buildAlert(alarm_detected):
-    '''
-    Function to find latest video files and send for transcoding
-    '''
-    
-    outf = []
-    ch_files = {}
+    global LAST_TRIGGER
     
     # capture the time when the alarm sounds = eventtime
     eventtime = time.time()
+    LAST_TRIGGER = eventtime
     #print 'Alarm Time: %s' % eventtime
     logger.info('Alarm Time: %s' % time.strftime("%Y/%m/%d %H:%M:%S"))
     
-    alarm_detected.set()
+    # zmodopipe keeps the last SEG_TIME seconds of every channel and dumps them on SIGHUP,
+    # a SIGHUP while the clips of an incident are still open extends them instead
+    try:
+        os.kill(ZPROC.pid, signal.SIGHUP)
+    except Exception:
+        logger.error('Cannot signal zmodopipe to dump its buffers', exc_info=True)
+        return
+    
+    # one mail per incident, the trigger only extended the one being captured. If zmodopipe
+    # closed that one meanwhile the trigger opened a new one, claimIncident() mails it
+    with TRIGGER_LOCK:
+        TRIGGERS.append(eventtime)
+        if not INCIDENT.acquire(False):
+            logger.info('Incident in progress, extending its clips')
+            return
+        TRIGGERS[:] = [eventtime]
+    
+    startMailer(eventtime)
+
+def startMailer(eventtime):
+    ''' Mail the incident opened at eventtime, without holding up the GPIO callback thread '''
+    mailer = threading.Thread(target=mailIncident, args=(eventtime,))
+    mailer.daemon = True
+    mailer.start()
+
+def claimIncident(path, snapshot):
+    '''
+    zmodopipe listed the incident being mailed in the manifest at path, so it's closed and the
+    next trigger opens a new one. Lets that trigger start its mail while this one still goes out.
+    Triggers that came after the incident's last alarm already opened one, it's mailed straight away.
+    '''
+    MAILED.add(path)
+    MAILED.update([os.path.join(TMP_PATH, clip['file']) for clip in snapshot['clips']])
+    
+    # a trigger is timed before its SIGHUP, zmodopipe times the alarm in whole ms after it
+    with TRIGGER_LOCK:
+        TRIGGERS[:] = [t for t in TRIGGERS if t * 1000 > snapshot['last'] + 1]
+        if not TRIGGERS:
+            INCIDENT.release()
+            return
+        eventtime = TRIGGERS[0]
+    
+    logger.info('Trigger after the incident closed, mailing the next one')
+    startMailer(eventtime)
+
+def incidentClips(eventtime, manifest):
+    '''
+    Generator of the clips of an incident in the order they close. zmodopipe renames each clip
+    into place as it closes, it's mailed straight away while the other channels' clips are still
+    being written. manifest[0] is set once zmodopipe lists them all, with the activity zmodopipe
+    saw in each clip: the ones still left then go most active first.
+    With MIN_ACTIVITY only the clips at least that active are mailed, most active first, which
+    has to wait for the manifest. The most active one always is.
+    With MAIL_BUDGET the clips are trimmed to fit it together once the manifest is in, see budgetClips().
+    '''
     
-    while alarm_detected.is_set():
-        time.sleep(0.1)                                           # wait for buffer to complete saving
+    sent = set()
+    longest = max([POST_TIME] + CH_POST.values())
     
-    # get all files related to each channel and sort according to modified date.
-    for ch in CH_LIST:
-        ch_files[ch] = [file for file in glob.glob("%s/*ch0%s.h264" % (TMP_PATH,ch))]
-        if len(ch_files[ch]) > 1:
-            ch_files[ch].sort(key=os.path.getctime)             # be careful this must be modification time
-        #else:
-        #    print 'Warning: There is only 1 recording file available for channel %s' % ch
+    while True:
+        # every channel is cut around the same instant, once the last clip is written zmodopipe
+        # lists them all in a <stamp>.json manifest, renamed into place once complete
+        if manifest[0] is None:
+            files = [file for file in glob.glob("%s/*.json" % TMP_PATH) \
+                    if os.path.getmtime(file) >= int(eventtime) and file not in MAILED]
+            if files:
+                path = min(files, key=os.path.getmtime)
+                with open(path) as f:
+                    manifest[0] = json.load(f)
+                claimIncident(path, manifest[0])
+        
+        if manifest[0] is None and MIN_ACTIVITY is None and MAIL_BUDGET is None:
+            clips = [file for file in glob.glob("%s/*_ch*.mp4" % TMP_PATH) \
+                    if not file.endswith('_crash.mp4') and os.path.getmtime(file) >= int(eventtime) and file not in MAILED]
+        elif manifest[0] is None:
+            clips = []
+        else:
+            ranked = sorted(manifest[0]['clips'], key=lambda clip: -clip.get('activity', 0))
+            if MIN_ACTIVITY is not None:
+                for clip in ranked[1:]:
+                    if clip.get('activity', 0) < MIN_ACTIVITY and os.path.join(TMP_PATH, clip['file']) not in sent:
+                        logger.info('CH%s activity %.2f, not attached' % (clip['channel'], clip.get('activity', 0)))
+                        sent.add(os.path.join(TMP_PATH, clip['file']))
+            clips = [os.path.join(TMP_PATH, clip['file']) for clip in ranked]
+            if MAIL_BUDGET is not None:
+                for trimmed in budgetClips(manifest[0], [clip for clip in ranked if os.path.join(TMP_PATH, clip['file']) not in sent]):
+                    logger.debug('Mailing %s' % trimmed.name)
+                    yield trimmed
+                return
+        
+        ready = [chf for chf in clips if chf not in sent]
+        for chf in ready:
+            logger.debug('Mailing %s' % chf)
+            sent.add(chf)
+            yield chf
+        
+        if manifest[0] is not None and not ready:
+            return
+        if manifest[0] is None and time.time() > LAST_TRIGGER + longest + DUMP_TIMEOUT:
+            logger.warning('no snapshot received from zmodopipe')
+            return
+        if not ready:
+            time.sleep(0.05)
+
+def budgetClips(snapshot, clips):
+    '''
+    The clips of a snapshot trimmed to fit a mail of MAIL_BUDGET bytes together. Each is cut
+    to whole GOPs, the ones nearest the alarm go in first across all channels, then the most
+    active channel's. A channel that can't have even its GOP at the alarm is left out, with
+    MAIL_THIN every clip loses its non-reference frames first if that keeps it in. The mail
+    always goes, if need be with no clip at all.
+    '''
     
+    indexed = []
+    for clip in clips:
+        try:
+            indexed.append(dvrclip.Clip(os.path.join(TMP_PATH, clip['file']), clip['start'], clip['channel'], clip.get('activity', 0)))
+        except (IOError, OSError, struct.error):
+            logger.warning('CH%s cannot read %s' % (clip['channel'], clip['file']), exc_info=True)
+    
+    room = dvrmail.payload(MAIL_BUDGET, len(indexed), CONFIG['MAIL_BODY'])
+    trimmed = dvrclip.plan(indexed, snapshot['alarm'], room, MAIL_THIN)
+    
+    for clip in indexed:
+        if clip not in [cut.clip for cut in trimmed]:
+            logger.warning('CH%s left out, its clip does not fit the %s byte mail budget' % (clip.channel, MAIL_BUDGET))
+    for cut in trimmed:
+        if cut.first > 0 or cut.last < len(cut.clip.fragments) or cut.thinned:
+            logger.info('CH%s trimmed to %+.1fs..%+.1fs%s, %s of %s bytes' % (cut.clip.channel,
+                (cut.clip.start + cut.clip.fragments[cut.first].time - snapshot['alarm']) / 1000.0,
+                (cut.clip.start + cut.clip.fragments[cut.last - 1].time + cut.clip.fragments[cut.last - 1].duration - snapshot['alarm']) / 1000.0,
+                ' without non-reference frames' if cut.thinned else '', cut.size, os.path.getsize(cut.clip.path)))
+    return trimmed
+
+def mailIncident(eventtime):
+    '''
+    Function to mail the clips of an incident as zmodopipe writes them
+    '''
     
-    #print ch_files                                             # print sorted file matrix
-    for ch in CH_LIST:
-        logger.debug('CH%s files found in tmp' % ch)
-        for chf in ch_files[ch]:
-            #print 'CH%s:\t%s\t%.0f' %(ch, chf, os.stat(chf).st_ctime)
-            logger.debug('CH%s:\t%s\t%.0f' %(ch, chf, os.stat(chf).st_ctime))
-        outf.append(chf)                                        # keep the latest files of each channel
+    manifest = [None]
     
-    transcodeVid(outf)
+    try:
+        send_mail(CONFIG['MAIL_FROM'], CONFIG['MAIL_TO'], 'DVR Alarm %s' \
+            % time.strftime("%Y-%m-%d_%H-%M-%S", time.localtime(eventtime)), CONFIG['MAIL_BODY'],
+            incidentClips(eventtime, manifest), CONFIG['MAIL_SERVER'])
+        
+        snapshot = manifest[0]
+        if snapshot is None:
+            return
+        
+        for clip in snapshot['clips']:
+            logger.debug('CH%s:\t%s\t%+.1fs\t%+.1fs\tactivity %.2f' %(clip['channel'], clip['file'], (clip['start'] - snapshot['alarm']) / 1000.0,
+                (clip['end'] - snapshot['alarm']) / 1000.0, clip.get('activity', 0)))
+        
+        for ch in CH_LIST:
+            if ch not in [clip['channel'] for clip in snapshot['clips']]:
+                logger.warning('CH%s no buffer dump received from zmodopipe' % ch)
+        
+        logger.info('Incident of %s trigger(s) captured in %.1fs' % (snapshot['alarms'], time.time() - eventtime))
+    except Exception:
+        logger.error('Failed to mail the incident', exc_info=True)
+    finally:
+        # claimed once the manifest is in, otherwise zmodopipe never closed it
+        if manifest[0] is None:
+            INCIDENT.release()
 
 def exit(work_completed):
     ''' function to notify all threads to finish processing '''
     work_completed.set()                                # Notify threads to finish processing
     pass
 
-def readBuffer(ch, alarm_detected, work_completed):
+def zmodopipeCommand():
+    ''' The zmodopipe command line for the configuration, see main() '''
+    cstr = ''
+    for ch in CH_LIST: cstr += "-c %s " % ch
+    for ch in CH_POST: cstr += "-A %s:%s " % (ch, CH_POST[ch])
+    return '%s -e -b %s -A %s -P %s -d %s -f mp4 -s %s -u %s -a %s %s-m %s' % (ZMOD, SEG_TIME, POST_TIME, RING_PATH, TMP_PATH, CONFIG['DVR_IP'], CONFIG['DVR_USER'], CONFIG['DVR_PASS'], cstr, CONFIG['DVR_MODEL'])
+
+@contextlib.contextmanager
+def testRig(channels, delay):
     '''
-    Function to continually read named pipe into ringbuffer and save to file  when alarm is triggered
+    zmodopipe streaming that many channels of dvremu into a fresh TMP_PATH, no Pi or DVR needed.
+    The mails go to dvrmail's stand-in relay, which holds each one delay seconds before accepting
+    it. Yields the list the relay adds each mail it took to, as (path, time it came in), once the
+    pre-alarm buffers are full.
     '''
     
-    #buf = RingBuffer(12288)                            # ringbuffer less effective than circular buffer using dequeue
-    buf = CircularBuffer(320*SEG_TIME)                    # 300 * 32 bytes ~ 1 sec video
-    zpipe = '/tmp/zmodo%s' % (ch-1)
-    blocksize = 32
+    global ZPROC, TMP_PATH, RING_PATH, ZMOD, SEG_TIME, POST_TIME, MAIL_PORT, CH_LIST, CONFIG
+    
+    here = os.path.dirname(os.path.abspath(__file__))
+    TMP_PATH = tempfile.mkdtemp(prefix='dvralarm')
+    RING_PATH = os.path.join(TMP_PATH, 'ring')
+    ZMOD = os.path.join(here, 'zmodopipe')
+    SEG_TIME, POST_TIME, CH_LIST = 2, 1, range(1, channels + 1)
+    CONFIG = {'DVR_IP': '127.0.0.1', 'DVR_USER': 'admin', 'DVR_PASS': 'admin', 'DVR_MODEL': 1, 'MAIL_SERVER': '127.0.0.1',
+        'MAIL_FROM': 'alarm@localhost', 'MAIL_TO': 'admin@localhost', 'MAIL_BODY': 'dvralarm self-test'}
+    ensure_dir(RING_PATH)
+    ensure_dir(os.path.join(TMP_PATH, 'mail'))
+    
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(4)
+    MAIL_PORT = listener.getsockname()[1]
+    mails = []
+    def relay():
+        while True:
+            path = os.path.join(TMP_PATH, 'mail', 'mail%i.eml' % len(mails))
+            dvrmail._serve(listener, path, [], delay)
+            mails.append((path, os.path.getmtime(path)))
+    relayer = threading.Thread(target=relay)
+    relayer.daemon = True
+    relayer.start()
+    
+    devnull = open(os.devnull, 'w')
+    emu = subprocess.Popen([os.path.join(here, 'dvremu'), '-m', '1', '-c', str(channels)], stdout=devnull)
+    ZPROC = subprocess.Popen(shlex.split(zmodopipeCommand()), stdout=devnull, stderr=devnull)
+    try:
+        time.sleep(SEG_TIME + 1)
+        yield mails
+    finally:
+        for proc in (ZPROC, emu):
+            proc.terminate()
+            proc.wait()
+        devnull.close()
+        shutil.rmtree(TMP_PATH, ignore_errors=True)
+
+def selfTest():
+    '''
+    Two triggers further apart than the post-roll, the second while the relay still holds
+    the first mail, have to be mailed one each with a clip of every channel. Returns True if they were.
+    '''
     
-    while not work_completed.is_set():                  # exit here when we close the program
-        if os.path.exists(zpipe):
-            try:
-                with open(zpipe, 'rb') as fh:
-                    #print threading.currentThread().getName(), 'started'
-                    logger.debug('%s thread started' % threading.currentThread().getName())
-                    
-                    while not alarm_detected.is_set() and not work_completed.is_set():      # exit here when we raise an alarm
-                        block = fh.read(blocksize)
-                        '''
-                        # perform some cleanup of the received h264 stream
-                        for ch in block:
-                            str += hex(ord(ch))+" "
-                        print str
-                        #buf.append(fh.read(32))            # 32 seems to be a happy medium value between read wait and CPU usage
-                        '''
-                        buf.append(block)
-
-            except Exception:
-                #print errtxt
-                logger.error('Cannot read data from %s confirm zmodopipe is running and streaming video' % zpipe, exc_info=True)
-            
-            if work_completed.is_set(): break           # avoid writing buffer on normal exit
-            
-            ## write buffer to file when alarm_detected.is_set ##
-            ofile = '%s/%s_ch0%s.h264' \
-                    % (TMP_PATH,time.strftime("%Y%m%d_%H%M%S"),ch)
-            try:
-                with open(ofile, 'wb') as fo:
-                    bytearray = buf.get()
-                    #printBuf(bytearray)
-            
-                    for byte in bytearray:              # sequentially read ringbuffer and write to file
-                        if byte != None:
-                            fo.write(byte)
-                
-                time.sleep(1)                            # wait 1 second, should be enough time for all threads to complete action
-                alarm_detected.clear()                  # reset alarm trigger since file is captured
-                
-            except Exception:
-                    #print errtxt
-                    logger.error('Cannot write ringbuffer data to file %s' % ofile, exc_info=True)
+    with testRig(2, 3) as mails:
+        buildAlert()
+        time.sleep(POST_TIME + 1.5)
+        buildAlert()
+        deadline = time.time() + POST_TIME + DUMP_TIMEOUT + 10
+        while len(mails) < 2 and time.time() < deadline:
+            time.sleep(0.1)
         
-        else:
-            time.sleep(0.5)                             # sleep if the zmodopipe is not yet available
-        
-    #print threading.currentThread().getName(), 'closed'
-    logger.info('CH%s stopped readbuffer thread' % ch)
-    logger.debug('%s thread closed' % threading.currentThread().getName())
+        ok = len(mails) == 2
+        for path, received in mails:
+            with open(path + '.json') as f:
+                clips = json.load(f)
+            print '%s: %s' % (os.path.basename(path), ', '.join(sorted(clips)) or 'no clips')
+            ok &= len(clips) == len(CH_LIST)
+        print '%i mail(s) for 2 incidents %s' % (len(mails), 'ok' if ok else 'FAILED')
+    return ok
+
+def latencyTest():
+    '''
+    Time from trigger to mail with 1 to 16 channels. zmodopipe muxes the clips on a dump thread
+    per CPU, up to DUMP_THREADS, each thread writing its share of the channels in turn, and each
+    clip is mailed as it closes. So the time past the post-roll only grows with the channels per thread.
+    Returns True if every run mailed all its clips and 16 channels took no longer past the post-roll
+    than 1 channel times the channels each thread had.
+    '''
+    
+    threads = min(multiprocessing.cpu_count(), DUMP_THREADS)
+    perThread = (16 + threads - 1) / threads
+
+    took = {}
+    for channels in (1, 2, 4, 8, 16):
+        with testRig(channels, 0) as mails:
+            buildAlert()
+            deadline = time.time() + POST_TIME + DUMP_TIMEOUT + 10
+            while not mails and time.time() < deadline:
+                time.sleep(0.1)
+            
+            if mails:
+                with open(mails[0][0] + '.json') as f:
+                    clips = len(json.load(f))
+                if clips == channels:
+                    took[channels] = mails[0][1] - LAST_TRIGGER
+            print '%2i channel(s): %s' % (channels, '%.2fs from trigger to mail, %.2fs past the post-roll' %
+                (took[channels], took[channels] - POST_TIME) if channels in took else 'FAILED, not every clip was mailed')
+    
+    ok = len(took) == 5 and took[16] - POST_TIME <= (took[1] - POST_TIME) * perThread
+    print 'trigger to mail %s with %i dump thread(s)' % ('within bounds from 1 to 16 channels' if ok else 'FAILED', threads)
+    return ok
 
 def main(IS_DAEMON):
     '''DVRAlarm Alarm PGM CCTV Integration
     
     By default dvralarm is started in user interactive mode use CTRL-C to interrupt
-    We spawn the zmodopipe process, read output into ringbuffer and wait for a GPIO or CLI trigger
-    When we receive a trigger event we save video buffer and send an email alert
+    We spawn the zmodopipe process, which buffers the video, and wait for a GPIO or CLI trigger
+    When we receive a trigger event zmodopipe dumps the video buffer and we send an email alert
     
     Usage: dvralarm [OPTION]
     
     OPTIONS
     -d, --daemonize         Run dvralarm with no CLI output, CTRL-C to exit
     -v, --verbose           Enable debug level logging.
+    -t, --test              Check two incidents get a mail each against dvremu, no Pi needed, and exit.
+    -l, --latency           Measure trigger to mail time with 1 to 16 channels of dvremu and exit.
     -h, --help              Output this command usage message and exit.
     
     '''
@@ -553,8 +653,9 @@ def main(IS_DAEMON):
     #become_daemon()
     #os.setpgrp()
     
+    global ZPROC
+    
     ## setup threading events
-    alarm_detected = threading.Event()
     work_completed = threading.Event()
     
     # GPIO 23 set up as input. It is pulled up to stop false signals  
@@ -563,7 +664,7 @@ def main(IS_DAEMON):
     GPIO.setup(24, GPIO.IN, pull_up_down=GPIO.PUD_UP)
     
     # Add interrupt driven input detect
-    GPIO.add_event_detect(23, GPIO.FALLING, callback=lambda x: buildAlert(alarm_detected), bouncetime=2000)
+    GPIO.add_event_detect(23, GPIO.FALLING, callback=lambda x: buildAlert(), bouncetime=2000)
     # Add interrupt driven input detect
     GPIO.add_event_detect(24, GPIO.FALLING, callback=lambda x: exit(work_completed), bouncetime=2000)
     
@@ -572,16 +673,20 @@ def main(IS_DAEMON):
     
     # Setup working directories
     ensure_dir(TMP_PATH)
+    ensure_dir(RING_PATH)
 
     
     '''
     ## Start by spawning zmodopipe
-    # ./zmodopipe -s <dvr_ip> -u <user> -a <pass> -c <num> -c <num> -v -m <dvr_model>
+    # ./zmodopipe -e -b <sec> -d <dir> -s <dvr_ip> -u <user> -a <pass> -c <num> -c <num> -v -m <dvr_model>
+    # -e streams every channel from a single process instead of forking one per channel
+    # -b keeps the last <sec> seconds of each channel, dumped to <dir> on SIGHUP
+    # -A adds <sec> seconds after the SIGHUP to the dumps, -A <ch>:<sec> for one channel,
+    #    a SIGHUP within them extends the dumps instead of starting new ones
+    # -P keeps those buffers in files, after a crash they're dumped to <dir> as *_crash.mp4 on the next start
     '''
 
-    cstr = ''
-    for ch in CH_LIST: cstr += "-c %s " % ch
-    zmodopipe = '%s -s %s -u %s -a %s %s-m %s' % (ZMOD ,CONFIG['DVR_IP'], CONFIG['DVR_USER'], CONFIG['DVR_PASS'], cstr, CONFIG['DVR_MODEL'])
+    zmodopipe = zmodopipeCommand()
     #print 'Main Spawning: %s' % zmodopipe
     logger.info('Launching zmodopipe')
     logger.debug('Main Spawning: %s' % zmodopipe)
@@ -589,8 +694,9 @@ def main(IS_DAEMON):
     command = shlex.split(zmodopipe)        # split str by spaces for Popen
     
     try:
-        PIDS.append(subprocess.Popen(command, shell=False, stdout=subprocess.PIPE,
-                         stderr=subprocess.PIPE, close_fds=True, preexec_fn=os.setpgrp))
+        ZPROC = subprocess.Popen(command, shell=False, stdout=subprocess.PIPE,
+                         stderr=subprocess.PIPE, close_fds=True, preexec_fn=os.setpgrp)
+        PIDS.append(ZPROC)
     except Exception:
         #print 'Cannot spawn zmodopipe!\nNo reason to continue exiting.'
         logger.error('Cannot spawn zmodopipe!\nNo reason to continue exiting.', exc_info=True)
@@ -603,19 +709,6 @@ def main(IS_DAEMON):
     '''
     
     
-    for ch in CH_LIST:
-        '''
-        # Spawn a thread for each channel to read zmodopipe h264 stream into ring buffer
-        '''
-        try:
-            t = threading.Thread(name='CH%s_RingBuf' % ch, target=readBuffer, args = (ch, alarm_detected, work_completed))
-            t.start()
-            #print 'CH%s starting readbuffer thread' % ch
-            logger.info('CH%s starting readbuffer thread' % ch)
-        except Exception:
-            #print errtxt
-            logger.error('CH%s cannot spawn readbuffer thread' % ch, exc_info=True)
-
     '''
         Main loop
     '''
@@ -649,7 +742,7 @@ def main(IS_DAEMON):
             
             if cmd == 'a':
                 if not IS_DAEMON: print 'Alarm triggered from CLI!'
-                buildAlert(alarm_detected)
+                buildAlert()
             elif cmd == 'x':
                 if not IS_DAEMON: print 'Exiting...'
                 break
@@ -728,13 +821,10 @@ def create_config():
 
 if __name__ == '__main__':      ## main function of the application
     
-    if not os.geteuid() == 0:
-        sys.exit('Script must be run as root')
-    
     # Trap the input arguments.
     try:
-        opts, args = getopt.getopt(sys.argv[1:], 'hvdi', # Basic I/O arguments, arguments followed by : expect argument.
-                ['help', 'verbose','daemonize'])
+        opts, args = getopt.getopt(sys.argv[1:], 'hvditl', # Basic I/O arguments, arguments followed by : expect argument.
+                ['help', 'verbose','daemonize', 'test', 'latency'])
         #print opts, args
     except getopt.GetoptError as e:
         print '%s\n' % e
@@ -754,6 +844,14 @@ if __name__ == '__main__':      ## main function of the application
             #os.setpgrp()
         elif opt in ('-i'):
             INIT_C = True
+        elif opt in ('-t', '--test', '-l', '--latency'):
+            logging.basicConfig(format='%(relativeCreated)6d %(levelname)s %(message)s')
+            logger = logging.getLogger(__name__)
+            logger.setLevel(LEVEL)
+            sys.exit(0 if (selfTest() if opt in ('-t', '--test') else latencyTest()) else 1)
+    
+    if not os.geteuid() == 0:
+        sys.exit('Script must be run as root')
     
     
     # setup logger 
@@ -802,6 +900,16 @@ if __name__ == '__main__':      ## main function of the application
     logger.setLevel(eval(CONFIG['LEVEL']))
     handler.setLevel(eval(CONFIG['LEVEL']))
     CH_LIST = [ int(e) for e in CONFIG['CH_LIST'].split(',') ]
+    # optional, channels whose clips run longer or shorter after the last trigger
+    CH_POST = dict([ [ int(v) for v in e.split(':') ] for e in CONFIG.get('CH_POST', '').split(',') if ':' in e ])
+    # optional, skip the clips of cameras that saw less motion than this (0 still, 1 P frames twice the quiet size)
+    if 'MIN_ACTIVITY' in CONFIG: MIN_ACTIVITY = float(CONFIG['MIN_ACTIVITY'])
+    # optional, max bytes of an alert mail (relays reject bigger ones), and whether to drop non-reference frames to fit it
+    if 'MAIL_BUDGET' in CONFIG: MAIL_BUDGET = int(CONFIG['MAIL_BUDGET'])
+    MAIL_THIN = bool(CONFIG.get('MAIL_THIN', False))
+    # optional, where the pre-alarm buffers are kept: on tmpfs (default) they survive a crash of zmodopipe,
+    # on disk a power cut too, at the cost of writing the stream to it
+    RING_PATH = CONFIG.get('RING_PATH', RING_PATH)
     
     #sys.exit()                      # Temporary system exit to test config file unit
     
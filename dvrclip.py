@@ -0,0 +1,408 @@
+#!/usr/bin/env python
+##
+##  GOP aware trimming of zmodopipe's MP4 clips to fit an alert mail
+##
+##  Public Domain
+##
+
+'''
+Fits the clips of an alert into a mail of a given size. zmodopipe writes every GOP of
+a clip as one moof/mdat fragment, so a clip cut between fragments still starts on a
+keyframe and plays. plan() grows a window of fragments on each channel outward from
+the trigger, always taking the fragment nearest to it next across all the channels,
+until the next one would not fit. A channel whose nearest GOP doesn't fit is left out,
+with thin the non-reference frames of every window are dropped before that happens.
+
+    clips = [dvrclip.Clip(path, clip['start'], clip['channel'], clip['activity']) for clip in ...]
+    for trimmed in dvrclip.plan(clips, alarm, dvrmail.payload(10 << 20, len(clips)), thin=True):
+        dvrmail.send(..., [trimmed, ...])
+
+Only the boxes around the frames are read to plan, the frames are copied from the
+clip as the trimmed clip is read. Run it to check it on dvremu's synthetic stream
+muxed by zmodomux.
+'''
+
+import os                                   # clip files
+import sys
+import struct                               # box fields
+import getopt                               # options of the self-test
+import tempfile
+import subprocess                           # dvremu and zmodomux for the self-test
+
+NAL_SLICE = 1
+NAL_IDR = 5
+
+def _boxes(data, start, end):
+    ''' (type, start, end) of the boxes in data between start and end '''
+    while start + 8 <= end:
+        size, kind = struct.unpack('>I4s', bytes(data[start:start + 8]))
+        if size < 8 or start + size > end:
+            return
+        yield kind, start, start + size
+        start += size
+
+def _find(data, start, end, path):
+    ''' start and end of the box at path below data[start:end], None if it's not there '''
+    for kind in path:
+        for box, start, end in _boxes(data, start, end):
+            if box == kind:
+                start += 8
+                break
+        else:
+            return None
+    return start - 8, end
+
+class _Trun(object):
+    ''' The sample table of a fragment's trun box '''
+
+    FIELDS = (0x100, 0x200, 0x400, 0x800)   # duration, size, flags, composition offset
+
+    def __init__(self, data, start, end):
+        self.flags = struct.unpack('>I', bytes(data[start + 8:start + 12]))[0]
+        count = struct.unpack('>I', bytes(data[start + 12:start + 16]))[0]
+        pos = start + 16
+        self.dataOffset = self.firstFlags = None
+        if self.flags & 0x1:
+            self.dataOffset = struct.unpack('>i', bytes(data[pos:pos + 4]))[0]
+            pos += 4
+        if self.flags & 0x4:
+            self.firstFlags = struct.unpack('>I', bytes(data[pos:pos + 4]))[0]
+            pos += 4
+        fields = [field for field in self.FIELDS if self.flags & field]
+        self.samples = []
+        for n in range(count):
+            values = struct.unpack('>%iI' % len(fields), bytes(data[pos:pos + 4 * len(fields)]))
+            self.samples.append(dict(zip(fields, values)))
+            pos += 4 * len(fields)
+
+    def pack(self, samples, dataOffset):
+        out = struct.pack('>II', self.flags, len(samples))
+        if self.flags & 0x1:
+            out += struct.pack('>i', dataOffset)
+        if self.flags & 0x4:
+            out += struct.pack('>I', self.firstFlags)
+        for sample in samples:
+            out += b''.join([struct.pack('>I', sample[field]) for field in self.FIELDS if self.flags & field])
+        return struct.pack('>I4s', len(out) + 8, b'trun') + out
+
+class Fragment(object):
+    ''' One moof/mdat of a clip, a GOP unless zmodopipe had to split it '''
+
+    def __init__(self, offset, size, time, duration):
+        self.offset = offset                # in the file
+        self.size = size                    # moof and mdat
+        self.time = time                    # ms from the start of the clip
+        self.duration = duration            # ms
+        self.thinned = None                 # (size, pieces) without non-reference frames, see Clip.thin()
+
+class Clip(object):
+    '''
+        A clip zmodopipe dumped, indexed by fragment. start is the time of its first
+        frame in ms since the epoch, as in zmodopipe's manifest.
+    '''
+
+    def __init__(self, path, start=0, channel=0, activity=0):
+        self.path = path
+        self.name = os.path.basename(path)
+        self.start = start
+        self.channel = channel
+        self.activity = activity
+        self.head = 0                       # bytes of ftyp and moov, every trimmed clip starts with them
+        self.fragments = []
+
+        timescale = 90000
+        with open(path, 'rb') as f:
+            size = os.fstat(f.fileno()).st_size
+            offset = 0
+            while offset + 8 <= size:
+                f.seek(offset)
+                length, kind = struct.unpack('>I4s', f.read(8))
+                if length < 8 or offset + length > size:
+                    break                   # cut short, what's before it still plays
+
+                if kind == b'moov':
+                    f.seek(offset)
+                    moov = bytearray(f.read(length))
+                    mdhd = _find(moov, 0, length, [b'moov', b'trak', b'mdia', b'mdhd'])
+                    if mdhd:
+                        at = mdhd[0] + (28 if moov[mdhd[0] + 8] == 1 else 20)
+                        timescale = struct.unpack('>I', bytes(moov[at:at + 4]))[0] or timescale
+                    self.head = offset + length
+                elif kind == b'moof':
+                    f.seek(offset)
+                    moof = bytearray(f.read(length))
+                    mdat = f.read(8)
+                    if len(mdat) < 8 or mdat[4:] != b'mdat':
+                        break
+                    mdatLength = struct.unpack('>I', mdat[:4])[0]
+                    if mdatLength < 8 or offset + length + mdatLength > size:
+                        break
+                    tfdt = _find(moof, 0, length, [b'moof', b'traf', b'tfdt'])
+                    trun = _find(moof, 0, length, [b'moof', b'traf', b'trun'])
+                    decode = 0
+                    if tfdt:
+                        version = moof[tfdt[0] + 8]
+                        decode = struct.unpack('>Q' if version == 1 else '>I',
+                            bytes(moof[tfdt[0] + 12:tfdt[0] + (20 if version == 1 else 16)]))[0]
+                    ticks = sum([sample.get(0x100, 0) for sample in _Trun(moof, *trun).samples]) if trun else 0
+                    self.fragments.append(Fragment(offset, length + mdatLength, decode * 1000 // timescale,
+                        ticks * 1000 // timescale))
+                    length += mdatLength
+                elif not self.fragments:
+                    self.head = offset + length
+                offset += length
+
+    def nearest(self, alarm):
+        ''' Index of the fragment nearest to alarm '''
+        return min(range(len(self.fragments)), key=lambda idx: self.distance(idx, alarm))
+
+    def distance(self, idx, alarm):
+        ''' ms between alarm and the fragment, 0 if it shows it '''
+        begin = self.start + self.fragments[idx].time
+        end = begin + self.fragments[idx].duration
+        return begin - alarm if alarm < begin else alarm - end if alarm >= end else 0
+
+    def thin(self, idx):
+        '''
+            Size of the fragment without the frames no other frame references, which
+            can go without breaking the decoding of the rest. The frames left keep their
+            times, the one before a dropped frame is shown for longer.
+        '''
+        frag = self.fragments[idx]
+        if frag.thinned is not None:
+            return frag.thinned[0]
+        frag.thinned = (frag.size, [(frag.offset, frag.size)])
+
+        with open(self.path, 'rb') as f:
+            f.seek(frag.offset)
+            moofLength = struct.unpack('>I', f.read(4))[0]
+            f.seek(frag.offset)
+            moof = bytearray(f.read(moofLength))
+            traf = _find(moof, 0, moofLength, [b'moof', b'traf'])
+            tfhd = _find(moof, 0, moofLength, [b'moof', b'traf', b'tfhd'])
+            where = _find(moof, 0, moofLength, [b'moof', b'traf', b'trun'])
+            if not traf or not tfhd or not where or len([box for box in _boxes(moof, traf[0] + 8, traf[1]) if box[0] == b'trun']) != 1:
+                return frag.size
+            trun = _Trun(moof, *where)
+            if trun.dataOffset is None or not trun.flags & 0x100 or not trun.flags & 0x200 or \
+                    struct.unpack('>I', bytes(moof[tfhd[0] + 8:tfhd[0] + 12]))[0] & 0x1:
+                return frag.size            # only zmodopipe's own layout is rewritten
+
+            kept = []
+            data = frag.offset + trun.dataOffset
+            for sample in trun.samples:
+                if not kept or self._reference(f, data, sample[0x200]):
+                    kept.append((dict(sample), data))
+                else:
+                    kept[-1][0][0x100] += sample[0x100]
+                data += sample[0x200]
+
+        if len(kept) == len(trun.samples):
+            return frag.size
+
+        # the trun shrinks and the boxes holding it with it
+        samples = [sample for sample, data in kept]
+        shrink = where[1] - where[0] - len(trun.pack(samples, 0))
+        table = trun.pack(samples, moofLength - shrink + 8)
+        mdatLength = sum([sample[0x200] for sample in samples]) + 8
+        head = struct.pack('>I', moofLength - shrink)
+        head += bytes(moof[4:traf[0]]) + struct.pack('>I', traf[1] - traf[0] - shrink) + bytes(moof[traf[0] + 4:where[0]])
+        head += table + bytes(moof[where[1]:]) + struct.pack('>I4s', mdatLength, b'mdat')
+        pieces = [head] + [(data, sample[0x200]) for sample, data in kept]
+        frag.thinned = (len(head) + mdatLength - 8, pieces)
+        return frag.thinned[0]
+
+    def _reference(self, f, offset, size):
+        ''' False if the frame at offset is a slice no other frame references '''
+        end = offset + size
+        while offset + 5 <= end:
+            f.seek(offset)
+            header = bytearray(f.read(5))
+            if len(header) < 5:
+                break
+            kind = header[4] & 0x1f
+            if kind in (NAL_SLICE, NAL_IDR):
+                return kind == NAL_IDR or header[4] >> 5 != 0
+            offset += 4 + struct.unpack('>I', bytes(header[:4]))[0]
+        return True
+
+    def cost(self, idx, thin):
+        return self.thin(idx) if thin else self.fragments[idx].size
+
+class Trimmed(object):
+    ''' A window of a clip's fragments, read like the file it would be '''
+
+    def __init__(self, clip, first, last, thin):
+        self.clip = clip
+        self.name = clip.name
+        self.first = first
+        self.last = last                    # the window ends before this fragment
+        self.thinned = thin
+        self.pieces = [(0, clip.head)]
+        for idx in range(first, last):
+            if thin:
+                clip.thin(idx)
+                self.pieces += clip.fragments[idx].thinned[1]
+            else:
+                self.pieces.append((clip.fragments[idx].offset, clip.fragments[idx].size))
+        self.size = sum([len(piece) if isinstance(piece, bytes) else piece[1] for piece in self.pieces])
+        self._file = None
+        self._piece = 0
+        self._at = 0                        # bytes of the current piece already read
+
+    def read(self, size=-1):
+        if self._file is None:
+            self._file = open(self.clip.path, 'rb')
+        out = []
+        while self._piece < len(self.pieces) and size != 0:
+            piece = self.pieces[self._piece]
+            length = len(piece) if isinstance(piece, bytes) else piece[1]
+            want = length - self._at if size < 0 else min(size, length - self._at)
+            if isinstance(piece, bytes):
+                out.append(piece[self._at:self._at + want])
+            else:
+                self._file.seek(piece[0] + self._at)
+                out.append(self._file.read(want))
+                if len(out[-1]) < want:
+                    raise IOError('%s got shorter' % self.clip.path)
+            self._at += want
+            size -= want if size > 0 else 0
+            if self._at == length:
+                self._piece += 1
+                self._at = 0
+        return b''.join(out)
+
+    def close(self):
+        if self._file is not None:
+            self._file.close()
+            self._file = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+def _grow(clips, alarm, room, thin):
+    ''' [first, last) fragment windows, in the order their clips came in, taking up to room bytes '''
+    windows = {}
+    order = []
+    closed = set()                          # (clip, side) that can't grow any more
+    used = 0
+
+    while True:
+        best = None
+        for n, clip in enumerate(clips):
+            if not clip.fragments:
+                continue
+            if n in windows:
+                sides = [(windows[n][0] - 1, -1), (windows[n][1], 1)]
+            else:
+                sides = [(clip.nearest(alarm), 0)]
+            for idx, side in sides:
+                if 0 <= idx < len(clip.fragments) and (n, side) not in closed:
+                    key = (clip.distance(idx, alarm), -clip.activity, n)
+                    if best is None or key < best[0]:
+                        best = (key, n, idx, side)
+        if best is None:
+            break
+
+        key, n, idx, side = best
+        cost = clips[n].cost(idx, thin) + (0 if n in windows else clips[n].head)
+        if used + cost > room:
+            closed.add((n, side))
+            continue
+        used += cost
+        if side == 0:
+            windows[n] = [idx, idx + 1]
+            order.append(n)
+        elif side < 0:
+            windows[n][0] = idx
+        else:
+            windows[n][1] = idx + 1
+
+    return [(clips[n], windows[n][0], windows[n][1]) for n in order]
+
+def plan(clips, alarm, room, thin=False):
+    '''
+        The clips trimmed to fit room bytes together, nearest the alarm (ms since the
+        epoch) and then most active first, as Trimmed. A clip whose GOP nearest the
+        alarm doesn't fit is left out, with thin the non-reference frames of all of
+        them are dropped if that leaves out fewer.
+    '''
+    windows = _grow(clips, alarm, room, False)
+    thinned = False
+    if thin and len(windows) < len([clip for clip in clips if clip.fragments]):
+        fewer = _grow(clips, alarm, room, True)
+        if len(fewer) > len(windows):
+            windows = fewer
+            thinned = True
+    return [Trimmed(clip, first, last, thinned) for clip, first, last in windows]
+
+def usage():
+    print('Usage: %s [-e <dvremu>] [-z <zmodomux>]\nTrims synthetic clips to budgets and checks what comes out' % sys.argv[0])
+
+if __name__ == '__main__':
+    # Muxes clips of different sizes, plans them into shrinking budgets and checks the
+    # trimmed clips fit, are whole GOPs around the alarm and index again as clips
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'e:z:h')
+    except getopt.GetoptError:
+        usage()
+        sys.exit(1)
+    here = os.path.dirname(os.path.abspath(__file__))
+    conf = {'-e': os.path.join(here, 'dvremu'), '-z': os.path.join(here, 'zmodomux')}
+    conf.update(dict(opts))
+    if '-h' in conf:
+        usage()
+        sys.exit(0)
+
+    tmp = tempfile.mkdtemp(prefix='dvrclip')
+    clips = []
+    # dvremu's synthetic stream, 25 frame GOPs with P frames of 2000, 4000 and 8000 bytes
+    for ch, kbps in enumerate([464, 928, 1856]):
+        raw = os.path.join(tmp, 'clip.h264')
+        path = os.path.join(tmp, 'clip_ch%02i.mp4' % (ch + 1))
+        if subprocess.call([conf['-e'], '-w', raw, '-k', '10', '-r', str(kbps), '-F', '25']) != 0 or \
+                subprocess.call([conf['-z'], '-r', '25', raw, path]) != 0:
+            print('Cannot make clips with %s and %s' % (conf['-e'], conf['-z']))
+            sys.exit(1)
+        os.remove(raw)
+        clips.append(Clip(path, 1000000, ch + 1, ch))
+
+    fail = 0
+    alarm = 1000000 + 6500                  # in the middle of the 7th GOP
+    total = sum([os.path.getsize(clip.path) for clip in clips])
+    for room, thin in [(total, False), (total // 2, False), (300000, False), (300000, True), (100000, True), (1000, True)]:
+        trimmed = plan(clips, alarm, room, thin)
+        used = 0
+        ok = True
+        for clip in trimmed:
+            out = os.path.join(tmp, 'trimmed.mp4')
+            with clip:
+                with open(out, 'wb') as f:
+                    data = clip.read(57 * 1024)
+                    while data:
+                        f.write(data)
+                        data = clip.read(57 * 1024)
+            used += os.path.getsize(out)
+            again = Clip(out, 1000000)
+            shown = sum([frag.duration for frag in again.fragments])
+            # the window holds the alarm, starts on a keyframe and keeps its running time
+            ok &= os.path.getsize(out) == clip.size and len(again.fragments) == clip.last - clip.first and \
+                clip.first <= 6 < clip.last and again.fragments[0].time == clip.first * 1000 and abs(shown - (clip.last - clip.first) * 1000) <= 40
+            if clip.thinned:
+                ok &= all([again.thin(idx) == again.fragments[idx].size for idx in range(len(again.fragments))])
+            os.remove(out)
+        ok &= used <= room and (room < total or len(trimmed) == len(clips))
+        print('%8i bytes%s: %s, %i bytes %s' % (room, ' thin' if thin else '', ', '.join(['ch%i %i-%is%s' % (clip.clip.channel,
+              clip.first, clip.last, ' thinned' if clip.thinned else '') for clip in trimmed]) or 'nothing', used, 'ok' if ok else 'FAILED'))
+        fail |= not ok
+
+    # thinning has to bring in a channel that was left out
+    fail |= len(plan(clips, alarm, 300000, True)) <= len(plan(clips, alarm, 300000, False))
+
+    for clip in clips:
+        os.remove(clip.path)
+    os.rmdir(tmp)
+    sys.exit(fail)
@@ -0,0 +1,581 @@
+/*****************************************
+ * DVR emulator for testing zmodopipe    *
+ * License: Public Domain                *
+ *****************************************/
+
+// Stands in for a DVR of any of the models zmodopipe supports (-m, same numbers),
+// answers each model's login the way zmodopipe expects it and then streams H.264,
+// a recorded file (-f) or a synthetic stream, to every channel that logs in.
+// Forks a process per connection, like the DVRs these were reverse engineered from
+// it doesn't care how many connections a channel gets. With -M the synthetic scene of
+// a channel moves now and then, its P frames grow like an encoder's would. With -w the
+// stream is written to a file instead, for tests that need H.264 without a DVR.
+//
+//   ./dvremu -m 1 -p 18600 -c 4 -f cam.h264 &
+//   ./zmodopipe -e -s 127.0.0.1 -p 18600 -m 1 -c 1 -c 2 -c 3 -c 4
+//
+// Compile: gcc -Wall -O2 dvremu.c nalscan.c synth.c -o dvremu
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "nalscan.h"
+#include "synth.h"
+
+#define MAX_CHANNELS 16		// same limit as zmodopipe
+#define SYNTH_GOP 25		// frames per GOP of the synthetic stream
+#define MOTION_PERIOD 10	// -M channels move MOTION_SECONDS of every MOTION_PERIOD seconds
+#define MOTION_SECONDS 3
+#define MOTION_SCALE 4		// their P frames are this many times bigger meanwhile
+
+// Model numbers, as zmodopipe's -m
+enum
+{
+	mobile = 1,
+	media,
+	media_header,
+	qt504,
+	dvr8104_mobile,
+	cnmclassic,
+	visionari,
+	swannmedia,
+	swanndvr8,
+	meye,
+};
+
+// Where each model's login carries what we check, offsets into the packet zmodopipe sends
+struct emuModel
+{
+	const char *name;
+	unsigned short port;		// the model's usual port
+	int loginLen;			// size of the packet with the credentials
+	int userOff, userLen;
+	int passOff, passLen;
+};
+
+struct emuModel models[] = {
+	{ NULL, 0, 0, 0, 0, 0, 0 },
+	{ "mobile", 18600, 68, 12, 32, 44, 20 },
+	{ "media", 9000, 507, 47, 8, 81, 6 },
+	{ "media w/header", 9000, 507, 47, 8, 81, 6 },
+	{ "QT504", 6036, 144, 32, 8, 68, 6 },
+	{ "DVR-8104 mobile", 8888, 116, 60, 4, 92, 6 },
+	{ "CnM Classic", 9000, 500, 40, 8, 72, 6 },
+	{ "Visionari", 1115, 116, 60, 8, 92, 6 },
+	{ "Swann media", 9000, 507, 47, 8, 79, 6 },
+	{ "Swann DVR8", 9000, 88, 20, 32, 52, 32 },
+	{ "mEye", 80, 58, 18, 20, 38, 20 },
+};
+
+struct emuArgs_t {
+	int model;		// -m model to emulate
+	unsigned short port;	// -p port to listen on
+	int channels;		// -c channels the DVR has
+	char *file;		// -f H.264 file to stream, synthetic if not given
+	int kbps;		// -r bitrate, sizes the synthetic frames or paces the file
+	int fps;		// -F frame rate
+	char *username;		// -u login username
+	char *password;		// -a login password
+	int latency;		// -L ms before each reply to the login
+	int dropAfter;		// -k seconds to stream before dropping the connection, 0 for never
+	bool verbose;		// -v
+	unsigned int motion;	// -M channels whose synthetic scene moves, a bit each
+	char *write;		// -w write -k seconds of channel 1's stream to this file and exit
+} emuArgs = { media, 0, 4, NULL, 0, 25, "admin", "admin", 0, 0, false, 0, NULL };
+
+// The stream every channel gets, looped, and where its frames start
+unsigned char *g_stream;
+size_t g_streamLen;
+size_t *g_frames;
+size_t g_frameCount;
+size_t g_frameCap;
+size_t g_loopFrames;	// frames of the still scene, the synthetic stream has a moving GOP after them
+
+void addFrame(size_t offset)
+{
+	if( g_frameCount == g_frameCap )
+	{
+		g_frameCap = g_frameCap ? g_frameCap * 2 : 1024;
+		g_frames = realloc(g_frames, g_frameCap * sizeof(*g_frames));
+		if( g_frames == NULL )
+		{
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	g_frames[g_frameCount++] = offset;
+}
+
+void frameNal(void *ctx, const struct nalUnit *nal)
+{
+	if( nal->newAccessUnit )
+		addFrame(nal->auStart);
+}
+
+// One GOP at kbps and fps: a keyframe with SPS/PPS five times the size of the P frames after it,
+// every other one of them non-reference, then the same GOP with the P frames of a scene that moves
+int makeSynthetic(void)
+{
+	size_t gopBytes = (size_t)emuArgs.kbps * 1000 / 8 * SYNTH_GOP / emuArgs.fps;
+	size_t frameBytes = gopBytes / (SYNTH_GOP + 4);
+	int frame;
+
+	g_stream = malloc(frameBytes * (10 + SYNTH_GOP * (1 + MOTION_SCALE)) + 64 * 2 * SYNTH_GOP);
+	if( g_stream == NULL )
+		return 1;
+
+	for( frame=0;frame<2*SYNTH_GOP;frame++ )
+	{
+		addFrame(g_streamLen);
+
+		if( frame % SYNTH_GOP == 0 )
+			g_streamLen += synthFrame(g_stream + g_streamLen, true, true, frameBytes * 5);
+		else
+			g_streamLen += synthFrame(g_stream + g_streamLen, false, frame % SYNTH_GOP % 2 == 0,
+				frame < SYNTH_GOP ? frameBytes : frameBytes * MOTION_SCALE);
+	}
+	g_loopFrames = SYNTH_GOP;
+
+	return 0;
+}
+
+// Read the file and find its frames
+int loadFile(const char *name)
+{
+	struct nalScanner sc;
+	struct stat st;
+	FILE *fp;
+
+	fp = fopen(name, "rb");
+	if( fp == NULL || fstat(fileno(fp), &st) == -1 || st.st_size == 0 )
+	{
+		perror(name);
+		if( fp )
+			fclose(fp);
+		return 1;
+	}
+
+	g_streamLen = st.st_size;
+	g_stream = malloc(g_streamLen);
+	if( g_stream == NULL || fread(g_stream, 1, g_streamLen, fp) != g_streamLen )
+	{
+		perror(name);
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	memset(&sc, 0, sizeof(sc));
+	addFrame(0);
+	nalScan(&sc, g_stream, g_streamLen, frameNal, NULL);
+
+	// Anything before the first access unit goes out with it
+	if( g_frameCount > 1 && g_frames[1] == 0 )
+	{
+		memmove(g_frames, g_frames + 1, (g_frameCount - 1) * sizeof(*g_frames));
+		g_frameCount--;
+	}
+	g_loopFrames = g_frameCount;
+
+	return 0;
+}
+
+int recvExact(int fd, void *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while( got < len )
+	{
+		n = recv(fd, (char*)buf + got, len - got, 0);
+		if( n <= 0 )
+			return 1;
+		got += n;
+	}
+
+	return 0;
+}
+
+// Send a login reply, after the emulated latency
+int sendReply(int fd, const void *buf, size_t len)
+{
+	if( emuArgs.latency )
+		usleep(emuArgs.latency * 1000);
+
+	return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : 1;
+}
+
+bool checkField(const unsigned char *pkt, int off, int len, const char *expect)
+{
+	char field[64] = {0};
+
+	memcpy(field, pkt + off, len);
+	return strncmp(field, expect, len) == 0;
+}
+
+// Channel from a 1 << channel bitmask
+int maskChannel(const unsigned char *p)
+{
+	int mask = (p[0] << 8) | p[1];
+	int channel = 0;
+
+	if( mask == 0 || (mask & (mask - 1)) != 0 )
+		return -1;
+	while( (mask >>= 1) != 0 )
+		channel++;
+	return channel;
+}
+
+// Answer the model's login the way zmodopipe's Connect* function expects it.
+// Returns the channel to stream, or -1 to drop the connection.
+int serveLogin(int fd)
+{
+	struct emuModel *m = &models[emuArgs.model];
+	unsigned char pkt[1024];
+	unsigned char reply[1024];
+	bool ok;
+	int channel = -1;
+
+	memset(reply, 0, sizeof(reply));
+
+	switch( emuArgs.model )
+	{
+	case media_header:
+		if( recvExact(fd, pkt, 7) != 0 || memcmp(pkt, "0123456", 7) != 0 )
+			return -1;
+		// Fall through
+	case media:
+	case swannmedia:
+		if( recvExact(fd, pkt, m->loginLen) != 0 )
+			return -1;
+		channel = maskChannel(pkt + 37);
+		if( emuArgs.model == swannmedia && sendReply(fd, reply, 8) != 0 )
+			return -1;
+		break;
+
+	case mobile:
+		if( recvExact(fd, pkt, m->loginLen) != 0 || pkt[3] != 64 )
+			return -1;
+		channel = (pkt[64] << 8) | pkt[65];
+
+		// Length, then 20 bytes with the login status at [16]
+		ok = checkField(pkt, m->userOff, m->userLen, emuArgs.username) &&
+			checkField(pkt, m->passOff, m->passLen, emuArgs.password);
+		reply[3] = 20;
+		reply[4 + 16] = ok;
+		if( sendReply(fd, reply, 24) != 0 )
+			return -1;
+		if( !ok )
+		{
+			if( emuArgs.verbose )
+				printf("Wrong username or password\n");
+			return -1;
+		}
+
+		// A section with its length in the last header byte, then 27 bytes
+		memset(reply, 0, sizeof(reply));
+		reply[3] = 8;
+		if( sendReply(fd, reply, 12) != 0 || sendReply(fd, reply, 27) != 0 )
+			return -1;
+		return channel;
+
+	case qt504:
+		if( recvExact(fd, pkt, m->loginLen) != 0 || memcmp(pkt, "1111", 4) != 0 || sendReply(fd, reply, 532) != 0 )
+			return -1;
+		if( recvExact(fd, pkt + 512, 88) != 0 || sendReply(fd, reply, 64) != 0 )
+			return -1;
+		if( recvExact(fd, pkt + 512, 60) != 0 || sendReply(fd, reply, 124) != 0 )
+			return -1;
+		channel = maskChannel(pkt + 512 + 36);
+		break;
+
+	case dvr8104_mobile:
+	case visionari:
+		if( recvExact(fd, pkt, m->loginLen) != 0 || pkt[3] != 0x70 )
+			return -1;
+		channel = pkt[113];
+		break;
+
+	case cnmclassic:
+		if( recvExact(fd, pkt, m->loginLen) != 0 )
+			return -1;
+		channel = maskChannel(pkt + 30);
+		reply[0] = 1;
+		if( sendReply(fd, reply, 8) != 0 || sendReply(fd, reply + 8, 520) != 0 )
+			return -1;
+		break;
+
+	case swanndvr8:
+		if( recvExact(fd, pkt, m->loginLen) != 0 || memcmp(pkt, "\xf0\xde\xbc\x0a\x01", 5) != 0 )
+			return -1;
+		memcpy(reply, pkt, 4);
+		reply[8] = 0x50;
+		if( sendReply(fd, reply, 32) != 0 )
+			return -1;
+		// Open channel request
+		if( recvExact(fd, pkt + 512, 32) != 0 || pkt[512 + 4] != 0x03 )
+			return -1;
+		channel = (pkt[512 + 11] << 8) | pkt[512 + 12];
+		break;
+
+	case meye:
+		if( recvExact(fd, pkt + 512, 43) != 0 || memcmp(pkt + 512, "GET /bubble/live", 16) != 0 || sendReply(fd, reply, 1024) != 0 )
+			return -1;
+		if( recvExact(fd, pkt, m->loginLen) != 0 || pkt[0] != 0xaa || sendReply(fd, reply, 54) != 0 )
+			return -1;
+		// Stream config, then the channel
+		if( recvExact(fd, pkt + 512, 18) != 0 || sendReply(fd, reply, 22) != 0 )
+			return -1;
+		if( recvExact(fd, pkt + 512, 26) != 0 || pkt[512] != 0xaa )
+			return -1;
+		channel = (pkt[512 + 9] << 8) | pkt[512 + 10];
+		break;
+
+	default:
+		return -1;
+	}
+
+	if( !checkField(pkt, m->userOff, m->userLen, emuArgs.username) || !checkField(pkt, m->passOff, m->passLen, emuArgs.password) )
+	{
+		if( emuArgs.verbose )
+			printf("Wrong username or password\n");
+		return -1;
+	}
+
+	return channel;
+}
+
+// Stream the frames, looped, until the connection drops or -k
+void serveStream(int fd, int channel)
+{
+	double start = wallSecs();
+	unsigned long long sent = 0;
+	unsigned long long frames = 0;
+	size_t frame = 0;
+
+	while( emuArgs.dropAfter == 0 || wallSecs() - start < emuArgs.dropAfter )
+	{
+		size_t end = frame + 1 < g_frameCount ? g_frames[frame + 1] : g_streamLen;
+		size_t len = end - g_frames[frame];
+
+		if( send(fd, g_stream + g_frames[frame], len, MSG_NOSIGNAL) != (ssize_t)len )
+			return;
+		sent += len;
+		frames++;
+
+		// Each GOP of a moving channel is the still or the moving one, depending on the time
+		if( ++frame % g_loopFrames == 0 )
+		{
+			double secs = wallSecs() - start;
+
+			frame = g_loopFrames < g_frameCount && (emuArgs.motion & (1U << channel)) &&
+				(int)secs % MOTION_PERIOD >= MOTION_PERIOD - MOTION_SECONDS ? g_loopFrames : 0;
+		}
+
+		// A recorded file keeps its frame timing unless a bitrate was asked for
+		if( emuArgs.file && emuArgs.kbps )
+			sleepUntil(start + sent * 8 / (emuArgs.kbps * 1000.0));
+		else
+			sleepUntil(start + (double)frames / emuArgs.fps);
+	}
+
+	if( emuArgs.verbose )
+		printf("Ch %i: Dropping the connection after %i seconds\n", channel+1, emuArgs.dropAfter);
+}
+
+// The frames channel 1 would get in -k seconds (10 if not given), without pacing them
+int writeStream(const char *name)
+{
+	int seconds = emuArgs.dropAfter ? emuArgs.dropAfter : 10;
+	unsigned long long frames = 0;
+	size_t frame = 0;
+	FILE *fp;
+
+	fp = fopen(name, "wb");
+	if( fp == NULL )
+	{
+		perror(name);
+		return 1;
+	}
+
+	while( frames < (unsigned long long)seconds * emuArgs.fps )
+	{
+		size_t end = frame + 1 < g_frameCount ? g_frames[frame + 1] : g_streamLen;
+
+		if( fwrite(g_stream + g_frames[frame], 1, end - g_frames[frame], fp) != end - g_frames[frame] )
+			break;
+		frames++;
+
+		if( ++frame % g_loopFrames == 0 )
+			frame = g_loopFrames < g_frameCount && (emuArgs.motion & 1) &&
+				frames / emuArgs.fps % MOTION_PERIOD >= MOTION_PERIOD - MOTION_SECONDS ? g_loopFrames : 0;
+	}
+
+	if( fclose(fp) != 0 || frames < (unsigned long long)seconds * emuArgs.fps )
+	{
+		perror(name);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	int listenFd, fd;
+	int flag = true;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "m:p:c:f:r:F:u:a:L:k:M:w:vh")) != -1 )
+	{
+		switch( opt )
+		{
+		case 'm':
+			emuArgs.model = atoi(optarg);
+			break;
+		case 'p':
+			emuArgs.port = atoi(optarg);
+			break;
+		case 'c':
+			emuArgs.channels = atoi(optarg);
+			break;
+		case 'f':
+			emuArgs.file = optarg;
+			break;
+		case 'r':
+			emuArgs.kbps = atoi(optarg);
+			break;
+		case 'F':
+			emuArgs.fps = atoi(optarg);
+			break;
+		case 'u':
+			emuArgs.username = optarg;
+			break;
+		case 'a':
+			emuArgs.password = optarg;
+			break;
+		case 'L':
+			emuArgs.latency = atoi(optarg);
+			break;
+		case 'k':
+			emuArgs.dropAfter = atoi(optarg);
+			break;
+		case 'M':
+			if( atoi(optarg) >= 1 && atoi(optarg) <= MAX_CHANNELS )
+				emuArgs.motion |= 1U << (atoi(optarg) - 1);
+			break;
+		case 'w':
+			emuArgs.write = optarg;
+			break;
+		case 'v':
+			emuArgs.verbose = true;
+			break;
+		default:
+			printf("Usage: %s [-m <model 1-10, as zmodopipe>] [-p <port>] [-c <channels>] [-f <file.h264>]\n"
+				"\t[-r <kbit/s>] [-F <fps>] [-u <username>] [-a <password>] [-L <login reply latency ms>]\n"
+				"\t[-k <seconds before dropping each connection>] [-M <ch#, its synthetic scene moves>]\n"
+				"\t[-w <file.h264 to write -k seconds of the stream to instead of serving it>] [-v]\n", argv[0]);
+			return 0;
+		}
+	}
+
+	if( emuArgs.model < mobile || emuArgs.model > meye || emuArgs.channels < 1 || emuArgs.channels > MAX_CHANNELS ||
+		emuArgs.fps <= 0 || emuArgs.kbps < 0 || emuArgs.latency < 0 || emuArgs.dropAfter < 0 )
+	{
+		printf("Invalid arguments\n");
+		return 1;
+	}
+
+	if( !emuArgs.port )
+		emuArgs.port = models[emuArgs.model].port;
+
+	if( emuArgs.file )
+	{
+		if( loadFile(emuArgs.file) != 0 )
+			return 1;
+	}
+	else
+	{
+		if( !emuArgs.kbps )
+			emuArgs.kbps = 1000;
+		if( makeSynthetic() != 0 )
+		{
+			printf("Out of memory\n");
+			return 1;
+		}
+	}
+
+	if( emuArgs.write )
+		return writeStream(emuArgs.write);
+
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(emuArgs.port);
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
+
+	if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, 64) == -1 )
+	{
+		perror("Failed to listen");
+		return 1;
+	}
+
+	printf("Emulating a %s DVR with %i channels on port %i, %lu byte stream of %lu frames\n", models[emuArgs.model].name,
+		emuArgs.channels, emuArgs.port, (unsigned long)g_streamLen, (unsigned long)g_frameCount);
+	fflush(stdout);
+
+	// Connections are served by their own process, nobody waits for them
+	signal(SIGCHLD, SIG_IGN);
+
+	while( true )
+	{
+		fd = accept(listenFd, NULL, NULL);
+		if( fd == -1 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			perror("accept failed");
+			return 1;
+		}
+
+		if( fork() == 0 )
+		{
+			int channel;
+
+			close(listenFd);
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+
+			channel = serveLogin(fd);
+			if( channel < 0 || channel >= emuArgs.channels )
+			{
+				if( emuArgs.verbose && channel < 0 )
+					printf("Login failed, closing\n");
+				else if( emuArgs.verbose )
+					printf("Ch %i: No such channel, closing\n", channel+1);
+				exit(1);
+			}
+
+			if( emuArgs.verbose )
+			{
+				printf("Ch %i: Logged in, streaming\n", channel+1);
+				fflush(stdout);
+			}
+
+			serveStream(fd, channel);
+			exit(0);
+		}
+		close(fd);
+	}
+}
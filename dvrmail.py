@@ -0,0 +1,301 @@
+#!/usr/bin/env python
+##
+##  Streaming SMTP sender for dvralarm's alert mails
+##
+##  Public Domain
+##
+
+'''
+Sends a mail with file attachments without ever holding an attachment, let alone the
+whole message, in memory. Each file is read a chunk at a time, base64 encoded by
+binascii in one call per chunk and written straight to the SMTP socket, so it takes
+the same memory for one clip as for sixteen.
+
+    dvrmail.send('127.0.0.1', 'alarm@raspberry.pi', 'admin@example.com', 'DVR Alarm',
+                 'Footage of the alarm', ['/tmp/dvralert/20261016_141502_ch01.mp4', ...])
+
+files can be a generator, the connection is opened once it yields the first one and
+each is sent as soon as it comes. Besides paths it takes objects with read() and a
+name, like dvrclip's trimmed clips, payload() tells how much of them fits a mail. The envelope is pipelined if the server offers
+PIPELINING (RFC 2920) and the message goes in BDAT chunks if it offers CHUNKING
+(RFC 3030), as DATA otherwise.
+
+Run it to check it with and without both against a stand-in SMTP server on localhost.
+'''
+
+import os                                   # files to attach
+import re
+import sys
+import time
+import json
+import socket
+import getopt                               # options of the self-test
+import hashlib
+import binascii                             # base64 kernel
+import smtplib                              # connection, EHLO and replies
+import tempfile
+import resource                             # peak memory of the self-test
+from email.utils import formatdate
+
+CHUNK = 57 * 1024                           # bytes of a file encoded at a time, whole base64 lines
+WINDOW = 8                                  # BDAT replies left outstanding when pipelining
+HEADER = 1024                               # bytes of the message header and the parts' boundaries
+PART = 256                                  # bytes of an attachment's part header
+
+def _encode(data):
+    ''' base64 of data as CRLF terminated lines of 76 characters '''
+    line = binascii.b2a_base64(data)[:-1]
+    return b'\r\n'.join([line[i:i+76] for i in range(0, len(line), 76)]) + b'\r\n'
+
+def payload(size, files, text=''):
+    ''' Bytes of files attachments and text that fit in a mail of size bytes, once base64 encoded '''
+    return max(0, (size - HEADER - len(text) - PART * files) // 78 * 57)
+
+def _check(code, resp, expected, command):
+    if code not in expected:
+        raise smtplib.SMTPResponseException(code, '%s: %s' % (command, resp))
+
+class _Message(object):
+    ''' The message of a transaction, written out every CHUNK bytes as DATA or as a BDAT chunk '''
+
+    def __init__(self, smtp, chunking, pipelining):
+        self.smtp = smtp
+        self.chunking = chunking
+        self.pipelining = pipelining
+        self.pending = []
+        self.size = 0
+        self.outstanding = 0                # BDAT chunks whose reply wasn't read yet
+
+    def write(self, data):
+        self.pending.append(data)
+        self.size += len(data)
+        if self.size >= CHUNK:
+            self.flush()
+
+    def flush(self, last=False):
+        data = b''.join(self.pending)
+        self.pending = []
+        self.size = 0
+
+        if not self.chunking:
+            self.smtp.send(data + (b'.\r\n' if last else b''))
+            if last:
+                code, resp = self.smtp.getreply()
+                _check(code, resp, (250,), 'DATA')
+            return
+
+        self.smtp.send(('BDAT %i%s\r\n' % (len(data), ' LAST' if last else '')).encode('ascii') + data)
+        self.outstanding += 1
+        while self.outstanding > (WINDOW if self.pipelining and not last else 0):
+            code, resp = self.smtp.getreply()
+            self.outstanding -= 1
+            _check(code, resp, (250,), 'BDAT')
+
+def _envelope(smtp, send_from, send_to, pipelining, chunking):
+    ''' MAIL, RCPT and DATA unless the message goes in BDAT chunks, sent at once if pipelining '''
+    commands = [('MAIL FROM:%s' % smtplib.quoteaddr(send_from), (250,))]
+    commands += [('RCPT TO:%s' % smtplib.quoteaddr(to), (250, 251)) for to in send_to]
+    if not chunking:
+        commands.append(('DATA', (354,)))
+
+    if pipelining:
+        smtp.send(''.join([command + '\r\n' for command, expected in commands]).encode('ascii'))
+        replies = [smtp.getreply() for command in commands]
+    else:
+        replies = []
+        for command, expected in commands:
+            smtp.putcmd(command)
+            replies.append(smtp.getreply())
+            if replies[-1][0] not in expected:
+                break
+
+    # every reply of a pipelined group has to be read before the first failure counts
+    for (command, expected), (code, resp) in zip(commands, replies):
+        _check(code, resp, expected, command)
+
+def send(server, send_from, send_to, subject, text, files, port=25):
+    '''
+        Mail files as attachments, send_to is an address or a list of them. Each is a path
+        or an object with read() and name. A file that can't be opened is noted in the mail
+        instead. Returns the number of files attached.
+    '''
+    if not isinstance(send_to, (list, tuple)):
+        send_to = [send_to]
+
+    files = iter(files)
+    first = next(files, None)
+    boundary = '==dvrmail%s==' % binascii.hexlify(os.urandom(8)).decode('ascii')
+    attached = 0
+
+    smtp = smtplib.SMTP(server, port)
+    try:
+        smtp.ehlo_or_helo_if_needed()
+        pipelining = smtp.has_extn('pipelining')
+        chunking = smtp.has_extn('chunking')
+        _envelope(smtp, send_from, send_to, pipelining, chunking)
+        msg = _Message(smtp, chunking, pipelining)
+
+        # only the text can have lines starting with a dot, base64 never does
+        text = re.sub(r'\r?\n', '\r\n', text)
+        if not chunking:
+            text = re.sub(r'(?m)^\.', '..', text)
+        msg.write(('Subject: %s\r\nFrom: %s\r\nTo: %s\r\nDate: %s\r\nMIME-Version: 1.0\r\n'
+            'Content-Type: multipart/mixed; boundary="%s"\r\n\r\n--%s\r\nContent-Type: text/plain; charset="us-ascii"\r\n'
+            'Content-Transfer-Encoding: 7bit\r\n\r\n%s\r\n' % (subject, send_from, ', '.join(send_to),
+            formatdate(localtime=True), boundary, boundary, text)).encode('ascii'))
+
+        while first is not None:
+            name = os.path.basename(first.name if hasattr(first, 'read') else first)
+            try:
+                f = first if hasattr(first, 'read') else open(first, 'rb')
+            except (IOError, OSError):
+                msg.write(('--%s\r\nContent-Type: text/plain; charset="us-ascii"\r\n\r\nFailed to attach %s, skipping\r\n'
+                    % (boundary, name)).encode('ascii'))
+            else:
+                with f:
+                    msg.write(('--%s\r\nContent-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n'
+                        'Content-Disposition: attachment; filename="%s"\r\n\r\n' % (boundary, name)).encode('ascii'))
+                    data = f.read(CHUNK)
+                    while data:
+                        msg.write(_encode(data))
+                        data = f.read(CHUNK)
+                attached += 1
+            first = next(files, None)
+
+        msg.write(('--%s--\r\n' % boundary).encode('ascii'))
+        msg.flush(True)
+        smtp.quit()
+    finally:
+        smtp.close()
+
+    return attached
+
+def _serve(listener, path, extensions, delay=0):
+    '''
+        Stand-in SMTP server for the self-test, takes one mail, writes it to path
+        and the md5 of each decoded attachment to path.json. A slow relay holds the
+        reply to the end of the mail delay seconds.
+    '''
+    import email
+    conn, addr = listener.accept()
+    rfile = conn.makefile('rb')
+    out = open(path, 'wb')
+    conn.sendall(b'220 localhost dvrmail test\r\n')
+
+    while True:
+        line = rfile.readline()
+        if not line:
+            break
+        command = line.strip().split(b' ')
+        verb = command[0].upper()
+        if verb == b'EHLO':
+            conn.sendall(b''.join([b'250-' + extn + b'\r\n' for extn in [b'localhost'] + extensions]) + b'250 8BITMIME\r\n')
+        elif verb == b'DATA':
+            conn.sendall(b'354 go ahead\r\n')
+            line = rfile.readline()
+            while line != b'.\r\n':
+                out.write(line[1:] if line.startswith(b'..') else line)
+                line = rfile.readline()
+            time.sleep(delay)
+            conn.sendall(b'250 accepted\r\n')
+        elif verb == b'BDAT':
+            out.write(rfile.read(int(command[1])))
+            if command[-1].upper() == b'LAST':
+                time.sleep(delay)
+            conn.sendall(b'250 chunk accepted\r\n')
+        elif verb == b'QUIT':
+            conn.sendall(b'221 bye\r\n')
+            break
+        else:
+            conn.sendall(b'250 ok\r\n')
+    out.close()
+    conn.close()
+
+    with open(path, 'rb') as f:
+        msg = email.message_from_binary_file(f) if sys.version_info[0] >= 3 else email.message_from_file(f)
+    sums = dict([(part.get_filename(), hashlib.md5(part.get_payload(decode=True)).hexdigest())
+        for part in msg.walk() if part.get_filename()])
+    with open(path + '.json', 'w') as f:
+        json.dump(sums, f)
+
+def _peak():
+    ''' Peak resident memory of this process in KB '''
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+def usage():
+    print('Usage: %s [-n <files>] [-m <MB each>]\nSends the files through a stand-in SMTP server with and without PIPELINING and CHUNKING'
+          % sys.argv[0])
+
+if __name__ == '__main__':
+    # Mails random files to a stand-in server forked off this process, checks they arrive intact
+    # and that sending them didn't take memory in proportion to their size
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 'n:m:h')
+    except getopt.GetoptError:
+        usage()
+        sys.exit(1)
+    conf = {'-n': '8', '-m': '4'}
+    conf.update(dict(opts))
+    if '-h' in conf:
+        usage()
+        sys.exit(0)
+
+    tmp = tempfile.mkdtemp(prefix='dvrmail')
+    files = []
+    sums = {}
+    for i in range(int(conf['-n'])):
+        files.append(os.path.join(tmp, 'clip_ch%02i.mp4' % (i + 1)))
+        md5 = hashlib.md5()
+        with open(files[-1], 'wb') as f:
+            for mb in range(int(conf['-m'])):
+                data = os.urandom(1024 * 1024 - i)
+                md5.update(data)
+                f.write(data)
+        sums[os.path.basename(files[-1])] = md5.hexdigest()
+    files.append(os.path.join(tmp, 'missing.mp4'))
+
+    fail = 0
+    text = '.a line starting with a dot\nand one more'
+    base = _peak()
+    for extensions in ([b'PIPELINING', b'CHUNKING'], [b'PIPELINING'], [b'CHUNKING'], []):
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.bind(('127.0.0.1', 0))
+        listener.listen(1)
+        port = listener.getsockname()[1]
+        received = os.path.join(tmp, 'received.eml')
+
+        pid = os.fork()
+        if pid == 0:
+            try:
+                _serve(listener, received, extensions)
+            finally:
+                os._exit(0)
+        listener.close()
+
+        start = time.time()
+        attached = send('127.0.0.1', 'alarm@raspberry.pi', 'admin@example.com', 'dvrmail self-test',
+                        text, iter(files), port)
+        took = time.time() - start
+        os.waitpid(pid, 0)
+
+        with open(received + '.json') as f:
+            got = json.load(f)
+        # a mail any smaller than this one can't have had room for its attachments by payload()
+        ok = got == sums and attached == len(files) - 1 and \
+            payload(os.path.getsize(received) - 1, len(files), text) < sum([os.path.getsize(f) for f in files[:-1]])
+        grown = (_peak() - base) / 1024.0
+        print('%-20s %i files, %i MB in %.2f s, peak memory +%.1f MB %s' % (' '.join([e.decode('ascii') for e in extensions]) or 'plain',
+              attached, int(conf['-n']) * int(conf['-m']), took, grown, 'ok' if ok else 'FAILED'))
+        fail |= not ok
+        os.remove(received)
+        os.remove(received + '.json')
+
+    # a sender buffering one attachment would grow by more than its size
+    if (_peak() - base) / 1024.0 >= int(conf['-m']):
+        print('Memory grew with the attachments')
+        fail = 1
+
+    for f in files[:-1]:
+        os.remove(f)
+    os.rmdir(tmp)
+    sys.exit(fail)
@@ -0,0 +1,765 @@
+/*****************************************
+ * Fragmented MP4 writer for raw H.264   *
+ * License: Public Domain                *
+ *****************************************/
+
+// Wraps the raw H.264 received from the DVR in an MP4 container without ffmpeg.
+// Each GOP becomes one fragment (moof + mdat) so memory use is bounded by the
+// GOP size and the file can be written out as the stream is read.
+//
+// Timestamps come from frame arrival times. Frames often arrive in bursts,
+// so within a fragment the arrival deltas are only used when they are all
+// positive, otherwise the fragment's span is shared evenly between its frames.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mp4mux.h"
+#include "nalscan.h"
+
+// Growable buffer the boxes are assembled in
+struct mp4Buf
+{
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+	bool failed;
+};
+
+static void bufReserve(struct mp4Buf *b, size_t len)
+{
+	unsigned char *data;
+	size_t cap;
+
+	if( b->failed || b->len + len <= b->cap )
+		return;
+
+	cap = b->cap ? b->cap * 2 : 1024;
+	while( cap < b->len + len )
+		cap *= 2;
+
+	data = realloc(b->data, cap);
+	if( data == NULL )
+	{
+		b->failed = true;
+		return;
+	}
+
+	b->data = data;
+	b->cap = cap;
+}
+
+static void put(struct mp4Buf *b, const void *data, size_t len)
+{
+	bufReserve(b, len);
+	if( b->failed )
+		return;
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put8(struct mp4Buf *b, unsigned int val)
+{
+	unsigned char byte = val;
+
+	put(b, &byte, 1);
+}
+
+static void put16(struct mp4Buf *b, unsigned int val)
+{
+	put8(b, val >> 8);
+	put8(b, val);
+}
+
+static void put32(struct mp4Buf *b, unsigned int val)
+{
+	put16(b, val >> 16);
+	put16(b, val);
+}
+
+static void put64(struct mp4Buf *b, unsigned long long val)
+{
+	put32(b, val >> 32);
+	put32(b, val);
+}
+
+static void putZeros(struct mp4Buf *b, size_t len)
+{
+	while( len-- )
+		put8(b, 0);
+}
+
+// Start a box, returns its offset so boxEnd can fill in the size
+static size_t boxStart(struct mp4Buf *b, const char *type)
+{
+	size_t start = b->len;
+
+	put32(b, 0);
+	put(b, type, 4);
+	return start;
+}
+
+// Full boxes carry a version and flags after the type
+static size_t fullBoxStart(struct mp4Buf *b, const char *type, int version, unsigned int flags)
+{
+	size_t start = boxStart(b, type);
+
+	put32(b, (version << 24) | flags);
+	return start;
+}
+
+static void boxEnd(struct mp4Buf *b, size_t start)
+{
+	size_t size = b->len - start;
+
+	if( b->failed )
+		return;
+
+	b->data[start] = size >> 24;
+	b->data[start + 1] = size >> 16;
+	b->data[start + 2] = size >> 8;
+	b->data[start + 3] = size;
+}
+
+static void putMatrix(struct mp4Buf *b)
+{
+	put32(b, 0x00010000);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0x00010000);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0x40000000);
+}
+
+static int writeAll(int fd, const unsigned char *data, size_t len)
+{
+	while( len )
+	{
+		ssize_t written = write(fd, data, len);
+
+		if( written == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			return -1;
+		}
+		data += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+// Exp-Golomb reader over an SPS with emulation prevention bytes removed
+struct bitReader
+{
+	unsigned char data[256];
+	size_t len;
+	size_t pos;		// in bits
+};
+
+static unsigned int readBit(struct bitReader *br)
+{
+	unsigned int bit;
+
+	if( br->pos >= br->len * 8 )
+		return 0;
+
+	bit = (br->data[br->pos / 8] >> (7 - br->pos % 8)) & 1;
+	br->pos++;
+	return bit;
+}
+
+static unsigned int readBits(struct bitReader *br, int count)
+{
+	unsigned int val = 0;
+
+	while( count-- )
+		val = (val << 1) | readBit(br);
+	return val;
+}
+
+static unsigned int readUe(struct bitReader *br)
+{
+	int zeros = 0;
+
+	while( readBit(br) == 0 && zeros < 32 )
+		zeros++;
+
+	return ((1u << zeros) - 1) + readBits(br, zeros);
+}
+
+static int readSe(struct bitReader *br)
+{
+	unsigned int val = readUe(br);
+
+	return val & 1 ? (int)((val + 1) / 2) : -(int)(val / 2);
+}
+
+static void skipScalingList(struct bitReader *br, int size)
+{
+	int last = 8, next = 8;
+	int idx;
+
+	for( idx=0;idx<size;idx++ )
+	{
+		if( next != 0 )
+			next = (last + readSe(br) + 256) % 256;
+		last = next == 0 ? last : next;
+	}
+}
+
+int mp4ParseSps(const unsigned char *sps, size_t len, int *width, int *height)
+{
+	struct bitReader br;
+	unsigned int profile, chromaFormat = 1;
+	unsigned int widthMbs, heightMaps, frameMbsOnly;
+	unsigned int cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
+	size_t idx;
+	int zeros = 0;
+
+	memset(&br, 0, sizeof(br));
+
+	// Drop the emulation prevention bytes (00 00 03)
+	for( idx=0;idx<len && br.len<sizeof(br.data);idx++ )
+	{
+		if( zeros >= 2 && sps[idx] == 3 )
+		{
+			zeros = 0;
+			continue;
+		}
+		zeros = sps[idx] == 0 ? zeros + 1 : 0;
+		br.data[br.len++] = sps[idx];
+	}
+
+	if( br.len < 4 )
+		return 1;
+
+	br.pos = 8;		// NAL header
+	profile = readBits(&br, 8);
+	readBits(&br, 16);	// constraint flags, level
+	readUe(&br);		// seq_parameter_set_id
+
+	if( profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+		profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+		profile == 139 || profile == 134 || profile == 135 )
+	{
+		chromaFormat = readUe(&br);
+		if( chromaFormat == 3 )
+			readBit(&br);	// separate_colour_plane_flag
+		readUe(&br);		// bit_depth_luma_minus8
+		readUe(&br);		// bit_depth_chroma_minus8
+		readBit(&br);		// qpprime_y_zero_transform_bypass_flag
+		if( readBit(&br) )	// seq_scaling_matrix_present_flag
+		{
+			for( idx=0;idx<(chromaFormat != 3 ? 8 : 12);idx++ )
+			{
+				if( readBit(&br) )
+					skipScalingList(&br, idx < 6 ? 16 : 64);
+			}
+		}
+	}
+
+	readUe(&br);		// log2_max_frame_num_minus4
+	switch( readUe(&br) )	// pic_order_cnt_type
+	{
+	case 0:
+		readUe(&br);	// log2_max_pic_order_cnt_lsb_minus4
+		break;
+	case 1:
+	{
+		unsigned int cycle;
+
+		readBit(&br);	// delta_pic_order_always_zero_flag
+		readSe(&br);	// offset_for_non_ref_pic
+		readSe(&br);	// offset_for_top_to_bottom_field
+		cycle = readUe(&br);
+		for( idx=0;idx<cycle && idx<256;idx++ )
+			readSe(&br);
+		break;
+	}
+	}
+
+	readUe(&br);		// max_num_ref_frames
+	readBit(&br);		// gaps_in_frame_num_value_allowed_flag
+	widthMbs = readUe(&br) + 1;
+	heightMaps = readUe(&br) + 1;
+	frameMbsOnly = readBit(&br);
+	if( !frameMbsOnly )
+		readBit(&br);	// mb_adaptive_frame_field_flag
+	readBit(&br);		// direct_8x8_inference_flag
+	if( readBit(&br) )	// frame_cropping_flag
+	{
+		cropLeft = readUe(&br);
+		cropRight = readUe(&br);
+		cropTop = readUe(&br);
+		cropBottom = readUe(&br);
+	}
+
+	*width = widthMbs * 16 - (cropLeft + cropRight) * (chromaFormat == 0 || chromaFormat == 3 ? 1 : 2);
+	*height = (2 - frameMbsOnly) * heightMaps * 16 -
+		(cropTop + cropBottom) * (chromaFormat == 1 ? 2 : 1) * (2 - frameMbsOnly);
+
+	return *width > 0 && *height > 0 ? 0 : 1;
+}
+
+// ftyp and moov describing one H.264 track, sample data follows in fragments
+static int mp4WriteHeader(struct mp4Writer *mw)
+{
+	struct mp4Buf b;
+	size_t moov, trak, mdia, minf, dinf, dref, stbl, stsd, avc1, avcc, mvex, box;
+	int width = 0, height = 0;
+	int ret;
+
+	if( mp4ParseSps(mw->sps + 4, mw->spsLen - 4, &width, &height) != 0 )
+		return -1;
+
+	memset(&b, 0, sizeof(b));
+
+	box = boxStart(&b, "ftyp");
+	put(&b, "iso5", 4);
+	put32(&b, 512);
+	put(&b, "iso5", 4);
+	put(&b, "iso6", 4);
+	put(&b, "avc1", 4);
+	put(&b, "mp41", 4);
+	boxEnd(&b, box);
+
+	moov = boxStart(&b, "moov");
+
+	box = fullBoxStart(&b, "mvhd", 0, 0);
+	put32(&b, 0);		// creation time
+	put32(&b, 0);		// modification time
+	put32(&b, 1000);	// timescale
+	put32(&b, 0);		// duration, unknown when fragmented
+	put32(&b, 0x00010000);	// rate 1.0
+	put16(&b, 0x0100);	// volume 1.0
+	putZeros(&b, 10);
+	putMatrix(&b);
+	putZeros(&b, 24);
+	put32(&b, 2);		// next track ID
+	boxEnd(&b, box);
+
+	trak = boxStart(&b, "trak");
+
+	box = fullBoxStart(&b, "tkhd", 0, 3);	// enabled, in movie
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, 1);		// track ID
+	put32(&b, 0);
+	put32(&b, 0);		// duration
+	putZeros(&b, 8);
+	put16(&b, 0);		// layer
+	put16(&b, 0);		// alternate group
+	put16(&b, 0);		// volume
+	put16(&b, 0);
+	putMatrix(&b);
+	put32(&b, width << 16);
+	put32(&b, height << 16);
+	boxEnd(&b, box);
+
+	mdia = boxStart(&b, "mdia");
+
+	box = fullBoxStart(&b, "mdhd", 0, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, MP4_TIMESCALE);
+	put32(&b, 0);
+	put16(&b, 0x55c4);	// language "und"
+	put16(&b, 0);
+	boxEnd(&b, box);
+
+	box = fullBoxStart(&b, "hdlr", 0, 0);
+	put32(&b, 0);
+	put(&b, "vide", 4);
+	putZeros(&b, 12);
+	put(&b, "VideoHandler", 13);
+	boxEnd(&b, box);
+
+	minf = boxStart(&b, "minf");
+
+	box = fullBoxStart(&b, "vmhd", 0, 1);
+	putZeros(&b, 8);	// graphics mode, opcolor
+	boxEnd(&b, box);
+
+	dinf = boxStart(&b, "dinf");
+	dref = fullBoxStart(&b, "dref", 0, 0);
+	put32(&b, 1);
+	box = fullBoxStart(&b, "url ", 0, 1);	// data is in this file
+	boxEnd(&b, box);
+	boxEnd(&b, dref);
+	boxEnd(&b, dinf);
+
+	stbl = boxStart(&b, "stbl");
+
+	stsd = fullBoxStart(&b, "stsd", 0, 0);
+	put32(&b, 1);
+	avc1 = boxStart(&b, "avc1");
+	putZeros(&b, 6);
+	put16(&b, 1);		// data reference index
+	putZeros(&b, 16);
+	put16(&b, width);
+	put16(&b, height);
+	put32(&b, 0x00480000);	// 72 dpi
+	put32(&b, 0x00480000);
+	put32(&b, 0);
+	put16(&b, 1);		// frame count
+	putZeros(&b, 32);	// compressor name
+	put16(&b, 0x0018);	// depth
+	put16(&b, 0xffff);
+
+	avcc = boxStart(&b, "avcC");
+	put8(&b, 1);		// version
+	put8(&b, mw->sps[5]);	// profile
+	put8(&b, mw->sps[6]);	// profile compatibility
+	put8(&b, mw->sps[7]);	// level
+	put8(&b, 0xff);		// 4 byte NAL lengths
+	put8(&b, 0xe1);		// one SPS
+	put16(&b, mw->spsLen - 4);
+	put(&b, mw->sps + 4, mw->spsLen - 4);
+	put8(&b, 1);		// one PPS
+	put16(&b, mw->ppsLen - 4);
+	put(&b, mw->pps + 4, mw->ppsLen - 4);
+	boxEnd(&b, avcc);
+
+	boxEnd(&b, avc1);
+	boxEnd(&b, stsd);
+
+	// Empty sample tables, the samples are described by the fragments
+	box = fullBoxStart(&b, "stts", 0, 0);
+	put32(&b, 0);
+	boxEnd(&b, box);
+	box = fullBoxStart(&b, "stsc", 0, 0);
+	put32(&b, 0);
+	boxEnd(&b, box);
+	box = fullBoxStart(&b, "stsz", 0, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	boxEnd(&b, box);
+	box = fullBoxStart(&b, "stco", 0, 0);
+	put32(&b, 0);
+	boxEnd(&b, box);
+
+	boxEnd(&b, stbl);
+	boxEnd(&b, minf);
+	boxEnd(&b, mdia);
+	boxEnd(&b, trak);
+
+	mvex = boxStart(&b, "mvex");
+	box = fullBoxStart(&b, "trex", 0, 0);
+	put32(&b, 1);		// track ID
+	put32(&b, 1);		// sample description index
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	boxEnd(&b, box);
+	boxEnd(&b, mvex);
+
+	boxEnd(&b, moov);
+
+	ret = b.failed ? -1 : writeAll(mw->fd, b.data, b.len);
+	free(b.data);
+	mw->started = true;
+	return ret;
+}
+
+// Write the frames held so far as one moof/mdat, end is the arrival time
+// of the frame that follows them (or < 0 if unknown)
+static int mp4Flush(struct mp4Writer *mw, long long end)
+{
+	struct mp4Buf b;
+	unsigned int durations[mw->sampleCount ? mw->sampleCount : 1];
+	unsigned long long span;
+	unsigned int idx;
+	size_t moof, traf, trun, dataOffset, box;
+	bool useArrival = true;
+	int ret;
+
+	if( mw->sampleCount == 0 )
+		return 0;
+
+	if( end < 0 )
+		end = mw->sampleCount > 1 ? mw->samples[mw->sampleCount - 1].time +
+			(mw->samples[mw->sampleCount - 1].time - mw->samples[0].time) / (mw->sampleCount - 1) : -1;
+
+	for( idx=0;idx<mw->sampleCount;idx++ )
+	{
+		long long next = idx + 1 < mw->sampleCount ? mw->samples[idx + 1].time : end;
+
+		if( next <= mw->samples[idx].time )
+		{
+			useArrival = false;
+			break;
+		}
+		durations[idx] = (next - mw->samples[idx].time) * (MP4_TIMESCALE / 1000);
+	}
+
+	if( !useArrival )
+	{
+		if( end > mw->samples[0].time )
+			span = (end - mw->samples[0].time) * (MP4_TIMESCALE / 1000);
+		else
+			span = (unsigned long long)mw->sampleCount * MP4_TIMESCALE / MP4_DEFAULT_FPS;
+
+		for( idx=0;idx<mw->sampleCount;idx++ )
+			durations[idx] = span / mw->sampleCount;
+	}
+
+	memset(&b, 0, sizeof(b));
+
+	moof = boxStart(&b, "moof");
+
+	box = fullBoxStart(&b, "mfhd", 0, 0);
+	put32(&b, ++mw->sequence);
+	boxEnd(&b, box);
+
+	traf = boxStart(&b, "traf");
+
+	box = fullBoxStart(&b, "tfhd", 0, 0x020000);	// default-base-is-moof
+	put32(&b, 1);
+	boxEnd(&b, box);
+
+	box = fullBoxStart(&b, "tfdt", 1, 0);
+	put64(&b, mw->decodeTime);
+	boxEnd(&b, box);
+
+	// data offset, duration, size and flags per sample
+	trun = fullBoxStart(&b, "trun", 0, 0x000701);
+	put32(&b, mw->sampleCount);
+	dataOffset = b.len;
+	put32(&b, 0);
+	for( idx=0;idx<mw->sampleCount;idx++ )
+	{
+		put32(&b, durations[idx]);
+		put32(&b, mw->samples[idx].size);
+		put32(&b, mw->samples[idx].keyframe ? 0x02000000 : 0x01010000);
+		mw->decodeTime += durations[idx];
+	}
+	boxEnd(&b, trun);
+
+	boxEnd(&b, traf);
+	boxEnd(&b, moof);
+
+	// Sample data starts right after the mdat header
+	if( !b.failed )
+	{
+		unsigned int offset = b.len - moof + 8;
+
+		b.data[dataOffset] = offset >> 24;
+		b.data[dataOffset + 1] = offset >> 16;
+		b.data[dataOffset + 2] = offset >> 8;
+		b.data[dataOffset + 3] = offset;
+	}
+
+	put32(&b, mw->mdatLen + 8);
+	put(&b, "mdat", 4);
+
+	ret = b.failed ? -1 : writeAll(mw->fd, b.data, b.len);
+	if( ret == 0 )
+		ret = writeAll(mw->fd, mw->mdat, mw->mdatLen);
+
+	free(b.data);
+	mw->frames += mw->sampleCount;
+	mw->sampleCount = 0;
+	mw->mdatLen = 0;
+	return ret;
+}
+
+int mp4WriteFrame(struct mp4Writer *mw, const unsigned char *au, size_t len, long long time)
+{
+	const unsigned char *end = au + len;
+	const unsigned char *nal, *next;
+	bool keyframe = false;
+	size_t frameLen = 0;
+
+	// First pass, find out what the frame holds and how big it will be
+	for( nal = nalFindStartCode(au, end); nal; nal = next )
+	{
+		const unsigned char *payload = nal + 3;
+		size_t nalLen;
+		int type;
+
+		next = nalFindStartCode(payload, end);
+		nalLen = (next ? next : end) - payload;
+
+		// A 4 byte start code leaves a zero at the end of the previous NAL
+		while( next && nalLen && payload[nalLen - 1] == 0 )
+			nalLen--;
+		if( nalLen == 0 )
+			continue;
+
+		type = payload[0] & 0x1f;
+		if( type == NAL_IDR )
+			keyframe = true;
+		if( type != NAL_AUD )
+			frameLen += 4 + nalLen;
+
+		// Keep the parameter sets, with a start code, for the avcC box
+		if( !mw->started && (type == NAL_SPS || type == NAL_PPS) )
+		{
+			unsigned char *dst = type == NAL_SPS ? mw->sps : mw->pps;
+			unsigned int *dstLen = type == NAL_SPS ? &mw->spsLen : &mw->ppsLen;
+
+			if( nalLen + 4 <= 256 )
+			{
+				dst[0] = dst[1] = dst[2] = 0;
+				dst[3] = 1;
+				memcpy(dst + 4, payload, nalLen);
+				*dstLen = nalLen + 4;
+			}
+		}
+	}
+
+	if( !mw->started )
+	{
+		// Nothing can be played before the first keyframe
+		if( !keyframe || !mw->spsLen || !mw->ppsLen )
+			return 0;
+		if( mp4WriteHeader(mw) != 0 )
+			return -1;
+	}
+
+	// A new GOP starts a new fragment
+	if( mw->sampleCount && (keyframe || mw->mdatLen + frameLen > MP4_MAX_FRAGMENT) )
+	{
+		if( mp4Flush(mw, time) != 0 )
+			return -1;
+	}
+
+	if( mw->sampleCount == mw->sampleCap )
+	{
+		unsigned int cap = mw->sampleCap ? mw->sampleCap * 2 : 64;
+		struct mp4Sample *samples = realloc(mw->samples, cap * sizeof(struct mp4Sample));
+
+		if( samples == NULL )
+			return -1;
+		mw->samples = samples;
+		mw->sampleCap = cap;
+	}
+
+	if( mw->mdatLen + frameLen > mw->mdatCap )
+	{
+		size_t cap = mw->mdatCap ? mw->mdatCap : 65536;
+		unsigned char *mdat;
+
+		while( cap < mw->mdatLen + frameLen )
+			cap *= 2;
+		mdat = realloc(mw->mdat, cap);
+		if( mdat == NULL )
+			return -1;
+		mw->mdat = mdat;
+		mw->mdatCap = cap;
+	}
+
+	// Second pass, copy the NAL units with a length prefix instead of a start code
+	for( nal = nalFindStartCode(au, end); nal; nal = next )
+	{
+		const unsigned char *payload = nal + 3;
+		unsigned char *dst = mw->mdat + mw->mdatLen;
+		size_t nalLen;
+
+		next = nalFindStartCode(payload, end);
+		nalLen = (next ? next : end) - payload;
+		while( next && nalLen && payload[nalLen - 1] == 0 )
+			nalLen--;
+		if( nalLen == 0 || (payload[0] & 0x1f) == NAL_AUD )
+			continue;
+
+		dst[0] = nalLen >> 24;
+		dst[1] = nalLen >> 16;
+		dst[2] = nalLen >> 8;
+		dst[3] = nalLen;
+		memcpy(dst + 4, payload, nalLen);
+		mw->mdatLen += 4 + nalLen;
+	}
+
+	mw->samples[mw->sampleCount].size = frameLen;
+	mw->samples[mw->sampleCount].time = time;
+	mw->samples[mw->sampleCount].keyframe = keyframe;
+	mw->sampleCount++;
+
+	return 0;
+}
+
+// Arrival time of the next frame taken from the stream
+static long long streamTime(struct mp4Writer *mw)
+{
+	if( mw->chunkTime >= 0 )
+		return mw->chunkTime;
+
+	return mw->streamFrames * 1000 / (mw->fps > 0 ? mw->fps : MP4_DEFAULT_FPS);
+}
+
+// A new access unit starts, the collected bytes before it make up the previous one
+static void streamNal(void *ctx, const struct nalUnit *nal)
+{
+	struct mp4Writer *mw = ctx;
+	size_t len;
+
+	if( !nal->newAccessUnit || mw->error )
+		return;
+
+	len = nal->auStart - mw->auStart;
+
+	// Anything before the first access unit can't be decoded
+	if( mw->auOpen && mp4WriteFrame(mw, mw->au, len, mw->auTime) != 0 )
+		mw->error = -1;
+
+	memmove(mw->au, mw->au + len, mw->auLen - len);
+	mw->auLen -= len;
+	mw->auStart = nal->auStart;
+	mw->auOpen = true;
+	mw->auTime = streamTime(mw);
+	mw->streamFrames++;
+}
+
+int mp4WriteStream(struct mp4Writer *mw, const unsigned char *buf, size_t len, long long time)
+{
+	if( mw->auLen + len > mw->auCap )
+	{
+		size_t cap = mw->auCap ? mw->auCap : 65536;
+		unsigned char *au;
+
+		while( cap < mw->auLen + len )
+			cap *= 2;
+		au = realloc(mw->au, cap);
+		if( au == NULL )
+			return -1;
+		mw->au = au;
+		mw->auCap = cap;
+	}
+
+	memcpy(mw->au + mw->auLen, buf, len);
+	mw->auLen += len;
+	mw->chunkTime = time;
+
+	nalScan(&mw->scan, buf, len, streamNal, mw);
+	return mw->error;
+}
+
+int mp4Close(struct mp4Writer *mw)
+{
+	int ret = mw->error;
+
+	if( ret == 0 && mw->auOpen && mw->auLen )
+		ret = mp4WriteFrame(mw, mw->au, mw->auLen, mw->auTime);
+	if( ret == 0 )
+		ret = mp4Flush(mw, -1);
+
+	free(mw->samples);
+	free(mw->mdat);
+	free(mw->au);
+	mw->samples = NULL;
+	mw->mdat = NULL;
+	mw->au = NULL;
+	mw->sampleCap = mw->sampleCount = 0;
+	mw->mdatCap = mw->mdatLen = 0;
+	mw->auCap = mw->auLen = 0;
+	mw->auOpen = false;
+	return ret;
+}
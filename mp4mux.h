@@ -0,0 +1,73 @@
+/*****************************************
+ * Fragmented MP4 writer for raw H.264   *
+ * License: Public Domain                *
+ *****************************************/
+
+#ifndef MP4MUX_H
+#define MP4MUX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "nalscan.h"
+
+#define MP4_TIMESCALE 90000		// track timescale, ticks per second
+#define MP4_DEFAULT_FPS 25		// frame rate assumed when arrival times can't be used
+#define MP4_MAX_FRAGMENT (4 << 20)	// flush a fragment early once it holds this many bytes
+
+// One frame waiting in the current fragment
+struct mp4Sample
+{
+	unsigned int size;		// bytes in mdat, length prefixed NAL units
+	long long time;			// arrival time in ms
+	bool keyframe;
+};
+
+// Writes an fMP4 file: ftyp and moov once the first SPS/PPS have been seen,
+// then a moof/mdat fragment per GOP. Nothing is seeked, so the output can be a pipe.
+// Zero it and set fd (and fps if arrival times aren't known) before use.
+struct mp4Writer
+{
+	int fd;				// output file
+	bool started;			// ftyp/moov written
+	unsigned int sequence;		// fragment sequence number
+	unsigned long long decodeTime;	// decode time of the next fragment, in MP4_TIMESCALE
+	unsigned char sps[256];
+	unsigned int spsLen;
+	unsigned char pps[256];
+	unsigned int ppsLen;
+	struct mp4Sample *samples;	// frames in the current fragment
+	unsigned int sampleCount;
+	unsigned int sampleCap;
+	unsigned char *mdat;		// their data
+	size_t mdatLen;
+	size_t mdatCap;
+	unsigned long long frames;	// frames written so far
+	int fps;			// frame rate used when no arrival time is given
+	// Raw stream input (mp4WriteStream)
+	struct nalScanner scan;		// splits the stream into access units
+	unsigned char *au;		// the access unit being collected
+	size_t auLen;
+	size_t auCap;
+	unsigned long long auStart;	// stream offset of au[0]
+	long long auTime;		// arrival time of its first byte
+	bool auOpen;			// au holds the start of an access unit
+	long long chunkTime;		// arrival time of the chunk being scanned
+	unsigned long long streamFrames;// access units taken from the stream
+	int error;
+};
+
+// Add one access unit (frame) in Annex-B format, time is its arrival time in ms.
+// Frames before the first keyframe with SPS/PPS are skipped.
+int mp4WriteFrame(struct mp4Writer *mw, const unsigned char *au, size_t len, long long time);
+
+// Add raw Annex-B stream as it was received, time is the chunk's arrival time in ms
+// or -1 to time frames at fps. Frames are cut out with the NAL scanner.
+int mp4WriteStream(struct mp4Writer *mw, const unsigned char *buf, size_t len, long long time);
+
+// Flush the last frame and fragment and free the writer's buffers, fd is left open
+int mp4Close(struct mp4Writer *mw);
+
+// Get the picture size from an SPS (without start code), returns 0 on success
+int mp4ParseSps(const unsigned char *sps, size_t len, int *width, int *height);
+
+#endif
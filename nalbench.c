@@ -0,0 +1,198 @@
+/*****************************************
+ * NAL scanner microbenchmark            *
+ * License: Public Domain                *
+ *****************************************/
+
+// Measures how fast nalscan.c gets through a synthetic H.264 stream,
+// fed in recv() sized chunks the way zmodopipe's channel loop does,
+// and how many channels of a given bitrate that is on one core.
+//
+// Compile: gcc -Wall -O2 nalbench.c nalscan.c synth.c -o nalbench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "nalscan.h"
+#include "synth.h"
+
+struct benchArgs_t {
+	int sizeMb;		// -s MB of stream to generate
+	int kbps;		// -r bitrate of one channel in kbit/s
+	int chunk;		// -c bytes per recv() chunk
+	int iterations;		// -i passes over the stream
+} benchArgs = { 32, 1000, 2048, 5 };
+
+struct nalCounts
+{
+	unsigned long long nals;
+	unsigned long long frames;
+	unsigned long long keyframes;
+	unsigned long long lastStart;
+};
+
+void countNal(void *ctx, const struct nalUnit *nal)
+{
+	struct nalCounts *counts = ctx;
+
+	counts->nals++;
+	counts->lastStart = nal->start;
+	if( nal->newAccessUnit )
+		counts->frames++;
+	if( nal->type == NAL_IDR && nal->firstSlice )
+		counts->keyframes++;
+}
+
+// GOPs of 25 frames, a 30 KB keyframe with parameter sets then 24 frames of 4 KB
+size_t makeStream(unsigned char *buf, size_t size, unsigned long long *frames, unsigned long long *keyframes)
+{
+	size_t len = 0;
+	int frame = 0;
+
+	while( len + 40000 < size )
+	{
+		if( frame % 25 == 0 )
+		{
+			len += synthFrame(buf + len, true, true, 30000);
+			(*keyframes)++;
+		}
+		else
+			len += synthFrame(buf + len, false, frame % 2, 3000 + rand() % 2000);
+		(*frames)++;
+		frame++;
+	}
+
+	return len;
+}
+
+double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+unsigned long long countStartCodes(const unsigned char *(*find)(const unsigned char*, const unsigned char*),
+	const unsigned char *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = buf + len;
+	unsigned long long found = 0;
+
+	while( (p = find(p, end)) != NULL )
+	{
+		found++;
+		p += 3;
+	}
+
+	return found;
+}
+
+void report(const char *name, double secs, size_t bytes)
+{
+	double mbps = bytes / secs / 1e6;
+
+	printf("%-16s %8.1f MB/s  %8.0f channels @ %i kbit/s per core\n", name, mbps,
+		mbps * 1e6 * 8 / (benchArgs.kbps * 1000.0), benchArgs.kbps);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *buf;
+	size_t size, len;
+	unsigned long long frames = 0, keyframes = 0;
+	unsigned long long simdCodes = 0, scalarCodes = 0;
+	struct nalCounts whole, chunked;
+	struct nalScanner sc;
+	struct timespec start;
+	double secs;
+	size_t pos;
+	int opt;
+	int iter;
+
+	while( (opt = getopt(argc, argv, "s:r:c:i:h")) != -1 )
+	{
+		switch( opt )
+		{
+		case 's':
+			benchArgs.sizeMb = atoi(optarg);
+			break;
+		case 'r':
+			benchArgs.kbps = atoi(optarg);
+			break;
+		case 'c':
+			benchArgs.chunk = atoi(optarg);
+			break;
+		case 'i':
+			benchArgs.iterations = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-s <MB of stream>] [-r <kbit/s per channel>] [-c <chunk bytes>] [-i <iterations>]\n", argv[0]);
+			return 0;
+		}
+	}
+
+	if( benchArgs.sizeMb <= 0 || benchArgs.kbps <= 0 || benchArgs.chunk <= 0 || benchArgs.iterations <= 0 )
+	{
+		printf("Invalid arguments\n");
+		return 1;
+	}
+
+	size = (size_t)benchArgs.sizeMb * 1024 * 1024;
+	buf = malloc(size + 64);
+	if( buf == NULL )
+	{
+		printf("Failed to allocate %i MB\n", benchArgs.sizeMb);
+		return 1;
+	}
+
+	srand(1);
+	len = makeStream(buf, size, &frames, &keyframes);
+	printf("Stream: %lu bytes, %llu frames, %llu keyframes, simd: %s\n", (unsigned long)len, frames, keyframes, nalScanImpl());
+
+	// Raw start code search
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	for( iter=0;iter<benchArgs.iterations;iter++ )
+		scalarCodes = countStartCodes(nalFindStartCodeScalar, buf, len);
+	report("find (scalar)", elapsed(&start), len * benchArgs.iterations);
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	for( iter=0;iter<benchArgs.iterations;iter++ )
+		simdCodes = countStartCodes(nalFindStartCode, buf, len);
+	report("find (simd)", elapsed(&start), len * benchArgs.iterations);
+
+	// Full scanner, whole buffer and in recv() sized chunks
+	memset(&whole, 0, sizeof(whole));
+	memset(&sc, 0, sizeof(sc));
+	nalScan(&sc, buf, len, countNal, &whole);
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	for( iter=0;iter<benchArgs.iterations;iter++ )
+	{
+		memset(&chunked, 0, sizeof(chunked));
+		memset(&sc, 0, sizeof(sc));
+
+		for( pos=0;pos<len;pos+=benchArgs.chunk )
+			nalScan(&sc, buf + pos, pos + benchArgs.chunk > len ? len - pos : benchArgs.chunk, countNal, &chunked);
+	}
+	secs = elapsed(&start);
+	report("scan (chunked)", secs, len * benchArgs.iterations);
+
+	// Both paths and both ways of feeding must agree with what was generated
+	if( simdCodes != scalarCodes || whole.nals != simdCodes || chunked.nals != whole.nals ||
+		chunked.lastStart != whole.lastStart || chunked.frames != frames || chunked.keyframes != keyframes )
+	{
+		printf("MISMATCH: scalar %llu simd %llu whole %llu chunked %llu, frames %llu/%llu, keyframes %llu/%llu\n",
+			scalarCodes, simdCodes, whole.nals, chunked.nals, chunked.frames, frames, chunked.keyframes, keyframes);
+		free(buf);
+		return 1;
+	}
+
+	printf("16 channels @ %i kbit/s use %.2f%% of one core\n", benchArgs.kbps,
+		100.0 * 16 * benchArgs.kbps * 1000.0 / 8 / (len * benchArgs.iterations / secs));
+
+	free(buf);
+	return 0;
+}
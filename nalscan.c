@@ -0,0 +1,221 @@
+/*****************************************
+ * H.264 Annex-B NAL unit scanner        *
+ * License: Public Domain                *
+ *****************************************/
+
+// Finds start codes (00 00 01) in the raw stream as it is received and
+// classifies the NAL units behind them, without copying any data.
+// Access unit (frame) boundaries are worked out as described in
+// H.264 7.4.1.2.3, so callers can cut the stream on whole frames.
+
+#include "nalscan.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+const char *nalScanImpl(void)
+{
+#if defined(__SSE2__)
+	return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
+
+// Looks at every third byte, anything above 1 can't be part of a start code
+// ending at, or one or two bytes after, that position.
+const unsigned char *nalFindStartCodeScalar(const unsigned char *p, const unsigned char *end)
+{
+	const unsigned char *q;
+
+	if( end - p < 3 )
+		return NULL;
+
+	q = p + 2;
+	while( q < end )
+	{
+		if( *q > 1 )
+			q += 3;
+		else if( *q == 0 )
+			q++;
+		else
+		{
+			if( q[-1] == 0 && q[-2] == 0 )
+				return q - 2;
+			q += 3;
+		}
+	}
+
+	return NULL;
+}
+
+// Checks 16 bytes at a time for two zero bytes in a row.
+// Encoded slice data rarely has those (emulation prevention), so most blocks are skipped.
+// Each block needs two bytes of look ahead, the tail is left to the scalar version.
+const unsigned char *nalFindStartCode(const unsigned char *p, const unsigned char *end)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	while( end - p >= 18 )
+	{
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), zero));
+
+		// Zero followed by zero, the last byte pairs with the next block
+		mask &= (mask >> 1) | 0x8000;
+
+		while( mask )
+		{
+			int idx = __builtin_ctz(mask);
+
+			if( p[idx + 1] == 0 && p[idx + 2] == 1 )
+				return p + idx;
+			mask &= mask - 1;
+		}
+		p += 16;
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint8x16_t zero = vdupq_n_u8(0);
+
+	while( end - p >= 18 )
+	{
+		uint64x2_t zeros = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(p), zero));
+
+		if( (vgetq_lane_u64(zeros, 0) | vgetq_lane_u64(zeros, 1)) != 0 )
+		{
+			int idx;
+
+			for( idx=0;idx<16;idx++ )
+			{
+				if( p[idx] == 0 && p[idx + 1] == 0 && p[idx + 2] == 1 )
+					return p + idx;
+			}
+		}
+		p += 16;
+	}
+#endif
+	return nalFindStartCodeScalar(p, end);
+}
+
+// Classify the pending NAL and track access unit boundaries
+static void nalEmit(struct nalScanner *sc, nalCallback cb, void *ctx)
+{
+	struct nalUnit nal;
+
+	nal.start = sc->pendingStart;
+	nal.type = sc->header[0] & 0x1f;
+	nal.refIdc = (sc->header[0] >> 5) & 0x03;
+	nal.newAccessUnit = false;
+	nal.firstSlice = false;
+
+	if( nal.type >= NAL_SLICE && nal.type <= NAL_IDR )
+	{
+		// first_mb_in_slice is 0 (ue(v) '1') on the first slice of a picture
+		nal.firstSlice = (sc->header[1] & 0x80) != 0;
+
+		if( sc->auOpen )
+			sc->auOpen = false;
+		else if( nal.firstSlice )
+		{
+			sc->auStart = nal.start;
+			nal.newAccessUnit = true;
+		}
+	}
+	else if( (nal.type >= NAL_SEI && nal.type <= NAL_AUD) || (nal.type >= 14 && nal.type <= 18) )
+	{
+		// These always come before the first slice of the next picture
+		if( !sc->auOpen )
+		{
+			sc->auOpen = true;
+			sc->auStart = nal.start;
+			nal.newAccessUnit = true;
+		}
+	}
+
+	nal.auStart = sc->auStart;
+	sc->pending = 0;
+
+	if( cb )
+		cb(ctx, &nal);
+}
+
+// A start code was found, its 00 00 01 begins at stream offset pos
+// and prevZero says whether the byte before it is zero (4 byte start code).
+// hdr points at what follows it in the current chunk.
+static const unsigned char *nalFound(struct nalScanner *sc, unsigned long long pos, bool prevZero,
+	const unsigned char *hdr, const unsigned char *end, nalCallback cb, void *ctx)
+{
+	sc->pendingStart = prevZero ? pos - 1 : pos;
+	sc->pending = 2;
+
+	while( sc->pending && hdr < end )
+	{
+		sc->header[2 - sc->pending] = *hdr++;
+		sc->pending--;
+	}
+
+	if( !sc->pending )
+		nalEmit(sc, cb, ctx);
+
+	return hdr;
+}
+
+void nalScan(struct nalScanner *sc, const unsigned char *buf, size_t len, nalCallback cb, void *ctx)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = buf + len;
+	const unsigned char *found;
+	unsigned long long base = sc->offset;
+	unsigned int zeros = sc->zeros;
+	size_t idx;
+
+	if( len == 0 )
+		return;
+
+	// Finish a header that was split from its start code
+	while( sc->pending && p < end )
+	{
+		sc->header[2 - sc->pending] = *p++;
+		sc->pending--;
+
+		if( !sc->pending )
+			nalEmit(sc, cb, ctx);
+	}
+
+	// Start codes split across the previous chunk
+	if( p == buf )
+	{
+		if( zeros >= 2 && buf[0] == 1 )
+			p = nalFound(sc, base - 2, zeros >= 3, buf + 1, end, cb, ctx);
+		else if( zeros >= 1 && len >= 2 && buf[0] == 0 && buf[1] == 1 )
+			p = nalFound(sc, base - 1, zeros >= 2, buf + 2, end, cb, ctx);
+	}
+
+	while( p < end && (found = nalFindStartCode(p, end)) != NULL )
+	{
+		bool prevZero;
+
+		if( found > buf )
+			prevZero = found[-1] == 0;
+		else
+			prevZero = zeros >= 1;
+
+		p = nalFound(sc, base + (found - buf), prevZero, found + 3, end, cb, ctx);
+	}
+
+	// Remember trailing zeros, they may start a code in the next chunk
+	for( idx=0;idx<len && idx<3 && buf[len - 1 - idx] == 0;idx++ )
+		;
+	if( idx == len )
+		zeros += idx;
+	else
+		zeros = idx;
+	sc->zeros = zeros > 3 ? 3 : zeros;
+
+	sc->offset = base + len;
+}
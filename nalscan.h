@@ -0,0 +1,59 @@
+/*****************************************
+ * H.264 Annex-B NAL unit scanner        *
+ * License: Public Domain                *
+ *****************************************/
+
+#ifndef NALSCAN_H
+#define NALSCAN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// NAL unit types (nal_unit_type) we act on
+#define NAL_SLICE	1	// non-IDR slice
+#define NAL_IDR		5	// IDR slice, a keyframe
+#define NAL_SEI		6
+#define NAL_SPS		7	// sequence parameter set
+#define NAL_PPS		8	// picture parameter set
+#define NAL_AUD		9	// access unit delimiter
+
+// One NAL unit found in the stream
+struct nalUnit
+{
+	unsigned long long start;	// stream offset of the start code (incl. the leading 0 of a 4 byte code)
+	unsigned long long auStart;	// stream offset of the access unit this NAL belongs to
+	int type;			// nal_unit_type
+	int refIdc;			// nal_ref_idc, 0 means no other frame references this one
+	bool newAccessUnit;		// this NAL is the first of a new access unit (frame)
+	bool firstSlice;		// first slice of a picture, with type NAL_IDR this is a keyframe
+};
+
+typedef void (*nalCallback)(void *ctx, const struct nalUnit *nal);
+
+// Streaming scanner state, carried over between chunks.
+// Zero it before use.
+struct nalScanner
+{
+	unsigned long long offset;	// stream offset of the next byte to be fed
+	unsigned int zeros;		// number of zero bytes at the end of the last chunk (max 3)
+	int pending;			// bytes of the NAL header still needed (0 if none)
+	unsigned char header[2];	// NAL header and first payload byte
+	unsigned long long pendingStart;// start code offset of the pending NAL
+	unsigned long long auStart;	// start of the current access unit
+	bool auOpen;			// a non-VCL NAL already opened the next access unit
+};
+
+// Find the first 00 00 01 start code in [p, end).
+// Returns a pointer to its first zero byte, or NULL if there is none.
+// Uses SSE2 or NEON when available.
+const unsigned char *nalFindStartCode(const unsigned char *p, const unsigned char *end);
+const unsigned char *nalFindStartCodeScalar(const unsigned char *p, const unsigned char *end);
+
+// Feed the next chunk of the stream, cb is called for every NAL unit once
+// its header is available, in stream order. Start codes split across chunks are found.
+void nalScan(struct nalScanner *sc, const unsigned char *buf, size_t len, nalCallback cb, void *ctx);
+
+// The name of the SIMD path compiled in ("sse2", "neon" or "scalar")
+const char *nalScanImpl(void);
+
+#endif
@@ -6,4 +6,4 @@ if [[ $# -eq 0 ]] ; then
 fi
 
 echo Packaging dvralarm_$1beta.tar.gz
-tar czvf dvralarm_$1beta.tar.gz Makefile README zmodopipe.c dvralarm_pi.py dvralarm.sh Dev_Testing_Sketch_Pull-up_Resister.png
+tar czvf dvralarm_$1beta.tar.gz Makefile README zmodopipe.c zmodopipe.h zmodopipe.py nalscan.c nalscan.h synth.c synth.h nalbench.c mp4mux.c mp4mux.h zmodomux.c splicebench.c zmodoshm.h zmodorec.h zmodocat.c zmodoextract.c dvremu.c zmodobench.c zmodoshm.py dvralarm_pi.py dvrmail.py dvrclip.py dvralarm.sh Dev_Testing_Sketch_Pull-up_Resister.png
@@ -0,0 +1,228 @@
+/*****************************************
+ * zmodopipe forwarding benchmark        *
+ * License: Public Domain                *
+ *****************************************/
+
+// Runs zmodopipe against a local TCP sender posing as a media port DVR
+// and reads its FIFO as fast as it can, once forwarding with copies
+// and once with splice() (-Z). Reports throughput and the CPU time
+// zmodopipe used for it.
+//
+// Compile: gcc -Wall -O2 splicebench.c synth.c -o splicebench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "synth.h"
+
+#define LOGIN_SIZE 507		// media port login packet zmodopipe sends
+
+struct benchArgs_t {
+	int sizeMb;		// -s MB to forward per run
+	int chunk;		// -c bytes per send() of the DVR
+	int rate;		// -r MB/s the DVR sends at, 0 for as fast as it can
+	char *zmodopipe;	// -z zmodopipe binary to run
+} benchArgs = { 512, 2048, 100, "./zmodopipe" };
+
+// The fake DVR, swallows the login then streams until the reader is attached
+// (zmodopipe discards that) and total bytes once told to go
+void runSender(int listenFd, int goFd, unsigned long long total)
+{
+	char *buf = malloc(benchArgs.chunk);
+	char login[LOGIN_SIZE];
+	unsigned long long sent = 0;
+	double start;
+	size_t got = 0;
+	ssize_t len;
+	char go;
+	int fd;
+
+	fd = accept(listenFd, NULL, NULL);
+	if( fd == -1 || buf == NULL )
+		exit(1);
+
+	while( got < sizeof(login) && (len = recv(fd, login + got, sizeof(login) - got, 0)) > 0 )
+		got += len;
+
+	memset(buf, 0x55, benchArgs.chunk);
+	fcntl(goFd, F_SETFL, O_NONBLOCK);
+	while( read(goFd, &go, 1) != 1 )
+	{
+		if( send(fd, buf, benchArgs.chunk, 0) <= 0 )
+			exit(1);
+		usleep(1000);
+	}
+
+	start = wallSecs();
+	while( sent < total )
+	{
+		len = send(fd, buf, benchArgs.chunk, 0);
+		if( len <= 0 )
+			exit(1);
+		sent += len;
+
+		// Pace every 64 KB
+		if( benchArgs.rate && (sent & 0xffff) < (unsigned)len )
+		{
+			double ahead = sent / (benchArgs.rate * 1e6) - (wallSecs() - start);
+
+			if( ahead > 0 )
+				usleep(ahead * 1e6);
+		}
+	}
+
+	// Hold the connection open so zmodopipe doesn't reconnect mid run
+	pause();
+	exit(0);
+}
+
+int runBench(const char *name, bool splice)
+{
+	unsigned long long total = (unsigned long long)benchArgs.sizeMb * 1024 * 1024;
+	unsigned long long received = 0;
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	struct rusage usage;
+	char fifo[64], port[16];
+	char buf[65536];
+	double start, secs, cpu;
+	pid_t sender, zmodo;
+	int listenFd, fifoFd;
+	int goPipe[2];
+	ssize_t len;
+
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, 1) == -1 ||
+		getsockname(listenFd, (struct sockaddr*)&addr, &addrLen) == -1 || pipe(goPipe) == -1 )
+	{
+		perror("Failed to set up the sender");
+		return 1;
+	}
+
+	fflush(stdout);
+	sender = fork();
+	if( sender == 0 )
+	{
+		close(goPipe[1]);
+		runSender(listenFd, goPipe[0], total);
+	}
+	close(goPipe[0]);
+	close(listenFd);
+
+	sprintf(port, "%i", ntohs(addr.sin_port));
+	sprintf(fifo, "/tmp/splicebench%i0", (int)getpid());
+
+	zmodo = fork();
+	if( zmodo == 0 )
+	{
+		char pipeName[32];
+
+		close(goPipe[1]);
+		sprintf(pipeName, "splicebench%i", (int)getppid());
+		if( freopen("/dev/null", "w", stdout) == NULL )
+			exit(1);
+		execl(benchArgs.zmodopipe, benchArgs.zmodopipe, "-e", "-s", "127.0.0.1", "-p", port, "-m", "2",
+			"-c", "1", "-n", pipeName, splice ? "-Z" : NULL, NULL);
+		perror("Failed to run zmodopipe");
+		exit(1);
+	}
+
+	// zmodopipe creates the FIFO and opens it once it has data
+	while( (fifoFd = open(fifo, O_RDONLY | O_NONBLOCK)) == -1 )
+		usleep(1000);
+	fcntl(fifoFd, F_SETFL, 0);
+
+	while( (len = read(fifoFd, buf, sizeof(buf))) == 0 )
+		usleep(1000);
+
+	if( write(goPipe[1], "g", 1) != 1 )
+		return 1;
+	start = wallSecs();
+	secs = 0;
+
+	// The copy path drops what the reader can't take, stop once nothing more arrives
+	while( received < total )
+	{
+		struct pollfd pfd = { fifoFd, POLLIN, 0 };
+
+		if( poll(&pfd, 1, 2000) != 1 || (len = read(fifoFd, buf, sizeof(buf))) <= 0 )
+			break;
+		received += len;
+		secs = wallSecs() - start;
+	}
+
+	kill(zmodo, SIGTERM);
+	wait4(zmodo, NULL, 0, &usage);
+	kill(sender, SIGTERM);
+	waitpid(sender, NULL, 0);
+	close(fifoFd);
+	close(goPipe[1]);
+
+	cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	printf("%-8s %8.1f MB/s  zmodopipe cpu %6.2fs (user %.2fs sys %.2fs), %6.1f us/MB", name,
+		received / secs / 1e6, cpu, usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6, cpu * 1e6 / (total / 1e6));
+
+	if( received < total )
+		printf(", %llu of %llu bytes dropped", total - received, total);
+	printf("\n");
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while( (opt = getopt(argc, argv, "s:c:r:z:h")) != -1 )
+	{
+		switch( opt )
+		{
+		case 's':
+			benchArgs.sizeMb = atoi(optarg);
+			break;
+		case 'c':
+			benchArgs.chunk = atoi(optarg);
+			break;
+		case 'r':
+			benchArgs.rate = atoi(optarg);
+			break;
+		case 'z':
+			benchArgs.zmodopipe = optarg;
+			break;
+		default:
+			printf("Usage: %s [-s <MB per run>] [-c <DVR send size>] [-r <MB/s, 0 unpaced>] [-z <zmodopipe binary>]\n", argv[0]);
+			return 0;
+		}
+	}
+
+	if( benchArgs.sizeMb <= 0 || benchArgs.chunk <= 0 || benchArgs.rate < 0 )
+	{
+		printf("Invalid arguments\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	printf("Forwarding %i MB over loopback, DVR sends %i byte chunks at %i MB/s\n", benchArgs.sizeMb, benchArgs.chunk, benchArgs.rate);
+
+	if( runBench("copy", false) != 0 || runBench("splice", true) != 0 )
+		return 1;
+
+	return 0;
+}
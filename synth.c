@@ -0,0 +1,77 @@
+/*****************************************
+ * Synthetic H.264 for the test tools    *
+ * License: Public Domain                *
+ *****************************************/
+
+// The stream the DVR emulator serves and the benchmarks feed zmodopipe,
+// and the clock they pace it with. Not part of zmodopipe itself.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "nalscan.h"
+#include "synth.h"
+
+const unsigned char synthParamSets[SYNTH_PARAM_SETS] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x0d, 0xac, 0xb2, 0x02, 0xc3, 0xf4,
+	0x20, 0x00, 0x00, 0x03, 0x00, 0x20, 0x00, 0x00, 0x06, 0x51, 0xe2, 0x85, 0x49,
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xeb, 0xc0, 0x8c, 0xb2, 0x2c };
+
+double wallSecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleepUntil(double when)
+{
+	double now = wallSecs();
+
+	if( when > now )
+		usleep((when - now) * 1e6);
+}
+
+size_t synthPayload(unsigned char *out, size_t len)
+{
+	size_t n = 0;
+	int zeros = 0;
+
+	while( n < len )
+	{
+		unsigned char byte = rand() & 0xff;
+
+		if( zeros >= 2 && byte <= 3 )
+		{
+			out[n++] = 0x03;
+			zeros = 0;
+			continue;
+		}
+		zeros = byte == 0 ? zeros + 1 : 0;
+		out[n++] = byte;
+	}
+
+	return n;
+}
+
+size_t synthSlice(unsigned char *out, int type, int refIdc, size_t len)
+{
+	out[0] = 0;
+	out[1] = 0;
+	out[2] = 0;
+	out[3] = 1;
+	out[4] = (refIdc << 5) | type;
+	out[5] = 0x88;		// first_mb_in_slice = 0
+	return 6 + synthPayload(out + 6, len);
+}
+
+size_t synthFrame(unsigned char *out, bool keyframe, bool reference, size_t len)
+{
+	if( !keyframe )
+		return synthSlice(out, NAL_SLICE, reference ? 2 : 0, len);
+
+	memcpy(out, synthParamSets, SYNTH_PARAM_SETS);
+	return SYNTH_PARAM_SETS + synthSlice(out + SYNTH_PARAM_SETS, NAL_IDR, 3, len);
+}
@@ -0,0 +1,32 @@
+/*****************************************
+ * Synthetic H.264 for the test tools    *
+ * License: Public Domain                *
+ *****************************************/
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// 352x240 SPS then PPS, with their start codes, so a synthetic stream's picture size can be parsed
+extern const unsigned char synthParamSets[];
+#define SYNTH_PARAM_SETS 36
+
+// Monotonic wall clock in seconds, and a sleep until a time on it
+double wallSecs(void);
+void sleepUntil(double when);
+
+// len bytes of random slice payload with emulation prevention applied,
+// so the only start codes are the ones we put in. Returns the bytes written.
+size_t synthPayload(unsigned char *out, size_t len);
+
+// A NAL unit: 4 byte start code, header, first_mb_in_slice = 0 and len bytes of payload.
+// Returns the bytes written, 6 + len at least.
+size_t synthSlice(unsigned char *out, int type, int refIdc, size_t len);
+
+// A frame of len bytes payload: a keyframe is SPS, PPS and an IDR slice,
+// other frames a P slice, nal_ref_idc 0 unless reference. Returns the bytes written.
+size_t synthFrame(unsigned char *out, bool keyframe, bool reference, size_t len);
+
+#endif
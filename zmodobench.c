@@ -0,0 +1,761 @@
+/*****************************************
+ * zmodopipe streaming benchmark suite   *
+ * License: Public Domain                *
+ *****************************************/
+
+// Runs zmodopipe (-e) against a local TCP sender posing as a media port DVR and
+// reads its FIFOs, to find where the recv/write loop runs out of CPU:
+//  - throughput: one channel sent as fast as the loopback takes it
+//  - channels:   1, 2, 4 ... channels at a set bitrate, for the CPU each costs
+//  - slow_reader: a reader taking half the stream, behind a 500 and a 100 ms output queue (-q),
+//                what it gets of each GOP has to stay decodable
+//  - activity:   a scene that starts moving, behind only the output queue (-q),
+//                has to be scored for activity
+//  - alarm:      channels kept in pre-alarm buffers (-b, -A) and dumped again and again,
+//                nothing may be lost or dropped while the clips are written
+// Every frame the sender writes carries its sequence number and the time it was
+// sent, the reader uses them for the socket to FIFO latency and to count lost frames.
+// Every other P frame is non-reference, as many DVRs send them.
+// Results are printed as JSON so runs can be compared, progress goes to stderr.
+//
+// Compile: gcc -Wall -O2 zmodobench.c synth.c -o zmodobench
+
+#define _GNU_SOURCE	// memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "synth.h"
+
+#define LOGIN_SIZE 507		// media port login packet zmodopipe sends
+#define MAX_CHANNELS 16		// zmodopipe's limit
+#define GOP 25			// frames per keyframe
+#define MARKER "ZBTS"		// starts the tag in every frame, the rest is filled with 'U'
+#define MARKER_LEN 28		// MARKER, 16 hex digits of send time in us, 8 of sequence
+#define MAX_SAMPLES 65536	// latency samples kept per run
+#define ALARM_CHANNELS 4	// channels in the alarm run
+#define ALARM_INTERVAL 1.5	// seconds between its alarms, past their -A 1 so each is an incident of its own
+#define MOTION_AFTER 3		// seconds the activity run's scene is still before it moves
+#define MOTION_SCALE 3		// and how much bigger its P frames are then
+
+struct benchArgs_t {
+	int seconds;		// -d seconds measured per run
+	int kbps;		// -r kbit/s per channel for the paced runs
+	int fps;		// -F frames per second
+	int maxChannels;	// -n most channels tried
+	char *zmodopipe;	// -z zmodopipe binary to run
+	char *output;		// -o write the JSON here instead of stdout
+	char *scenario;		// -s only run this scenario
+} benchArgs = { 5, 4000, 25, MAX_CHANNELS, "./zmodopipe", NULL, NULL };
+
+// What the reader saw of one channel
+struct benchChannel
+{
+	int fd;
+	unsigned char carry[MARKER_LEN];	// tail of the last read, a tag can span reads
+	int carryLen;
+	bool started;			// first tag seen
+	unsigned int nextSeq;
+	unsigned long long bytes;	// read in the measured window
+	unsigned long long allBytes;	// read since zmodopipe started
+	unsigned long long frames;
+	unsigned long long lost;	// sequence numbers skipped
+	unsigned int brokenGop;		// 1 + the GOP that lost a frame others reference, 0 if none
+	unsigned long long keysLost;
+	unsigned long long undecodable;	// frames read after a frame they reference was lost
+};
+
+struct benchResult
+{
+	const char *scenario;
+	int channels;
+	int kbps;			// 0 for unpaced
+	double seconds;			// measured window
+	unsigned long long bytes;
+	unsigned long long frames;
+	unsigned long long lost;
+	unsigned long long keysLost;	// keyframes among them
+	unsigned long long undecodable;	// frames read that reference a lost one
+	unsigned long long expected;	// frames sent in the window, paced runs only
+	double cpu;			// zmodopipe CPU seconds over its whole run
+	double life;			// and the seconds it ran
+	unsigned long long lifeBytes;	// bytes read from it in that time
+	unsigned long long droppedFrames;	// zmodopipe's own counts in the window, from its metrics
+	unsigned long long droppedBytes;
+	unsigned long long shedFrames;	// non-reference frames zmodopipe shed, in the window
+	unsigned long long shedGops;	// and GOPs it cut short
+	int alarms;			// SIGHUPs sent in the window
+	int snapshots;			// manifests zmodopipe wrote for them
+	unsigned long long activity;	// zmodopipe's activity score at the end, summed over the channels
+	double *latency;		// us
+	int samples;
+};
+
+FILE *g_out;
+bool g_firstResult = true;
+bool g_motion = false;		// the senders' scene moves after MOTION_AFTER seconds
+
+// Sum a counter over the channels from zmodopipe's metrics (-M) socket
+unsigned long long fetchMetric(const char *path, const char *name, const char *label)
+{
+	struct sockaddr_un addr;
+	static char buf[65536];
+	unsigned long long total = 0;
+	size_t got = 0;
+	ssize_t len;
+	char *line;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+		send(fd, "GET /metrics HTTP/1.0\r\n\r\n", 27, 0) != 27 )
+	{
+		close(fd);
+		return 0;
+	}
+
+	while( got < sizeof(buf) - 1 && (len = recv(fd, buf + got, sizeof(buf) - 1 - got, 0)) > 0 )
+		got += len;
+	buf[got] = 0;
+	close(fd);
+
+	for( line=strtok(buf, "\n");line!=NULL;line=strtok(NULL, "\n") )
+	{
+		if( strncmp(line, name, strlen(name)) == 0 && line[strlen(name)] == '{' &&
+			(label == NULL || strstr(line, label) != NULL) )
+			total += strtoull(strrchr(line, ' ') + 1, NULL, 10);
+	}
+
+	return total;
+}
+
+// Build a frame: start code, slice header, tag, filler. Keyframes get SPS/PPS in front.
+// Returns the frame size, *tag is where the tag goes.
+size_t makeFrame(unsigned char *buf, size_t size, bool keyframe, bool reference, size_t *tag)
+{
+	size_t len = synthFrame(buf, keyframe, reference, 0);
+
+	*tag = len;
+
+	if( size < len + MARKER_LEN )
+		size = len + MARKER_LEN;
+	memset(buf + len, 'U', size - len);
+
+	return size;
+}
+
+// The fake DVR for one connection: swallow the login, then send tagged frames,
+// paced at fps or as fast as the socket takes them
+void runSender(int fd, int kbps)
+{
+	size_t frameSize = (size_t)(kbps ? kbps : benchArgs.kbps) * 1000 / 8 / benchArgs.fps;
+	unsigned char *key, *delta, *nonRef;
+	size_t keyLen, deltaLen, nonRefLen, keyTag, deltaTag, nonRefTag;
+	char login[LOGIN_SIZE];
+	unsigned int seq;
+	double start;
+	size_t got = 0;
+	ssize_t len;
+
+	key = malloc(frameSize * 3 + SYNTH_PARAM_SETS + MARKER_LEN + 8);
+	delta = malloc(frameSize * MOTION_SCALE + MARKER_LEN + 8);
+	nonRef = malloc(frameSize * MOTION_SCALE + MARKER_LEN + 8);
+	if( key == NULL || delta == NULL || nonRef == NULL )
+		exit(1);
+
+	// Keyframes are three times the others
+	keyLen = makeFrame(key, frameSize * 3, true, true, &keyTag);
+	deltaLen = makeFrame(delta, frameSize, false, true, &deltaTag);
+	nonRefLen = makeFrame(nonRef, frameSize, false, false, &nonRefTag);
+
+	while( got < sizeof(login) && (len = recv(fd, login + got, sizeof(login) - got, 0)) > 0 )
+		got += len;
+
+	start = wallSecs();
+	for( seq=0;;seq++ )
+	{
+		bool keyframe = seq % GOP == 0;
+		bool reference = seq % GOP % 2 == 0;
+		unsigned char *buf = keyframe ? key : reference ? delta : nonRef;
+		size_t bufLen = keyframe ? keyLen : reference ? deltaLen : nonRefLen;
+		size_t sent = 0;
+		char tag[MARKER_LEN + 1];
+
+		if( kbps )
+			sleepUntil(start + (double)seq / benchArgs.fps);
+
+		// A moving scene only shows in the P frames
+		if( g_motion && seq == MOTION_AFTER * benchArgs.fps )
+		{
+			deltaLen = makeFrame(delta, frameSize * MOTION_SCALE, false, true, &deltaTag);
+			nonRefLen = makeFrame(nonRef, frameSize * MOTION_SCALE, false, false, &nonRefTag);
+			bufLen = keyframe ? keyLen : reference ? deltaLen : nonRefLen;
+		}
+
+		sprintf(tag, MARKER "%016llx%08x", (unsigned long long)(wallSecs() * 1e6), seq);
+		memcpy(buf + (keyframe ? keyTag : reference ? deltaTag : nonRefTag), tag, MARKER_LEN);
+
+		while( sent < bufLen )
+		{
+			len = send(fd, buf + sent, bufLen - sent, 0);
+			if( len <= 0 )
+				exit(0);
+			sent += len;
+		}
+	}
+}
+
+// Accept zmodopipe's connections, one sender process each
+void runListener(int listenFd, int kbps)
+{
+	int fd;
+
+	setpgid(0, 0);
+	signal(SIGCHLD, SIG_IGN);
+
+	while( (fd = accept(listenFd, NULL, NULL)) != -1 )
+	{
+		if( fork() == 0 )
+		{
+			close(listenFd);
+			runSender(fd, kbps);
+		}
+		close(fd);
+	}
+	exit(1);
+}
+
+// Find the tags in what was read
+void readTags(struct benchChannel *ch, struct benchResult *res, bool measure, const unsigned char *data, size_t len)
+{
+	static unsigned char scratch[MARKER_LEN + 65536];
+	unsigned char *p, *end;
+
+	memcpy(scratch, ch->carry, ch->carryLen);
+	memcpy(scratch + ch->carryLen, data, len);
+	end = scratch + ch->carryLen + len;
+	p = scratch;
+
+	while( (p = memmem(p, end - p, MARKER, 4)) != NULL && end - p >= MARKER_LEN )
+	{
+		double now = wallSecs() * 1e6;
+		unsigned long long sentUs;
+		unsigned int seq;
+		char hex[17];
+
+		memcpy(hex, p + 4, 16);
+		hex[16] = 0;
+		sentUs = strtoull(hex, NULL, 16);
+		memcpy(hex, p + 20, 8);
+		hex[8] = 0;
+		seq = strtoul(hex, NULL, 16);
+
+		if( measure )
+		{
+			unsigned int skipped;
+
+			if( ch->started && seq > ch->nextSeq )
+				ch->lost += seq - ch->nextSeq;
+
+			// The rest of a GOP can't be decoded once its keyframe or a P frame that's referenced is gone
+			for( skipped=ch->started ? ch->nextSeq : seq;skipped<seq;skipped++ )
+			{
+				if( skipped % GOP == 0 )
+					ch->keysLost++;
+				if( skipped % GOP % 2 == 0 )
+					ch->brokenGop = skipped / GOP + 1;
+			}
+			if( ch->brokenGop == seq / GOP + 1 )
+				ch->undecodable++;
+			ch->frames++;
+			if( res->samples < MAX_SAMPLES )
+				res->latency[res->samples++] = now - sentUs;
+		}
+		ch->started = true;
+		ch->nextSeq = seq + 1;
+		p += MARKER_LEN;
+	}
+
+	// Keep a tag cut off by the end of the read, or what could be the start of one
+	if( p != NULL )
+		ch->carryLen = end - p;
+	else
+		ch->carryLen = end - scratch < 3 ? end - scratch : 3;
+	memcpy(ch->carry, end - ch->carryLen, ch->carryLen);
+}
+
+// Read every channel until deadline, at most rate bytes/s each if rate isn't 0
+void readChannels(struct benchChannel *chans, int count, struct benchResult *res, bool measure, double deadline, double rate)
+{
+	static unsigned char buf[65536];
+	struct pollfd pfds[MAX_CHANNELS];
+	unsigned long long taken[MAX_CHANNELS] = {0};
+	double start = wallSecs();
+	int i;
+
+	while( wallSecs() < deadline )
+	{
+		int timeout = (deadline - wallSecs()) * 1000 + 1;
+
+		for( i=0;i<count;i++ )
+		{
+			pfds[i].fd = chans[i].fd;
+			pfds[i].events = POLLIN;
+		}
+
+		if( poll(pfds, count, timeout > 100 ? 100 : timeout) <= 0 )
+			continue;
+
+		for( i=0;i<count;i++ )
+		{
+			size_t want = sizeof(buf);
+			ssize_t len;
+
+			if( !(pfds[i].revents & POLLIN) )
+				continue;
+
+			// The slow reader takes what its rate allows and comes back later
+			if( rate > 0 )
+			{
+				double allowed = rate * (wallSecs() - start) - taken[i];
+
+				if( allowed < 4096 )
+				{
+					usleep(5000);
+					continue;
+				}
+				if( want > allowed )
+					want = allowed;
+			}
+
+			len = read(chans[i].fd, buf, want);
+			if( len <= 0 )
+				continue;
+
+			taken[i] += len;
+			chans[i].allBytes += len;
+			if( measure )
+				chans[i].bytes += len;
+			readTags(&chans[i], res, measure, buf, len);
+		}
+	}
+}
+
+int compareDouble(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+double percentile(const struct benchResult *res, double pct)
+{
+	if( res->samples == 0 )
+		return 0;
+	return res->latency[(int)((res->samples - 1) * pct / 100)];
+}
+
+double cpuUtil(const struct benchResult *res)
+{
+	return res->life > 0 ? res->cpu / res->life : 0;
+}
+
+double cpuPerMbit(const struct benchResult *res)
+{
+	return res->lifeBytes ? res->cpu * 1000 / (res->lifeBytes * 8 / 1e6) : 0;
+}
+
+void printResult(struct benchResult *res)
+{
+	double mbit = res->bytes * 8 / 1e6;
+
+	qsort(res->latency, res->samples, sizeof(double), compareDouble);
+
+	fprintf(g_out, "%s\n    {\"scenario\": \"%s\", \"channels\": %i, \"kbps_per_channel\": %i, \"seconds\": %.3f,\n",
+		g_firstResult ? "" : ",", res->scenario, res->channels, res->kbps, res->seconds);
+	fprintf(g_out, "     \"bytes\": %llu, \"bytes_per_sec_per_channel\": %.0f, \"mbit_per_sec\": %.2f,\n",
+		res->bytes, res->bytes / res->seconds / res->channels, mbit / res->seconds);
+	fprintf(g_out, "     \"cpu_seconds\": %.3f, \"cpu_util\": %.4f, \"cpu_ms_per_mbit\": %.4f,\n",
+		res->cpu, cpuUtil(res), cpuPerMbit(res));
+	fprintf(g_out, "     \"frames\": %llu, \"frames_expected\": %llu, \"frames_lost\": %llu, \"keyframes_lost\": %llu,\n",
+		res->frames, res->expected, res->lost, res->keysLost);
+	fprintf(g_out, "     \"frames_undecodable\": %llu, \"shed_frames\": %llu, \"shed_gops\": %llu,\n",
+		res->undecodable, res->shedFrames, res->shedGops);
+	fprintf(g_out, "     \"dropped_frames\": %llu, \"dropped_bytes\": %llu, \"alarms\": %i, \"snapshots\": %i, \"activity\": %llu,\n",
+		res->droppedFrames, res->droppedBytes, res->alarms, res->snapshots, res->activity);
+	fprintf(g_out, "     \"latency_us\": {\"samples\": %i, \"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f}}",
+		res->samples, percentile(res, 50), percentile(res, 90), percentile(res, 99), percentile(res, 100));
+	fflush(g_out);
+	g_firstResult = false;
+
+	fprintf(stderr, "%-11s %2i ch %8.1f Mbit/s  cpu %5.1f%% %7.3f ms/Mbit  latency p50 %7.0f us p99 %7.0f us  lost %llu frames, dropped %llu bytes"
+		"  shed %llu frames %llu GOPs\n", res->scenario, res->channels, mbit / res->seconds, cpuUtil(res) * 100, cpuPerMbit(res),
+		percentile(res, 50), percentile(res, 99), res->lost, res->droppedBytes, res->shedFrames, res->shedGops);
+}
+
+// Remove what zmodopipe dumped to dir, returns the snapshot manifests found
+int clearDumps(const char *dir)
+{
+	char pattern[128];
+	glob_t files;
+	int manifests = 0;
+	size_t i;
+
+	sprintf(pattern, "%s/*", dir);
+	if( glob(pattern, 0, NULL, &files) != 0 )
+		return 0;
+
+	for( i=0;i<files.gl_pathc;i++ )
+	{
+		size_t len = strlen(files.gl_pathv[i]);
+
+		if( len > 5 && strcmp(files.gl_pathv[i] + len - 5, ".json") == 0 )
+			manifests++;
+		unlink(files.gl_pathv[i]);
+	}
+	globfree(&files);
+
+	return manifests;
+}
+
+// One run: count channels at kbps each (0 unpaced), extra options for zmodopipe,
+// the reader limited to readRate of the stream if not 0. With alarms zmodopipe
+// keeps the channels for dumps and is sent a SIGHUP every ALARM_INTERVAL.
+int runBench(struct benchResult *res, const char *scenario, int count, int kbps, char **extra, double readRate, bool alarms)
+{
+	struct benchChannel chans[MAX_CHANNELS];
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	char port[16], pipeName[32], fifo[64], metrics[64], dumps[64];
+	char *argv[64];
+	char chanArgs[MAX_CHANNELS][4];
+	struct rusage usage;
+	double born, start, rate, alarmAt;
+	pid_t listener, zmodo;
+	int listenFd;
+	int argc = 0;
+	int i;
+
+	memset(res, 0, sizeof(*res));
+	memset(chans, 0, sizeof(chans));
+	res->scenario = scenario;
+	res->channels = count;
+	res->kbps = kbps;
+	res->latency = malloc(MAX_SAMPLES * sizeof(double));
+	if( res->latency == NULL )
+		return 1;
+
+	listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, MAX_CHANNELS) == -1 ||
+		getsockname(listenFd, (struct sockaddr*)&addr, &addrLen) == -1 )
+	{
+		perror("Failed to set up the sender");
+		return 1;
+	}
+
+	fflush(g_out);
+	listener = fork();
+	if( listener == 0 )
+		runListener(listenFd, kbps);
+	close(listenFd);
+
+	sprintf(port, "%i", ntohs(addr.sin_port));
+	sprintf(pipeName, "zmodobench%i", (int)getpid());
+	sprintf(metrics, "/tmp/zmodobench%i.metrics", (int)getpid());
+	sprintf(dumps, "/tmp/zmodobench%i.dumps", (int)getpid());
+
+	argv[argc++] = benchArgs.zmodopipe;
+	argv[argc++] = "-e";
+	argv[argc++] = "-s";
+	argv[argc++] = "127.0.0.1";
+	argv[argc++] = "-p";
+	argv[argc++] = port;
+	argv[argc++] = "-m";
+	argv[argc++] = "2";
+	argv[argc++] = "-n";
+	argv[argc++] = pipeName;
+	argv[argc++] = "-M";
+	argv[argc++] = metrics;
+	for( i=0;i<count;i++ )
+	{
+		sprintf(chanArgs[i], "%i", i + 1);
+		argv[argc++] = "-c";
+		argv[argc++] = chanArgs[i];
+	}
+	for( i=0;extra && extra[i];i++ )
+		argv[argc++] = extra[i];
+	if( alarms )
+	{
+		mkdir(dumps, 0755);
+		argv[argc++] = "-d";
+		argv[argc++] = dumps;
+	}
+	argv[argc] = NULL;
+
+	born = wallSecs();
+	zmodo = fork();
+	if( zmodo == 0 )
+	{
+		if( freopen("/dev/null", "w", stdout) == NULL )
+			exit(1);
+		execv(benchArgs.zmodopipe, argv);
+		perror("Failed to run zmodopipe");
+		exit(1);
+	}
+
+	// zmodopipe creates the FIFOs, they're opened before any data is sent to them
+	for( i=0;i<count;i++ )
+	{
+		double giveUp = wallSecs() + 5;
+
+		sprintf(fifo, "/tmp/%s%i", pipeName, i);
+		while( (chans[i].fd = open(fifo, O_RDONLY | O_NONBLOCK)) == -1 && wallSecs() < giveUp )
+			usleep(1000);
+		if( chans[i].fd == -1 )
+		{
+			fprintf(stderr, "zmodopipe didn't create %s\n", fifo);
+			count = i;
+			break;
+		}
+	}
+
+	// Let every channel log in and settle before measuring
+	rate = readRate * (kbps ? kbps : benchArgs.kbps) * 1000 / 8;
+	if( count == res->channels )
+		readChannels(chans, count, res, false, wallSecs() + 1, 0);
+
+	// What was dropped while the readers opened the FIFOs doesn't count
+	res->droppedFrames = fetchMetric(metrics, "zmodopipe_dropped_frames_total", NULL);
+	res->shedFrames = fetchMetric(metrics, "zmodopipe_shed_frames_total", NULL);
+	res->shedGops = fetchMetric(metrics, "zmodopipe_shed_gops_total", NULL);
+	res->droppedBytes = fetchMetric(metrics, "zmodopipe_dropped_bytes_total", alarms ? NULL : "slow_reader");
+
+	// The last alarm is left the time to be dumped before zmodopipe is stopped
+	start = wallSecs();
+	for( alarmAt=start + ALARM_INTERVAL;count == res->channels;alarmAt+=ALARM_INTERVAL )
+	{
+		if( !alarms || alarmAt + ALARM_INTERVAL > start + benchArgs.seconds )
+		{
+			readChannels(chans, count, res, true, start + benchArgs.seconds, rate);
+			break;
+		}
+
+		readChannels(chans, count, res, true, alarmAt, rate);
+		kill(zmodo, SIGHUP);
+		res->alarms++;
+	}
+	res->seconds = wallSecs() - start;
+
+	res->droppedFrames = fetchMetric(metrics, "zmodopipe_dropped_frames_total", NULL) - res->droppedFrames;
+	res->shedFrames = fetchMetric(metrics, "zmodopipe_shed_frames_total", NULL) - res->shedFrames;
+	res->shedGops = fetchMetric(metrics, "zmodopipe_shed_gops_total", NULL) - res->shedGops;
+	res->droppedBytes = fetchMetric(metrics, "zmodopipe_dropped_bytes_total", alarms ? NULL : "slow_reader") - res->droppedBytes;
+	res->activity = fetchMetric(metrics, "zmodopipe_activity", NULL);
+
+	// /proc only counts CPU time in ticks, the rusage of the whole run is exact
+	kill(zmodo, SIGTERM);
+	wait4(zmodo, NULL, 0, &usage);
+	res->life = wallSecs() - born;
+	res->cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	kill(-listener, SIGTERM);
+	kill(listener, SIGTERM);
+	waitpid(listener, NULL, 0);
+
+	if( alarms )
+	{
+		res->snapshots = clearDumps(dumps);
+		rmdir(dumps);
+	}
+
+	for( i=0;i<count;i++ )
+	{
+		close(chans[i].fd);
+		res->bytes += chans[i].bytes;
+		res->lifeBytes += chans[i].allBytes;
+		res->frames += chans[i].frames;
+		res->lost += chans[i].lost;
+		res->keysLost += chans[i].keysLost;
+		res->undecodable += chans[i].undecodable;
+	}
+	if( kbps )
+		res->expected = (unsigned long long)(res->seconds * benchArgs.fps) * res->channels;
+
+	return count == res->channels ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct benchResult res;
+	char *slowArgs[] = { "-q", "500", NULL };
+	char *shortArgs[] = { "-q", "100", NULL };
+	char *alarmArgs[] = { "-b", "4", "-A", "1", "-f", "mp4", NULL };
+	double perCore = 0;
+	int sustained = 0;
+	int retval = 0;
+	int count;
+	int i;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "d:r:F:n:z:o:s:h")) != -1 )
+	{
+		switch( opt )
+		{
+		case 'd':
+			benchArgs.seconds = atoi(optarg);
+			break;
+		case 'r':
+			benchArgs.kbps = atoi(optarg);
+			break;
+		case 'F':
+			benchArgs.fps = atoi(optarg);
+			break;
+		case 'n':
+			benchArgs.maxChannels = atoi(optarg);
+			break;
+		case 'z':
+			benchArgs.zmodopipe = optarg;
+			break;
+		case 'o':
+			benchArgs.output = optarg;
+			break;
+		case 's':
+			benchArgs.scenario = optarg;
+			break;
+		default:
+			printf("Usage: %s [-d <seconds per run>] [-r <kbit/s per channel>] [-F <fps>] [-n <max channels>]\n"
+				"\t[-z <zmodopipe binary>] [-o <JSON file>] [-s throughput|channels|slow_reader|activity|alarm]\n"
+				"Exits with 1 if the alarm run lost or dropped anything, the slow reader got frames it can't decode\n"
+				"or the activity run scored no motion\n", argv[0]);
+			return 0;
+		}
+	}
+
+	if( benchArgs.seconds <= 0 || benchArgs.kbps <= 0 || benchArgs.fps <= 0 ||
+		benchArgs.maxChannels < 1 || benchArgs.maxChannels > MAX_CHANNELS )
+	{
+		printf("Invalid arguments\n");
+		return 1;
+	}
+
+	g_out = stdout;
+	if( benchArgs.output && (g_out = fopen(benchArgs.output, "w")) == NULL )
+	{
+		perror(benchArgs.output);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "%i s per run, paced channels at %i kbit/s and %i fps\n", benchArgs.seconds, benchArgs.kbps, benchArgs.fps);
+	fprintf(g_out, "{\n  \"zmodopipe\": \"%s\", \"seconds_per_run\": %i, \"fps\": %i, \"cpus\": %li,\n  \"results\": [",
+		benchArgs.zmodopipe, benchArgs.seconds, benchArgs.fps, sysconf(_SC_NPROCESSORS_ONLN));
+
+	if( benchArgs.scenario == NULL || strcmp(benchArgs.scenario, "throughput") == 0 )
+	{
+		if( runBench(&res, "throughput", 1, 0, NULL, 0, false) != 0 )
+			return 1;
+		printResult(&res);
+		free(res.latency);
+	}
+
+	// A run is sustained when every frame sent made it through
+	for( count=1;benchArgs.scenario == NULL || strcmp(benchArgs.scenario, "channels") == 0;count*=2 )
+	{
+		if( count > benchArgs.maxChannels )
+			count = benchArgs.maxChannels;
+
+		if( runBench(&res, "channels", count, benchArgs.kbps, NULL, 0, false) != 0 )
+			return 1;
+		printResult(&res);
+		if( res.lost == 0 && res.frames + count * benchArgs.fps >= res.expected )
+		{
+			sustained = count;
+			if( cpuUtil(&res) > 0 )
+				perCore = count / cpuUtil(&res);
+		}
+		free(res.latency);
+
+		if( count == benchArgs.maxChannels )
+			break;
+	}
+
+	// Half the stream read, a 500 ms queue can only delay the drops.
+	// They have to be whole frames nothing references, then the ends of GOPs.
+	// A 100 ms queue is smaller than a keyframe, nothing can be cut from the
+	// frame the reader is in to make room for it, the input has to wait.
+	for( i=0;benchArgs.scenario == NULL || strcmp(benchArgs.scenario, "slow_reader") == 0;i++ )
+	{
+		if( runBench(&res, "slow_reader", 1, benchArgs.kbps, i == 0 ? slowArgs : shortArgs, 0.5, false) != 0 )
+			return 1;
+		printResult(&res);
+		if( res.keysLost || res.undecodable || res.frames == 0 )
+		{
+			fprintf(stderr, "Slow reader behind a %s ms queue lost %llu keyframes and got %llu frames it can't decode\n",
+				i == 0 ? slowArgs[1] : shortArgs[1], res.keysLost, res.undecodable);
+			retval = 1;
+		}
+		free(res.latency);
+
+		if( i == 1 )
+			break;
+	}
+
+	// The activity score comes from the scanner, which an output queue alone has to run
+	if( benchArgs.scenario == NULL || strcmp(benchArgs.scenario, "activity") == 0 )
+	{
+		g_motion = true;
+		if( runBench(&res, "activity", 1, benchArgs.kbps, slowArgs, 0, false) != 0 )
+			return 1;
+		g_motion = false;
+		printResult(&res);
+		if( res.activity == 0 )
+		{
+			fprintf(stderr, "Activity run scored no motion with only -q\n");
+			retval = 1;
+		}
+		free(res.latency);
+	}
+
+	// Dumping clips mustn't hold up the channels
+	if( benchArgs.scenario == NULL || strcmp(benchArgs.scenario, "alarm") == 0 )
+	{
+		count = benchArgs.maxChannels < ALARM_CHANNELS ? benchArgs.maxChannels : ALARM_CHANNELS;
+		if( runBench(&res, "alarm", count, benchArgs.kbps, alarmArgs, 0, true) != 0 )
+			return 1;
+		printResult(&res);
+		if( res.lost || res.droppedBytes || res.snapshots < res.alarms || res.alarms == 0 )
+		{
+			fprintf(stderr, "Alarm run lost %llu frames and dropped %llu bytes, %i of %i alarms dumped\n",
+				res.lost, res.droppedBytes, res.snapshots, res.alarms);
+			retval = 1;
+		}
+		free(res.latency);
+	}
+
+	fprintf(g_out, "\n  ],\n  \"max_sustained_channels\": %i, \"channels_per_core\": %.1f\n}\n", sustained, perCore);
+	if( benchArgs.scenario == NULL || strcmp(benchArgs.scenario, "channels") == 0 )
+		fprintf(stderr, "Sustained %i channels, %.1f channels per core\n", sustained, perCore);
+
+	if( g_out != stdout )
+		fclose(g_out);
+	return retval;
+}
@@ -0,0 +1,75 @@
+/*****************************************
+ * Read a zmodopipe shared memory export *
+ * License: Public Domain                *
+ *****************************************/
+
+// Writes a channel exported by zmodopipe -x to stdout, starting on a keyframe,
+// for as many viewers/recorders as needed, e.g.
+//   zmodocat /dev/shm/zmodo0 | ffplay -f h264 -
+//
+// Compile: gcc -Wall -O2 zmodocat.c -o zmodocat
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include "zmodoshm.h"
+
+int main(int argc, char **argv)
+{
+	struct zshmReader rd;
+	unsigned char buf[65536];
+	bool verbose = false;
+	long len;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "vh")) != -1 )
+	{
+		switch( opt )
+		{
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			printf("Usage: %s [-v] /dev/shm/<pipe name><ch#>\n", argv[0]);
+			return 0;
+		}
+	}
+
+	if( optind >= argc )
+	{
+		printf("Usage: %s [-v] /dev/shm/<pipe name><ch#>\n", argv[0]);
+		return 1;
+	}
+
+	if( zshmAttach(&rd, argv[optind]) != 0 )
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	while( __atomic_load_n(&rd.hdr->pid, __ATOMIC_ACQUIRE) != 0 )
+	{
+		len = zshmRead(&rd, buf, sizeof(buf));
+
+		if( len == 0 )
+		{
+			usleep(10000);
+			continue;
+		}
+
+		if( len == -1 )
+		{
+			if( verbose )
+				fprintf(stderr, "Lapped by the producer, skipped to a keyframe (%llu times)\n", (unsigned long long)rd.lapped);
+			continue;
+		}
+
+		if( fwrite(buf, 1, len, stdout) != (size_t)len )
+			break;
+	}
+
+	zshmDetach(&rd);
+	return 0;
+}
@@ -0,0 +1,375 @@
+/*****************************************
+ * Clip extraction from zmodopipe's      *
+ * continuous recording                  *
+ * License: Public Domain                *
+ *****************************************/
+
+// Cuts a time window of a channel out of the segment files zmodopipe -w records,
+// from the last keyframe at or before the start to the first one after the end,
+// so the clip holds whole GOPs and plays on its own. Only the segment headers and
+// indexes are read to find the cut, then the stream between is copied as it is.
+//
+//   zmodopipe-extract -d /var/lib/zmodo -c 3 -s 14:02:10 -e 14:02:40 > clip.h264
+//   zmodopipe-extract -d /var/lib/zmodo -c 3 -l
+//
+// Compile: gcc -Wall -O2 zmodoextract.c -o zmodopipe-extract
+
+#define _GNU_SOURCE // strptime()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zmodorec.h"
+
+#define COPY_SIZE (1024 * 1024)
+
+struct extractArgs_t {
+	char *dir;		// -d recording directory (zmodopipe's -w)
+	char *pipeName;		// -n zmodopipe's pipe name
+	int channel;		// -c channel, 1 based like zmodopipe's -c
+	long long start;	// -s window start, ms since the epoch
+	long long end;		// -e window end
+	char *output;		// -o clip file, stdout if not given
+	bool list;		// -l list the segments instead
+} extractArgs = { ".", "zmodo", 0, -1, -1, NULL, false };
+
+// A segment file with its header and index mapped
+struct segment
+{
+	int fd;
+	struct zrecHeader *hdr;
+	struct zrecIndexEntry *index;
+	unsigned int entries;	// usable index entries
+};
+
+struct segment *g_segments;
+int g_segmentCount;
+
+// "YYYY-MM-DD HH:MM:SS[.mmm]", "HH:MM:SS[.mmm]" (today) or seconds since the epoch, local time
+long long parseTime(const char *text)
+{
+	struct tm tm;
+	time_t now = time(NULL);
+	const char *rest;
+	double frac = 0;
+	char *end;
+
+	// A format that fails can leave fields behind, start each from today
+	if( (localtime_r(&now, &tm), rest = strptime(text, "%Y-%m-%d %H:%M:%S", &tm)) == NULL &&
+		(localtime_r(&now, &tm), rest = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm)) == NULL &&
+		(localtime_r(&now, &tm), rest = strptime(text, "%H:%M:%S", &tm)) == NULL )
+	{
+		double secs = strtod(text, &end);
+
+		if( end == text || *end )
+			return -1;
+		return secs * 1000;
+	}
+
+	if( *rest == '.' )
+		frac = strtod(rest, &end);
+	else if( *rest )
+		return -1;
+
+	tm.tm_isdst = -1;
+	return mktime(&tm) * 1000LL + (long long)(frac * 1000);
+}
+
+void printTime(FILE *fp, long long ms)
+{
+	time_t secs = ms / 1000;
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&secs, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(fp, "%s.%03lli", buf, ms % 1000);
+}
+
+int compareSequence(const void *a, const void *b)
+{
+	const struct segment *x = a, *y = b;
+
+	return x->hdr->sequence < y->hdr->sequence ? -1 : x->hdr->sequence > y->hdr->sequence;
+}
+
+// Map the header and index of every written segment of the channel, oldest first
+int openSegments(void)
+{
+	char pattern[512];
+	glob_t files;
+	size_t idx;
+
+	sprintf(pattern, "%s/%s%i-*.seg", extractArgs.dir, extractArgs.pipeName, extractArgs.channel - 1);
+	if( glob(pattern, 0, NULL, &files) != 0 )
+	{
+		fprintf(stderr, "No recording matches %s\n", pattern);
+		return 1;
+	}
+
+	g_segments = calloc(files.gl_pathc, sizeof(*g_segments));
+	if( g_segments == NULL )
+		return 1;
+
+	for( idx=0;idx<files.gl_pathc;idx++ )
+	{
+		struct segment *seg = &g_segments[g_segmentCount];
+		struct stat st;
+		void *map;
+
+		seg->fd = open(files.gl_pathv[idx], O_RDONLY);
+		if( seg->fd == -1 || fstat(seg->fd, &st) == -1 || st.st_size < ZREC_DATA_OFFSET )
+		{
+			perror(files.gl_pathv[idx]);
+			if( seg->fd != -1 )
+				close(seg->fd);
+			continue;
+		}
+
+		map = mmap(NULL, ZREC_DATA_OFFSET, PROT_READ, MAP_SHARED, seg->fd, 0);
+		if( map == MAP_FAILED )
+		{
+			perror(files.gl_pathv[idx]);
+			close(seg->fd);
+			continue;
+		}
+		seg->hdr = map;
+
+		if( seg->hdr->magic != ZREC_MAGIC || seg->hdr->version != ZREC_VERSION || seg->hdr->sequence == 0 ||
+			seg->hdr->indexOffset < sizeof(struct zrecHeader) || seg->hdr->indexOffset > seg->hdr->dataOffset ||
+			seg->hdr->dataOffset > ZREC_DATA_OFFSET || seg->hdr->dataOffset + seg->hdr->length > st.st_size )
+		{
+			munmap(map, ZREC_DATA_OFFSET);
+			close(seg->fd);
+			continue;
+		}
+
+		// Entries past the recorded length are for stream that isn't on disk yet
+		seg->index = (struct zrecIndexEntry*)((char*)map + seg->hdr->indexOffset);
+		seg->entries = seg->hdr->indexCount;
+		if( seg->entries > (seg->hdr->dataOffset - seg->hdr->indexOffset) / sizeof(struct zrecIndexEntry) )
+			seg->entries = (seg->hdr->dataOffset - seg->hdr->indexOffset) / sizeof(struct zrecIndexEntry);
+		while( seg->entries > 0 && seg->index[seg->entries - 1].offset >= seg->hdr->length )
+			seg->entries--;
+
+		g_segmentCount++;
+	}
+	globfree(&files);
+
+	qsort(g_segments, g_segmentCount, sizeof(*g_segments), compareSequence);
+	return 0;
+}
+
+// First index entry later than time, entries if there is none
+unsigned int findAfter(const struct segment *seg, long long time)
+{
+	unsigned int lo = 0, hi = seg->entries;
+
+	while( lo < hi )
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if( seg->index[mid].time <= time )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Where a clip starting at time begins: the last keyframe at or before it,
+// or the first one in the segment if time is before that
+unsigned long long findStart(const struct segment *seg, long long time)
+{
+	unsigned int idx = findAfter(seg, time);
+
+	while( idx > 0 && !(seg->index[idx - 1].flags & ZREC_KEYFRAME) )
+		idx--;
+	if( idx > 0 )
+		return seg->index[idx - 1].offset;
+
+	for( idx=0;idx<seg->entries;idx++ )
+	{
+		if( seg->index[idx].flags & ZREC_KEYFRAME )
+			return seg->index[idx].offset;
+	}
+
+	// No keyframes, the stream can only be cut anywhere
+	return 0;
+}
+
+// Where a clip ending at time ends: the first keyframe after it, or the end of the segment
+unsigned long long findEnd(const struct segment *seg, long long time)
+{
+	unsigned int idx;
+
+	for( idx=findAfter(seg, time);idx<seg->entries;idx++ )
+	{
+		if( seg->index[idx].flags & ZREC_KEYFRAME )
+			return seg->index[idx].offset;
+	}
+
+	return seg->hdr->length;
+}
+
+int copyRange(const struct segment *seg, unsigned long long from, unsigned long long to, int out)
+{
+	static char buf[COPY_SIZE];
+
+	while( from < to )
+	{
+		size_t want = to - from < sizeof(buf) ? to - from : sizeof(buf);
+		ssize_t len = pread(seg->fd, buf, want, seg->hdr->dataOffset + from);
+		ssize_t done = 0;
+
+		if( len <= 0 )
+			return 1;
+
+		while( done < len )
+		{
+			ssize_t written = write(out, buf + done, len - done);
+
+			if( written == -1 && errno == EINTR )
+				continue;
+			if( written <= 0 )
+				return 1;
+			done += written;
+		}
+		from += len;
+	}
+
+	return 0;
+}
+
+void listSegments(void)
+{
+	int idx;
+
+	for( idx=0;idx<g_segmentCount;idx++ )
+	{
+		struct segment *seg = &g_segments[idx];
+		unsigned int entry, keys = 0;
+
+		for( entry=0;entry<seg->entries;entry++ )
+			keys += (seg->index[entry].flags & ZREC_KEYFRAME) != 0;
+
+		printf("%6llu  ", (unsigned long long)seg->hdr->sequence);
+		printTime(stdout, seg->hdr->startTime);
+		printf(" - ");
+		printTime(stdout, seg->hdr->endTime);
+		printf("  %10llu bytes  %5u keyframes%s\n", (unsigned long long)seg->hdr->length, keys,
+			seg->hdr->closed ? "" : "  (recording)");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long copied = 0;
+	int out = STDOUT_FILENO;
+	int first = -1, last = -1;
+	int opt;
+	int idx;
+
+	while( (opt = getopt(argc, argv, "d:n:c:s:e:o:lh")) != -1 )
+	{
+		switch( opt )
+		{
+		case 'd':
+			extractArgs.dir = optarg;
+			break;
+		case 'n':
+			extractArgs.pipeName = optarg;
+			break;
+		case 'c':
+			extractArgs.channel = atoi(optarg);
+			break;
+		case 's':
+			extractArgs.start = parseTime(optarg);
+			break;
+		case 'e':
+			extractArgs.end = parseTime(optarg);
+			break;
+		case 'o':
+			extractArgs.output = optarg;
+			break;
+		case 'l':
+			extractArgs.list = true;
+			break;
+		default:
+			printf("Usage: %s -d <recording dir> [-n <pipe name>] -c <channel> -s <start> -e <end> [-o <clip.h264>]\n"
+				"       %s -d <recording dir> [-n <pipe name>] -c <channel> -l\n"
+				"Times are local, \"YYYY-MM-DD HH:MM:SS[.mmm]\", \"HH:MM:SS[.mmm]\" for today or seconds since the epoch\n",
+				argv[0], argv[0]);
+			return 0;
+		}
+	}
+
+	if( extractArgs.channel < 1 || (!extractArgs.list && (extractArgs.start < 0 || extractArgs.end < extractArgs.start)) )
+	{
+		fprintf(stderr, "Invalid arguments, see -h\n");
+		return 1;
+	}
+
+	if( openSegments() != 0 )
+		return 1;
+
+	if( extractArgs.list )
+	{
+		listSegments();
+		return 0;
+	}
+
+	// The segments the window touches
+	for( idx=0;idx<g_segmentCount;idx++ )
+	{
+		if( g_segments[idx].hdr->endTime < extractArgs.start || g_segments[idx].hdr->startTime > extractArgs.end )
+			continue;
+		if( first == -1 )
+			first = idx;
+		last = idx;
+	}
+
+	if( first == -1 )
+	{
+		fprintf(stderr, "Nothing recorded between ");
+		printTime(stderr, extractArgs.start);
+		fprintf(stderr, " and ");
+		printTime(stderr, extractArgs.end);
+		fprintf(stderr, "\n");
+		return 1;
+	}
+
+	if( extractArgs.output && (out = open(extractArgs.output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 )
+	{
+		perror(extractArgs.output);
+		return 1;
+	}
+
+	for( idx=first;idx<=last;idx++ )
+	{
+		struct segment *seg = &g_segments[idx];
+		unsigned long long from = idx == first ? findStart(seg, extractArgs.start) : 0;
+		unsigned long long to = idx == last ? findEnd(seg, extractArgs.end) : seg->hdr->length;
+
+		if( from < to && copyRange(seg, from, to, out) != 0 )
+		{
+			perror("Failed to write the clip");
+			return 1;
+		}
+		copied += to > from ? to - from : 0;
+	}
+
+	fprintf(stderr, "%llu bytes from %i segment%s\n", copied, last - first + 1, last > first ? "s" : "");
+
+	if( out != STDOUT_FILENO )
+		close(out);
+	return 0;
+}
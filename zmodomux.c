@@ -0,0 +1,89 @@
+/*****************************************
+ * Wrap raw H.264 in an MP4 container    *
+ * License: Public Domain                *
+ *****************************************/
+
+// Companion to zmodopipe for streams captured as raw .h264,
+// does the job of "ffmpeg -f h264 -i in.h264 -c copy out.mp4".
+//
+// Compile: gcc -Wall -O2 zmodomux.c mp4mux.c nalscan.c -o zmodomux
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "mp4mux.h"
+
+int main(int argc, char **argv)
+{
+	struct mp4Writer mw;
+	unsigned char buf[65536];
+	ssize_t len;
+	int inFd, outFd;
+	int fps = MP4_DEFAULT_FPS;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "r:h")) != -1 )
+	{
+		switch( opt )
+		{
+		case 'r':
+			fps = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-r <fps>] <input.h264|-> <output.mp4|->\n", argv[0]);
+			return 0;
+		}
+	}
+
+	if( argc - optind != 2 || fps <= 0 )
+	{
+		printf("Usage: %s [-r <fps>] <input.h264|-> <output.mp4|->\n", argv[0]);
+		return 1;
+	}
+
+	inFd = strcmp(argv[optind], "-") ? open(argv[optind], O_RDONLY) : STDIN_FILENO;
+	if( inFd == -1 )
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	outFd = strcmp(argv[optind + 1], "-") ? open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) : STDOUT_FILENO;
+	if( outFd == -1 )
+	{
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	memset(&mw, 0, sizeof(mw));
+	mw.fd = outFd;
+	mw.fps = fps;
+
+	while( (len = read(inFd, buf, sizeof(buf))) > 0 )
+	{
+		if( mp4WriteStream(&mw, buf, len, -1) != 0 )
+			break;
+	}
+
+	if( len == -1 )
+		perror(argv[optind]);
+
+	if( mp4Close(&mw) != 0 || len != 0 )
+	{
+		fprintf(stderr, "Failed to write %s\n", argv[optind + 1]);
+		return 1;
+	}
+
+	if( mw.frames == 0 )
+	{
+		fprintf(stderr, "No keyframe with SPS/PPS found in %s\n", argv[optind]);
+		return 1;
+	}
+
+	close(outFd);
+	return 0;
+}
@@ -7,6 +7,29 @@
  *****************************************/
 
 /* Version history
+ * 0.44 - 2026-10-16
+ *       Added single process event loop mode (-e), channels are multiplexed with epoll.
+ *       Fork mode children now share the same per channel state machine.
+ *       Added in-process pre-alarm ring buffer (-b), dumped on SIGHUP.
+ *       Dumps start on a keyframe, found by scanning the stream for NAL units.
+ *       Dumps can be written as fragmented MP4 (-f mp4), no ffmpeg needed.
+ *       Added zero-copy forwarding with splice() (-Z).
+ *       Slow pipe readers are absorbed by an output queue (-q), on overflow whole frames are dropped.
+ *       Channels can be exported to shared memory rings (-x) for any number of readers, see zmodoshm.h.
+ *       Per channel stream metrics are served in Prometheus text format (-M).
+ *       Connects don't block the other channels and time out (-T), failed ones are retried
+ *       with a jittered exponential backoff (-R) instead of a fixed 10 seconds.
+ *       Channels can be recorded continuously to preallocated segment files (-w, -W), see zmodorec.h.
+ *       Recordings are indexed by time and keyframe, zmodopipe-extract cuts clips out of them.
+ *       The pre-alarm buffers can be kept in files (-P), after a crash they are dumped on the next start.
+ *       All channels are cut around the same alarm instant, with seconds after it (-A), and listed in a manifest.
+ *       Dumps are written by a thread per CPU straight out of the rings, the channels keep streaming meanwhile.
+ *       Alarms within the post-alarm seconds (-A, per channel) extend the dumps, one clip per incident.
+ *       The streaming engine builds as libzmodopipe.so too, see zmodopipe.h, with a ctypes binding (zmodopipe.py).
+ *       Commands on a control socket (-C): reset, add or remove a single channel, change its quality,
+ *       take a snapshot or read the stats, each answered with a line of JSON.
+ *       Channels are scored for activity from their frame sizes, no decoding, listed with each snapshot clip.
+ *       A slow reader's queue sheds frames nothing references first, then cuts GOPs short, keyframes always go through.
  * 0.43 - 2015-06-12
  *       Added support for mEye compatible.
  * 0.42 - 2015-04-22
@@ -26,8 +49,9 @@
  *       Initial version, working mobile port support, but buggy
  */
 
-// Compile: gcc -Wall zmodopipe.c -o zmodopipe
+// Compile: gcc -Wall -O2 -pthread zmodopipe.c nalscan.c mp4mux.c -o zmodopipe
 
+#define _GNU_SOURCE	// splice()
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -47,6 +71,20 @@
 #include <sys/wait.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include "nalscan.h"
+#include "mp4mux.h"
+#include "zmodoshm.h"
+#include "zmodorec.h"
+#include "zmodopipe.h"
 
 //typedef enum bool {false=0, true=1,} bool;
 
@@ -160,6 +198,372 @@ struct mEye
 };	// Total size:		  58 bytes
 
 #define MAX_CHANNELS 16		// maximum channels to support (I've only seen max of 16).
+#define RECONNECT_MIN_DELAY 100	// ms before the first retry after a failed connect or login
+#define RECONNECT_MAX_DELAY 10000	// default cap on the backoff between retries (-R)
+#define CONNECT_TIMEOUT 3000	// default connect timeout in ms (-T)
+#define LOGIN_TIMEOUT 5000	// ms a login may take, what a single reply could take before
+#define LOGIN_DRAIN_QUIET 200	// ms without data that ends a reply of unknown length
+#define LOGIN_MAX_STEPS 8	// sends and receives in a login
+#define LOGIN_MAX_PACKETS 4	// packets a login sends
+#define LOGIN_PACKET_SIZE 512	// largest login packet
+#define LOGIN_REPLY_SIZE 1024	// replies are kept up to this size, the rest is read and discarded
+#define READS_PER_WAKEUP 8	// max recv calls per channel before servicing the others
+#define RING_MARK_INTERVAL 20	// ms between arrival time marks in the pre-alarm ring index
+#define RING_KEYS_PER_SEC 8	// keyframes per second the ring's keyframe index can hold
+#define SNAPSHOT_TIMEOUT 10000	// ms an incident may take past its post-alarm seconds before a new alarm replaces it
+#define CHILD_POLL 100		// ms between the fork mode parent's checks for exited children
+#define DUMP_JOBS (MAX_CHANNELS * 2)	// clips the dump threads can have queued, and open
+#define DUMP_POLL 100		// ms between a dump thread's writes of its open clips
+#define DUMP_THREADS 8		// most dump threads, there is one per CPU up to that
+#define DUMP_SLACK 200		// ms a clip is kept open past its window for stream still on its way into the ring
+#define DUMP_CHUNK 65536	// bytes copied out of a ring at a time while dumping
+#define RING_MAGIC 0x474e525a	// "ZRNG", a -P ring file holds a ring with this header
+#define RING_VERSION 2
+#define MAX_PARAM_SET 256	// largest SPS/PPS kept for prepending to dumps
+#define SPLICE_PIPE_SIZE (256 * 1024)	// capacity requested for a channel's splice pipe
+#define EVENT_OUTPUT 0x100	// epoll tag of a channel's output pipe, or'ed with the channel
+#define EVENT_WAKE 0x200	// epoll tag of the eventfd zmodoClose wakes the engine thread with
+#define FRAMES_PER_SEC 60	// frames per second of ring the frame index of libzmodopipe can hold
+#define ACTIVITY_SECONDS 256	// seconds of activity scores kept per channel, and listed per clip
+#define ACTIVITY_FALL 0.2	// weight of a quieter second in the quiet scene level
+#define ACTIVITY_RISE 0.005	// and of a busier one, motion takes minutes to become the new quiet
+#define CONTROL_LINE 256	// longest control command
+#define CONTROL_REPLY_SIZE 8192	// largest control reply
+#define METRICS_BUF_SIZE 32768	// largest metrics response
+#define RECORD_WRITE_SIZE (1024 * 1024)	// the recording goes to disk in blocks of this size
+#define RECORD_BUFFERS 4	// blocks per channel, filled or waiting for the disk
+#define RECORD_JOBS (MAX_CHANNELS * RECORD_BUFFERS * 2)	// writes the writer thread can have queued
+#define RECORD_MAX_SEGMENT (64 << 20)	// largest segment file
+#define RECORD_MIN_SEGMENTS 4	// the store is split into at least this many
+#define RECORD_PENDING_KEYS 8	// keyframes found in a chunk before it is recorded
+#define QUEUE_UNITS 256		// access unit starts an output queue keeps, to cut a GOP short at one
+
+// Output queue between the camera and a slow pipe reader (-q).
+// Offsets count every byte passed on since the channel started, including
+// the ones written straight to the pipe, so they can be compared.
+struct outQueue
+{
+	unsigned char *data;
+	size_t size;
+	size_t room;			// size of data, past size there is room for a keyframe, see queueAdd()
+	unsigned long long head;	// offset past the last byte queued
+	unsigned long long tail;	// offset of the next byte to write to the pipe
+	unsigned long long auStart;	// offset where the access unit being received starts
+	bool keyframes;			// the stream has keyframes, so dropping can wait for the next one
+	bool dropping;			// dropping access units until the next keyframe
+	bool overflowed;		// dropping because the queue overflowed (not for lack of a reader)
+	bool keyUnit;			// the access unit being received has SPS, PPS or IDR, it isn't shed
+	bool shedding;			// dropping the access unit being received, nothing references it
+	bool stalled;			// the socket isn't read until the reader has taken the queue back under size
+	unsigned long long droppedBytes;	// stream lost to overflows
+	unsigned long long droppedUnits;	// access units lost to overflows
+	unsigned long long units[QUEUE_UNITS];	// where the last access units queued start
+	unsigned int unitCount;		// access units recorded in units
+};
+
+// What a step of a DVR login does, see loginStep()
+typedef enum LoginOp
+{
+	login_send = 1,		// send packet arg
+	login_recv,		// receive exactly arg bytes
+	login_recvAny,		// receive whatever arrives first, up to arg bytes
+	login_recvSized,	// receive a 4 byte header, its last arg bytes are the (big endian) length of what follows, then that
+	login_drain,		// receive until nothing arrives for arg ms
+	login_expect,		// byte arg of the last reply has to be value
+} LoginOp;
+
+struct loginStep
+{
+	LoginOp op;
+	int arg;
+	int value;
+};
+
+// A model's login handshake. The Connect* functions build it once per channel,
+// loginStep() runs it without blocking as the socket becomes ready.
+struct loginScript
+{
+	struct loginStep steps[LOGIN_MAX_STEPS];
+	int stepCount;
+	unsigned char packets[LOGIN_MAX_PACKETS][LOGIN_PACKET_SIZE];
+	size_t packetLen[LOGIN_MAX_PACKETS];
+	int packetCount;
+	// Progress of the current attempt
+	int step;			// step being run
+	size_t done;			// bytes of it sent or received
+	bool sized;			// login_recvSized has its header, want is the length that follows
+	size_t want;
+	unsigned char header[4];	// login_recvSized header
+	unsigned char reply[LOGIN_REPLY_SIZE];	// start of the last reply
+	size_t replyLen;
+	long long quietAt;		// login_drain is done if nothing arrives before this, in nowMs() time
+	unsigned int events;		// epoll events the socket is waiting for
+};
+
+// Counters of one channel for the metrics endpoint (-M). They live in memory shared
+// with the fork mode children and are read by the server thread while the channel
+// updates them, so every access is atomic.
+struct channelMetrics
+{
+	unsigned long long bytes;		// received from the DVR
+	unsigned long long packets;		// recv()/splice() calls that returned data
+	unsigned long long droppedSlow;		// bytes dropped because the reader didn't keep up
+	unsigned long long droppedNoReader;	// bytes discarded while nobody was reading
+	unsigned long long droppedFrames;	// whole frames dropped by the output queue
+	unsigned long long shedFrames;		// of them non-reference frames shed before the queue overflowed
+	unsigned long long shedGops;		// GOPs cut short by the output queue
+	unsigned long long recorded;		// bytes written to the recording
+	unsigned long long droppedDisk;		// bytes not recorded because the disk didn't keep up
+	unsigned long long logins;		// successful logins
+	unsigned long long loginFailures;	// failed connects and logins
+	unsigned long long reconnects;		// connections lost or reset after a login
+	long long queued;			// bytes waiting for the reader
+	long long loginMs;			// time the last connect and login took
+	long long lastByte;			// nowMs() of the last byte received, 0 if none yet
+	long long streaming;			// 1 while logged in
+	long long activity;			// activity score of the last second, x1000
+};
+
+// A command taken on the control socket (-C), run by the streaming loop in -e mode
+struct controlRequest
+{
+	char line[CONTROL_LINE];
+	char reply[CONTROL_REPLY_SIZE];
+	bool done;			// reply is filled in
+	void (*run)(void *ctx);		// run this on the streaming loop instead of the command line, NULL for a command
+	void *ctx;
+};
+
+// One channel's clip of an alarm snapshot
+struct snapshotClip
+{
+	char file[64];			// name in dumpDir, empty if the channel has none
+	long long start;		// arrival time of the first byte, ms since the epoch
+	long long end;			// and of the last
+	unsigned long long bytes;
+	int post;			// seconds after the last alarm it runs to
+	int activity;			// peak activity score while it runs, x1000
+	int scoreCount;			// seconds in scores
+	int scores[ACTIVITY_SECONDS];	// activity score of each second from start, -1 where there is none
+};
+
+// The alarm snapshot being cut, an incident of one or more alarms. It is shared with
+// the fork mode children, so all of them cut their channel around the same instant,
+// alarms during it extend every clip, and the last one done lists them all.
+struct alarmSnapshot
+{
+	long long time;			// ms since the epoch of the first alarm, 0 if no incident is open
+	long long last;			// and of the latest, each clip runs to the channel's post-alarm seconds after it
+	int alarms;			// alarms in the incident
+	int done;			// channels cut so far
+	struct snapshotClip clips[MAX_CHANNELS];
+};
+
+// A clip cut out of a channel's ring. The dump thread writes it out of the ring
+// while the channel keeps streaming into it, following the stream until the clip's
+// window closes.
+struct dumpJob
+{
+	struct channelState *cs;
+	unsigned long long from;	// stream offset the clip starts at
+	unsigned long long pos;		// and written up to
+	long long alarm;		// instant it was cut around
+	long long start;		// arrival time of its first byte, ms since the epoch
+	int post;			// seconds after the last alarm it runs to
+	char file[64];			// name in dumpDir
+	int fd;				// the file while it's written, -1 before
+	struct mp4Writer mw;		// with -f mp4
+	bool shared;			// one of the clips of the shared snapshot, extended by its alarms
+	int channels;			// clips in that snapshot
+	long long keyTime;		// arrival time of the keyframe the clip starts on
+	unsigned int spsLen;		// SPS/PPS to prepend, the keyframe came without them
+	unsigned int ppsLen;
+	unsigned char sps[MAX_PARAM_SET];
+	unsigned char pps[MAX_PARAM_SET];
+};
+
+// Arrival time of a position in the stream
+struct ringMark
+{
+	unsigned long long offset;	// stream offset of the first byte received at this time
+	long long time;			// arrival time, ms since the epoch
+};
+
+// Start of a keyframe's access unit in the stream
+struct ringKey
+{
+	unsigned long long offset;	// stream offset of the access unit (incl. any SPS/PPS before the IDR)
+	long long time;			// arrival time, ms since the epoch
+	bool params;			// SPS and PPS are part of the access unit
+	unsigned int sum;		// ring on disk: ringSum of the GOP before this keyframe, 0 if none
+};
+
+// Start of an access unit in the stream, indexed for the frames zmodoPoll hands out
+struct ringFrame
+{
+	unsigned long long offset;	// stream offset of the access unit
+	long long time;			// arrival time, ms since the epoch
+	bool key;			// it's a keyframe's
+};
+
+// Counters at the start of the ring allocation (or -P file), followed by
+// the mark index, the keyframe index and then the stream data itself.
+// A ring file outlives a crash of the process writing it, so the tail moves on before
+// data is overwritten and the head after it's written, and the index slots the next
+// mark and keyframe go to don't count. Whatever a crash interrupts is never in the ring.
+struct ringHeader
+{
+	unsigned int magic;		// RING_MAGIC
+	unsigned int version;		// RING_VERSION
+	unsigned int closed;		// 1 once the process writing the ring exited cleanly
+	unsigned int summed;		// 1 if the ring is on disk and its keys carry the sums of their GOPs
+	char boot[40];			// boot_id of the system that wrote it, a power cut can only lose pages across a boot
+	size_t size;			// data capacity in bytes
+	unsigned int markCount;		// capacity of the mark index
+	unsigned int keyCount;		// capacity of the keyframe index
+	unsigned long long head;	// total bytes written, next byte goes to data[head % size]
+	unsigned long long tail;	// oldest byte still held
+	unsigned long long markHead;	// total marks written
+	unsigned long long keyHead;	// total keyframes indexed
+	unsigned int spsLen;		// latest SPS, with its start code
+	unsigned int ppsLen;		// latest PPS, with its start code
+	unsigned char sps[MAX_PARAM_SET];
+	unsigned char pps[MAX_PARAM_SET];
+};
+
+// Pre-alarm ring, the last few seconds of a channel's stream in
+// one contiguous preallocated block, indexed by arrival time and keyframe.
+struct streamRing
+{
+	struct ringHeader *hdr;
+	struct ringMark *marks;
+	struct ringKey *keys;
+	unsigned char *data;
+	size_t mapLen;			// bytes mapped from the -P file, 0 if allocated
+	bool recovered;			// the -P file was left behind by a process that didn't exit cleanly
+	bool sync;			// the -P file is on disk, its GOPs are summed and written back as they complete
+	int syncFd;			// the file then
+	unsigned long long synced;	// stream offset written back up to
+};
+
+// Where a zmodoSnapshot starts and ends and the parameter sets it prepends. The streaming
+// loop takes them, it rewrites the indexes and the parameter sets in place. Only the stream
+// itself can be copied on another thread, ringRead checks the tail again after copying.
+struct snapshotCut
+{
+	struct channelState *cs;
+	long long from, to;		// ms since the epoch asked for
+	struct ringKey key;		// keyframe it starts at
+	bool found;			// there is one
+	unsigned long long end;		// stream offset it ends at
+	unsigned int spsLen, ppsLen;	// parameter sets to prepend, 0 if the keyframe has them
+	unsigned char sps[MAX_PARAM_SET];
+	unsigned char pps[MAX_PARAM_SET];
+};
+
+// Continuous recording of a channel into preallocated segment files (-w), see zmodorec.h.
+// The channel fills aligned blocks, a writer thread writes them out.
+struct recordStore
+{
+	int count;			// segment files
+	int *fds;
+	struct zrecIndexEntry **index;	// each segment's index, mapped from its file
+	size_t segSize;			// stream bytes a segment holds, a multiple of RECORD_WRITE_SIZE
+	int segment;			// segment being written
+	struct zrecHeader hdr;		// its header, length counts the blocks handed to the writer
+	unsigned char *bufs[RECORD_BUFFERS];
+	bool busy[RECORD_BUFFERS];	// with the writer thread, guarded by g_recordLock
+	int cur;			// block being filled, -1 while none is free
+	size_t curLen;
+	unsigned long long curStart;	// stream offset of its first byte
+	bool cutPending;		// the next segment starts at cut
+	unsigned long long cut;		// stream offset of the keyframe it starts on
+	struct ringKey keys[RECORD_PENDING_KEYS];	// keyframes to index once their stream is recorded
+	int keyCount;
+	long long lastMark;		// time of the last index entry
+	int syncFd;			// block written last, dropped from the page cache after the next one (writer thread only)
+	off_t syncFrom;
+	size_t syncLen;
+};
+
+// A block on its way to disk, or only a segment header if buf is -1
+struct recordJob
+{
+	struct recordStore *rec;
+	int channel;
+	int fd;
+	int buf;
+	off_t offset;
+	size_t len;
+	struct zrecHeader hdr;
+};
+
+typedef enum ChannelState
+{
+	ch_idle = 0,	// channel not streamed by this process
+	ch_wait,	// waiting to (re)connect
+	ch_connecting,	// connect in progress
+	ch_login,	// connected, logging in
+	ch_streaming,	// logged in, forwarding stream to the pipe
+} ChannelState;
+
+// Activity score of one second of a channel
+struct activitySample
+{
+	long long second;	// wall clock second it's for
+	int score;		// x1000
+};
+
+// Per channel state, one entry for each camera channel
+struct channelState
+{
+	int channel;		// camera channel (0 index)
+	ChannelState state;	// where the channel is in its connection cycle
+	int sockFd;		// connection to the DVR
+	int outPipe;		// output pipe for this channel
+	char pipename[256];	// /tmp/<pipeName><channel>
+	long long retryAt;	// when to reconnect (ch_wait) or give up connecting or logging in, in nowMs() time
+	long long connectStart;	// when the current connect attempt began
+	int backoff;		// ms the last retry was scheduled after, 0 once logged in
+	struct loginScript login;	// the model's login, built once
+	struct streamRing ring;	// pre-alarm buffer (-b)
+	struct nalScanner scan;	// finds NAL units in the stream as it is received
+	long long recvTime;	// arrival time of the chunk being scanned
+	int paramType;		// NAL_SPS/NAL_PPS being copied out of the ring, 0 if none
+	unsigned long long paramStart;	// stream offset of that parameter set
+	bool auSps;		// the current access unit carries an SPS
+	bool auPps;		// the current access unit carries a PPS
+	int splicePipe[2];	// in-kernel pipe the stream is spliced through (-Z), -1 if unused
+	size_t spliceLen;	// bytes held in splicePipe
+	size_t spliceSize;	// its capacity
+	bool outBlocked;	// waiting for the output pipe to become writable
+	struct outQueue queue;	// absorbs a slow reader (-q)
+	const unsigned char *chunk;	// the chunk being scanned
+	unsigned long long chunkBase;	// its stream offset
+	unsigned long long fedTo;	// stream offset of the next byte to pass to the queue
+	unsigned char hold[8];	// start code at the end of the last chunk, passed on with the next
+	int holdLen;
+	char shmName[256];	// /dev/shm/<pipeName><channel>
+	struct zshmHeader *shm;	// shared memory export (-x), NULL if unused
+	unsigned char *shmData;
+	unsigned long long shmDelta;	// scanner offset minus export offset of the same byte
+	struct recordStore record;	// continuous recording (-w), count is 0 if unused
+	struct ringFrame *frames;	// access units in the ring for zmodoPoll, NULL unless embedded
+	unsigned int frameCount;
+	unsigned long long frameHead;	// access units indexed, the last one is still being received
+	unsigned long long pollNext;	// index of the next frame zmodoPoll returns
+	bool pollStarted;		// pollNext was set, the first poll starts on a keyframe
+	unsigned long long pollLapped;	// times the channel overran pollNext
+	bool stopped;			// removed through the control socket, its buffers are kept for an add
+	unsigned long long actAuStart;	// start of the access unit being received, 0 before the first
+	bool actAuKey;			// it's a keyframe
+	unsigned long long actKeyBytes;	// size of the last keyframe
+	long long actSecond;		// wall clock second the frames are summed for
+	unsigned long long actBytes;	// non-key frame bytes in it
+	int actFrames;
+	double actBaseline;		// level of the quiet scene, see activitySecond()
+	struct activitySample activity[ACTIVITY_SECONDS];	// by second % ACTIVITY_SECONDS
+};
 
 struct globalArgs_t {
 	bool verbose;			// -v duh
@@ -171,30 +575,190 @@ struct globalArgs_t {
 	char *username;			// -u login username
 	char *password;			// -a login password
 	int timer;			// -t alarm timer
+	bool eventLoop;			// -e stream all channels from one process
+	int ringSeconds;		// -b seconds of stream to keep for alarm dumps
+	int postSeconds;		// -A seconds of stream after the alarm added to the dumps
+	int channelPost[MAX_CHANNELS];	// -A <channel>:<seconds> for one channel, -1 if not given
+	int ringBitrate;		// -B max expected bitrate (kbit/s), sizes the ring
+	char *ringDir;			// -P directory the rings are kept in as files, to survive a crash
+	char *dumpDir;			// -d directory the ring is dumped to
+	bool dumpMp4;			// -f write dumps as MP4 instead of raw h264
+	bool splice;			// -Z forward with splice(), without copying through user space
+	int queueMs;			// -q ms of stream (at -B) queued for a slow reader
+	int exportSeconds;		// -x seconds of stream (at -B) shared in /dev/shm with any number of readers
+	char *metricsAddr;		// -M loopback port or unix socket path the metrics are served on
+	int connectTimeout;		// -T ms to wait for a connect
+	int reconnectMax;		// -R ms cap on the backoff between reconnects
+	char *recordDir;		// -w directory every channel is recorded to continuously
+	int recordMb;			// -W MB of segment files per channel
+	char *controlPath;		// -C unix socket commands are taken on
+	bool highQuality[MAX_CHANNELS];	// stream a channel in high quality where the model can choose, set with the control socket
 } globalArgs = {0};
 
 extern char *optarg;
-const char *optString = "vn:c:p:s:m:u:a:t:h?";
+const char *optString = "vn:c:p:s:m:u:a:t:eb:A:B:P:d:f:Zq:x:M:T:R:w:W:C:h?";
 int g_childPids[MAX_CHANNELS] = {0};
-int g_cleanUp = false;
+volatile sig_atomic_t g_cleanUp = false;
+volatile sig_atomic_t g_dumpRequest = false;	// An alarm was raised, dump the pre-alarm rings
+long long g_alarmSignal;	// When the last SIGHUP came in, 0 once raiseAlarm() took it
+pthread_mutex_t g_alarmLock = PTHREAD_MUTEX_INITIALIZER;	// Guards the incident in g_snapshot, the control thread raises alarms too
+struct alarmSnapshot *g_snapshot;	// Alarm being dumped, shared with the children
+long long g_alarmTime;	// Instant this process last cut its channels around, 0 if none yet
 char g_errBuf[256];	// This will contain the error message for perror calls
 int g_processCh = -1;	// Channel this process will be in charge of (-1 means parent)
+struct channelState g_channels[MAX_CHANNELS];	// Channels streamed by this process
+struct sockaddr_in g_serverAddr;	// DVR address, shared by all channels
+int g_epollFd = -1;	// epoll instance multiplexing the channel sockets
+char g_recvBuf[16384];	// Receive buffer shared by all channels
+struct channelMetrics *g_metrics;	// Per channel counters, shared with the children
+int g_metricsFd = -1;	// Listening socket of the metrics endpoint
+pthread_mutex_t g_recordLock = PTHREAD_MUTEX_INITIALIZER;	// Guards the writer's job queue and the blocks' busy flags
+pthread_cond_t g_recordCond = PTHREAD_COND_INITIALIZER;	// Signalled when a job is queued or the writer should stop
+struct recordJob g_recordJobs[RECORD_JOBS];	// Writes queued for the writer thread
+unsigned int g_recordHead, g_recordTail;	// Jobs queued and jobs done
+bool g_recordStop;	// The writer thread finishes the queue and exits
+bool g_recordRunning;	// The writer thread was started
+pthread_t g_recordThread;
+pthread_mutex_t g_dumpLock = PTHREAD_MUTEX_INITIALIZER;	// Guards the dump threads' job queue
+pthread_cond_t g_dumpCond = PTHREAD_COND_INITIALIZER;	// Signalled when a clip is queued or the dump threads should stop
+struct dumpJob g_dumpJobs[DUMP_JOBS];	// Clips queued for the dump threads
+unsigned int g_dumpHead, g_dumpTail;	// Clips queued and clips written
+bool g_dumpStop;	// The dump threads finish the queue and exit
+int g_dumpRunning;	// Dump threads started
+pthread_t g_dumpThreads[DUMP_THREADS];
+bool g_embedded;	// Running in libzmodopipe, the frames go to zmodoPoll instead of FIFOs
+int g_wakeFd = -1;	// eventfd the control thread and zmodoClose wake the streaming loop with
+pthread_t g_engineThread;
+pthread_mutex_t g_frameLock = PTHREAD_MUTEX_INITIALIZER;	// Guards the engine state and the frame wakeups
+pthread_cond_t g_frameCond = PTHREAD_COND_INITIALIZER;	// Signalled when frames were indexed or the engine started or stopped
+bool g_framesAdded;	// Frames were indexed since the last wakeup
+bool g_engineRunning;	// The engine thread is streaming
+bool g_engineDone;	// The engine thread returned
+int g_controlFd = -1;	// Listening socket of the control socket
+pthread_mutex_t g_controlLock = PTHREAD_MUTEX_INITIALIZER;	// Guards g_controlRequest
+pthread_cond_t g_controlCond = PTHREAD_COND_INITIALIZER;	// Signalled when the streaming loop ran it
+struct controlRequest *g_controlRequest;	// Command waiting for the streaming loop, NULL if none
+bool g_controlOpen;	// The streaming loop takes requests, guarded by g_controlLock
 
 void sigHandler(int sig);
 void display_usage(char *name);
 int printMessage(bool verbose, const char *message, ...);
-int ConnectViaMobile(int sockFd, int channel);
-int ConnectViaMedia(int sockFd, int channel);
-int ConnectQT504(int sockFd, int channel);
-int ConnectDVR8104ViaMobile(int sockFd, int channel);
-int ConnectCnMClassic(int sockFd, int channel);
-int ConnectSwannViaMedia(int sockFd, int channel);
-int ConnectSwannDVR8(int sockFd, int channel);
-int ConnectMEYE(int sockFd, int channel);
-int ConnectVisionari(int sockFd, int channel);
+void setDefaultArgs(void);
+void setDefaultPort(void);
+int resolveServer(void);
+void raiseAlarm(long long when);
+int waitChildren(int *status);
+int runEventLoop(void);
+int channelInit(struct channelState *cs);
+void channelFree(struct channelState *cs);
+void startChannel(struct channelState *cs);
+void connectDone(struct channelState *cs);
+void beginLogin(struct channelState *cs);
+void advanceLogin(struct channelState *cs);
+void loginDone(struct channelState *cs);
+void failChannel(struct channelState *cs);
+long long channelDue(struct channelState *cs);
+void channelTimer(struct channelState *cs);
+int loginSend(struct loginScript *login, const void *buf, size_t len);
+void loginAdd(struct loginScript *login, LoginOp op, int arg, int value);
+int loginStep(struct channelState *cs);
+int loginRecv(struct channelState *cs, unsigned char *buf, size_t bufSize, size_t want, bool any);
+int loginDrain(struct channelState *cs, int quietMs);
+void resetChannel(struct channelState *cs, bool keepPipe, int delayMs);
+void readChannel(struct channelState *cs);
+bool channelScans(struct channelState *cs);
+void spliceChannel(struct channelState *cs);
+int flushSplice(struct channelState *cs);
+void blockOutput(struct channelState *cs, bool block);
+int queueInit(struct outQueue *q, int ms, int kbps);
+void queueStall(struct channelState *cs, bool stall);
+void queueFree(struct outQueue *q);
+void queueRestart(struct channelState *cs);
+bool queueResume(struct channelState *cs, bool keyframe);
+void queueCutGop(struct channelState *cs);
+void queueAdd(struct channelState *cs, const unsigned char *buf, size_t len);
+void queueFeed(struct channelState *cs, unsigned long long to);
+void queueNal(struct channelState *cs, const struct nalUnit *nal);
+void queueChunkDone(struct channelState *cs, size_t len);
+int flushQueue(struct channelState *cs);
+int shmCreate(struct channelState *cs, int seconds, int kbps);
+void shmClose(struct channelState *cs);
+void shmRestart(struct channelState *cs);
+void shmAppend(struct channelState *cs, const char *buf, size_t len);
+void shmAddKey(struct channelState *cs, unsigned long long offset);
+int recordInit(struct channelState *cs, const char *dir, int mb);
+void recordClose(struct channelState *cs);
+void recordFree(struct channelState *cs);
+int recordTake(struct recordStore *rec);
+void recordBegin(struct channelState *cs);
+void recordSubmit(struct channelState *cs, bool last);
+void recordRotate(struct channelState *cs, unsigned long long cut);
+void recordAppend(struct channelState *cs, const char *buf, size_t len, unsigned long long offset);
+void recordKey(struct channelState *cs, unsigned long long offset);
+void recordIndex(struct recordStore *rec, unsigned long long offset, long long time, unsigned int flags);
+int recordStartWriter(void);
+void recordStopWriter(void);
+void *recordWriter(void *arg);
+void recordWrite(struct recordJob *job);
+void metricAdd(unsigned long long *counter, unsigned long long n);
+void metricSet(long long *gauge, long long value);
+int metricsInit(void);
+int snapshotInit(void);
+int metricsListen(const char *addr);
+void *metricsServe(void *arg);
+size_t metricsFormat(char *buf, size_t size);
+long long nowMs(void);
+long long wallMs(void);
+int ringInit(struct streamRing *ring, int seconds, int kbps, const char *path);
+void ringFree(struct streamRing *ring);
+void ringAppend(struct streamRing *ring, const char *buf, size_t len, long long now);
+unsigned long long ringFindTime(struct streamRing *ring, long long time);
+int ringRead(struct streamRing *ring, unsigned char *dst, unsigned long long from, size_t len);
+void ringAddKey(struct streamRing *ring, unsigned long long offset, long long time, bool params);
+unsigned int ringSum(struct streamRing *ring, unsigned long long from, unsigned long long to);
+void ringSync(struct streamRing *ring, unsigned long long to);
+void ringValidate(struct streamRing *ring);
+struct ringKey *ringFindKey(struct streamRing *ring, unsigned long long offset);
+void channelNal(void *ctx, const struct nalUnit *nal);
+void activityFrame(struct channelState *cs, unsigned long long bytes, bool key);
+void activitySecond(struct channelState *cs);
+void activityClip(struct channelState *cs, long long start, long long end, struct snapshotClip *clip);
+int ringWrite(struct streamRing *ring, int fd, unsigned long long from, unsigned long long to);
+int ringWriteMp4(struct streamRing *ring, struct mp4Writer *mw, unsigned long long from, unsigned long long to);
+int channelPost(int channel);
+int longestPost(void);
+void dumpCut(struct channelState *cs, long long alarm, const char *stamp, const char *tag, struct dumpJob *job);
+bool dumpStep(struct dumpJob *job, bool stop);
+void dumpRecovered(struct channelState *cs);
+void dumpChannels(void);
+int dumpStartWriter(void);
+void dumpStopWriter(void);
+void *dumpWriter(void *arg);
+void writeManifest(const char *clipName);
+void *engineMain(void *arg);
+void snapshotTake(void *ctx);
+int frameNext(struct channelState *cs, struct zmodoFrame *frame);
+void frameSeekKey(struct channelState *cs);
+int controlListen(const char *path);
+void *controlServe(void *arg);
+void controlRun(struct controlRequest *req);
+bool controlPost(struct controlRequest *req);
+void controlPoll(void);
+void controlExecute(struct controlRequest *req);
+int controlStats(char *buf, size_t size);
+int ConnectViaMobile(struct loginScript *login, int channel);
+int ConnectViaMedia(struct loginScript *login, int channel);
+int ConnectQT504(struct loginScript *login, int channel);
+int ConnectDVR8104ViaMobile(struct loginScript *login, int channel);
+int ConnectCnMClassic(struct loginScript *login, int channel);
+int ConnectSwannViaMedia(struct loginScript *login, int channel);
+int ConnectSwannDVR8(struct loginScript *login, int channel);
+int ConnectMEYE(struct loginScript *login, int channel);
+int ConnectVisionari(struct loginScript *login, int channel);
 
 // Function pointer list
-int (*pConnectFunc[])(int, int) = {
+// Build the login of each model
+int (*pConnectFunc[])(struct loginScript*, int) = {
 	NULL,
 	ConnectViaMobile,
 	ConnectViaMedia,
@@ -224,41 +788,18 @@ void printBuffer(char *pbuf, size_t len)
 	printf("\n");
 }
 
+#ifndef ZMODO_LIBRARY
 int main(int argc, char**argv)
 {
-	char pipename[256];
-	struct addrinfo hints, *server;
-	struct sockaddr_in serverAddr;
 	int retval = 0;
-	char recvBuf[2048];
-	struct sigaction sapipe, oldsapipe, saterm, oldsaterm, saint, oldsaint, sahup, oldsahup;
+	struct sigaction sapipe, oldsapipe, saterm, oldsaterm, saint, oldsaint, sahup, oldsahup, sadump, oldsadump;
 	char opt;
 	int loopIdx;
-	int outPipe = -1;
-#ifdef DOMAIN_SOCKETS
-	struct sockaddr_un addr;
-#endif
-	int sockFd = -1;
-	struct timeval tv;
-#ifdef NON_BLOCK_READ
-	struct timeval tv, tv_sel;
-#endif
-	struct linger lngr;
 	int status = 0;
 	int pid = 0;
 
-	lngr.l_onoff = false;
-	lngr.l_linger = 0;
-
 	// Process arguments
-	// Clear and set defaults
-	memset(&globalArgs, 0, sizeof(globalArgs));
-	
-	globalArgs.hostname =
-		globalArgs.pipeName = "zmodo";
-	globalArgs.model = media;
-	globalArgs.username = 
-		globalArgs.password = "admin";
+	setDefaultArgs();
 
 	// Read command-line
 	while( ((opt = getopt(argc, argv, optString)) != -1) && (opt != 255))
@@ -292,6 +833,69 @@ int main(int argc, char**argv)
 		case 't':
 			globalArgs.timer = atoi(optarg);
 			break;
+		case 'e':
+			globalArgs.eventLoop = true;
+			break;
+		case 'b':
+			globalArgs.ringSeconds = atoi(optarg);
+			break;
+		case 'A':
+			// -A <seconds> for every channel, -A <channel>:<seconds> for one
+			if( strchr(optarg, ':') )
+			{
+				int channel = atoi(optarg);
+
+				if( channel > 0 && channel <= MAX_CHANNELS )
+					globalArgs.channelPost[channel-1] = atoi(strchr(optarg, ':') + 1);
+			}
+			else
+				globalArgs.postSeconds = atoi(optarg);
+			break;
+		case 'B':
+			globalArgs.ringBitrate = atoi(optarg);
+			break;
+		case 'P':
+			globalArgs.ringDir = optarg;
+			break;
+		case 'd':
+			globalArgs.dumpDir = optarg;
+			break;
+		case 'Z':
+			globalArgs.splice = true;
+			break;
+		case 'q':
+			globalArgs.queueMs = atoi(optarg);
+			break;
+		case 'x':
+			globalArgs.exportSeconds = atoi(optarg);
+			break;
+		case 'M':
+			globalArgs.metricsAddr = optarg;
+			break;
+		case 'T':
+			globalArgs.connectTimeout = atoi(optarg);
+			break;
+		case 'R':
+			globalArgs.reconnectMax = atoi(optarg);
+			break;
+		case 'w':
+			globalArgs.recordDir = optarg;
+			break;
+		case 'W':
+			globalArgs.recordMb = atoi(optarg);
+			break;
+		case 'C':
+			globalArgs.controlPath = optarg;
+			break;
+		case 'f':
+			if( strcmp(optarg, "mp4") == 0 )
+				globalArgs.dumpMp4 = true;
+			else if( strcmp(optarg, "h264") != 0 )
+			{
+				display_usage(argv[0]);
+				return 0;
+			}
+			break;
 		case 'h':
 			// Fall through
 		case '?':
@@ -303,6 +907,227 @@ int main(int argc, char**argv)
 	}
 
 	// Set up default values based on provided values (if any)
+	setDefaultPort();
+
+	if( globalArgs.connectTimeout <= 0 )
+		globalArgs.connectTimeout = CONNECT_TIMEOUT;
+	if( globalArgs.ringDir && globalArgs.ringSeconds <= 0 )
+		printMessage(false, "-P only keeps the -b buffers, ignored\n");
+	if( globalArgs.reconnectMax < RECONNECT_MIN_DELAY )
+		globalArgs.reconnectMax = RECONNECT_MIN_DELAY;
+
+	// The rings and the recording need to see the stream, so it has to be copied through user space
+	if( globalArgs.splice && (globalArgs.ringSeconds > 0 || globalArgs.exportSeconds > 0 || globalArgs.recordDir) )
+	{
+		printMessage(false, "-Z can't be used with -b, -x or -w, forwarding with copies\n");
+		globalArgs.splice = false;
+	}
+
+	memset(&sapipe, 0, sizeof(sapipe));
+	memset(&saint, 0, sizeof(saint));
+	memset(&saterm, 0, sizeof(saterm));
+	memset(&sahup, 0, sizeof(sahup));
+	memset(&sadump, 0, sizeof(sadump));
+	
+	// Ignore SIGPIPE, a closed reader is handled per channel through EPIPE
+	sapipe.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sapipe, &oldsapipe);
+
+	// Handle SIGTERM & SIGING
+	saterm.sa_handler = sigHandler;
+	sigaction(SIGTERM, &saterm, &oldsaterm);
+	saint.sa_handler = sigHandler;
+	sigaction(SIGINT, &saint, &oldsaint);
+	
+	// SIGUSR2 is used to reset the pipe and connection
+	sahup.sa_handler = sigHandler;
+	sigaction(SIGUSR2, &sahup, &oldsahup);
+
+	// SIGHUP dumps the pre-alarm rings, the handler only notes when it came (see raiseAlarm).
+	// The calls it interrupts are restarted, the fork mode parent takes it in waitChildren().
+	sadump.sa_handler = sigHandler;
+	sadump.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &sadump, &oldsadump);
+
+	// SIGUSR1 and the -t timer (SIGALRM) are used to reset the pipe and connection.
+	// Only the processes that stream handle them.
+	if( globalArgs.eventLoop )
+	{
+		sigaction(SIGUSR1, &sahup, NULL);
+		sigaction(SIGALRM, &sahup, NULL);
+	}
+	else
+		signal( SIGUSR1, SIG_IGN );		// Ignore SIGUSR1 in parent process
+
+	if( resolveServer() != 0 )
+		return 1;
+
+	// The counters are set up before forking so the children update the ones the server reads,
+	// and the snapshot so they all cut around the instant the parent got the alarm
+	if( metricsInit() != 0 || snapshotInit() != 0 )
+		return 1;
+
+	if( globalArgs.metricsAddr )
+	{
+		pthread_t thread;
+		sigset_t all, old;
+
+		if( metricsListen(globalArgs.metricsAddr) != 0 )
+			return 1;
+
+		// Signals are left to the streaming thread, its epoll_wait has to see them
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		if( pthread_create(&thread, NULL, metricsServe, NULL) != 0 )
+		{
+			printMessage(false, "Failed to start the metrics server\n");
+			return 1;
+		}
+		pthread_detach(thread);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	// In -e mode the commands are run by the streaming loop, the control thread wakes it up
+	if( globalArgs.controlPath )
+	{
+		pthread_t thread;
+		sigset_t all, old;
+
+		if( controlListen(globalArgs.controlPath) != 0 )
+			return 1;
+		if( globalArgs.eventLoop && (g_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 )
+		{
+			perror("Failed to create the control eventfd");
+			return 1;
+		}
+
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		if( pthread_create(&thread, NULL, controlServe, NULL) != 0 )
+		{
+			printMessage(false, "Failed to start the control socket\n");
+			return 1;
+		}
+		pthread_detach(thread);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	// In event loop mode this process streams every channel itself
+	if( !globalArgs.eventLoop )
+	{
+		sigset_t hup;
+
+		sigemptyset(&hup);
+		sigaddset(&hup, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+		do
+		{
+			if( pid )
+			{
+				printMessage(true, "Child %i returned: %i\n", pid, status);
+
+				if( g_cleanUp == 2 )
+					g_cleanUp = false;	// Ignore SIGHUP
+			}
+
+			// Create a fork for each camera channel to stream
+			for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+			{
+				//static bool hitFirst = false;
+				if( globalArgs.channel[loopIdx] == true )
+				{
+					// Always fork if we're starting up, or if the pid of the dead child process matches
+					if( pid == 0 || g_childPids[loopIdx] == pid )
+						g_childPids[loopIdx] = fork();
+
+					// Child Process
+					if( g_childPids[loopIdx] == 0 )
+					{
+						// SIGUSR1 is used to reset the pipe and connection
+						sigaction(SIGUSR1, &sahup, NULL);
+						sigaction(SIGALRM, &sahup, NULL);
+
+						memset(g_childPids, 0, sizeof(g_childPids));
+						g_processCh = loopIdx;
+						pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+
+						// Only the parent serves the metrics and takes commands
+						if( g_metricsFd != -1 )
+						{
+							close(g_metricsFd);
+							g_metricsFd = -1;
+						}
+						if( g_controlFd != -1 )
+						{
+							close(g_controlFd);
+							g_controlFd = -1;
+						}
+						break;
+					}
+					// Error
+					else if( g_childPids[loopIdx] == -1 )
+					{
+						printMessage(false, "fork failed\n");
+						return 1;
+					}
+				}
+			}
+		}
+		while( g_processCh == -1 && (pid = waitChildren(&status)) > 0 && g_cleanUp != true );
+	}
+
+	// Children only stream the channel they were forked for (g_processCh)
+	if( globalArgs.eventLoop || g_processCh != -1 )
+		retval = runEventLoop();
+
+	// Restore old signal handler
+	sigaction(SIGPIPE, &oldsapipe, NULL);
+	sigaction(SIGTERM, &oldsaterm, NULL);
+	sigaction(SIGINT, &oldsaint, NULL);
+	sigaction(SIGUSR2, &oldsahup, NULL);
+	sigaction(SIGHUP, &oldsadump, NULL);
+
+	if( g_metricsFd != -1 && globalArgs.metricsAddr[0] == '/' )
+		unlink(globalArgs.metricsAddr);
+	if( g_controlFd != -1 )
+		unlink(globalArgs.controlPath);
+
+	// Kill all children (if any)
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		if( g_childPids[loopIdx] > 0 )
+			kill( g_childPids[loopIdx], SIGTERM );
+	}
+	return retval;
+}
+#endif
+
+// Clear and set the option defaults
+void setDefaultArgs(void)
+{
+	int loopIdx;
+
+	memset(&globalArgs, 0, sizeof(globalArgs));
+
+	globalArgs.hostname =
+		globalArgs.pipeName = "zmodo";
+	globalArgs.model = media;
+	globalArgs.username = 
+		globalArgs.password = "admin";
+	globalArgs.ringBitrate = 4096;
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+		globalArgs.channelPost[loopIdx] = -1;
+	globalArgs.queueMs = 2000;
+	globalArgs.connectTimeout = CONNECT_TIMEOUT;
+	globalArgs.reconnectMax = RECONNECT_MAX_DELAY;
+	globalArgs.dumpDir = "/tmp/dvralert";
+	globalArgs.recordMb = 1024;
+}
+
+// The model's port if none was given
+void setDefaultPort(void)
+{
 	if( !globalArgs.port )
 	{   
 	    //printMessage(true, "%s\n", globalArgs.model);
@@ -334,29 +1159,16 @@ int main(int argc, char**argv)
 			break;
 		}
 	}
+}
 
-	memset(&saint, 0, sizeof(saint));
-	memset(&saterm, 0, sizeof(saterm));
-	memset(&sahup, 0, sizeof(sahup));
-	
-	// Ignore SIGPIPE
-	sapipe.sa_handler = sigHandler;
-	sigaction(SIGPIPE, &sapipe, &oldsapipe);
-
-	// Handle SIGTERM & SIGING
-	saterm.sa_handler = sigHandler;
-	sigaction(SIGTERM, &saterm, &oldsaterm);
-	saint.sa_handler = sigHandler;
-	sigaction(SIGINT, &saint, &oldsaint);
-	
-	signal( SIGUSR1, SIG_IGN );		// Ignore SIGUSR1 in parent process
-
-	// SIGUSR2 is used to reset the pipe and connection
-	sahup.sa_handler = sigHandler;
-	sigaction(SIGUSR2, &sahup, &oldsahup);
+// Look up the DVR, every channel connects to g_serverAddr
+int resolveServer(void)
+{
+	struct addrinfo hints, *server;
+	int retval;
 
-	memset(&serverAddr, 0, sizeof(serverAddr));
-	serverAddr.sin_family = AF_INET;
+	memset(&g_serverAddr, 0, sizeof(g_serverAddr));
+	g_serverAddr.sin_family = AF_INET;
 	
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
@@ -368,306 +1180,4028 @@ int main(int argc, char**argv)
 		return 1;
 	}
 
-	serverAddr.sin_addr = ((struct sockaddr_in*)server->ai_addr)->sin_addr;
-	serverAddr.sin_port = htons(globalArgs.port);
-
+	g_serverAddr.sin_addr = ((struct sockaddr_in*)server->ai_addr)->sin_addr;
+	g_serverAddr.sin_port = htons(globalArgs.port);
+	freeaddrinfo(server);
 
-	do
-	{
-		if( pid )
-		{
-			printMessage(true, "Child %i returned: %i\n", pid, status);
+	return 0;
+}
 
-			if( g_cleanUp == 2 )
-				g_cleanUp = false;	// Ignore SIGHUP
-		}
+// Set up the state for every channel this process streams and
+// multiplex all of their sockets through a single epoll instance.
+// In fork mode this is called by each child with g_processCh set,
+// so the same state machine drives a single channel.
+int runEventLoop(void)
+{
+	struct epoll_event events[MAX_CHANNELS * 2];
+	struct channelState *cs;
+	long long signalled;
+	int retval = 1;
+	int loopIdx;
+	int ready;
 
-		// Create a fork for each camera channel to stream
-		for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
-		{
-			//static bool hitFirst = false;
-			if( globalArgs.channel[loopIdx] == true )
-			{
-				// Always fork if we're starting up, or if the pid of the dead child process matches
-				if( pid == 0 || g_childPids[loopIdx] == pid )
-					g_childPids[loopIdx] = fork();
+	// Fork mode children each need their own backoff jitter
+	srand(getpid() ^ nowMs());
 
-				// Child Process
-				if( g_childPids[loopIdx] == 0 )
-				{
-					// SIGUSR1 is used to reset the pipe and connection
-					sahup.sa_handler = sigHandler;
-					sigaction(SIGUSR1, &sahup, &oldsahup);
+	g_epollFd = epoll_create1(0);
+	if( g_epollFd == -1 )
+	{
+		perror("Failed to create epoll instance");
+		return 1;
+	}
 
-					memset(g_childPids, 0, sizeof(g_childPids));
-					g_processCh = loopIdx;
-					break;
-				}
-				// Error
-				else if( g_childPids[loopIdx] == -1 )
-				{
-					printMessage(false, "fork failed\n");
-					return 1;
-				}
-			}
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		cs = &g_channels[loopIdx];
+		cs->channel = loopIdx;
+		cs->state = ch_idle;
+		cs->sockFd = -1;
+		cs->outPipe = -1;
+		cs->splicePipe[0] = cs->splicePipe[1] = -1;
+
+		if( globalArgs.channel[loopIdx] != true )
+			continue;
+		if( g_processCh != -1 && g_processCh != loopIdx )
+			continue;
+
+		if( channelInit(cs) != 0 )
+		{
+			channelFree(cs);
+			goto teardown;
 		}
 	}
-	while( (pid = wait(&status)) > 0  && g_cleanUp != true );
 
-	if( g_processCh != -1 )
+	if( globalArgs.recordDir && recordStartWriter() != 0 )
+	{
+		printMessage(false, "Failed to start the recording writer\n");
+		goto teardown;
+	}
+	if( globalArgs.ringSeconds > 0 && dumpStartWriter() != 0 )
 	{
-		// At this point, g_processCh contains the camera number to use
-		sprintf(pipename, "/tmp/%s%i", globalArgs.pipeName, g_processCh);
+		printMessage(false, "Failed to start the dump writer\n");
+		goto teardown;
+	}
 
-		tv.tv_sec = 5;		// Wait 5 seconds for socket data
-		tv.tv_usec = 0;
-		
-#ifndef DOMAIN_SOCKETS
-		retval = mkfifo(pipename, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	// Embedded there are no signals, zmodoClose wakes the loop up to stop it.
+	// The control thread wakes it up to run a command.
+	if( g_wakeFd != -1 )
+	{
+		struct epoll_event ev;
 
-		if( retval != 0 )
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = EVENT_WAKE;
+		if( epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_wakeFd, &ev) == -1 )
 		{
-			sprintf(g_errBuf, "Ch %i: Failed to create pipe", g_processCh+1);
-			perror(g_errBuf);
+			perror("Failed to watch the wakeup eventfd");
+			goto teardown;
 		}
-#endif	
 
-		while( !g_cleanUp )
+		pthread_mutex_lock(&g_controlLock);
+		g_controlOpen = true;
+		pthread_mutex_unlock(&g_controlLock);
+	}
+	if( g_embedded )
+	{
+		pthread_mutex_lock(&g_frameLock);
+		g_engineRunning = true;
+		pthread_cond_broadcast(&g_frameCond);
+		pthread_mutex_unlock(&g_frameLock);
+	}
+
+	while( !g_cleanUp )
+	{
+		long long now = nowMs();
+		int timeout = -1;
+
+		// Start any channel that is due for a (re)connect, give up on connects and logins that take too long
+		for( loopIdx=0;loopIdx<MAX_CHANNELS && !g_cleanUp;loopIdx++ )
 		{
-			int flag = true;
-#ifdef NON_BLOCK_READ
-			fd_set readfds;
-#endif
-			// Initialize the socket and connect
-			sockFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			long long due;
 
-			if( setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv)))
+			cs = &g_channels[loopIdx];
+
+			if( (due = channelDue(cs)) == -1 )
+				continue;
+
+			if( due <= now )
 			{
-				sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set socket timeout");
-				perror(g_errBuf);
+				channelTimer(cs);
+				now = nowMs();
+
+				if( (due = channelDue(cs)) == -1 )
+					continue;
 			}
 
-			if( setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)))
+			if( timeout == -1 || due - now < timeout )
+				timeout = due > now ? (int)(due - now) : 0;
+		}
+
+		// A SIGHUP only left when it came, the incident is opened or extended here
+		if( (signalled = __atomic_exchange_n(&g_alarmSignal, 0, __ATOMIC_RELAXED)) != 0 )
+			raiseAlarm(signalled);
+
+		// An alarm that opens an incident is cut straight away, the dump threads follow
+		// the clips until they close. Alarms during it only extend it (see raiseAlarm).
+		// A child signalled on its own, not through the parent, cuts around when it was.
+		if( g_dumpRequest )
+		{
+			g_dumpRequest = false;
+
+			if( g_snapshot->time == 0 || g_snapshot->time != g_alarmTime )
 			{
-				sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set TCP_NODELAY");
-				perror(g_errBuf);
+				g_alarmTime = g_snapshot->time ? g_snapshot->time : wallMs();
+				dumpChannels();
 			}
-			if( setsockopt(sockFd, SOL_SOCKET, SO_LINGER, (char*)&lngr, sizeof(lngr)))
+		}
+
+		ready = epoll_wait(g_epollFd, events, MAX_CHANNELS * 2, timeout);
+
+		if( ready == -1 && errno != EINTR )
+		{
+			perror("epoll_wait failed");
+			break;
+		}
+
+		for( loopIdx=0;loopIdx<ready;loopIdx++ )
+		{
+			if( events[loopIdx].data.u32 == EVENT_WAKE )
 			{
-				sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set SO_LINGER");
-				perror(g_errBuf);
+				eventfd_t count;
+
+				eventfd_read(g_wakeFd, &count);
+				controlPoll();
+				continue;
 			}
 
-			retval = connect(sockFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-			
-			if( globalArgs.verbose )
-				printMessage(true, "Ch %i: Connect result: %i\n", g_processCh+1, retval);
-			
-			if( retval == -1 && errno != EINPROGRESS )
+			cs = &g_channels[events[loopIdx].data.u32 & ~EVENT_OUTPUT];
+
+			if( cs->state == ch_connecting )
 			{
-				int sleeptime = 10;
+				connectDone(cs);
+				continue;
+			}
 
-				if( globalArgs.verbose )
-				{
-					sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to connect");
-					perror(g_errBuf);
-					printMessage(true, "Waiting %i seconds.\n", sleeptime);
-				}
-				close(sockFd);
-				sockFd = -1;
-				sleep(sleeptime);
+			if( cs->state == ch_login )
+			{
+				advanceLogin(cs);
 				continue;
 			}
-		
-			if( retval == -1 && errno != EINPROGRESS )
+
+			if( cs->state != ch_streaming )
+				continue;
+
+			// The output pipe drained, carry on writing to it
+			if( events[loopIdx].data.u32 & EVENT_OUTPUT )
 			{
-				
-				sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to connect");
-				perror(g_errBuf);
-				return 1;
+				if( cs->outBlocked && (cs->splicePipe[0] != -1 ? flushSplice(cs) : flushQueue(cs)) == 0 )
+					blockOutput(cs, false);
 			}
-			
+			// A socket waiting on the output pipe still reports a hang up or error,
+			// spliceChannel wouldn't look at it and epoll would report it again at once
+			else if( cs->outBlocked && (events[loopIdx].events & (EPOLLHUP | EPOLLERR)) )
+			{
+				if( globalArgs.verbose )
+					printMessage(true, "Ch %i: Connection lost while the reader is behind\n", cs->channel+1);
+				resetChannel(cs, true, 0);
+			}
+			else
+				readChannel(cs);
+		}
+
+		// Wake up zmodoPoll callers waiting for the frames that came in
+		if( g_framesAdded )
+		{
+			pthread_mutex_lock(&g_frameLock);
+			g_framesAdded = false;
+			pthread_cond_broadcast(&g_frameCond);
+			pthread_mutex_unlock(&g_frameLock);
+		}
+
+		// If we receive a SIGUSR1, close and reset everything
+		// A SIGUSR2 only resets the connection, the pipe stays open.
+		if( g_cleanUp >= 2 )
+		{
+			bool keepPipe = (g_cleanUp == 3);
+
+			g_cleanUp = false;
+
+			for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+			{
+				cs = &g_channels[loopIdx];
+
+				if( cs->state == ch_idle )
+					continue;
+
+				resetChannel(cs, keepPipe, 0);
+			}
+		}
+	}
+
+	if( globalArgs.verbose )
+		printMessage(true, "Exiting loop: %i\n", g_cleanUp);
+	retval = 0;
+
+	// A failed start unwinds the channels set up so far here too, embedded it is retried
+teardown:
+	// Clips being dumped are written out of the rings
+	dumpStopWriter();
+
+	// Received signal to exit, cleanup. Removed channels still have their buffers.
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		cs = &g_channels[loopIdx];
+
+		if( cs->state == ch_idle && !cs->stopped )
+			continue;
+
+		resetChannel(cs, false, 0);
+		cs->state = ch_idle;
+		unlink(cs->pipename);
+		ringFree(&cs->ring);
+		queueFree(&cs->queue);
+		shmClose(cs);
+		recordClose(cs);
+		free(cs->frames);
+		cs->frames = NULL;
+
+		if( cs->splicePipe[0] != -1 )
+		{
+			close(cs->splicePipe[0]);
+			close(cs->splicePipe[1]);
+			cs->splicePipe[0] = cs->splicePipe[1] = -1;
+		}
+	}
+
+	// Everything recorded has to be on disk before the blocks go
+	recordStopWriter();
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+		recordFree(&g_channels[loopIdx]);
+
+	close(g_epollFd);
+	g_epollFd = -1;
+
+	return retval;
+}
+
+// Set up the pipe, buffers and login of a channel and have it connect straight away
+int channelInit(struct channelState *cs)
+{
+	sprintf(cs->pipename, "/tmp/%s%i", globalArgs.pipeName, cs->channel);
+#ifndef DOMAIN_SOCKETS
+	if( !g_embedded && mkfifo(cs->pipename, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH) != 0 )
+	{
+		sprintf(g_errBuf, "Ch %i: Failed to create pipe", cs->channel+1);
+		perror(g_errBuf);
+	}
+#endif
+	if( globalArgs.ringSeconds > 0 )
+	{
+		char ringFile[512];
+
+		sprintf(ringFile, "%s/%s%i.ring", globalArgs.ringDir, globalArgs.pipeName, cs->channel);
+		if( ringInit(&cs->ring, globalArgs.ringSeconds + channelPost(cs->channel), globalArgs.ringBitrate,
+			globalArgs.ringDir ? ringFile : NULL) != 0 )
+		{
+			printMessage(false, "Ch %i: Failed to allocate %i second pre-alarm buffer\n", cs->channel+1, globalArgs.ringSeconds);
+			return 1;
+		}
+		if( cs->ring.recovered )
+			dumpRecovered(cs);
+	}
+	if( g_embedded )
+	{
+		cs->frameCount = (globalArgs.ringSeconds + channelPost(cs->channel)) * FRAMES_PER_SEC + 64;
+		cs->frames = calloc(cs->frameCount, sizeof(struct ringFrame));
+		if( cs->frames == NULL )
+		{
+			printMessage(false, "Ch %i: Failed to allocate the frame index\n", cs->channel+1);
+			return 1;
+		}
+	}
+	if( globalArgs.exportSeconds > 0 && shmCreate(cs, globalArgs.exportSeconds, globalArgs.ringBitrate) != 0 )
+	{
+		sprintf(g_errBuf, "Ch %i: Failed to create shared memory export", cs->channel+1);
+		perror(g_errBuf);
+		return 1;
+	}
+	if( globalArgs.recordDir && recordInit(cs, globalArgs.recordDir, globalArgs.recordMb) != 0 )
+	{
+		sprintf(g_errBuf, "Ch %i: Failed to set up the recording in %s", cs->channel+1, globalArgs.recordDir);
+		perror(g_errBuf);
+		return 1;
+	}
+	// Splice channels hold data back in the kernel instead
+	if( !globalArgs.splice && globalArgs.queueMs > 0 && queueInit(&cs->queue, globalArgs.queueMs, globalArgs.ringBitrate) != 0 )
+	{
+		printMessage(false, "Ch %i: Failed to allocate %i ms output queue\n", cs->channel+1, globalArgs.queueMs);
+		return 1;
+	}
+#ifndef DOMAIN_SOCKETS
+	if( globalArgs.splice )
+	{
+		if( pipe2(cs->splicePipe, O_NONBLOCK) == -1 )
+		{
+			sprintf(g_errBuf, "Ch %i: Failed to create splice pipe, forwarding with copies", cs->channel+1);
+			perror(g_errBuf);
+			cs->splicePipe[0] = cs->splicePipe[1] = -1;
+		}
+		else
+		{
+			// A bigger pipe means fewer wakeups, the default is fine if we can't have it
+			fcntl(cs->splicePipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+			cs->spliceSize = fcntl(cs->splicePipe[1], F_GETPIPE_SZ);
+			cs->spliceLen = 0;
+		}
+	}
+#endif
+
+	// The login packets don't change, only the handshake is redone on a reconnect
+	if( pConnectFunc[globalArgs.model](&cs->login, cs->channel) != 0 )
+	{
+		printMessage(false, "Ch %i: Login doesn't fit in the login script\n", cs->channel+1);
+		return 1;
+	}
+
+	// Connect straight away
+	cs->state = ch_wait;
+	cs->retryAt = 0;
+
+	return 0;
+}
+
+// Undo a channelInit that failed part way. The channel never streamed, so nothing is
+// waiting to be written out and the next channelInit starts from scratch.
+void channelFree(struct channelState *cs)
+{
+	unlink(cs->pipename);
+	ringFree(&cs->ring);
+	queueFree(&cs->queue);
+	shmClose(cs);
+	recordFree(cs);
+	free(cs->frames);
+	cs->frames = NULL;
+	memset(&cs->login, 0, sizeof(cs->login));
+
+	if( cs->splicePipe[0] != -1 )
+	{
+		close(cs->splicePipe[0]);
+		close(cs->splicePipe[1]);
+		cs->splicePipe[0] = cs->splicePipe[1] = -1;
+	}
+}
+
+// Start connecting to the DVR for one channel. The connect completes in the event loop
+// (connectDone), unless it fails or takes longer than the connect timeout.
+void startChannel(struct channelState *cs)
+{
+	struct linger lngr;
+	struct epoll_event ev;
+	int flag = true;
+	int retval;
+
+	lngr.l_onoff = false;
+	lngr.l_linger = 0;
+
+	cs->connectStart = nowMs();
+
+	// Initialize the socket and connect
+	cs->sockFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if( cs->sockFd == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to create socket");
+		perror(g_errBuf);
+		failChannel(cs);
+		return;
+	}
+
+	if( setsockopt(cs->sockFd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)))
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to set TCP_NODELAY");
+		perror(g_errBuf);
+	}
+	if( setsockopt(cs->sockFd, SOL_SOCKET, SO_LINGER, (char*)&lngr, sizeof(lngr)))
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to set SO_LINGER");
+		perror(g_errBuf);
+	}
+
+	// The socket never blocks, the connect, login and stream all run from the event loop
+	if( fcntl(cs->sockFd, F_SETFL, O_NONBLOCK) == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to set O_NONBLOCK");
+		perror(g_errBuf);
+	}
+
+	retval = connect(cs->sockFd, (struct sockaddr*)&g_serverAddr, sizeof(g_serverAddr));
+
+	if( globalArgs.verbose )
+		printMessage(true, "Ch %i: Connect result: %i\n", cs->channel+1, retval);
+
+	if( retval == -1 && errno != EINPROGRESS )
+	{
+		if( globalArgs.verbose )
+		{
+			sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to connect");
+			perror(g_errBuf);
+		}
+		failChannel(cs);
+		return;
+	}
+
+	// Writable once connected (or failed)
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.u32 = cs->channel;
+
+	if( epoll_ctl(g_epollFd, EPOLL_CTL_ADD, cs->sockFd, &ev) == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to add socket to epoll");
+		perror(g_errBuf);
+		failChannel(cs);
+		return;
+	}
+
+	cs->state = ch_connecting;
+	cs->retryAt = cs->connectStart + globalArgs.connectTimeout;
+
+	// Connected already (local DVR)
+	if( retval == 0 )
+		connectDone(cs);
+}
+
+// The socket of a connecting channel became writable, log in if the connect succeeded
+void connectDone(struct channelState *cs)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if( getsockopt(cs->sockFd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 )
+		err = errno;
+
+	if( err != 0 )
+	{
+		if( globalArgs.verbose )
+		{
+			errno = err;
+			sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to connect");
+			perror(g_errBuf);
+		}
+		failChannel(cs);
+		return;
+	}
+
+	cs->login.events = EPOLLOUT;
+	beginLogin(cs);
+}
+
+// Start the login handshake on a connected socket
+void beginLogin(struct channelState *cs)
+{
+	struct loginScript *login = &cs->login;
+
+	login->step = 0;
+	login->done = 0;
+	login->sized = false;
+	login->replyLen = 0;
+	login->quietAt = 0;
+
+	cs->state = ch_login;
+	cs->retryAt = nowMs() + LOGIN_TIMEOUT;
+
+	advanceLogin(cs);
+}
+
+// Run the login as far as the DVR's replies allow
+void advanceLogin(struct channelState *cs)
+{
+	switch( loginStep(cs) )
+	{
+	case 0:
+		loginDone(cs);
+		break;
+	case -1:
+		printMessage(true, "Login failed, retrying.\nDid you select the right model?\n");
+		failChannel(cs);
+		break;
+	}
+}
+
+// Logged in, start reading the stream
+void loginDone(struct channelState *cs)
+{
+	struct channelMetrics *m = &g_metrics[cs->channel];
+	struct epoll_event ev;
+
+	// A new connection is a new stream, keep the offsets in line with the ring
+	memset(&cs->scan, 0, sizeof(cs->scan));
+	cs->paramType = 0;
+	cs->actAuStart = 0;
+	if( cs->ring.hdr )
+		cs->scan.offset = cs->ring.hdr->head;
+	if( cs->queue.data )
+		queueRestart(cs);
+	if( cs->shm )
+		shmRestart(cs);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = cs->channel;
+
+	if( epoll_ctl(g_epollFd, EPOLL_CTL_MOD, cs->sockFd, &ev) == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to watch socket");
+		perror(g_errBuf);
+		failChannel(cs);
+		return;
+	}
+
+	cs->state = ch_streaming;
+	cs->backoff = 0;
+	metricAdd(&m->logins, 1);
+	metricSet(&m->loginMs, nowMs() - cs->connectStart);
+	metricSet(&m->streaming, 1);
+
+	// the stream sometimes goes grey,
+	// this alarm should periodically reset the stream
+	if(globalArgs.timer)
+		alarm(globalArgs.timer);
+}
+
+// A connect or login failed, retry after an exponential backoff.
+// The first retry comes quickly, as a DVR blip is usually over by then. Later ones
+// double up to the cap and are jittered, so channels (and other instances) that
+// lost the DVR together don't retry in lockstep.
+void failChannel(struct channelState *cs)
+{
+	int delay;
+
+	metricAdd(&g_metrics[cs->channel].loginFailures, 1);
+
+	if( cs->backoff == 0 )
+		cs->backoff = RECONNECT_MIN_DELAY;
+	else if( cs->backoff < globalArgs.reconnectMax )
+		cs->backoff *= 2;
+	if( cs->backoff > globalArgs.reconnectMax )
+		cs->backoff = globalArgs.reconnectMax;
+
+	// Anywhere from half to all of it
+	delay = cs->backoff / 2 + rand() % (cs->backoff / 2 + 1);
+
+	if( globalArgs.verbose )
+		printMessage(true, "Ch %i: Retrying in %i ms\n", cs->channel+1, delay);
+
+	resetChannel(cs, true, delay);
+}
+
+// When the event loop has to call channelTimer() for a channel, -1 if it doesn't
+long long channelDue(struct channelState *cs)
+{
+	switch( cs->state )
+	{
+	case ch_wait:
+	case ch_connecting:
+		return cs->retryAt;
+	case ch_login:
+		if( cs->login.quietAt != 0 && cs->login.quietAt < cs->retryAt )
+			return cs->login.quietAt;
+		return cs->retryAt;
+	default:
+		return -1;
+	}
+}
+
+// A channel's timer expired: reconnect, or give up on a connect or login that took too long
+void channelTimer(struct channelState *cs)
+{
+	switch( cs->state )
+	{
+	case ch_wait:
+		startChannel(cs);
+		break;
+	case ch_connecting:
+		if( globalArgs.verbose )
+			printMessage(true, "Ch %i: Connect timed out\n", cs->channel+1);
+		failChannel(cs);
+		break;
+	case ch_login:
+		if( nowMs() >= cs->retryAt )
+		{
+			printMessage(true, "Ch %i: Login timed out\n", cs->channel+1);
+			failChannel(cs);
+		}
+		else
+			advanceLogin(cs);	// the DVR went quiet, a drain is over
+		break;
+	default:
+		break;
+	}
+}
+
+// Add a packet to a login and a step sending it, returns 0 if it fit
+int loginSend(struct loginScript *login, const void *buf, size_t len)
+{
+	if( login->packetCount == LOGIN_MAX_PACKETS || len > LOGIN_PACKET_SIZE || login->stepCount == LOGIN_MAX_STEPS )
+		return 1;
+
+	memcpy(login->packets[login->packetCount], buf, len);
+	login->packetLen[login->packetCount] = len;
+	loginAdd(login, login_send, login->packetCount++, 0);
+	return 0;
+}
+
+// Add a step to a login, the scripts are sized so they always fit
+void loginAdd(struct loginScript *login, LoginOp op, int arg, int value)
+{
+	if( login->stepCount == LOGIN_MAX_STEPS )
+		return;
+
+	login->steps[login->stepCount].op = op;
+	login->steps[login->stepCount].arg = arg;
+	login->steps[login->stepCount].value = value;
+	login->stepCount++;
+}
+
+// Run a channel's login as far as the socket allows, picking up where the last call stopped.
+// Returns 0 once logged in, 1 while waiting for the DVR and -1 if the login failed.
+int loginStep(struct channelState *cs)
+{
+	struct loginScript *login = &cs->login;
+	struct epoll_event ev;
+	ssize_t len;
+	int retval;
+	int idx;
+
+	while( login->step < login->stepCount )
+	{
+		struct loginStep *step = &login->steps[login->step];
+
+		switch( step->op )
+		{
+		case login_send:
 			retval = 0;
+			while( login->done < login->packetLen[step->arg] )
+			{
+				len = send(cs->sockFd, login->packets[step->arg] + login->done, login->packetLen[step->arg] - login->done, MSG_NOSIGNAL);
+
+				if( len == -1 && errno == EINTR )
+					continue;
+				if( len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+				{
+					retval = 1;
+					break;
+				}
+				if( len <= 0 )
+				{
+					retval = -1;
+					break;
+				}
+				login->done += len;
+			}
 
-			if( pConnectFunc[globalArgs.model](sockFd, g_processCh) != 0 )
+			if( retval == 0 && globalArgs.verbose )
+				printMessage(true, "Ch %i: Send %i result: %i\n", cs->channel+1, step->arg+1, (int)login->done);
+			break;
+
+		case login_recv:
+		case login_recvAny:
+			retval = loginRecv(cs, login->reply, sizeof(login->reply), step->arg, step->op == login_recvAny);
+			login->replyLen = login->done;
+			break;
+
+		case login_recvSized:
+			if( !login->sized )
 			{
-				printMessage(true, "Login failed, bailing.\nDid you select the right model?\n");
-				close(sockFd);
-				sockFd = -1;
-				return 1;
+				if( (retval = loginRecv(cs, login->header, sizeof(login->header), sizeof(login->header), false)) != 0 )
+					break;
+
+				login->want = 0;
+				for( idx=sizeof(login->header)-step->arg;idx<sizeof(login->header);idx++ )
+					login->want = (login->want << 8) | login->header[idx];
+				login->sized = true;
+				login->done = 0;
 			}
-#ifdef NON_BLOCK_READ
-			if( fcntl(sockFd, F_SETFL, O_NONBLOCK) == -1 )	// non-blocking sockets
+
+			retval = loginRecv(cs, login->reply, sizeof(login->reply), login->want, false);
+			login->replyLen = login->done;
+			break;
+
+		case login_drain:
+			retval = loginDrain(cs, step->arg);
+			break;
+
+		case login_expect:
+			retval = 0;
+			if( step->arg >= login->replyLen || step->arg >= sizeof(login->reply) || login->reply[step->arg] != step->value )
 			{
-				sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set O_NONBLOCK");
-				perror(g_errBuf);
+				if( globalArgs.verbose )
+				{
+					printMessage(true, "Ch %i: Login refused: ", cs->channel+1);
+					printBuffer((char*)login->reply, login->replyLen < sizeof(login->reply) ? login->replyLen : sizeof(login->reply));
+				}
+				retval = -1;
 			}
-			FD_ZERO(&readfds);
-			FD_SET(sockFd, &readfds	);
+			break;
+
+		default:
+			retval = -1;
+			break;
+		}
+
+		if( retval == -1 )
+		{
+			if( globalArgs.verbose )
+			{
+				sprintf(g_errBuf, "Ch %i: Login step %i failed", cs->channel+1, login->step+1);
+				perror(g_errBuf);
+			}
+			return -1;
+		}
+
+		// Wait for the socket to be writable for a send, readable otherwise
+		if( retval == 1 )
+		{
+			unsigned int events = step->op == login_send ? EPOLLOUT : EPOLLIN;
+
+			if( login->events != events )
+			{
+				memset(&ev, 0, sizeof(ev));
+				ev.events = events;
+				ev.data.u32 = cs->channel;
+
+				if( epoll_ctl(g_epollFd, EPOLL_CTL_MOD, cs->sockFd, &ev) == -1 )
+					return -1;
+				login->events = events;
+			}
+			return 1;
+		}
+
+		if( globalArgs.verbose && step->op != login_send && step->op != login_expect )
+			printMessage(true, "Ch %i: Receive %i result: %i\n", cs->channel+1, login->step+1, (int)login->done);
+
+		login->step++;
+		login->done = 0;
+		login->sized = false;
+	}
+
+	return 0;
+}
+
+// Receive bytes [done, want) of a reply, the first bufSize of them into buf and the rest
+// is discarded. any stops after the first read that returns data.
+// Returns 0 when done, 1 if the DVR hasn't sent it yet and -1 if the socket failed or closed.
+int loginRecv(struct channelState *cs, unsigned char *buf, size_t bufSize, size_t want, bool any)
+{
+	struct loginScript *login = &cs->login;
+	ssize_t len;
+
+	while( login->done < want )
+	{
+		unsigned char *dst = (unsigned char*)g_recvBuf;
+		size_t room = sizeof(g_recvBuf);
+
+		if( login->done < bufSize )
+		{
+			dst = buf + login->done;
+			room = bufSize - login->done;
+		}
+		if( room > want - login->done )
+			room = want - login->done;
+
+		len = recv(cs->sockFd, dst, room, 0);
+
+		if( len == -1 && errno == EINTR )
+			continue;
+		if( len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+			return 1;
+		if( len <= 0 )
+			return -1;
+
+		login->done += len;
+		if( any )
+			break;
+	}
+
+	return 0;
+}
+
+// Receive and discard a reply of unknown length, it has ended once nothing arrived for quietMs.
+// Returns 0 when done, 1 while it may still be coming and -1 if the socket failed or closed.
+int loginDrain(struct channelState *cs, int quietMs)
+{
+	struct loginScript *login = &cs->login;
+	ssize_t len;
+
+	if( login->quietAt == 0 )
+		login->quietAt = nowMs() + quietMs;
+
+	while( (len = recv(cs->sockFd, g_recvBuf, sizeof(g_recvBuf), 0)) > 0 || (len == -1 && errno == EINTR) )
+	{
+		if( len > 0 )
+		{
+			login->done += len;
+			login->quietAt = nowMs() + quietMs;
+		}
+	}
+
+	if( len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) )
+		return -1;
+
+	if( nowMs() < login->quietAt )
+		return 1;
+
+	login->quietAt = 0;
+	return 0;
+}
+
+// Close the connection of a channel and schedule the reconnect.
+// keepPipe leaves the output pipe open so the reader isn't disturbed.
+void resetChannel(struct channelState *cs, bool keepPipe, int delayMs)
+{
+	struct channelMetrics *m = &g_metrics[cs->channel];
+
+	// Not when shutting down
+	if( cs->state == ch_streaming && g_cleanUp != true )
+		metricAdd(&m->reconnects, 1);
+	metricSet(&m->streaming, 0);
+
+	if( cs->sockFd != -1 )
+	{
+		// Closing the socket removes it from the epoll set
+		close(cs->sockFd);
+		cs->sockFd = -1;
+	}
+
+	// Stop waiting on the output pipe, the new socket starts out being read
+	if( cs->outBlocked )
+	{
+		if( keepPipe )
+			epoll_ctl(g_epollFd, EPOLL_CTL_DEL, cs->outPipe, NULL);
+		cs->outBlocked = false;
+	}
+
+	if( !keepPipe && cs->outPipe != -1 )
+	{
+		close(cs->outPipe);
+		cs->outPipe = -1;
+	}
+
+	// A new reader starts on a keyframe, not with what the last one left
+	if( !keepPipe && cs->queue.data )
+	{
+		metricAdd(&m->droppedNoReader, cs->queue.head - cs->queue.tail);
+		metricSet(&m->queued, 0);
+		cs->queue.tail = cs->queue.auStart = cs->queue.head;
+		cs->queue.dropping = cs->queue.keyframes;
+		cs->queue.overflowed = cs->queue.keyUnit = cs->queue.shedding = cs->queue.stalled = false;
+	}
+
+	// Whatever is left in the splice pipe would go to a new reader mid frame
+	while( !keepPipe && cs->spliceLen > 0 )
+	{
+		ssize_t dropped = read(cs->splicePipe[0], g_recvBuf, cs->spliceLen < sizeof(g_recvBuf) ? cs->spliceLen : sizeof(g_recvBuf));
+
+		if( dropped <= 0 )
+		{
+			cs->spliceLen = 0;
+			break;
+		}
+		cs->spliceLen -= dropped;
+		metricAdd(&m->droppedNoReader, dropped);
+	}
+	if( !keepPipe )
+		metricSet(&m->queued, cs->spliceLen);
+
+	cs->state = ch_wait;
+	cs->retryAt = nowMs() + delayMs;
+}
+
+// The scanner finds the frames for the rings, the queue, the export, the recording and zmodoPoll,
+// and scores the activity the metrics (-M) and the control socket's stats (-C) report
+bool channelScans(struct channelState *cs)
+{
+	return cs->ring.hdr || cs->queue.data || cs->shm || cs->record.count || globalArgs.metricsAddr || globalArgs.controlPath;
+}
+
+// Read h264 data from the camera and forward it to the pipe
+void readChannel(struct channelState *cs)
+{
+#ifdef DOMAIN_SOCKETS
+	struct sockaddr_un addr;
+#endif
+	struct channelMetrics *m = &g_metrics[cs->channel];
+	int read;
+	int retval;
+	int loopIdx;
+
+	if( cs->splicePipe[0] != -1 )
+	{
+		spliceChannel(cs);
+		return;
+	}
+
+	// Don't let a single busy channel starve the others
+	for( loopIdx=0;loopIdx<READS_PER_WAKEUP;loopIdx++ )
+	{
+		// Read actual h264 data from camera
+		read  = recv(cs->sockFd, g_recvBuf, sizeof(g_recvBuf), 0);
+		
+		if( read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+			return;		// Not ready yet
+
+		// Server disconnected, close the socket so we can try to reconnect
+		if( read <= 0 )
+		{
+			if( globalArgs.verbose )
+				printMessage(true, "Ch %i: Socket closed. Receive result: %i\n", cs->channel+1, read);
+			
+			resetChannel(cs, true, 0);
+			return;
+		}
+
+		if( globalArgs.verbose )
+		{
+			printf(".");
+			fflush(stdout);
+		}
+
+		metricAdd(&m->bytes, read);
+		metricAdd(&m->packets, 1);
+		metricSet(&m->lastByte, nowMs());
+
+		// Frames found in the chunk are timed by its arrival
+		if( channelScans(cs) )
+			cs->recvTime = wallMs();
+
+		if( cs->ring.hdr )
+			ringAppend(&cs->ring, g_recvBuf, read, cs->recvTime);
+
+		if( cs->shm )
+			shmAppend(cs, g_recvBuf, read);
+
+#ifdef DOMAIN_SOCKETS
+		if( cs->outPipe == -1 )
+		{
+			cs->outPipe = socket(AF_UNIX, SOCK_STREAM, 0);
+			if( cs->outPipe == -1 )
+				perror("Error creating socket");
+
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			strncpy(addr.sun_path, cs->pipename, sizeof(addr.sun_path) - 1);
+
+			if( bind(cs->outPipe, (struct sockaddr*)&addr, sizeof(addr)) == -1 )
+				perror("Error binding socket");
+		}
+		
+#else
+		// Open the pipe if it wasn't previously opened
+		if( cs->outPipe == -1 && !g_embedded )
+			cs->outPipe = open(cs->pipename, O_WRONLY | O_NONBLOCK);
+#endif
+
+		if( channelScans(cs) )
+		{
+			cs->chunk = (unsigned char*)g_recvBuf;
+			cs->chunkBase = cs->scan.offset;
+			nalScan(&cs->scan, cs->chunk, read, channelNal, cs);
+		}
+
+		if( cs->record.count )
+			recordAppend(cs, g_recvBuf, read, cs->chunkBase);
+
+		// Queue whole frames and write what the reader takes
+		if( cs->queue.data )
+		{
+			queueChunkDone(cs, read);
+
+			if( cs->outBlocked )
+				metricSet(&m->queued, cs->queue.head - cs->queue.tail);
+			else if( flushQueue(cs) == -1 )
+				return;
+			if( cs->queue.stalled )
+				return;
+			continue;
+		}
+
+		// send to pipe
+		if( cs->outPipe != -1 )
+		{
+
+			if( (retval = write(cs->outPipe, g_recvBuf, read)) == -1)
+			{
+				if( errno == EAGAIN || errno == EWOULDBLOCK )
+				{
+					if( globalArgs.verbose )
+						printMessage(true, "\nCh %i: %s", cs->channel+1, "Reader isn't reading fast enough, discarding data. Not enough processing power?\n");
+					metricAdd(&m->droppedSlow, read);
+
+					// Right now we discard data, should be a way to buffer maybe?
+					continue;
+				}
+				// reader closed the pipe, wait for it to be opened again.
+				else if( globalArgs.verbose )
+				{
+					sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Pipe closed");
+					perror(g_errBuf);
+				}
+#ifndef DOMAIN_SOCKETS
+				resetChannel(cs, false, 0);
+#else
+				resetChannel(cs, true, 0);
 #endif
-			// the stream sometimes goes grey,
-			// this alarm should periodically reset the stream
-			if(globalArgs.timer)
-				alarm(globalArgs.timer);
+				return;
+			}
+			else
+			{
+				// A partial write loses the rest of the chunk
+				metricAdd(&m->droppedSlow, read - retval);
+
+				if( globalArgs.verbose )
+				{
+					printf("\b \b");
+					fflush(stdout);
+				}
+			}
+		}
+		else if( !g_embedded )
+			metricAdd(&m->droppedNoReader, read);
+	}
+}
+
+// Forward data from the camera to the pipe without copying it through user space,
+// socket -> splicePipe -> outPipe. What the reader can't take yet stays in splicePipe
+// and the socket isn't read again until the output pipe drains, so nothing is lost.
+void spliceChannel(struct channelState *cs)
+{
+	ssize_t moved;
+	int loopIdx;
+
+	// Don't let a single busy channel starve the others
+	for( loopIdx=0;loopIdx<READS_PER_WAKEUP && !cs->outBlocked;loopIdx++ )
+	{
+		// Make room first if a previous flush fell short
+		if( cs->spliceLen > 0 && flushSplice(cs) != 0 )
+			return;
+
+		moved = splice(cs->sockFd, NULL, cs->splicePipe[1], NULL, cs->spliceSize - cs->spliceLen,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if( moved == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+			return;		// Not ready yet
+
+		// Server disconnected, close the socket so we can try to reconnect
+		if( moved <= 0 )
+		{
+			if( globalArgs.verbose )
+				printMessage(true, "Ch %i: Socket closed. Splice result: %i\n", cs->channel+1, (int)moved);
+
+			resetChannel(cs, true, 0);
+			return;
+		}
+
+		cs->spliceLen += moved;
+
+		if( globalArgs.verbose )
+		{
+			printf(".");
+			fflush(stdout);
+		}
+
+		metricAdd(&g_metrics[cs->channel].bytes, moved);
+		metricAdd(&g_metrics[cs->channel].packets, 1);
+		metricSet(&g_metrics[cs->channel].lastByte, nowMs());
+	}
+
+	if( cs->spliceLen > 0 )
+		flushSplice(cs);
+}
+
+// Move what splicePipe holds on to the output pipe, partial transfers are retried.
+// Returns 0 once it is empty, 1 if the output pipe is full and -1 if the channel was reset.
+int flushSplice(struct channelState *cs)
+{
+	ssize_t moved;
+
+	// Open the pipe if it wasn't previously opened
+	if( cs->outPipe == -1 )
+		cs->outPipe = open(cs->pipename, O_WRONLY | O_NONBLOCK);
+
+	while( cs->spliceLen > 0 )
+	{
+		// Nobody is reading yet, discard the data as the copy path does
+		if( cs->outPipe == -1 )
+			moved = read(cs->splicePipe[0], g_recvBuf, cs->spliceLen < sizeof(g_recvBuf) ? cs->spliceLen : sizeof(g_recvBuf));
+		else
+			moved = splice(cs->splicePipe[0], NULL, cs->outPipe, NULL, cs->spliceLen, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if( moved == -1 && errno == EINTR )
+			continue;
+
+		if( moved == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+		{
+			metricSet(&g_metrics[cs->channel].queued, cs->spliceLen);
+			blockOutput(cs, true);
+			return 1;
+		}
+
+		// reader closed the pipe, wait for it to be opened again.
+		if( moved <= 0 )
+		{
+			if( globalArgs.verbose )
+			{
+				sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Pipe closed");
+				perror(g_errBuf);
+			}
+			resetChannel(cs, false, 0);
+			return -1;
+		}
+
+		cs->spliceLen -= moved;
+		if( cs->outPipe == -1 )
+			metricAdd(&g_metrics[cs->channel].droppedNoReader, moved);
+	}
+
+	metricSet(&g_metrics[cs->channel].queued, 0);
+	return 0;
+}
+
+// Wait for the output pipe to become writable. With splice the socket isn't read
+// meanwhile (TCP holds the stream back), the output queue keeps taking data.
+// block false undoes it.
+void blockOutput(struct channelState *cs, bool block)
+{
+	struct epoll_event ev;
+
+	if( cs->outBlocked == block )
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.u32 = cs->channel | EVENT_OUTPUT;
+
+	if( epoll_ctl(g_epollFd, block ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, cs->outPipe, &ev) == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to watch output pipe");
+		perror(g_errBuf);
+		return;
+	}
+
+	cs->outBlocked = block;
+
+	// The output queue keeps taking data, only splice stops reading
+	if( cs->splicePipe[0] == -1 )
+		return;
+
+	ev.events = block ? 0 : EPOLLIN;
+	ev.data.u32 = cs->channel;
+
+	if( epoll_ctl(g_epollFd, EPOLL_CTL_MOD, cs->sockFd, &ev) == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to update socket events");
+		perror(g_errBuf);
+	}
+}
+
+// Stop reading the socket while a keyframe overruns the output queue, TCP holds the
+// stream back meanwhile. stall false reads it again.
+void queueStall(struct channelState *cs, bool stall)
+{
+	struct epoll_event ev;
+
+	cs->queue.stalled = stall;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = stall ? 0 : EPOLLIN;
+	ev.data.u32 = cs->channel;
+
+	if( epoll_ctl(g_epollFd, EPOLL_CTL_MOD, cs->sockFd, &ev) == -1 )
+	{
+		sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Failed to update socket events");
+		perror(g_errBuf);
+	}
+}
+
+// Allocate an output queue for ms of stream at kbps, and room past it for
+// the rest of a chunk and the start code held back from the one before
+int queueInit(struct outQueue *q, int ms, int kbps)
+{
+	memset(q, 0, sizeof(*q));
+	q->size = (size_t)ms * kbps / 8;
+	q->room = q->size + sizeof(g_recvBuf) * 2;
+	q->data = malloc(q->room);
+	if( q->data == NULL )
+		return 1;
+
+	return 0;
+}
+
+void queueFree(struct outQueue *q)
+{
+	free(q->data);
+	memset(q, 0, sizeof(*q));
+}
+
+// A new connection is a new stream. The frame cut off by the old one
+// is taken back if none of it was written yet, and the new stream
+// is passed on from its first keyframe.
+void queueRestart(struct channelState *cs)
+{
+	struct outQueue *q = &cs->queue;
+
+	if( q->auStart >= q->tail )
+		q->head = q->auStart;
+	q->auStart = q->head;
+	q->dropping = q->keyframes;
+	q->overflowed = q->keyUnit = q->shedding = q->stalled = false;
+
+	cs->fedTo = cs->chunkBase = cs->scan.offset;
+	cs->holdLen = 0;
+}
+
+// Queue stream for the reader, written straight to the pipe when nothing is waiting.
+// When it doesn't fit the frame being received is dropped whole, along with the
+// frames after it until the next keyframe, as they would reference it. A keyframe
+// that doesn't fit cuts the GOP queued before it short instead, see queueCutGop(),
+// and stalls the input for what still doesn't fit.
+void queueAdd(struct channelState *cs, const unsigned char *buf, size_t len)
+{
+	struct outQueue *q = &cs->queue;
+	struct channelMetrics *m = &g_metrics[cs->channel];
+	ssize_t written;
+	size_t pos;
+	size_t part;
+
+	// Nobody is reading, start them on a keyframe once they are
+	if( cs->outPipe == -1 )
+	{
+		q->dropping = q->keyframes;
+		metricAdd(&m->droppedNoReader, len);
+		return;
+	}
+
+	// A frame nothing references being shed, see queueNal()
+	if( q->shedding )
+	{
+		q->droppedBytes += len;
+		metricAdd(&m->droppedSlow, len);
+		return;
+	}
+
+	// A stream without keyframes (not H.264) can only resume anywhere
+	if( q->dropping && (q->keyframes || !queueResume(cs, false)) )
+	{
+		if( q->overflowed )
+		{
+			q->droppedBytes += len;
+			metricAdd(&m->droppedSlow, len);
+		}
+		else
+			metricAdd(&m->droppedNoReader, len);
+		return;
+	}
+
+	// Errors are left to flushQueue, which sees them again
+	if( q->head == q->tail && (written = write(cs->outPipe, buf, len)) > 0 )
+	{
+		q->head += written;
+		q->tail += written;
+		buf += written;
+		len -= written;
+	}
+
+	if( len == 0 )
+		return;
+
+	if( q->head - q->tail + len > q->size && q->keyUnit )
+		queueCutGop(cs);
+
+	// What still doesn't fit of a keyframe goes past size and the socket isn't read
+	// until the reader has taken the queue back under it. The rest of the chunk always fits.
+	if( q->head - q->tail + len > q->size && q->keyUnit && !q->stalled )
+		queueStall(cs, true);
+
+	if( q->head - q->tail + len > (q->stalled ? q->room : q->size) )
+	{
+		// Take back what was queued of this frame, unless the reader already has part of it
+		if( q->auStart >= q->tail )
+		{
+			q->droppedBytes += q->head - q->auStart;
+			metricAdd(&m->droppedSlow, q->head - q->auStart);
+			q->head = q->auStart;
+		}
+		q->droppedBytes += len;
+		q->droppedUnits++;
+		metricAdd(&m->droppedSlow, len);
+		metricAdd(&m->droppedFrames, 1);
+		metricAdd(&m->shedGops, 1);
+		q->dropping = q->overflowed = true;
+
+		if( globalArgs.verbose )
+			printMessage(true, "\nCh %i: %s", cs->channel+1, "Reader isn't reading fast enough, dropping frames until the next keyframe. Not enough processing power?\n");
+		return;
+	}
+
+	pos = q->head % q->room;
+	part = q->room - pos;
+	if( part > len )
+		part = len;
+
+	memcpy(q->data + pos, buf, part);
+	memcpy(q->data, buf + part, len - part);
+	q->head += len;
+}
+
+// Pass the received stream up to offset to on to the queue,
+// bytes held back from the last chunk first
+void queueFeed(struct channelState *cs, unsigned long long to)
+{
+	if( cs->fedTo < to && cs->fedTo < cs->chunkBase )
+	{
+		size_t held = cs->chunkBase - cs->fedTo;
+		size_t len = to - cs->fedTo < held ? to - cs->fedTo : held;
+
+		queueAdd(cs, cs->hold + cs->holdLen - held, len);
+		cs->fedTo += len;
+	}
+
+	if( cs->fedTo < to )
+	{
+		queueAdd(cs, cs->chunk + (cs->fedTo - cs->chunkBase), to - cs->fedTo);
+		cs->fedTo = to;
+	}
+}
+
+// Stop dropping if there is a reader with room for the stream again.
+// After an overflow wait for it to take half the queue, so it isn't overrun again straight away,
+// unless this is a keyframe: it always goes and makes room for itself if it has to.
+bool queueResume(struct channelState *cs, bool keyframe)
+{
+	struct outQueue *q = &cs->queue;
+
+	if( cs->outPipe == -1 || (q->overflowed && !keyframe && q->head - q->tail > q->size / 2) )
+		return false;
+
+	if( q->overflowed && globalArgs.verbose )
+		printMessage(true, "\nCh %i: Output queue caught up, %llu frames (%llu bytes) dropped so far\n",
+			cs->channel+1, q->droppedUnits, q->droppedBytes);
+
+	q->dropping = q->overflowed = false;
+	q->auStart = q->head;
+	q->units[q->unitCount++ % QUEUE_UNITS] = q->head;
+	return true;
+}
+
+// Make room for a keyframe that doesn't fit: the access units queued after the one
+// the reader is in are dropped and what there is of the keyframe moves up behind it.
+// What the reader gets is the start of the GOP, then the next one, both decodable.
+// With nothing queued after the reader's frame there is nothing to cut, queueAdd()
+// stalls the input for the keyframe instead.
+void queueCutGop(struct channelState *cs)
+{
+	struct outQueue *q = &cs->queue;
+	struct channelMetrics *m = &g_metrics[cs->channel];
+	unsigned long long from = q->auStart;
+	unsigned long long src, dst, cut;
+	unsigned int idx, units = 0;
+
+	for( idx=0;idx<QUEUE_UNITS && idx<q->unitCount;idx++ )
+	{
+		if( q->units[idx] >= q->tail && q->units[idx] < from )
+			from = q->units[idx];
+	}
+
+	if( from == q->auStart )
+		return;
+
+	for( src=q->auStart, dst=from;src<q->head; )
+	{
+		size_t part = q->head - src;
+
+		if( part > q->room - src % q->room )
+			part = q->room - src % q->room;
+		if( part > q->room - dst % q->room )
+			part = q->room - dst % q->room;
+
+		memmove(q->data + dst % q->room, q->data + src % q->room, part);
+		src += part;
+		dst += part;
+	}
+
+	cut = q->auStart - from;
+	for( idx=0;idx<QUEUE_UNITS && idx<q->unitCount;idx++ )
+	{
+		if( q->units[idx] == ULLONG_MAX )
+			continue;
+		if( q->units[idx] >= q->auStart )
+			q->units[idx] -= cut;
+		else if( q->units[idx] >= from )
+		{
+			q->units[idx] = ULLONG_MAX;
+			units++;
+		}
+	}
+
+	q->head -= cut;
+	q->auStart = from;
+	q->droppedBytes += cut;
+	q->droppedUnits += units;
+	metricAdd(&m->droppedSlow, cut);
+	metricAdd(&m->droppedFrames, units);
+	metricAdd(&m->shedGops, 1);
+
+	if( globalArgs.verbose )
+		printMessage(true, "\nCh %i: Output queue full, cut %u frames off the GOP before a keyframe\n", cs->channel+1, units);
+}
+
+// Everything before a NAL unit belongs to the previous one, so the queue
+// always sees frame boundaries before the data that follows them
+void queueNal(struct channelState *cs, const struct nalUnit *nal)
+{
+	struct outQueue *q = &cs->queue;
+	struct channelMetrics *m = &g_metrics[cs->channel];
+	bool keyframe = nal->type == NAL_SPS || (nal->type == NAL_IDR && nal->firstSlice);
+
+	queueFeed(cs, nal->start);
+
+	if( keyframe )
+		q->keyframes = true;
+
+	// Resume on a keyframe, whatever came before it in its access unit is optional
+	if( q->dropping && keyframe && queueResume(cs, true) )
+	{
+		q->keyUnit = true;
+		q->shedding = false;
+		return;
+	}
+
+	if( nal->newAccessUnit )
+	{
+		q->auStart = q->head;
+		q->keyUnit = q->shedding = false;
+		if( !q->dropping )
+			q->units[q->unitCount++ % QUEUE_UNITS] = q->head;
+		if( q->dropping && q->overflowed )
+		{
+			q->droppedUnits++;
+			metricAdd(&m->droppedFrames, 1);
+		}
+	}
+
+	if( nal->type == NAL_SPS || nal->type == NAL_PPS || nal->type == NAL_IDR )
+		q->keyUnit = true;
+
+	// Once half the queue is waiting, frames nothing references are dropped whole so
+	// the ones that are referenced still fit, unless the reader has some of it already
+	if( nal->type == NAL_SLICE && nal->firstSlice && nal->refIdc == 0 && !q->keyUnit && !q->dropping &&
+		!q->shedding && cs->outPipe != -1 && q->auStart >= q->tail && q->head - q->tail > q->size / 2 )
+	{
+		q->droppedBytes += q->head - q->auStart;
+		q->droppedUnits++;
+		metricAdd(&m->droppedSlow, q->head - q->auStart);
+		metricAdd(&m->droppedFrames, 1);
+		metricAdd(&m->shedFrames, 1);
+		q->head = q->auStart;
+		q->shedding = true;
+	}
+}
+
+// The chunk has been scanned, pass all of it on except a start code at its end,
+// its NAL unit is only known once the next chunk is scanned
+void queueChunkDone(struct channelState *cs, size_t len)
+{
+	unsigned long long end = cs->chunkBase + len;
+	unsigned long long from = cs->scan.pending ? cs->scan.pendingStart : end - cs->scan.zeros;
+	unsigned char hold[sizeof(cs->hold)];
+	unsigned long long pos;
+
+	if( from < cs->fedTo )
+		from = cs->fedTo;
+
+	queueFeed(cs, from);
+
+	for( pos=from;pos<end;pos++ )
+	{
+		if( pos < cs->chunkBase )
+			hold[pos - from] = cs->hold[cs->holdLen - (cs->chunkBase - pos)];
+		else
+			hold[pos - from] = cs->chunk[pos - cs->chunkBase];
+	}
+
+	memcpy(cs->hold, hold, end - from);
+	cs->holdLen = end - from;
+}
+
+// Write queued stream to the pipe.
+// Returns 0 once the queue is empty, 1 if the pipe is full and -1 if the channel was reset.
+int flushQueue(struct channelState *cs)
+{
+	struct outQueue *q = &cs->queue;
+	ssize_t written;
+
+	while( q->tail < q->head )
+	{
+		size_t pos = q->tail % q->room;
+		size_t part = q->room - pos;
+
+		if( part > q->head - q->tail )
+			part = q->head - q->tail;
+
+		written = write(cs->outPipe, q->data + pos, part);
+
+		if( written == -1 && errno == EINTR )
+			continue;
+
+		if( written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+		{
+			metricSet(&g_metrics[cs->channel].queued, q->head - q->tail);
+			blockOutput(cs, true);
+			return 1;
+		}
+
+		// reader closed the pipe, wait for it to be opened again.
+		if( written <= 0 )
+		{
+			if( globalArgs.verbose )
+			{
+				sprintf(g_errBuf, "Ch %i: %s", cs->channel+1, "Pipe closed");
+				perror(g_errBuf);
+			}
+#ifndef DOMAIN_SOCKETS
+			resetChannel(cs, false, 0);
+#else
+			resetChannel(cs, true, 0);
+#endif
+			return -1;
+		}
+
+		q->tail += written;
+		if( q->stalled && q->head - q->tail <= q->size )
+			queueStall(cs, false);
+	}
+
+	metricSet(&g_metrics[cs->channel].queued, 0);
+	return 0;
+}
+
+// Create the shared memory export of a channel, sized for seconds at kbps.
+// A stale file is unlinked first rather than truncated, readers still
+// mapping it would fault otherwise.
+int shmCreate(struct channelState *cs, int seconds, int kbps)
+{
+	size_t size = (size_t)seconds * kbps * 1000 / 8;
+	void *map;
+	int fd;
+
+	sprintf(cs->shmName, "/dev/shm/%s%i", globalArgs.pipeName, cs->channel);
+	unlink(cs->shmName);
+
+	fd = open(cs->shmName, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if( fd == -1 )
+		return 1;
+
+	if( ftruncate(fd, ZSHM_DATA_OFFSET + size) == -1 )
+	{
+		close(fd);
+		unlink(cs->shmName);
+		return 1;
+	}
+
+	map = mmap(NULL, ZSHM_DATA_OFFSET + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED )
+	{
+		unlink(cs->shmName);
+		return 1;
+	}
+
+	cs->shm = map;
+	cs->shmData = (unsigned char*)map + ZSHM_DATA_OFFSET;
+	cs->shm->dataOffset = ZSHM_DATA_OFFSET;
+	cs->shm->keyCount = ZSHM_KEYS;
+	cs->shm->size = size;
+	cs->shm->channel = cs->channel;
+	cs->shm->pid = getpid();
+	cs->shm->version = ZSHM_VERSION;
+	__atomic_store_n(&cs->shm->magic, ZSHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// Tell readers the producer is gone and remove the export
+void shmClose(struct channelState *cs)
+{
+	if( cs->shm == NULL )
+		return;
+
+	__atomic_store_n(&cs->shm->pid, 0, __ATOMIC_RELEASE);
+	munmap(cs->shm, ZSHM_DATA_OFFSET + cs->shm->size);
+	unlink(cs->shmName);
+	cs->shm = NULL;
+	cs->shmData = NULL;
+}
+
+// A new DVR connection starts a new stream at the current head
+void shmRestart(struct channelState *cs)
+{
+	cs->shmDelta = cs->scan.offset - cs->shm->head;
+	cs->shm->streamStart = cs->shm->head;
+	__atomic_add_fetch(&cs->shm->generation, 1, __ATOMIC_RELEASE);
+}
+
+// Copy received data into the export, then publish it by moving head
+void shmAppend(struct channelState *cs, const char *buf, size_t len)
+{
+	struct zshmHeader *shm = cs->shm;
+	unsigned long long head = shm->head;
+	size_t pos;
+	size_t part;
+
+	// Only the tail of an oversized chunk survives anyway
+	if( len > shm->size )
+	{
+		buf += len - shm->size;
+		head += len - shm->size;
+		len = shm->size;
+	}
+
+	pos = head % shm->size;
+	part = shm->size - pos;
+	if( part > len )
+		part = len;
+
+	// Readers must learn the old data is going before it is overwritten
+	__atomic_store_n(&shm->writing, head + len, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(cs->shmData + pos, buf, part);
+	memcpy(cs->shmData, buf + part, len - part);
+	__atomic_store_n(&shm->head, head + len, __ATOMIC_RELEASE);
+}
+
+// Index a keyframe, offset is where the scanner found its access unit
+void shmAddKey(struct channelState *cs, unsigned long long offset)
+{
+	struct zshmHeader *shm = cs->shm;
+
+	__atomic_store_n(&shm->keys[shm->keyHead % shm->keyCount], offset - cs->shmDelta, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->keyHead, shm->keyHead + 1, __ATOMIC_RELEASE);
+}
+
+// Open or create the segment files of a channel's recording, mb in total, and carry on
+// after the newest segment a previous run left. Each file is allocated in full once.
+int recordInit(struct channelState *cs, const char *dir, int mb)
+{
+	struct recordStore *rec = &cs->record;
+	size_t total = (size_t)mb << 20;
+	unsigned long long newest = 0;
+	char name[512];
+	void *map;
+	int loopIdx;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->cur = rec->syncFd = -1;
+
+	rec->count = (total + RECORD_MAX_SEGMENT - 1) / RECORD_MAX_SEGMENT;
+	if( rec->count < RECORD_MIN_SEGMENTS )
+		rec->count = RECORD_MIN_SEGMENTS;
+	rec->segSize = total / rec->count / RECORD_WRITE_SIZE * RECORD_WRITE_SIZE;
+	if( rec->segSize == 0 )
+	{
+		printMessage(false, "Ch %i: -W has to be at least %i MB\n", cs->channel+1, RECORD_MIN_SEGMENTS * RECORD_WRITE_SIZE >> 20);
+		rec->count = 0;
+		errno = EINVAL;
+		return 1;
+	}
+
+	rec->fds = malloc(rec->count * sizeof(int));
+	rec->index = calloc(rec->count, sizeof(*rec->index));
+	if( rec->fds == NULL || rec->index == NULL )
+	{
+		free(rec->fds);
+		free(rec->index);
+		rec->count = 0;
+		return 1;
+	}
+	for( loopIdx=0;loopIdx<rec->count;loopIdx++ )
+		rec->fds[loopIdx] = -1;
+	rec->segment = rec->count - 1;
+
+	for( loopIdx=0;loopIdx<rec->count;loopIdx++ )
+	{
+		struct zrecHeader hdr;
+		off_t fileSize = ZREC_DATA_OFFSET + rec->segSize;
+		int err;
+
+		sprintf(name, "%s/%s%i-%i.seg", dir, globalArgs.pipeName, cs->channel, loopIdx);
+		rec->fds[loopIdx] = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if( rec->fds[loopIdx] == -1 )
+		{
+			recordFree(cs);
+			return 1;
+		}
+
+		if( pread(rec->fds[loopIdx], &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == ZREC_MAGIC &&
+			hdr.channel == cs->channel && hdr.sequence > newest )
+		{
+			newest = hdr.sequence;
+			rec->segment = loopIdx;
+		}
+
+		// Reserve the blocks up front, so the writes never have to allocate
+		if( ftruncate(rec->fds[loopIdx], fileSize) == -1 )
+		{
+			recordFree(cs);
+			return 1;
+		}
+		if( fallocate(rec->fds[loopIdx], 0, 0, fileSize) == -1 && (errno != EOPNOTSUPP ||
+			(err = posix_fallocate(rec->fds[loopIdx], 0, fileSize)) != 0) )
+		{
+			if( errno == EOPNOTSUPP )
+				errno = err;
+			recordFree(cs);
+			return 1;
+		}
+
+		// The index is written in place, the writer thread only updates the header's count
+		map = mmap(NULL, ZREC_DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fds[loopIdx], 0);
+		if( map == MAP_FAILED )
+		{
+			recordFree(cs);
+			return 1;
+		}
+		rec->index[loopIdx] = (struct zrecIndexEntry*)((char*)map + ZREC_INDEX_OFFSET);
+	}
+
+	for( loopIdx=0;loopIdx<RECORD_BUFFERS;loopIdx++ )
+	{
+		if( posix_memalign((void**)&rec->bufs[loopIdx], 4096, RECORD_WRITE_SIZE) != 0 )
+		{
+			rec->bufs[loopIdx] = NULL;
+			recordFree(cs);
+			errno = ENOMEM;
+			return 1;
+		}
+	}
+
+	rec->hdr.sequence = newest;
+	rec->cur = 0;
+	recordBegin(cs);
+
+	return 0;
+}
+
+// Hand over what is left, the writer thread is stopped afterwards
+void recordClose(struct channelState *cs)
+{
+	if( cs->record.count == 0 )
+		return;
+
+	recordSubmit(cs, true);
+}
+
+// Only once the writer thread is done with the blocks
+void recordFree(struct channelState *cs)
+{
+	struct recordStore *rec = &cs->record;
+	int loopIdx;
+
+	for( loopIdx=0;loopIdx<rec->count;loopIdx++ )
+	{
+		if( rec->fds[loopIdx] != -1 )
+			close(rec->fds[loopIdx]);
+		if( rec->index[loopIdx] )
+			munmap((char*)rec->index[loopIdx] - ZREC_INDEX_OFFSET, ZREC_DATA_OFFSET);
+	}
+	for( loopIdx=0;loopIdx<RECORD_BUFFERS;loopIdx++ )
+		free(rec->bufs[loopIdx]);
+
+	free(rec->fds);
+	free(rec->index);
+	memset(rec, 0, sizeof(*rec));
+}
+
+// A block the writer isn't busy with, other than the one being filled. -1 if there is none.
+int recordTake(struct recordStore *rec)
+{
+	int found = -1;
+	int loopIdx;
+
+	pthread_mutex_lock(&g_recordLock);
+	for( loopIdx=0;loopIdx<RECORD_BUFFERS && found == -1;loopIdx++ )
+	{
+		if( !rec->busy[loopIdx] && loopIdx != rec->cur )
+			found = loopIdx;
+	}
+	pthread_mutex_unlock(&g_recordLock);
+
+	return found;
+}
+
+// Move on to the next segment, overwriting the oldest. Its header is rewritten
+// straight away, so the old stream in it isn't taken for part of the new one.
+void recordBegin(struct channelState *cs)
+{
+	struct recordStore *rec = &cs->record;
+	struct recordJob *job;
+
+	rec->segment = (rec->segment + 1) % rec->count;
+	rec->hdr.magic = ZREC_MAGIC;
+	rec->hdr.version = ZREC_VERSION;
+	rec->hdr.dataOffset = ZREC_DATA_OFFSET;
+	rec->hdr.channel = cs->channel;
+	rec->hdr.sequence++;
+	rec->hdr.size = rec->segSize;
+	rec->hdr.length = 0;
+	rec->hdr.startTime = rec->hdr.endTime = wallMs();
+	rec->hdr.closed = 0;
+	rec->hdr.indexOffset = ZREC_INDEX_OFFSET;
+	rec->hdr.indexCount = 0;
+	rec->lastMark = 0;
+
+	// If the queue is that far behind the first block carries the header instead
+	pthread_mutex_lock(&g_recordLock);
+	if( g_recordHead - g_recordTail < RECORD_JOBS / 2 )
+	{
+		job = &g_recordJobs[g_recordHead++ % RECORD_JOBS];
+		job->rec = rec;
+		job->channel = cs->channel;
+		job->fd = rec->fds[rec->segment];
+		job->buf = -1;
+		job->offset = 0;
+		job->len = 0;
+		job->hdr = rec->hdr;
+		pthread_cond_signal(&g_recordCond);
+	}
+	pthread_mutex_unlock(&g_recordLock);
+}
+
+// Queue the block being filled for writing, with the segment's header updated to include it.
+// The last block of a segment is padded to a whole page and the header marked closed.
+void recordSubmit(struct channelState *cs, bool last)
+{
+	struct recordStore *rec = &cs->record;
+	struct recordJob *job;
+	size_t len = rec->cur != -1 ? rec->curLen : 0;
+	size_t padded = (len + 4095) & ~(size_t)4095;
+
+	// Without data only a closing header is written
+	if( len == 0 && !last )
+		return;
+
+	if( padded )
+		memset(rec->bufs[rec->cur] + len, 0, padded - len);
+	rec->hdr.length += len;
+	rec->hdr.endTime = wallMs();
+	rec->hdr.closed = last;
+
+	pthread_mutex_lock(&g_recordLock);
+	job = &g_recordJobs[g_recordHead++ % RECORD_JOBS];
+	job->rec = rec;
+	job->channel = cs->channel;
+	job->fd = rec->fds[rec->segment];
+	job->buf = padded ? rec->cur : -1;
+	job->offset = ZREC_DATA_OFFSET + rec->hdr.length - len;
+	job->len = padded;
+	job->hdr = rec->hdr;
+	if( padded )
+		rec->busy[rec->cur] = true;
+	pthread_cond_signal(&g_recordCond);
+	pthread_mutex_unlock(&g_recordLock);
+
+	rec->curStart += len;
+	rec->curLen = 0;
+	if( padded )
+		rec->cur = -1;
+}
+
+// End the segment at a stream offset and start the next one there. What the
+// block being filled holds past the cut moves to the new segment, a cut before
+// the block (an access unit that began in a block already written) is made at its start.
+void recordRotate(struct channelState *cs, unsigned long long cut)
+{
+	struct recordStore *rec = &cs->record;
+	size_t tail = 0;
+	int next = -1;
+
+	rec->cutPending = false;
+
+	if( rec->cur != -1 )
+	{
+		if( cut < rec->curStart )
+			cut = rec->curStart;
+		if( cut > rec->curStart + rec->curLen )
+			cut = rec->curStart + rec->curLen;
+
+		tail = rec->curStart + rec->curLen - cut;
+		rec->curLen -= tail;
+	}
+
+	// A block left with nothing of the old segment keeps the tail where it is
+	if( rec->cur != -1 && rec->curLen > 0 && tail > 0 )
+	{
+		next = recordTake(rec);
+		if( next != -1 )
+			memcpy(rec->bufs[next], rec->bufs[rec->cur] + rec->curLen, tail);
+		else
+			metricAdd(&g_metrics[cs->channel].droppedDisk, tail);
+	}
+
+	recordSubmit(cs, true);
+	recordBegin(cs);
+
+	if( rec->cur == -1 )
+	{
+		rec->cur = next;
+		rec->curLen = next != -1 ? tail : 0;
+	}
+	else
+		rec->curLen = tail;
+	rec->curStart = cut;
+}
+
+// Record a received chunk, offset is its position in the stream
+void recordAppend(struct channelState *cs, const char *buf, size_t len, unsigned long long offset)
+{
+	struct recordStore *rec = &cs->record;
+
+	while( len > 0 )
+	{
+		size_t part = len;
+
+		// A keyframe in this chunk starts the next segment
+		if( rec->cutPending )
+		{
+			if( rec->cut <= offset )
+			{
+				recordRotate(cs, rec->cut);
+				continue;
+			}
+			if( rec->cut - offset < part )
+				part = rec->cut - offset;
+		}
+
+		// Segment or its index full without a keyframe in sight
+		if( rec->hdr.length + rec->curLen >= rec->segSize || rec->hdr.indexCount >= ZREC_INDEX_ENTRIES )
+		{
+			recordRotate(cs, offset);
+			continue;
+		}
+
+		if( rec->cur == -1 && (rec->cur = recordTake(rec)) != -1 )
+		{
+			rec->curStart = offset;
+			rec->curLen = 0;
+		}
+
+		// Index the keyframes found in the chunk as their access units are reached
+		while( rec->keyCount > 0 && rec->keys[0].offset <= offset )
+		{
+			if( rec->cur != -1 )
+				recordIndex(rec, rec->keys[0].offset, rec->keys[0].time, ZREC_KEYFRAME);
+			memmove(rec->keys, rec->keys + 1, --rec->keyCount * sizeof(rec->keys[0]));
+		}
+		if( rec->keyCount > 0 && rec->keys[0].offset - offset < part )
+			part = rec->keys[0].offset - offset;
+
+		if( rec->cur != -1 && cs->recvTime - rec->lastMark >= ZREC_MARK_INTERVAL )
+			recordIndex(rec, offset, cs->recvTime, 0);
+
+		// The disk is behind and every block is waiting for it
+		if( rec->cur == -1 )
+		{
+			metricAdd(&g_metrics[cs->channel].droppedDisk, part);
+			buf += part;
+			offset += part;
+			len -= part;
+			continue;
+		}
+
+		if( part > RECORD_WRITE_SIZE - rec->curLen )
+			part = RECORD_WRITE_SIZE - rec->curLen;
+
+		memcpy(rec->bufs[rec->cur] + rec->curLen, buf, part);
+		rec->curLen += part;
+		buf += part;
+		offset += part;
+		len -= part;
+
+		if( rec->curLen == RECORD_WRITE_SIZE )
+			recordSubmit(cs, false);
+	}
+}
+
+// Segments end on the first keyframe once they are nearly full, so each starts on one.
+// The keyframe is indexed when its stream is recorded.
+void recordKey(struct channelState *cs, unsigned long long offset)
+{
+	struct recordStore *rec = &cs->record;
+
+	if( rec->keyCount < RECORD_PENDING_KEYS )
+	{
+		rec->keys[rec->keyCount].offset = offset;
+		rec->keys[rec->keyCount].time = cs->recvTime;
+		rec->keyCount++;
+	}
+
+	if( !rec->cutPending && rec->hdr.length + rec->curLen >= rec->segSize - rec->segSize / 8 )
+	{
+		rec->cut = offset;
+		rec->cutPending = true;
+	}
+}
+
+// Add an index entry for a stream offset in the block being filled, or shortly before it
+void recordIndex(struct recordStore *rec, unsigned long long offset, long long time, unsigned int flags)
+{
+	struct zrecIndexEntry *entry;
+
+	// An access unit that began in the previous segment
+	if( rec->hdr.indexCount >= ZREC_INDEX_ENTRIES || offset + rec->hdr.length < rec->curStart )
+		return;
+
+	entry = &rec->index[rec->segment][rec->hdr.indexCount++];
+	entry->time = time;
+	entry->offset = rec->hdr.length + offset - rec->curStart;
+	entry->flags = flags;
+	rec->lastMark = time;
+}
+
+// The writer thread takes no signals, they're for the streaming thread
+int recordStartWriter(void)
+{
+	sigset_t all, old;
+	int retval;
+
+	g_recordStop = false;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	retval = pthread_create(&g_recordThread, NULL, recordWriter, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	g_recordRunning = (retval == 0);
+	return retval;
+}
+
+// Let the writer finish what is queued and wait for it
+void recordStopWriter(void)
+{
+	if( !g_recordRunning )
+		return;
+
+	pthread_mutex_lock(&g_recordLock);
+	g_recordStop = true;
+	pthread_cond_signal(&g_recordCond);
+	pthread_mutex_unlock(&g_recordLock);
+
+	pthread_join(g_recordThread, NULL);
+	g_recordRunning = false;
+}
+
+// Write the queued blocks in order, the channels never wait for the disk
+void *recordWriter(void *arg)
+{
+	struct recordJob job;
+
+	pthread_mutex_lock(&g_recordLock);
+	while( true )
+	{
+		if( g_recordHead == g_recordTail )
+		{
+			if( g_recordStop )
+				break;
+			pthread_cond_wait(&g_recordCond, &g_recordLock);
+			continue;
+		}
+
+		job = g_recordJobs[g_recordTail % RECORD_JOBS];
+		pthread_mutex_unlock(&g_recordLock);
+
+		recordWrite(&job);
+
+		pthread_mutex_lock(&g_recordLock);
+		g_recordTail++;
+		if( job.buf != -1 )
+			job.rec->busy[job.buf] = false;
+	}
+	pthread_mutex_unlock(&g_recordLock);
+
+	return NULL;
+}
+
+// Write a block and then its segment's header. Writeback of the block is started
+// right away and the block before it is dropped from the page cache, so dirty pages
+// don't pile up and go out in bursts, and the recording doesn't push everything else out.
+void recordWrite(struct recordJob *job)
+{
+	struct recordStore *rec = job->rec;
+	char errBuf[64];
+	size_t done = 0;
+	ssize_t written;
+
+	while( job->buf != -1 && done < job->len )
+	{
+		written = pwrite(job->fd, rec->bufs[job->buf] + done, job->len - done, job->offset + done);
+		if( written == -1 && errno == EINTR )
+			continue;
+		if( written <= 0 )
+		{
+			sprintf(errBuf, "Ch %i: Recording write failed", job->channel+1);
+			perror(errBuf);
+			metricAdd(&g_metrics[job->channel].droppedDisk, job->len - done);
+			break;
+		}
+		done += written;
+	}
+
+	if( pwrite(job->fd, &job->hdr, sizeof(job->hdr), 0) != sizeof(job->hdr) )
+	{
+		sprintf(errBuf, "Ch %i: Recording header write failed", job->channel+1);
+		perror(errBuf);
+	}
+
+	if( done == 0 )
+		return;
+
+	metricAdd(&g_metrics[job->channel].recorded, done);
+
+	sync_file_range(job->fd, job->offset, done, SYNC_FILE_RANGE_WRITE);
+	if( rec->syncFd != -1 )
+	{
+		sync_file_range(rec->syncFd, rec->syncFrom, rec->syncLen,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(rec->syncFd, rec->syncFrom, rec->syncLen, POSIX_FADV_DONTNEED);
+	}
+	rec->syncFd = job->fd;
+	rec->syncFrom = job->offset;
+	rec->syncLen = done;
+}
+
+// Counters are only ever written by the channel's own process, relaxed is enough
+void metricAdd(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void metricSet(long long *gauge, long long value)
+{
+	__atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+// Allocate the counters in memory the fork mode children keep sharing with the parent
+int metricsInit(void)
+{
+	g_metrics = mmap(NULL, sizeof(struct channelMetrics) * MAX_CHANNELS, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if( g_metrics == MAP_FAILED )
+	{
+		g_metrics = NULL;
+		perror("Failed to allocate metrics");
+		return 1;
+	}
+
+	return 0;
+}
+
+int snapshotInit(void)
+{
+	g_snapshot = mmap(NULL, sizeof(struct alarmSnapshot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if( g_snapshot == MAP_FAILED )
+	{
+		g_snapshot = NULL;
+		perror("Failed to allocate the alarm snapshot");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Listen on 127.0.0.1:<addr>, or on a unix socket if addr is a path
+int metricsListen(const char *addr)
+{
+	struct sockaddr_un unixAddr;
+	struct sockaddr_in inetAddr;
+	int flag = true;
+	int retval;
+
+	if( addr[0] == '/' )
+	{
+		memset(&unixAddr, 0, sizeof(unixAddr));
+		unixAddr.sun_family = AF_UNIX;
+		strncpy(unixAddr.sun_path, addr, sizeof(unixAddr.sun_path) - 1);
+		unlink(addr);
+
+		g_metricsFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		retval = g_metricsFd == -1 ? -1 : bind(g_metricsFd, (struct sockaddr*)&unixAddr, sizeof(unixAddr));
+	}
+	else
+	{
+		memset(&inetAddr, 0, sizeof(inetAddr));
+		inetAddr.sin_family = AF_INET;
+		inetAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		inetAddr.sin_port = htons(atoi(addr));
+
+		g_metricsFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if( g_metricsFd != -1 )
+			setsockopt(g_metricsFd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
+		retval = g_metricsFd == -1 ? -1 : bind(g_metricsFd, (struct sockaddr*)&inetAddr, sizeof(inetAddr));
+	}
+
+	if( retval == -1 || listen(g_metricsFd, 4) == -1 )
+	{
+		perror("Failed to listen for metrics requests");
+		if( g_metricsFd != -1 )
+			close(g_metricsFd);
+		g_metricsFd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Metrics server thread, answers every connection with the current counters
+// as an HTTP response so Prometheus (or curl --unix-socket) can scrape it.
+// It never touches channel state, so the streaming loop isn't held up.
+void *metricsServe(void *arg)
+{
+	char body[METRICS_BUF_SIZE];
+	char header[128];
+	struct timeval tv;
+	size_t bodyLen;
+	int headerLen;
+	int fd;
+
+	tv.tv_sec = 1;		// Don't let a client that never sends its request stall the others
+	tv.tv_usec = 0;
+
+	while( true )
+	{
+		fd = accept(g_metricsFd, NULL, NULL);
+		if( fd == -1 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			perror("Metrics server stopped");
+			return NULL;
+		}
+
+		// Whatever was asked for, the request is only read so closing doesn't reset the connection
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+		if( recv(fd, body, sizeof(body), 0) >= 0 )
+		{
+			bodyLen = metricsFormat(body, sizeof(body));
+			headerLen = sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)bodyLen);
+
+			if( send(fd, header, headerLen, MSG_NOSIGNAL) == headerLen )
+				send(fd, body, bodyLen, MSG_NOSIGNAL);
+		}
+		close(fd);
+	}
+}
+
+// Write the counters of every channel in Prometheus text format, returns the length
+size_t metricsFormat(char *buf, size_t size)
+{
+	static const struct
+	{
+		const char *name;
+		const char *type;
+		const char *help;
+		const char *labels;	// besides channel
+		size_t offset;
+		int scale;		// divisor to get to the base unit
+	} metrics[] = {
+		{ "zmodopipe_received_bytes_total", "counter", "Stream bytes received from the DVR.", "",
+			offsetof(struct channelMetrics, bytes), 1 },
+		{ "zmodopipe_received_packets_total", "counter", "Reads from the DVR that returned data.", "",
+			offsetof(struct channelMetrics, packets), 1 },
+		{ "zmodopipe_dropped_bytes_total", "counter", "Stream bytes not passed on to the reader.", ",reason=\"slow_reader\"",
+			offsetof(struct channelMetrics, droppedSlow), 1 },
+		{ "zmodopipe_dropped_bytes_total", "counter", "", ",reason=\"no_reader\"",
+			offsetof(struct channelMetrics, droppedNoReader), 1 },
+		{ "zmodopipe_dropped_bytes_total", "counter", "", ",reason=\"slow_disk\"",
+			offsetof(struct channelMetrics, droppedDisk), 1 },
+		{ "zmodopipe_dropped_frames_total", "counter", "Whole frames dropped from the output queue.", "",
+			offsetof(struct channelMetrics, droppedFrames), 1 },
+		{ "zmodopipe_shed_frames_total", "counter", "Non-reference frames the output queue shed under pressure.", "",
+			offsetof(struct channelMetrics, shedFrames), 1 },
+		{ "zmodopipe_shed_gops_total", "counter", "GOPs the output queue cut short, the frames after the cut dropped.", "",
+			offsetof(struct channelMetrics, shedGops), 1 },
+		{ "zmodopipe_recorded_bytes_total", "counter", "Stream bytes written to the continuous recording.", "",
+			offsetof(struct channelMetrics, recorded), 1 },
+		{ "zmodopipe_logins_total", "counter", "Successful DVR logins.", "",
+			offsetof(struct channelMetrics, logins), 1 },
+		{ "zmodopipe_login_failures_total", "counter", "Failed DVR connects and logins.", "",
+			offsetof(struct channelMetrics, loginFailures), 1 },
+		{ "zmodopipe_reconnects_total", "counter", "Connections lost or reset after a login.", "",
+			offsetof(struct channelMetrics, reconnects), 1 },
+		{ "zmodopipe_login_duration_seconds", "gauge", "Time the last connect and login took.", "",
+			offsetof(struct channelMetrics, loginMs), 1000 },
+		{ "zmodopipe_queued_bytes", "gauge", "Stream bytes waiting for the reader.", "",
+			offsetof(struct channelMetrics, queued), 1 },
+		{ "zmodopipe_activity", "gauge", "Motion seen in the compressed stream over the last second, 0 for a still scene.", "",
+			offsetof(struct channelMetrics, activity), 1000 },
+		{ "zmodopipe_up", "gauge", "1 while the channel is logged in.", "",
+			offsetof(struct channelMetrics, streaming), 1 },
+	};
+	long long now = nowMs();
+	size_t len = 0;
+	unsigned int idx;
+	int loopIdx;
+
+	for( idx=0;idx<sizeof(metrics)/sizeof(metrics[0]);idx++ )
+	{
+		if( metrics[idx].help[0] )
+			len += snprintf(buf + len, len < size ? size - len : 0, "# HELP %s %s\n# TYPE %s %s\n",
+				metrics[idx].name, metrics[idx].help, metrics[idx].name, metrics[idx].type);
+
+		for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+		{
+			unsigned long long value;
+
+			// add and remove flip it on the streaming loop meanwhile
+			if( !__atomic_load_n(&globalArgs.channel[loopIdx], __ATOMIC_RELAXED) )
+				continue;
+
+			value = __atomic_load_n((unsigned long long*)((char*)&g_metrics[loopIdx] + metrics[idx].offset), __ATOMIC_RELAXED);
+
+			if( metrics[idx].scale == 1 )
+				len += snprintf(buf + len, len < size ? size - len : 0, "%s{channel=\"%i\"%s} %llu\n",
+					metrics[idx].name, loopIdx+1, metrics[idx].labels, value);
+			else
+				len += snprintf(buf + len, len < size ? size - len : 0, "%s{channel=\"%i\"%s} %.3f\n",
+					metrics[idx].name, loopIdx+1, metrics[idx].labels, (long long)value / (double)metrics[idx].scale);
+		}
+	}
+
+	// Age rather than a timestamp, the channels keep time with the monotonic clock
+	len += snprintf(buf + len, len < size ? size - len : 0, "# HELP zmodopipe_last_byte_age_seconds Time since the last byte was received.\n"
+		"# TYPE zmodopipe_last_byte_age_seconds gauge\n");
+
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		long long lastByte = __atomic_load_n(&g_metrics[loopIdx].lastByte, __ATOMIC_RELAXED);
+
+		if( !__atomic_load_n(&globalArgs.channel[loopIdx], __ATOMIC_RELAXED) || lastByte == 0 )
+			continue;
+
+		len += snprintf(buf + len, len < size ? size - len : 0, "zmodopipe_last_byte_age_seconds{channel=\"%i\"} %.3f\n",
+			loopIdx+1, (now - lastByte) / 1000.0);
+	}
+
+	return len < size ? len : size - 1;
+}
+
+// Listen for commands on the unix socket at path
+int controlListen(const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+
+	g_controlFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if( g_controlFd == -1 || bind(g_controlFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(g_controlFd, 4) == -1 )
+	{
+		perror("Failed to listen for commands");
+		if( g_controlFd != -1 )
+			close(g_controlFd);
+		g_controlFd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Control socket thread, takes one command line per connection and answers it
+// with one line of JSON, {"ok": true, ...} or {"ok": false, "error": "..."}.
+//   echo "reset 3" | socat - UNIX-CONNECT:/run/zmodopipe.sock
+void *controlServe(void *arg)
+{
+	struct controlRequest req;
+	struct timeval tv;
+	size_t len;
+	ssize_t got;
+	char *end;
+	int fd;
+
+	tv.tv_sec = 1;		// Don't let a client that never sends its command stall the others
+	tv.tv_usec = 0;
+
+	while( true )
+	{
+		fd = accept(g_controlFd, NULL, NULL);
+		if( fd == -1 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			perror("Control socket stopped");
+			return NULL;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+		len = 0;
+		while( len < sizeof(req.line) - 1 && (got = recv(fd, req.line + len, sizeof(req.line) - 1 - len, 0)) > 0 )
+		{
+			len += got;
+			if( memchr(req.line, '\n', len) )
+				break;
+		}
+		req.line[len] = '\0';
+		if( (end = strpbrk(req.line, "\r\n")) != NULL )
+			*end = '\0';
+
+		if( len > 0 )
+		{
+			controlRun(&req);
+			strcat(req.reply, "\n");
+			send(fd, req.reply, strlen(req.reply), MSG_NOSIGNAL);
+		}
+		close(fd);
+	}
+}
+
+// Stats and help are answered from the shared counters straight away. In -e mode the
+// others change channel state, the streaming loop runs them between its events.
+void controlRun(struct controlRequest *req)
+{
+	req->done = false;
+	req->run = NULL;
+
+	if( !globalArgs.eventLoop || strncmp(req->line, "stats", 5) == 0 || strncmp(req->line, "help", 4) == 0 )
+	{
+		controlExecute(req);
+		return;
+	}
+
+	if( !controlPost(req) )
+		snprintf(req->reply, sizeof(req->reply), "{\"ok\": false, \"error\": \"streaming loop not reachable\"}");
+}
+
+// Hand a request to the streaming loop and wait until it ran it, one request at a time.
+// False if the loop isn't taking requests (any more).
+bool controlPost(struct controlRequest *req)
+{
+	bool posted;
+
+	req->done = false;
+
+	pthread_mutex_lock(&g_controlLock);
+	while( g_controlOpen && g_controlRequest )
+		pthread_cond_wait(&g_controlCond, &g_controlLock);
+	posted = g_controlOpen;
+	if( posted )
+		g_controlRequest = req;
+	pthread_mutex_unlock(&g_controlLock);
+
+	if( !posted )
+		return false;
+
+	if( eventfd_write(g_wakeFd, 1) == -1 )
+	{
+		perror("Failed to wake up the streaming loop");
+		pthread_mutex_lock(&g_controlLock);
+		g_controlRequest = NULL;
+		pthread_cond_broadcast(&g_controlCond);
+		pthread_mutex_unlock(&g_controlLock);
+		return false;
+	}
+
+	pthread_mutex_lock(&g_controlLock);
+	while( !req->done )
+		pthread_cond_wait(&g_controlCond, &g_controlLock);
+	pthread_mutex_unlock(&g_controlLock);
+
+	return true;
+}
+
+// Run the command the control thread posted, called by the streaming loop when it wakes it up
+void controlPoll(void)
+{
+	struct controlRequest *req;
+
+	pthread_mutex_lock(&g_controlLock);
+	req = g_controlRequest;
+	pthread_mutex_unlock(&g_controlLock);
+
+	if( req == NULL )
+		return;
+
+	if( req->run )
+		req->run(req->ctx);
+	else
+		controlExecute(req);
+
+	pthread_mutex_lock(&g_controlLock);
+	req->done = true;
+	g_controlRequest = NULL;
+	pthread_cond_broadcast(&g_controlCond);
+	pthread_mutex_unlock(&g_controlLock);
+}
+
+// Carry out a command and fill in its reply. Channels are 1 based like -c.
+// In fork mode each channel is a child of this process: reset and snapshot are
+// passed on to them as the signals, the rest needs the channels in this process.
+void controlExecute(struct controlRequest *req)
+{
+	struct channelState *cs = NULL;
+	char *reply = req->reply;
+	size_t size = sizeof(req->reply);
+	char command[16] = "";
+	char arg[16] = "";
+	int channel = 0;
+	int fields;
+
+	fields = sscanf(req->line, "%15s %i %15s", command, &channel, arg);
+
+	if( strcmp(command, "help") == 0 )
+	{
+		snprintf(reply, size, "{\"ok\": true, \"commands\": [\"stats\", \"reset <ch>\", \"snapshot\", "
+			"\"quality <ch> high|low\", \"add <ch>\", \"remove <ch>\"]}");
+		return;
+	}
+
+	if( strcmp(command, "stats") == 0 )
+	{
+		controlStats(reply, size);
+		return;
+	}
+
+	if( strcmp(command, "snapshot") == 0 )
+	{
+		if( globalArgs.ringSeconds <= 0 )
+		{
+			snprintf(reply, size, "{\"ok\": false, \"error\": \"no pre-alarm buffer, see -b\"}");
+			return;
+		}
+
+		raiseAlarm(wallMs());
+		snprintf(reply, size, "{\"ok\": true, \"alarm\": %lli, \"alarms\": %i}",
+			__atomic_load_n(&g_snapshot->time, __ATOMIC_ACQUIRE), g_snapshot->alarms);
+		return;
+	}
+
+	if( strcmp(command, "reset") != 0 && strcmp(command, "quality") != 0 &&
+		strcmp(command, "add") != 0 && strcmp(command, "remove") != 0 )
+	{
+		snprintf(reply, size, "{\"ok\": false, \"error\": \"unknown command, try help\"}");
+		return;
+	}
+
+	if( fields < 2 || channel < 1 || channel > MAX_CHANNELS )
+	{
+		snprintf(reply, size, "{\"ok\": false, \"error\": \"channel must be 1 to %i\"}", MAX_CHANNELS);
+		return;
+	}
+
+	if( !globalArgs.eventLoop )
+	{
+		if( strcmp(command, "reset") != 0 )
+			snprintf(reply, size, "{\"ok\": false, \"error\": \"%s needs -e\"}", command);
+		else if( g_childPids[channel-1] <= 0 )
+			snprintf(reply, size, "{\"ok\": false, \"error\": \"channel %i is not streamed\"}", channel);
+		else
+		{
+			kill(g_childPids[channel-1], SIGUSR2);
+			snprintf(reply, size, "{\"ok\": true, \"channel\": %i}", channel);
+		}
+		return;
+	}
+
+	cs = &g_channels[channel-1];
+
+	if( strcmp(command, "add") == 0 )
+	{
+		if( cs->state != ch_idle )
+		{
+			snprintf(reply, size, "{\"ok\": false, \"error\": \"channel %i is already streamed\"}", channel);
+			return;
+		}
+
+		// Stored atomically, the metrics thread reads the flags while serving a scrape
+		__atomic_store_n(&globalArgs.channel[channel-1], true, __ATOMIC_RELAXED);
+		if( cs->stopped )
+		{
+			// It kept its buffers, it only has to connect again
+			cs->state = ch_wait;
+			cs->retryAt = 0;
+		}
+		else if( channelInit(cs) != 0 )
+		{
+			// Nothing is kept, the next add sets it up from scratch
+			channelFree(cs);
+			cs->state = ch_idle;
+			__atomic_store_n(&globalArgs.channel[channel-1], false, __ATOMIC_RELAXED);
+			snprintf(reply, size, "{\"ok\": false, \"error\": \"channel %i could not be set up\"}", channel);
+			return;
+		}
+		cs->stopped = false;
+		printMessage(true, "Ch %i: Added\n", channel);
+		snprintf(reply, size, "{\"ok\": true, \"channel\": %i}", channel);
+		return;
+	}
+
+	if( cs->state == ch_idle )
+	{
+		snprintf(reply, size, "{\"ok\": false, \"error\": \"channel %i is not streamed\"}", channel);
+		return;
+	}
+
+	if( strcmp(command, "reset") == 0 )
+	{
+		// Only the connection, the reader keeps its pipe and the other channels carry on
+		resetChannel(cs, true, 0);
+		printMessage(true, "Ch %i: Reset\n", channel);
+		snprintf(reply, size, "{\"ok\": true, \"channel\": %i}", channel);
+		return;
+	}
+
+	if( strcmp(command, "remove") == 0 )
+	{
+		// Its buffers stay allocated, an add picks them up again
+		resetChannel(cs, false, 0);
+		cs->state = ch_idle;
+		cs->stopped = true;
+		__atomic_store_n(&globalArgs.channel[channel-1], false, __ATOMIC_RELAXED);
+		printMessage(true, "Ch %i: Removed\n", channel);
+		snprintf(reply, size, "{\"ok\": true, \"channel\": %i}", channel);
+		return;
+	}
+
+	// quality, chosen in the login packets so the channel logs in again
+	if( globalArgs.model != swanndvr8 && globalArgs.model != meye )
+	{
+		snprintf(reply, size, "{\"ok\": false, \"error\": \"the DVR model has no quality setting\"}");
+		return;
+	}
+	if( strcmp(arg, "high") != 0 && strcmp(arg, "low") != 0 )
+	{
+		snprintf(reply, size, "{\"ok\": false, \"error\": \"quality is high or low\"}");
+		return;
+	}
+
+	globalArgs.highQuality[channel-1] = strcmp(arg, "high") == 0;
+	memset(&cs->login, 0, sizeof(cs->login));
+	if( pConnectFunc[globalArgs.model](&cs->login, cs->channel) != 0 )
+	{
+		snprintf(reply, size, "{\"ok\": false, \"error\": \"login doesn't fit in the login script\"}");
+		return;
+	}
+	resetChannel(cs, true, 0);
+	printMessage(true, "Ch %i: Quality %s\n", channel, arg);
+	snprintf(reply, size, "{\"ok\": true, \"channel\": %i, \"quality\": \"%s\"}", channel, arg);
+}
+
+// The shared counters of every channel as the stats reply, returns the length
+int controlStats(char *buf, size_t size)
+{
+	long long now = nowMs();
+	size_t len;
+	int loopIdx;
+	bool first = true;
+
+	len = snprintf(buf, size, "{\"ok\": true, \"channels\": [");
+
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		struct channelMetrics *m = &g_metrics[loopIdx];
+		long long lastByte = __atomic_load_n(&m->lastByte, __ATOMIC_RELAXED);
+
+		if( !__atomic_load_n(&globalArgs.channel[loopIdx], __ATOMIC_RELAXED) )
+			continue;
+
+		len += snprintf(buf + len, len < size ? size - len : 0, "%s{\"channel\": %i, \"streaming\": %s, \"bytes\": %llu, "
+			"\"logins\": %llu, \"login_failures\": %llu, \"reconnects\": %llu, \"dropped_slow\": %llu, "
+			"\"dropped_no_reader\": %llu, \"dropped_disk\": %llu, \"dropped_frames\": %llu, \"shed_frames\": %llu, "
+			"\"shed_gops\": %llu, \"queued\": %lli, \"activity\": %.3f, \"idle_ms\": %lli}", first ? "" : ", ", loopIdx+1,
+			__atomic_load_n(&m->streaming, __ATOMIC_RELAXED) ? "true" : "false",
+			__atomic_load_n(&m->bytes, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->logins, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->loginFailures, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->reconnects, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->droppedSlow, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->droppedNoReader, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->droppedDisk, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->droppedFrames, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->shedFrames, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->shedGops, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->queued, __ATOMIC_RELAXED),
+			__atomic_load_n(&m->activity, __ATOMIC_RELAXED) / 1000.0,
+			lastByte ? now - lastByte : -1);
+		first = false;
+	}
+
+	len += snprintf(buf + len, len < size ? size - len : 0, "]}");
+	if( len >= size )
+		len = snprintf(buf, size, "{\"ok\": false, \"error\": \"stats don't fit in the reply\"}");
+
+	return len;
+}
+
+// Milliseconds from a monotonic clock, used for all channel timers
+long long nowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Milliseconds since the epoch, used to timestamp stream data
+long long wallMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Allocate a ring large enough for the given seconds of stream at kbps.
+// The marks, one per RING_MARK_INTERVAL, bound the window in time,
+// the byte capacity only limits it when the stream exceeds kbps.
+// With a path the ring is a shared mapping of that file instead. On tmpfs it survives a
+// crash of the process. On disk it survives a power cut too: each GOP is summed and written
+// back as it completes (see ringSync), and what is taken over after a reboot is checked
+// against the sums first (see ringValidate). Pages that didn't make it only cost the GOPs they're in.
+// A file holding a ring of the same size is taken over as it is, recovered is set if its writer crashed.
+int ringInit(struct streamRing *ring, int seconds, int kbps, const char *path)
+{
+	size_t size = (size_t)seconds * kbps * 1000 / 8;
+	unsigned int markCount = seconds * 1000 / RING_MARK_INTERVAL + 64;
+	unsigned int keyCount = seconds * RING_KEYS_PER_SEC + 16;
+	size_t total = sizeof(struct ringHeader) + markCount * sizeof(struct ringMark) + keyCount * sizeof(struct ringKey) + size;
+	struct ringHeader *hdr;
+	struct statfs fs;
+	struct stat st;
+	char boot[40] = "";
+	char *block;
+	int fd;
+	FILE *fp;
+
+	memset(ring, 0, sizeof(*ring));
+
+	if( path == NULL )
+	{
+		block = calloc(1, total);
+		if( block == NULL )
+			return 1;
+	}
+	else
+	{
+		fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		if( fd == -1 || fstat(fd, &st) == -1 )
+		{
+			sprintf(g_errBuf, "Failed to open %s", path);
+			perror(g_errBuf);
+			if( fd != -1 )
+				close(fd);
+			return 1;
+		}
+
+		// A fresh file reads as an empty ring
+		if( st.st_size != total && (ftruncate(fd, 0) == -1 || ftruncate(fd, total) == -1) )
+		{
+			sprintf(g_errBuf, "Failed to size %s", path);
+			perror(g_errBuf);
+			close(fd);
+			return 1;
+		}
+
+		block = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if( block == MAP_FAILED )
+		{
+			sprintf(g_errBuf, "Failed to map %s", path);
+			perror(g_errBuf);
+			close(fd);
+			return 1;
+		}
+		ring->mapLen = total;
+
+		// Only tmpfs and ramfs have no disk to lose pages on
+		ring->sync = fstatfs(fd, &fs) == 0 && fs.f_type != TMPFS_MAGIC && fs.f_type != RAMFS_MAGIC;
+		ring->syncFd = fd;
+		if( !ring->sync )
+			close(fd);
+	}
+
+	ring->hdr = (struct ringHeader*)block;
+	ring->marks = (struct ringMark*)(block + sizeof(struct ringHeader));
+	ring->keys = (struct ringKey*)(ring->marks + markCount);
+	ring->data = (unsigned char*)(ring->keys + keyCount);
+
+	if( path && (fp = fopen("/proc/sys/kernel/random/boot_id", "r")) != NULL )
+	{
+		if( fgets(boot, sizeof(boot), fp) == NULL )
+			boot[0] = '\0';
+		fclose(fp);
+	}
+
+	hdr = ring->hdr;
+	if( path && hdr->magic == RING_MAGIC && hdr->version == RING_VERSION && hdr->size == size &&
+		hdr->markCount == markCount && hdr->keyCount == keyCount && hdr->tail <= hdr->head )
+	{
+		if( hdr->summed && strncmp(hdr->boot, boot, sizeof(boot)) != 0 )
+			ringValidate(ring);
+		ring->recovered = !hdr->closed && hdr->head > hdr->tail;
+		printMessage(true, "Kept %llu bytes of the pre-alarm buffer in %s\n", hdr->head - hdr->tail, path);
+	}
+	else if( path )
+		memset(hdr, 0, sizeof(*hdr));
+
+	ring->synced = hdr->head;
+	ring->hdr->summed = ring->sync;
+	strcpy(ring->hdr->boot, boot);
+	ring->hdr->magic = RING_MAGIC;
+	ring->hdr->version = RING_VERSION;
+	ring->hdr->closed = 0;
+	ring->hdr->size = size;
+	ring->hdr->markCount = markCount;
+	ring->hdr->keyCount = keyCount;
+
+	return 0;
+}
+
+void ringFree(struct streamRing *ring)
+{
+	if( ring->mapLen )
+	{
+		ring->hdr->closed = 1;
+		munmap(ring->hdr, ring->mapLen);
+	}
+	if( ring->sync )
+		close(ring->syncFd);
+	else
+		free(ring->hdr);
+	memset(ring, 0, sizeof(*ring));
+}
+
+// Copy received data into the ring, recording its arrival time
+void ringAppend(struct streamRing *ring, const char *buf, size_t len, long long now)
+{
+	struct ringHeader *hdr = ring->hdr;
+	unsigned long long head = hdr->head;
+	size_t pos;
+	size_t part;
+
+	if( hdr->markHead == 0 ||
+		now - ring->marks[(hdr->markHead - 1) % hdr->markCount].time >= RING_MARK_INTERVAL )
+	{
+		struct ringMark *mark = &ring->marks[hdr->markHead % hdr->markCount];
+
+		mark->offset = head;
+		mark->time = now;
+		__atomic_store_n(&hdr->markHead, hdr->markHead + 1, __ATOMIC_RELEASE);
+	}
+
+	// Only the tail of an oversized chunk survives anyway
+	if( len > hdr->size )
+	{
+		buf += len - hdr->size;
+		head += len - hdr->size;
+		len = hdr->size;
+	}
+
+	// Give up the data about to be overwritten first, see struct ringHeader
+	if( head + len > hdr->size )
+		hdr->tail = head + len - hdr->size;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	pos = head % hdr->size;
+	part = hdr->size - pos;
+	if( part > len )
+		part = len;
+
+	memcpy(ring->data + pos, buf, part);
+	memcpy(ring->data, buf + part, len - part);
+	__atomic_store_n(&hdr->head, head + len, __ATOMIC_RELEASE);
+}
+
+// Find the stream offset of the first data that arrived at or after time.
+// The result is clamped to the oldest data still held in the ring.
+unsigned long long ringFindTime(struct streamRing *ring, long long time)
+{
+	struct ringHeader *hdr = ring->hdr;
+	unsigned long long head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	unsigned long long markHead = __atomic_load_n(&hdr->markHead, __ATOMIC_ACQUIRE);
+	unsigned long long oldest = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+	unsigned long long lo, hi;
+
+	lo = markHead >= hdr->markCount ? markHead - hdr->markCount + 1 : 0;
+	hi = markHead;
+
+	// Marks are in arrival order, binary search for the first one >= time
+	while( lo < hi )
+	{
+		unsigned long long mid = lo + (hi - lo) / 2;
+
+		if( ring->marks[mid % hdr->markCount].time < time )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// The head is read first, stream appended since can't have arrived before time
+	if( lo == markHead || ring->marks[lo % hdr->markCount].offset > head )
+		return head;
+
+	return ring->marks[lo % hdr->markCount].offset > oldest ? ring->marks[lo % hdr->markCount].offset : oldest;
+}
+
+// Copy len bytes of stream from the ring, fails if they are no longer (or not yet) held.
+// The dump thread reads while the channel appends, the tail is checked again once
+// copied in case the channel overwrote them meanwhile.
+int ringRead(struct streamRing *ring, unsigned char *dst, unsigned long long from, size_t len)
+{
+	struct ringHeader *hdr = ring->hdr;
+	size_t pos;
+	size_t part;
+
+	if( from + len > __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) || from < __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED) )
+		return 1;
+
+	pos = from % hdr->size;
+	part = hdr->size - pos;
+	if( part > len )
+		part = len;
+
+	memcpy(dst, ring->data + pos, part);
+	memcpy(dst + part, ring->data, len - part);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return from < __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+}
+
+void ringAddKey(struct streamRing *ring, unsigned long long offset, long long time, bool params)
+{
+	struct ringHeader *hdr = ring->hdr;
+	struct ringKey *key = &ring->keys[hdr->keyHead % hdr->keyCount];
+	struct ringKey *prev = hdr->keyHead ? &ring->keys[(hdr->keyHead - 1) % hdr->keyCount] : NULL;
+	unsigned int sum = 0;
+
+	// The GOP before this keyframe is complete, on disk it's summed for ringValidate
+	if( ring->sync && prev && prev->offset >= hdr->tail && prev->offset < offset )
+		sum = ringSum(ring, prev->offset, offset);
+
+	key->offset = offset;
+	key->time = time;
+	key->params = params;
+	key->sum = sum;
+	__atomic_store_n(&hdr->keyHead, hdr->keyHead + 1, __ATOMIC_RELEASE);
+
+	if( ring->sync )
+		ringSync(ring, offset);
+}
+
+// FNV-1a of the stream from one offset to another, never 0 so 0 can mean no sum
+unsigned int ringSum(struct streamRing *ring, unsigned long long from, unsigned long long to)
+{
+	unsigned int sum = 2166136261U;
+	unsigned long long pos;
+
+	for( pos=from;pos<to;pos++ )
+		sum = (sum ^ ring->data[pos % ring->hdr->size]) * 16777619U;
+
+	return sum ? sum : 1;
+}
+
+// Start writing back the stream up to offset to, then the header and the indexes that
+// cover it. Nothing waits for the disk, the order the pages get there in isn't known,
+// the sums tell after a power cut (see ringValidate).
+void ringSync(struct streamRing *ring, unsigned long long to)
+{
+	size_t size = ring->hdr->size;
+	off_t dataStart = (unsigned char*)ring->data - (unsigned char*)ring->hdr;
+	unsigned long long from = ring->synced;
+
+	if( to - from > size )
+		from = to - size;
+
+	if( from % size + (to - from) > size )
+	{
+		sync_file_range(ring->syncFd, dataStart + from % size, size - from % size, SYNC_FILE_RANGE_WRITE);
+		sync_file_range(ring->syncFd, dataStart, (to - from) - (size - from % size), SYNC_FILE_RANGE_WRITE);
+	}
+	else if( to > from )
+		sync_file_range(ring->syncFd, dataStart + from % size, to - from, SYNC_FILE_RANGE_WRITE);
+
+	sync_file_range(ring->syncFd, 0, dataStart, SYNC_FILE_RANGE_WRITE);
+	ring->synced = to;
+}
+
+// A ring taken over from disk may have lost any of its pages in a power cut: the header
+// and the indexes can be ahead of the stream or behind it. Only the GOPs whose sums match,
+// from the newest one that does back to the first that doesn't, are kept.
+void ringValidate(struct streamRing *ring)
+{
+	struct ringHeader *hdr = ring->hdr;
+	unsigned long long first = hdr->keyHead >= hdr->keyCount ? hdr->keyHead - hdr->keyCount + 1 : 0;
+	unsigned long long head = 0, tail = 0, keyHead = 0;
+	unsigned long long idx;
+	bool found = false;
+
+	// Key idx holds the sum of the GOP from key idx - 1 up to it
+	for( idx=hdr->keyHead;idx-->first + 1; )
+	{
+		struct ringKey *key = &ring->keys[idx % hdr->keyCount];
+		struct ringKey *prev = &ring->keys[(idx - 1) % hdr->keyCount];
+		bool valid = key->sum && prev->offset >= hdr->tail && prev->offset < key->offset && key->offset <= hdr->head &&
+			key->offset - prev->offset <= hdr->size && ringSum(ring, prev->offset, key->offset) == key->sum;
+
+		if( valid && !found )
+		{
+			found = true;
+			head = key->offset;
+			keyHead = idx;
+		}
+		if( valid )
+			tail = prev->offset;
+		else if( found )
+			break;
+	}
+
+	if( !found )
+	{
+		printMessage(false, "None of the pre-alarm buffer on disk checks out, starting it empty\n");
+		hdr->tail = hdr->head;
+		return;
+	}
+
+	if( head != hdr->head || tail != hdr->tail )
+		printMessage(true, "Pre-alarm buffer on disk checked, kept %llu of %llu bytes\n", head - tail, hdr->head - hdr->tail);
+
+	// Nothing found from the lost part on
+	hdr->head = head;
+	hdr->tail = tail;
+	hdr->keyHead = keyHead;
+	while( hdr->markHead > 0 && ring->marks[(hdr->markHead - 1) % hdr->markCount].offset >= head )
+		hdr->markHead--;
+}
+
+// Find the keyframe to start a dump at for data from offset on.
+// That is the last keyframe at or before offset, so the whole window is covered,
+// or failing that the first one after it. NULL if none is left in the ring.
+struct ringKey *ringFindKey(struct streamRing *ring, unsigned long long offset)
+{
+	struct ringHeader *hdr = ring->hdr;
+	unsigned long long keyHead = __atomic_load_n(&hdr->keyHead, __ATOMIC_ACQUIRE);
+	unsigned long long oldest = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+	unsigned long long first = keyHead >= hdr->keyCount ? keyHead - hdr->keyCount + 1 : 0;
+	unsigned long long idx;
+	struct ringKey *found = NULL;
+
+	for( idx=first;idx<keyHead;idx++ )
+	{
+		struct ringKey *key = &ring->keys[idx % hdr->keyCount];
+
+		if( key->offset < oldest )
+			continue;
+
+		if( key->offset > offset )
+			return found ? found : key;
+
+		found = key;
+	}
+
+	return found;
+}
+
+// Called for every NAL unit received on a channel with a ring, export, output queue or recording.
+// Keeps the latest SPS/PPS and indexes keyframes so dumps can start on one.
+void channelNal(void *ctx, const struct nalUnit *nal)
+{
+	struct channelState *cs = ctx;
+	struct ringHeader *hdr = cs->ring.hdr;
+
+	if( cs->queue.data )
+		queueNal(cs, nal);
+
+	if( cs->shm && nal->type == NAL_IDR && nal->firstSlice )
+		shmAddKey(cs, nal->auStart);
+
+	if( cs->record.count && nal->type == NAL_IDR && nal->firstSlice )
+		recordKey(cs, nal->auStart);
+
+	// The access unit before this one is complete, it goes into the activity score
+	if( nal->newAccessUnit )
+	{
+		if( cs->actAuStart && nal->auStart > cs->actAuStart )
+			activityFrame(cs, nal->auStart - cs->actAuStart, cs->actAuKey);
+		cs->actAuStart = nal->auStart;
+		cs->actAuKey = false;
+	}
+	if( nal->type == NAL_IDR && nal->firstSlice )
+		cs->actAuKey = true;
+
+	if( hdr == NULL )
+		return;
+
+	// Index the frames for zmodoPoll, the last one is complete when the next one starts
+	if( cs->frames && nal->newAccessUnit )
+	{
+		struct ringFrame *frame = &cs->frames[cs->frameHead % cs->frameCount];
+
+		frame->offset = nal->auStart;
+		frame->time = cs->recvTime;
+		frame->key = false;
+		__atomic_store_n(&cs->frameHead, cs->frameHead + 1, __ATOMIC_RELEASE);
+		g_framesAdded = true;
+	}
+	if( cs->frames && cs->frameHead && nal->type == NAL_IDR && nal->firstSlice )
+		cs->frames[(cs->frameHead - 1) % cs->frameCount].key = true;
+
+	// The parameter set ends where this NAL starts, copy it out of the ring
+	if( cs->paramType )
+	{
+		unsigned long long len = nal->start - cs->paramStart;
+		unsigned char *dst = cs->paramType == NAL_SPS ? hdr->sps : hdr->pps;
+
+		if( len <= MAX_PARAM_SET && ringRead(&cs->ring, dst, cs->paramStart, len) == 0 )
+		{
+			if( cs->paramType == NAL_SPS )
+				hdr->spsLen = len;
+			else
+				hdr->ppsLen = len;
+		}
+		cs->paramType = 0;
+	}
+
+	if( nal->newAccessUnit )
+		cs->auSps = cs->auPps = false;
+
+	switch( nal->type )
+	{
+	case NAL_SPS:
+	case NAL_PPS:
+		cs->paramType = nal->type;
+		cs->paramStart = nal->start;
+		if( nal->type == NAL_SPS )
+			cs->auSps = true;
+		else
+			cs->auPps = true;
+		break;
+	case NAL_IDR:
+		if( nal->firstSlice )
+			ringAddKey(&cs->ring, nal->auStart, cs->recvTime, cs->auSps && cs->auPps);
+		break;
+	}
+}
+
+// Motion shows in the compressed stream without decoding it: a P frame only codes what
+// changed since the frame before. The non-key frame bytes of each second are summed up
+// and scored in activitySecond() once the next second's first frame completes.
+void activityFrame(struct channelState *cs, unsigned long long bytes, bool key)
+{
+	long long second = cs->recvTime / 1000;
+
+	if( second != cs->actSecond )
+	{
+		activitySecond(cs);
+		cs->actSecond = second;
+		cs->actBytes = 0;
+		cs->actFrames = 0;
+	}
+
+	if( key )
+		cs->actKeyBytes = bytes;
+	else
+	{
+		cs->actBytes += bytes;
+		cs->actFrames++;
+	}
+}
+
+// The level of a second is its mean non-key frame against the last keyframe, which
+// keeps it apart from the bitrate the DVR picked: under a constant bitrate motion
+// takes the GOP's bytes away from the keyframe. The score is how far the level is
+// above that of the quiet scene, 0 for a still picture, 1 for P frames twice as big.
+void activitySecond(struct channelState *cs)
+{
+	struct activitySample *sample = &cs->activity[cs->actSecond % ACTIVITY_SECONDS];
+	double level, score;
+
+	if( cs->actFrames == 0 || cs->actKeyBytes == 0 )
+		return;
+
+	level = (double)cs->actBytes / cs->actFrames / cs->actKeyBytes;
+	if( cs->actBaseline == 0 )
+		cs->actBaseline = level;
+	else
+		cs->actBaseline += (level - cs->actBaseline) * (level < cs->actBaseline ? ACTIVITY_FALL : ACTIVITY_RISE);
+
+	score = level / cs->actBaseline - 1;
+	if( score < 0 )
+		score = 0;
+
+	// The dump thread reads the samples, the second goes last
+	__atomic_store_n(&sample->score, (int)(score * 1000), __ATOMIC_RELAXED);
+	__atomic_store_n(&sample->second, cs->actSecond, __ATOMIC_RELEASE);
+	metricSet(&g_metrics[cs->channel].activity, score * 1000);
+}
+
+// List the activity score of every second of a clip and its peak
+void activityClip(struct channelState *cs, long long start, long long end, struct snapshotClip *clip)
+{
+	long long second;
+
+	clip->activity = 0;
+	clip->scoreCount = 0;
+
+	for( second=start/1000;second<=end/1000 && clip->scoreCount<ACTIVITY_SECONDS;second++ )
+	{
+		struct activitySample *sample = &cs->activity[second % ACTIVITY_SECONDS];
+		int score = -1;
+
+		// A sample being overwritten is for a later second
+		if( __atomic_load_n(&sample->second, __ATOMIC_ACQUIRE) == second )
+		{
+			score = __atomic_load_n(&sample->score, __ATOMIC_ACQUIRE);
+			if( __atomic_load_n(&sample->second, __ATOMIC_ACQUIRE) != second )
+				score = -1;
+		}
+
+		clip->scores[clip->scoreCount++] = score;
+		if( score > clip->activity )
+			clip->activity = score;
+	}
+}
+
+// Write the stream between two offsets to fd. The channel may be appending meanwhile,
+// so it's copied out a chunk at a time and fails if it was overwritten first.
+int ringWrite(struct streamRing *ring, int fd, unsigned long long from, unsigned long long to)
+{
+	unsigned char buf[DUMP_CHUNK];
+
+	while( from < to )
+	{
+		size_t len = to - from < sizeof(buf) ? to - from : sizeof(buf);
+		size_t done = 0;
+
+		if( ringRead(ring, buf, from, len) != 0 )
+			return -1;
+
+		while( done < len )
+		{
+			ssize_t written = write(fd, buf + done, len - done);
+
+			if( written == -1 )
+			{
+				if( errno == EINTR )
+					continue;
+				return -1;
+			}
+			done += written;
+		}
+		from += len;
+	}
+
+	return 0;
+}
+
+// Feed the stream between two offsets to an MP4 writer, each chunk with
+// the arrival time of the mark it was received under, so frames keep their timing.
+// Like ringWrite it fails if the channel overwrote the stream or its marks first.
+int ringWriteMp4(struct streamRing *ring, struct mp4Writer *mw, unsigned long long from, unsigned long long to)
+{
+	struct ringHeader *hdr = ring->hdr;
+	unsigned long long markHead = __atomic_load_n(&hdr->markHead, __ATOMIC_ACQUIRE);
+	unsigned long long lo, hi, idx;
+	unsigned char buf[DUMP_CHUNK];
+
+	lo = markHead >= hdr->markCount ? markHead - hdr->markCount + 1 : 0;
+	hi = markHead;
+
+	// Last mark at or before from
+	while( lo + 1 < hi )
+	{
+		unsigned long long mid = lo + (hi - lo) / 2;
+
+		if( ring->marks[mid % hdr->markCount].offset <= from )
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	for( idx=lo;idx<markHead && from < to;idx++ )
+	{
+		long long time = ring->marks[idx % hdr->markCount].time;
+		unsigned long long end = to;
+
+		if( idx + 1 < markHead && ring->marks[(idx + 1) % hdr->markCount].offset < to )
+			end = ring->marks[(idx + 1) % hdr->markCount].offset;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if( idx + hdr->markCount <= __atomic_load_n(&hdr->markHead, __ATOMIC_RELAXED) )
+			return -1;
+
+		while( from < end )
+		{
+			size_t part = end - from < sizeof(buf) ? end - from : sizeof(buf);
+
+			if( ringRead(ring, buf, from, part) != 0 || mp4WriteStream(mw, buf, part, time) != 0 )
+				return -1;
+			from += part;
+		}
+	}
+
+	return 0;
+}
+
+// Post-alarm seconds of a channel (-A)
+int channelPost(int channel)
+{
+	return globalArgs.channelPost[channel] >= 0 ? globalArgs.channelPost[channel] : globalArgs.postSeconds;
+}
+
+int longestPost(void)
+{
+	int longest = 0;
+	int loopIdx;
+
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		if( __atomic_load_n(&globalArgs.channel[loopIdx], __ATOMIC_RELAXED) && channelPost(loopIdx) > longest )
+			longest = channelPost(loopIdx);
+	}
+
+	return longest;
+}
+
+// Cut a clip from the ringSeconds before alarm out of a channel's ring, starting on the
+// keyframe before them. Only where it starts is worked out here, dumpStep writes it.
+void dumpCut(struct channelState *cs, long long alarm, const char *stamp, const char *tag, struct dumpJob *job)
+{
+	struct ringHeader *hdr = cs->ring.hdr;
+	struct ringKey *key;
+
+	memset(job, 0, sizeof(*job));
+	job->cs = cs;
+	job->fd = -1;
+	job->alarm = alarm;
+	job->post = channelPost(cs->channel);
+	snprintf(job->file, sizeof(job->file), "%s_ch0%i%s.%s", stamp, cs->channel+1, tag, globalArgs.dumpMp4 ? "mp4" : "h264");
+
+	job->from = ringFindTime(&cs->ring, alarm - globalArgs.ringSeconds * 1000LL);
+	job->start = alarm - globalArgs.ringSeconds * 1000LL;
+
+	// Start on a keyframe so the clip decodes from its first frame
+	key = ringFindKey(&cs->ring, job->from);
+	if( key )
+	{
+		job->from = key->offset;
+		job->start = job->keyTime = key->time;
+
+		// Prepend the parameter sets if the keyframe was sent without them
+		if( !key->params && hdr->spsLen && hdr->ppsLen )
+		{
+			job->spsLen = hdr->spsLen;
+			job->ppsLen = hdr->ppsLen;
+			memcpy(job->sps, hdr->sps, hdr->spsLen);
+			memcpy(job->pps, hdr->pps, hdr->ppsLen);
+		}
+	}
+	else
+		printMessage(true, "Ch %i: No keyframe in the buffer, dump starts mid GOP\n", cs->channel+1);
+	job->pos = job->from;
+}
+
+// Write what the ring holds of a clip to <dumpDir>/<file>. The file is written under
+// a temporary name and renamed when complete, so a reader never sees a partial dump.
+// The clip stays open until its window has closed, its post-alarm seconds after the
+// last alarm of the incident, or stop. Returns true once it's finished.
+// A clip of the shared snapshot goes in its list, the last one finished has the manifest written.
+bool dumpStep(struct dumpJob *job, bool stop)
+{
+	struct channelState *cs = job->cs;
+	struct ringHeader *hdr = cs->ring.hdr;
+	struct snapshotClip *clip = job->shared ? &g_snapshot->clips[cs->channel] : NULL;
+	long long last = job->shared ? __atomic_load_n(&g_snapshot->last, __ATOMIC_ACQUIRE) : job->alarm;
+	long long end = last + job->post * 1000LL;
+	bool closing = stop || wallMs() >= end + DUMP_SLACK;
+	unsigned long long to = closing ? ringFindTime(&cs->ring, end) : __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	unsigned long long markHead;
+	char filename[512];
+	char tmpname[520];
+	char errBuf[64];
+	int ret = 0;
+
+	sprintf(filename, "%s/%s", globalArgs.dumpDir, job->file);
+	sprintf(tmpname, "%s.part", filename);
+
+	if( job->fd == -1 )
+	{
+		job->fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if( job->fd == -1 )
+		{
+			sprintf(errBuf, "Ch %i: Failed to create dump file", cs->channel+1);
+			perror(errBuf);
+			ret = 1;
+		}
+		else if( globalArgs.dumpMp4 )
+		{
+			memset(&job->mw, 0, sizeof(job->mw));
+			job->mw.fd = job->fd;
+			ret = job->spsLen && (mp4WriteStream(&job->mw, job->sps, job->spsLen, job->keyTime) != 0 ||
+				mp4WriteStream(&job->mw, job->pps, job->ppsLen, job->keyTime) != 0);
+		}
+		else
+		{
+			ret = job->spsLen && (write(job->fd, job->sps, job->spsLen) != job->spsLen ||
+				write(job->fd, job->pps, job->ppsLen) != job->ppsLen);
+		}
+	}
+
+	if( ret == 0 && to > job->pos )
+	{
+		if( globalArgs.dumpMp4 )
+			ret = ringWriteMp4(&cs->ring, &job->mw, job->pos, to) != 0;
+		else
+			ret = ringWrite(&cs->ring, job->fd, job->pos, to) != 0;
+		job->pos = to;
+	}
+
+	if( ret == 0 && !closing )
+		return false;
+
+	if( job->fd != -1 && globalArgs.dumpMp4 )
+		ret = mp4Close(&job->mw) != 0 || ret;
+
+	if( job->fd != -1 && ret )
+	{
+		sprintf(errBuf, "Ch %i: Failed to write dump file", cs->channel+1);
+		perror(errBuf);
+		close(job->fd);
+		unlink(tmpname);
+	}
+	else if( job->fd != -1 )
+	{
+		close(job->fd);
+		rename(tmpname, filename);
+		printMessage(true, "Ch %i: Dumped %llu bytes to %s\n", cs->channel+1, job->pos - job->from, filename);
+
+		// The stream stopped before the window closed
+		markHead = __atomic_load_n(&hdr->markHead, __ATOMIC_ACQUIRE);
+		if( markHead && cs->ring.marks[(markHead - 1) % hdr->markCount].time < end )
+			end = cs->ring.marks[(markHead - 1) % hdr->markCount].time;
+
+		if( clip )
+		{
+			strcpy(clip->file, job->file);
+			clip->start = job->start;
+			clip->end = end;
+			clip->bytes = job->pos - job->from;
+			clip->post = job->post;
+			activityClip(cs, job->start, end, clip);
+		}
+	}
+
+	if( clip && __atomic_add_fetch(&g_snapshot->done, 1, __ATOMIC_ACQ_REL) == job->channels )
+	{
+		writeManifest(job->file);
+		__atomic_store_n(&g_snapshot->time, 0, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+// Cut the alarm out of the ring of every channel this process streams and hand the
+// clips to the dump thread, the channels carry on streaming while they're written
+void dumpChannels(void)
+{
+	struct dumpJob job;
+	char stamp[32];
+	time_t secs = g_alarmTime / 1000;
+	bool shared = g_alarmTime == g_snapshot->time;
+	int channels = 0;
+	int loopIdx;
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&secs));
+
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		if( globalArgs.channel[loopIdx] )
+			channels++;
+	}
+
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		struct channelState *cs = &g_channels[loopIdx];
+		bool queued = false;
+
+		if( cs->state == ch_idle || cs->ring.hdr == NULL )
+			continue;
+
+		dumpCut(cs, g_alarmTime, stamp, "", &job);
+		job.shared = shared;
+		job.channels = channels;
+
+		pthread_mutex_lock(&g_dumpLock);
+		if( g_dumpHead - g_dumpTail < DUMP_JOBS )
+		{
+			g_dumpJobs[g_dumpHead++ % DUMP_JOBS] = job;
+			pthread_cond_signal(&g_dumpCond);
+			queued = true;
+		}
+		pthread_mutex_unlock(&g_dumpLock);
+
+		// Still counts towards the manifest, the clip is just missing from it
+		if( !queued )
+		{
+			printMessage(false, "Ch %i: Too many dumps in progress, skipped\n", cs->channel+1);
+			if( shared && __atomic_add_fetch(&g_snapshot->done, 1, __ATOMIC_ACQ_REL) == channels )
+			{
+				writeManifest(job.file);
+				__atomic_store_n(&g_snapshot->time, 0, __ATOMIC_RELEASE);
+			}
+		}
+	}
+}
+
+// Start a dump thread per CPU, so the clips of an alarm on every channel are muxed side by side
+int dumpStartWriter(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	sigset_t all, old;
+	int retval = 0;
+
+	if( cpus < 1 )
+		cpus = 1;
+	if( cpus > DUMP_THREADS )
+		cpus = DUMP_THREADS;
+
+	g_dumpStop = false;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	while( g_dumpRunning < cpus && (retval = pthread_create(&g_dumpThreads[g_dumpRunning], NULL, dumpWriter, NULL)) == 0 )
+		g_dumpRunning++;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	// Fewer threads only write slower
+	return g_dumpRunning ? 0 : retval;
+}
+
+// Let the dump threads write what is queued and wait for them
+void dumpStopWriter(void)
+{
+	if( !g_dumpRunning )
+		return;
+
+	pthread_mutex_lock(&g_dumpLock);
+	g_dumpStop = true;
+	pthread_cond_broadcast(&g_dumpCond);
+	pthread_mutex_unlock(&g_dumpLock);
+
+	while( g_dumpRunning > 0 )
+		pthread_join(g_dumpThreads[--g_dumpRunning], NULL);
+}
+
+// Take on queued clips and write all the open ones every DUMP_POLL ms, until they close.
+// A clip is taken one at a time and another thread woken for the rest, which spreads
+// the clips of an alarm over the threads.
+void *dumpWriter(void *arg)
+{
+	struct dumpJob jobs[DUMP_JOBS];
+	struct timespec until;
+	int active = 0;
+	bool stop;
+	int idx;
+
+	pthread_mutex_lock(&g_dumpLock);
+	while( true )
+	{
+		if( g_dumpHead != g_dumpTail && active < DUMP_JOBS )
+		{
+			jobs[active++] = g_dumpJobs[g_dumpTail++ % DUMP_JOBS];
+			if( g_dumpHead != g_dumpTail )
+				pthread_cond_signal(&g_dumpCond);
+		}
+
+		if( active == 0 )
+		{
+			if( g_dumpStop )
+				break;
+			pthread_cond_wait(&g_dumpCond, &g_dumpLock);
+			continue;
+		}
+
+		stop = g_dumpStop;
+		pthread_mutex_unlock(&g_dumpLock);
+
+		for( idx=0;idx<active; )
+		{
+			if( dumpStep(&jobs[idx], stop) )
+				jobs[idx] = jobs[--active];
+			else
+				idx++;
+		}
+
+		pthread_mutex_lock(&g_dumpLock);
+		if( active && !g_dumpStop && g_dumpHead == g_dumpTail )
+		{
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += DUMP_POLL * 1000000L;
+			until.tv_sec += until.tv_nsec / 1000000000L;
+			until.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&g_dumpCond, &g_dumpLock, &until);
+		}
+	}
+	pthread_mutex_unlock(&g_dumpLock);
+
+	return NULL;
+}
+
+// List the clips of a snapshot in <dumpDir>/<stamp>.json, named after one of them, so they can be lined up:
+// {"alarm": ms, "last": ms, "alarms": n, "pre": s, "clips": [{"channel": n, "file": name, "start": ms, "end": ms, "bytes": n, "post": s,
+//   "activity": score, "scores": [score, ...]}, ...]}
+// Times are ms since the epoch, a clip starts on the keyframe before alarm - pre and runs to last + post.
+// scores has the activity score of each second from the one start is in, activity is their peak.
+void writeManifest(const char *clipName)
+{
+	char filename[512];
+	char tmpname[520];
+	bool first = true;
+	int loopIdx;
+	int idx;
+	FILE *fp;
+
+	sprintf(filename, "%s/%.15s.json", globalArgs.dumpDir, clipName);
+	sprintf(tmpname, "%s.part", filename);
+
+	fp = fopen(tmpname, "w");
+	if( fp == NULL )
+	{
+		perror("Failed to create the snapshot manifest");
+		return;
+	}
+
+	fprintf(fp, "{\"alarm\": %lli, \"last\": %lli, \"alarms\": %i, \"pre\": %i, \"clips\": [",
+		g_snapshot->time, g_snapshot->last, g_snapshot->alarms, globalArgs.ringSeconds);
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+	{
+		struct snapshotClip *clip = &g_snapshot->clips[loopIdx];
+
+		if( clip->file[0] == '\0' )
+			continue;
+
+		fprintf(fp, "%s\n  {\"channel\": %i, \"file\": \"%s\", \"start\": %lli, \"end\": %lli, \"bytes\": %llu, \"post\": %i, "
+			"\"activity\": %.3f, \"scores\": [", first ? "" : ",", loopIdx+1, clip->file, clip->start, clip->end, clip->bytes,
+			clip->post, clip->activity / 1000.0);
+		for( idx=0;idx<clip->scoreCount;idx++ )
+		{
+			if( clip->scores[idx] < 0 )
+				fprintf(fp, "%snull", idx ? ", " : "");
+			else
+				fprintf(fp, "%s%.3f", idx ? ", " : "", clip->scores[idx] / 1000.0);
+		}
+		fprintf(fp, "]}");
+		first = false;
+	}
+	fprintf(fp, "\n]}\n");
+
+	if( fclose(fp) != 0 )
+	{
+		perror("Failed to write the snapshot manifest");
+		unlink(tmpname);
+		return;
+	}
+
+	rename(tmpname, filename);
+	printMessage(true, "Snapshot of %i alarm%s listed in %s\n", g_snapshot->alarms, g_snapshot->alarms > 1 ? "s" : "", filename);
+}
+
+// The -P file of a channel was left behind by a crash, dump the ringSeconds that
+// led up to it to <dumpDir>/<stamp>_ch0<channel>_crash.h264, stamped with the crash
+void dumpRecovered(struct channelState *cs)
+{
+	struct ringHeader *hdr = cs->ring.hdr;
+	long long crash = hdr->markHead ? cs->ring.marks[(hdr->markHead - 1) % hdr->markCount].time : wallMs();
+	time_t secs = crash / 1000;
+	struct dumpJob job;
+	char stamp[32];
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&secs));
+	printMessage(false, "Ch %i: The pre-alarm buffer survived a crash at %s, dumping it\n", cs->channel+1, stamp);
+
+	dumpCut(cs, crash, stamp, "_crash", &job);
+	dumpStep(&job, true);
+}
+
+// libzmodopipe, see zmodopipe.h. The engine is runEventLoop in -e mode on a thread
+// of its own, without FIFOs, keeping every channel in a ring with its frames indexed.
+
+void *engineMain(void *arg)
+{
+	runEventLoop();
+
+	// Nothing is posted from now on, run what already was
+	pthread_mutex_lock(&g_controlLock);
+	g_controlOpen = false;
+	pthread_mutex_unlock(&g_controlLock);
+	controlPoll();
+
+	pthread_mutex_lock(&g_frameLock);
+	g_engineRunning = false;
+	g_engineDone = true;
+	pthread_cond_broadcast(&g_frameCond);
+	pthread_mutex_unlock(&g_frameLock);
+
+	return NULL;
+}
+
+ZMODO_API int zmodoOpen(const char *host, int port, int model, const char *username, const char *password,
+	unsigned int channels, int seconds)
+{
+	sigset_t all, old;
+	int loopIdx;
+	int retval;
+
+	if( g_embedded || model < mobile || model > meye || (channels & ((1U << MAX_CHANNELS) - 1)) == 0 || seconds <= 0 )
+		return -1;
+
+	setDefaultArgs();
+	globalArgs.hostname = (char*)host;
+	globalArgs.port = port;
+	globalArgs.model = model;
+	globalArgs.username = (char*)username;
+	globalArgs.password = (char*)password;
+	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+		globalArgs.channel[loopIdx] = (channels >> loopIdx) & 1;
+	globalArgs.eventLoop = true;
+	globalArgs.ringSeconds = seconds;
+	globalArgs.queueMs = 0;
+	setDefaultPort();
+
+	if( resolveServer() != 0 )
+		return -1;
+	if( (g_metrics == NULL && metricsInit() != 0) || (g_snapshot == NULL && snapshotInit() != 0) )
+		return -1;
+
+	g_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if( g_wakeFd == -1 )
+	{
+		perror("Failed to create the wakeup eventfd");
+		return -1;
+	}
+
+	g_embedded = true;
+	g_cleanUp = false;
+	g_engineRunning = g_engineDone = false;
+
+	// The engine thread has no business with the host's signals
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	retval = pthread_create(&g_engineThread, NULL, engineMain, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if( retval != 0 )
+	{
+		printMessage(false, "Failed to start the streaming engine\n");
+		close(g_wakeFd);
+		g_wakeFd = -1;
+		g_embedded = false;
+		return -1;
+	}
+
+	// Until the channels are set up, or that failed
+	pthread_mutex_lock(&g_frameLock);
+	while( !g_engineRunning && !g_engineDone )
+		pthread_cond_wait(&g_frameCond, &g_frameLock);
+	retval = g_engineRunning ? 0 : -1;
+	pthread_mutex_unlock(&g_frameLock);
+
+	if( retval != 0 )
+		zmodoClose();
+	return retval;
+}
+
+ZMODO_API int zmodoPoll(int channel, struct zmodoFrame *frame, int timeoutMs)
+{
+	struct channelState *cs;
+	struct timespec until;
+	int retval;
+
+	if( !g_embedded || channel < 1 || channel > MAX_CHANNELS || g_channels[channel-1].frames == NULL )
+		return -1;
+	cs = &g_channels[channel-1];
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	if( timeoutMs > 0 )
+	{
+		until.tv_sec += timeoutMs / 1000;
+		until.tv_nsec += (timeoutMs % 1000) * 1000000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+	}
+
+	// The lock only orders the wakeups, frames are read straight out of the index
+	pthread_mutex_lock(&g_frameLock);
+	while( (retval = frameNext(cs, frame)) == 0 && g_engineRunning && timeoutMs != 0 )
+	{
+		if( timeoutMs < 0 )
+			pthread_cond_wait(&g_frameCond, &g_frameLock);
+		else if( pthread_cond_timedwait(&g_frameCond, &g_frameLock, &until) == ETIMEDOUT )
+		{
+			retval = frameNext(cs, frame);
+			break;
+		}
+	}
+	if( retval == 0 && !g_engineRunning )
+		retval = -1;
+	pthread_mutex_unlock(&g_frameLock);
+
+	return retval;
+}
+
+// Fill in the frame at pollNext if it's complete and move on, returns 1 if it was.
+// The engine thread indexes frames meanwhile, if it overwrote the slot or the
+// frame's stream the cursor skips to the latest keyframe.
+int frameNext(struct channelState *cs, struct zmodoFrame *frame)
+{
+	struct ringHeader *hdr = cs->ring.hdr;
+	unsigned long long head = __atomic_load_n(&cs->frameHead, __ATOMIC_ACQUIRE);
+	struct ringFrame cur, next;
+	size_t pos, len;
+
+	if( !cs->pollStarted )
+	{
+		frameSeekKey(cs);
+		cs->pollStarted = true;
+	}
 
-			// Now we are connected and awaiting stream
-			do
-			{
-				int read;
-#ifdef NON_BLOCK_READ
-				tv_sel.tvsec = 0;
-				tv_sel.tv_usec = 10000;	// Wait 10 ms
+	if( cs->pollNext + 1 >= head )
+		return 0;
 
-				if( select( sockFd+1, &readfds, NULL, NULL, &tv_sel) == -1)
-				{
-					sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Select failed");
-					perror(g_errBuf);
-					
-					close(sockFd);
-					sockFd = -1;
-					break;			// Connection may have died, reset
-				}
+	cur = cs->frames[cs->pollNext % cs->frameCount];
+	next = cs->frames[(cs->pollNext + 1) % cs->frameCount];
 
-				if (!FD_ISSET(sockFd, &readfds))
-				{
-					if( globalArgs.verbose )
-						printMessage(true, "\nCh %i: %s", g_processCh+1, "Read would block\n");
-					continue;		// Not ready yet
-				}
-#endif
-				// Read actual h264 data from camera
-				read  = recv(sockFd, recvBuf, sizeof(recvBuf), 0);
-				
-				// Server disconnected, close the socket so we can try to reconnect
-				if( read <= 0 )
-				{
-#ifdef NON_BLOCK_READ
-					if( errno == EAGAIN || errno == EWOULDBLOCK )
-					{
-						if( globalArgs.verbose )
-							printMessage(true, "\nCh %i: %s", g_processCh+1, "Read would block\n");
-						continue;
-					}
-#endif
-					if( globalArgs.verbose )
-						printMessage(true, "Ch %i: Socket closed. Receive result: %i\n", g_processCh+1, read);
-					
-					close(sockFd);
-					sockFd = -1;
-					break;
-				}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if( __atomic_load_n(&cs->frameHead, __ATOMIC_RELAXED) - cs->pollNext >= cs->frameCount ||
+		cur.offset < __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED) || next.offset < cur.offset ||
+		next.offset - cur.offset > hdr->size )
+	{
+		cs->pollLapped++;
+		frameSeekKey(cs);
+		return 0;
+	}
 
-				if( globalArgs.verbose )
-				{
-					printf(".");
-					fflush(stdout);
-				}
+	len = next.offset - cur.offset;
+	pos = cur.offset % hdr->size;
 
-#ifdef DOMAIN_SOCKETS
-				if( outPipe == -1 )
-				{
-					outPipe = socket(AF_UNIX, SOCK_STREAM, 0);
-					if( outPipe == -1 )
-						perror("Error creating socket");
+	frame->data = cs->ring.data + pos;
+	frame->len = len < hdr->size - pos ? len : hdr->size - pos;
+	frame->wrap = len > frame->len ? cs->ring.data : NULL;
+	frame->wrapLen = len - frame->len;
+	frame->offset = cur.offset;
+	frame->time = cur.time;
+	frame->key = cur.key;
+	frame->lapped = cs->pollLapped;
 
-					memset(&addr, 0, sizeof(addr));
-					addr.sun_family = AF_UNIX;
-					strncpy(addr.sun_path, pipename, sizeof(addr.sun_path) - 1);
+	cs->pollNext++;
+	return 1;
+}
 
-					if( bind(outPipe, (struct sockaddr*)&addr, sizeof(addr)) == -1 )
-						perror("Error binding socket");
-				}
-				
-#else
-				// Open the pipe if it wasn't previously opened
-				if( outPipe == -1 )
-					outPipe = open(pipename, O_WRONLY | O_NONBLOCK);
-#endif
+// Move the poll cursor to the latest complete keyframe still in the ring,
+// or to the frame being received if there is none
+void frameSeekKey(struct channelState *cs)
+{
+	unsigned long long head = __atomic_load_n(&cs->frameHead, __ATOMIC_ACQUIRE);
+	unsigned long long oldest = __atomic_load_n(&cs->ring.hdr->tail, __ATOMIC_RELAXED);
+	unsigned long long idx;
 
-				// send to pipe
-				if( outPipe != -1 )
-				{
+	cs->pollNext = head ? head - 1 : 0;
+	for( idx=head ? head - 1 : 0;idx>0 && idx+cs->frameCount>head;idx-- )
+	{
+		struct ringFrame *frame = &cs->frames[(idx - 1) % cs->frameCount];
 
-					if( (retval = write(outPipe, recvBuf, read)) == -1)
-					{
-						if( errno == EAGAIN || errno == EWOULDBLOCK )
-						{
-							if( globalArgs.verbose )
-								printMessage(true, "\nCh %i: %s", g_processCh+1, "Reader isn't reading fast enough, discarding data. Not enough processing power?\n");
+		if( frame->offset < oldest )
+			break;
+		if( frame->key )
+		{
+			cs->pollNext = idx - 1;
+			break;
+		}
+	}
+}
 
-							// Right now we discard data, should be a way to buffer maybe?
-							continue;
-						}
-						// reader closed the pipe, wait for it to be opened again.
-						else if( globalArgs.verbose )
-						{
-							sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Pipe closed");
-							perror(g_errBuf);
-						}
-#ifndef DOMAIN_SOCKETS
-						close(outPipe);
-						outPipe = -1;
-#endif
-						close(sockFd);
-						sockFd = -1;
-						continue;
-					}
-					else
-					{
-						if( globalArgs.verbose )
-						{
-							printf("\b \b");
-							fflush(stdout);
-						}
-					}
-				}
-			}
-			while( sockFd != -1 && !g_cleanUp );
-			
-			// If we receive a SIGUSR1, close and reset everything
-			// Then start the loop over again.
-			if( g_cleanUp >= 2 )
-			{
-				g_cleanUp = false;
+ZMODO_API int zmodoValid(int channel, const struct zmodoFrame *frame)
+{
+	if( !g_embedded || channel < 1 || channel > MAX_CHANNELS || g_channels[channel-1].ring.hdr == NULL )
+		return 0;
 
-				if( sockFd != -1 )
-					close(sockFd);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return frame->offset >= __atomic_load_n(&g_channels[channel-1].ring.hdr->tail, __ATOMIC_RELAXED);
+}
 
-				sockFd = -1;
+// Take a zmodoSnapshot's cut, on the streaming loop
+void snapshotTake(void *ctx)
+{
+	struct snapshotCut *cut = ctx;
+	struct streamRing *ring = &cut->cs->ring;
+	struct ringKey *key;
+
+	cut->end = ringFindTime(ring, cut->to);
+	key = ringFindKey(ring, ringFindTime(ring, cut->from));
+	cut->found = key != NULL;
+	if( key == NULL )
+		return;
+	cut->key = *key;
+
+	if( !key->params && ring->hdr->spsLen && ring->hdr->ppsLen )
+	{
+		cut->spsLen = ring->hdr->spsLen;
+		cut->ppsLen = ring->hdr->ppsLen;
+		memcpy(cut->sps, ring->hdr->sps, cut->spsLen);
+		memcpy(cut->pps, ring->hdr->pps, cut->ppsLen);
+	}
+}
 
-				if( g_cleanUp != 3 )
-				{
-					if( outPipe != -1 )
-						close(outPipe);
-					outPipe = -1;
-				}
+// Cut like a dump, but synchronously and to any file: from the keyframe at or before from,
+// the parameter sets prepended if it was sent without them. The cut is taken on the streaming
+// loop, the stream is copied out of the ring on the caller's thread like the dump thread does.
+ZMODO_API long long zmodoSnapshot(int channel, long long from, long long to, const char *path)
+{
+	struct controlRequest req;
+	struct snapshotCut cut;
+	struct mp4Writer mw;
+	size_t pathLen = path ? strlen(path) : 0;
+	bool mp4 = pathLen > 4 && strcmp(path + pathLen - 4, ".mp4") == 0;
+	int ret = 0;
+	int fd;
+
+	if( !g_embedded || channel < 1 || channel > MAX_CHANNELS || g_channels[channel-1].ring.hdr == NULL || path == NULL )
+		return -1;
+
+	memset(&cut, 0, sizeof(cut));
+	cut.cs = &g_channels[channel-1];
+	cut.from = from;
+	cut.to = to;
+	memset(&req, 0, sizeof(req));
+	req.run = snapshotTake;
+	req.ctx = &cut;
+
+	// Once the loop stopped nothing changes the ring, take it here
+	if( !controlPost(&req) )
+		snapshotTake(&cut);
+	if( !cut.found || cut.key.offset >= cut.end )
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if( fd == -1 )
+		return -1;
+
+	if( mp4 )
+	{
+		memset(&mw, 0, sizeof(mw));
+		mw.fd = fd;
+		if( cut.spsLen )
+			ret = mp4WriteStream(&mw, cut.sps, cut.spsLen, cut.key.time) != 0 ||
+				mp4WriteStream(&mw, cut.pps, cut.ppsLen, cut.key.time) != 0;
+		ret = ret || ringWriteMp4(&cut.cs->ring, &mw, cut.key.offset, cut.end) != 0;
+		ret = mp4Close(&mw) != 0 || ret;
+	}
+	else
+	{
+		if( cut.spsLen )
+			ret = write(fd, cut.sps, cut.spsLen) != cut.spsLen || write(fd, cut.pps, cut.ppsLen) != cut.ppsLen;
+		ret = ret || ringWrite(&cut.cs->ring, fd, cut.key.offset, cut.end) != 0;
+	}
 
-			}
+	if( close(fd) != 0 || ret )
+	{
+		unlink(path);
+		return -1;
+	}
 
-		}
-		if( globalArgs.verbose )
-			printMessage(true, "Exiting loop: %i\n", g_cleanUp);
-		// Received signal to exit, cleanup
-		close(outPipe);
-		close(sockFd);
+	return cut.end - cut.key.offset;
+}
 
-		unlink(pipename);
-	}
+ZMODO_API void zmodoClose(void)
+{
+	unsigned long long one = 1;
+	int loopIdx;
 
-	// Restore old signal handler
-	sigaction(SIGPIPE, &oldsapipe, NULL);
-	sigaction(SIGTERM, &oldsaterm, NULL);
-	sigaction(SIGINT, &oldsaint, NULL);
-	sigaction(SIGUSR1, &oldsahup, NULL);
-	freeaddrinfo(server);
+	if( !g_embedded )
+		return;
 
-	// Kill all children (if any)
+	__atomic_store_n(&g_cleanUp, true, __ATOMIC_RELEASE);
+	if( write(g_wakeFd, &one, sizeof(one)) != sizeof(one) )
+		perror("Failed to wake the streaming engine");
+	pthread_join(g_engineThread, NULL);
+
+	close(g_wakeFd);
+	g_wakeFd = -1;
+	g_embedded = false;
 	for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
 	{
-		if( globalArgs.channel[loopIdx] > 0 )
-			kill( globalArgs.channel[loopIdx], SIGTERM );
+		g_channels[loopIdx].pollStarted = false;
+		g_channels[loopIdx].pollLapped = 0;
+		g_channels[loopIdx].frameHead = 0;
 	}
-	return 0;
 }
 
 void display_usage(char *name)
@@ -679,6 +5213,24 @@ void display_usage(char *name)
 		"    -p <int>\tPort number to connect to\n"
 		"    -c <int>\tChannels to stream (can be specified multiple times)\n"
 		"    -n <string>\tBase filename of pipe (ch# will be appended)\n"
+		"    -e\t\tStream all channels from a single process (no forking)\n"
+		"    -b <int>\tSeconds of stream to keep, dumped on SIGHUP\n"
+		"    -A <int>\tSeconds of stream after the SIGHUP added to the dumps (default 0),\n"
+		"    \t\t<ch#>:<int> for one channel. A SIGHUP within them extends the dumps\n"
+		"    -B <int>\tMax expected bitrate in kbit/s, sizes the -b, -q and -x buffers (default 4096)\n"
+		"    -P <string>\tKeep the -b buffers in files in this directory, after a crash they're dumped on the next start.\n"
+		"\t\tOn tmpfs they survive a crash of zmodopipe, on disk a power cut too\n"
+		"    -d <string>\tDirectory to dump to (default /tmp/dvralert)\n"
+		"    -f <string>\tDump format, h264 or mp4 (default h264)\n"
+		"    -Z\t\tForward with splice(), without copying (not with -b, -x or -w)\n"
+		"    -q <int>\tms of stream queued for a slow reader (default 2000, 0 to drop straight away)\n"
+		"    -x <int>\tSeconds of stream shared in /dev/shm/<pipe name><ch#> for any number of readers\n"
+		"    -M <string>\tServe Prometheus metrics on this loopback port, or unix socket if it's a path\n"
+		"    -T <int>\tConnect timeout in ms (default 3000)\n"
+		"    -R <int>\tMax ms between reconnect attempts, they back off up to it (default 10000)\n"
+		"    -w <string>\tRecord every channel continuously to preallocated segment files in this directory\n"
+		"    -W <int>\tMB of segment files per channel, the oldest are overwritten (default 1024)\n"
+		"    -C <string>\tTake commands on this unix socket, send \"help\" for the list\n"
 		"    -v\t\tVerbose output\n"
 		"    -u <string>\tUsername\n"
 		"    -a <string>\tPassword\n"
@@ -696,10 +5248,9 @@ void display_usage(char *name)
 	"\n");
 }
 
+// Only async-signal-safe work in here, the loops act on the flags
 void sigHandler(int sig)
 {
-	printMessage(true, "Received signal: %i\n", sig);
-	
 	switch( sig )
 	{
 	case SIGTERM:
@@ -709,13 +5260,74 @@ void sigHandler(int sig)
 		break;
 	case SIGUSR1:
 	case SIGALRM:
-	case SIGPIPE:
 		g_cleanUp = 2;
 		break;
 	case SIGUSR2:
 		g_cleanUp = 3;
 		break;
+	case SIGHUP:
+		// Only when, the streaming loop raises the alarm (raiseAlarm)
+		__atomic_store_n(&g_alarmSignal, wallMs(), __ATOMIC_RELAXED);
+		break;
+	}
+}
+
+// An alarm opens an incident, every channel is cut around the instant when it came in.
+// Alarms while it's open extend it. Runs on the streaming loop for a SIGHUP and for the
+// snapshot command, in fork mode on the parent's main thread and its control thread.
+void raiseAlarm(long long when)
+{
+	pthread_mutex_lock(&g_alarmLock);
+	if( g_processCh == -1 && g_snapshot )
+	{
+		if( g_snapshot->time && when - g_snapshot->last <= longestPost() * 1000LL + SNAPSHOT_TIMEOUT )
+		{
+			__atomic_store_n(&g_snapshot->last, when, __ATOMIC_RELEASE);
+			g_snapshot->alarms++;
+		}
+		else
+		{
+			memset(g_snapshot, 0, sizeof(*g_snapshot));
+			g_snapshot->last = when;
+			g_snapshot->alarms = 1;
+			__atomic_store_n(&g_snapshot->time, when, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&g_alarmLock);
+
+	// The parent doesn't stream in fork mode, pass it on to the children
+	if( g_processCh == -1 && !globalArgs.eventLoop )
+	{
+		int loopIdx;
+
+		for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+		{
+			if( g_childPids[loopIdx] > 0 )
+				kill( g_childPids[loopIdx], SIGHUP );
+		}
+	}
+	else
+		g_dumpRequest = true;
+}
+
+// Wait for a child of the fork mode parent to exit, 0 if told to stop first. SIGHUP is
+// blocked in the parent and taken here, so its alarm is raised outside the handler.
+int waitChildren(int *status)
+{
+	struct timespec poll = { 0, CHILD_POLL * 1000000L };
+	sigset_t hup;
+	int pid;
+
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+
+	while( (pid = waitpid(-1, status, WNOHANG)) == 0 && g_cleanUp != true )
+	{
+		if( sigtimedwait(&hup, NULL, &poll) == SIGHUP )
+			raiseAlarm(wallMs());
 	}
+
+	return pid;
 }
 
 int printMessage(bool verbose, const char *message, ...)
@@ -739,12 +5351,9 @@ int printMessage(bool verbose, const char *message, ...)
 // This is more compatible, but less reliable than the Media mode.
 // h264 decoder shows "This stream was generated by a broken encoder, invalid 8x8 inference"
 // Output is 320x240@25fps ~160kbit/s VBR
-int ConnectViaMobile(int sockFd, int channel)
+int ConnectViaMobile(struct loginScript *login, int channel)
 {
 	struct QSeeLoginMobile loginBuf = {0};
-	int retval;
-	int header;
-	char recvBuf[128];
 
 	// do writing
 	// Setup login buffer
@@ -755,68 +5364,21 @@ int ConnectViaMobile(int sockFd, int channel)
 	strcpy(loginBuf.user, globalArgs.username);
 	strcpy(loginBuf.pass, globalArgs.password);
 
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-
-	if( globalArgs.verbose )
-	{
-		printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
-	}
-
-	// do reading
-	// Get header length (4 bytes)
-	retval = recv(sockFd, &header, sizeof(header), 0);
-	if( retval != 4 )
-	{
-		printMessage(true, "Ch %i: Receive 1 failed.\n", channel+1);
+	if( loginSend(login, &loginBuf, sizeof(loginBuf)) != 0 )
 		return 1;
-	}
 
-	header = ntohl(header);
-	
-	// Get next section (20 bytes)
-	retval = recv(sockFd, recvBuf, header, 0);
-	if( retval != header )
-	{
-		printMessage(true, "Ch %i: Receive 2 failed.\n", channel+1);
-		return 1;
-	}
+	// do reading
+	// A 4 byte length, then the login status (20 bytes)
+	loginAdd(login, login_recvSized, 4, 0);
 
 	// Check login status
-	if( recvBuf[16] != 1 )
-	{
-		printMessage(true, "Ch %i: Login failed: ", channel+1);
-		int x;
-		for( x=0;x<header;x++)
-			printMessage(true, "%02x", recvBuf[x]);
-		return 1;
-	}
+	loginAdd(login, login_expect, 16, 1);
 
-	// Read next sections
-	retval = recv(sockFd, recvBuf, sizeof(header), 0);
-	if( retval != sizeof(header) && recvBuf[3] != 0 )
-	{
-		printMessage(true, "Ch %i: Problem length (4): %i, recvBuf[3]: %i\n", channel+1, retval, (int)recvBuf[3]);
-		return 1;
-	}
-
-	header = recvBuf[3] & 0xFF;
-	
-	retval = recv(sockFd, recvBuf, header, 0);
-	if( retval != header )
-	{
-		printMessage(true, "Ch %i: Receive 3 failed.\n", channel+1);
-		return 1;
-	}
+	// Next section, its length is in the last byte of its header
+	loginAdd(login, login_recvSized, 1, 0);
 
 	// Read another 27 bytes
-	header = 27;
-	
-	retval = recv(sockFd, recvBuf, header, 0);
-	if( retval != header )
-	{
-		printMessage(true, "Ch %i: Receive 4 failed.\n", channel+1);
-		return 1;
-	}
+	loginAdd(login, login_recv, 27, 0);
 
 	// If we got here, the stream will be waiting for us to recv.
 	return 0;
@@ -824,23 +5386,17 @@ int ConnectViaMobile(int sockFd, int channel)
 
 // This is less compatible, but more reliable than the mobile mode
 // Output is 704x480@25fps 1200kbit/s VBR
-int ConnectViaMedia(int sockFd, int channel)
+int ConnectViaMedia(struct loginScript *login, int channel)
 {
 	struct QSeeLoginMedia loginBuf;
-	int retval;
 	static bool beenHere = false;
 
 	memset(&loginBuf, 0, sizeof(loginBuf));
 
 	// Some models take a special header first
 	// Mine doesn't, so this is untested
-	if( globalArgs.model == media_header )
-	{
-		retval = send(sockFd, "0123456", 7, 0);
-
-		if( globalArgs.verbose )
-			printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
-	}
+	if( globalArgs.model == media_header && loginSend(login, "0123456", 7) != 0 )
+		return 1;
 
 	// Setup login buffer
 	loginBuf.valc[10] = 0x01;
@@ -861,36 +5417,16 @@ int ConnectViaMedia(int sockFd, int channel)
 		beenHere = true;
 	}
 
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-
-	if( globalArgs.verbose )
-		printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
-
-/*	// Not sure when this is used, possibly some other model
-	// do reading
-	// Get header length (8 bytes)
-	retval = recv(sockFd, &recvBuf, 8, 0);
-	if( retval != 8 )
-	{
-		if( retval != 16 )
-		{
-			printMessage(true, "Receive 1 failed.\n");
-			return 1;
-		}
-	}
-*/
-	// If we got here, the stream will be waiting for us to recv.
-	return 0;
+	// Some other model might answer with 8 (or 16) bytes first, mine doesn't
+	return loginSend(login, &loginBuf, sizeof(loginBuf));
 }
 
 // QT5 Family (ie. QT-504)
 // the QT-504 is a bit different, it sends 3 packets for login.
-int ConnectQT504(int sockFd, int channel)
+int ConnectQT504(struct loginScript *login, int channel)
 {
 	char suppLoginBuf[88] = {0};
 	struct QSee504Login loginBuf;
-	int retval;
-	char recvBuf[532];
 	static bool beenHere = false;
 
 	memset(&loginBuf, 0, sizeof(loginBuf));
@@ -926,23 +5462,11 @@ int ConnectQT504(int sockFd, int channel)
 	}
 
 	// Send the login packet (1 of 4)
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-
-	if( globalArgs.verbose )
-	{
-		printMessage(true, "Ch %i: Send 1 result: %i\n", channel+1, retval);
-	}
-
-	// do reading
-	// Get header length (4 bytes)
-	retval = recv(sockFd, &recvBuf, 532, 0);
+	if( loginSend(login, &loginBuf, sizeof(loginBuf)) != 0 )
+		return 1;
 
-	// Verify send was successful
-	if( retval != 532 )
-	{
-		printMessage(true, "Ch %i: Receive 1 failed: %i\n", channel+1, retval);
-	//	return 1;
-	}
+	// The reply should be 532 bytes, but a shorter one was never fatal
+	loginAdd(login, login_recvAny, 532, 0);
 	
 	/* Inbetween the 2 and last packets there is another packet.
 	 * It seems to be optional.
@@ -978,19 +5502,11 @@ int ConnectQT504(int sockFd, int channel)
 	
 
 	// Send the next packet (2 of 4)
-	retval = send(sockFd, suppLoginBuf, 88, 0);
-
-	if( globalArgs.verbose )
-	{
-		printMessage(true, "Ch %i: Send 2 result: %i\n", channel+1, retval);
-	}
+	if( loginSend(login, suppLoginBuf, 88) != 0 )
+		return 1;
 
-	retval = 0;
-	{
-	int ret = 0;
-	while( (ret = recv(sockFd, recvBuf, sizeof(recvBuf), 0)) > 0 )
-		retval += ret;
-	}
+	// Its reply has no known length, take everything until the DVR goes quiet
+	loginAdd(login, login_drain, LOGIN_DRAIN_QUIET, 0);
 	
 	suppLoginBuf[0] = 0x31;
 	suppLoginBuf[1] = 0x31;
@@ -1011,46 +5527,26 @@ int ConnectQT504(int sockFd, int channel)
 	}
 
 	// Send the next packet (3 of 4)
-	retval = send(sockFd, suppLoginBuf, 60, 0);
-
-	if( globalArgs.verbose )
-	{
-		printMessage(true, "Ch %i: Send 3 result: %i\n", channel+1, retval);
-	}
-
-	// do reading
-	retval = recv(sockFd, recvBuf, 124, 0);
-
-	// Verify send was successful
-	if( retval <= 0 )
-	{
-		printMessage(true, "Ch %i: Receive 3 failed.\n", channel+1);
+	if( loginSend(login, suppLoginBuf, 60) != 0 )
 		return 1;
-	}
-	else
-		printMessage(true, "Ch %i: Receive 3 result: %i bytes.\n", channel+1, retval);
-	
+
+	// Up to 124 bytes back
+	loginAdd(login, login_recvAny, 124, 0);
 
 	// Reuse the old buffer, last three bytes should still be 0
 	//suppLoginBuf[5] = 0;
 	
 	// Send the last packet (4 of 4)
-	//retval = send(sockFd, suppLoginBuf, 8, 0);
-
-	//if( globalArgs.verbose )
-	//{
-	//	printMessage(true, "Ch %i: Send 4 result: %i\n", channel+1, retval);
-	//}
+	//loginSend(login, suppLoginBuf, 8);
 
 	// If we got here, the stream will be waiting for us to recv.
 	return 0;
 }
 
 // Output is 352x240@25fps VBR
-int ConnectDVR8104ViaMobile(int sockFd, int channel)
+int ConnectDVR8104ViaMobile(struct loginScript *login, int channel)
 {
 	struct DVR8104MobileLogin loginBuf;
-	int retval;
 	static bool beenHere = false;
 
 	memset(&loginBuf, 0, sizeof(loginBuf));
@@ -1093,27 +5589,15 @@ int ConnectDVR8104ViaMobile(int sockFd, int channel)
 		beenHere = true;
 	}
 
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-
-	if( retval != sizeof(loginBuf) )
-	{
-		printMessage(true, "Ch %i: Send failed, was: %i, should be: %i\n", channel+1, retval, (int)sizeof(loginBuf));	
-		return 1;
-	}
-	if( globalArgs.verbose )
-		printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
-
 	// If we got here, the stream will be waiting for us to recv.
-	return 0;
+	return loginSend(login, &loginBuf, sizeof(loginBuf));
 }
 
 // CnM Classic 4 Cam
 // http://194.150.201.35/cnmsecure/support/4CamClassicKit.htm
-int ConnectCnMClassic(int sockFd, int channel)
+int ConnectCnMClassic(struct loginScript *login, int channel)
 {
 	struct CnMClassicLogin loginBuf;
-	int retval;
-	char recvBuf[532];
 	static bool beenHere = false;
 
 	memset(&loginBuf, 0, sizeof(loginBuf));
@@ -1135,44 +5619,23 @@ int ConnectCnMClassic(int sockFd, int channel)
 	}
 
 	// Send the login packet
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-
-	if( globalArgs.verbose )
-	{
-		printMessage(true, "Ch %i: Send 1 result: %i\n", channel+1, retval);
-	}
-
-	// do reading (1 of 2)
-	retval = recv(sockFd, &recvBuf, 8, 0);
-
-	// Verify send was successful
-	if( retval != 8 && recvBuf[0] != 1 )
-	{
-		printMessage(true, "Ch %i: Receive 1 failed: %i\n", channel+1, retval);
-		printBuffer((char*)&recvBuf, sizeof(recvBuf));
+	if( loginSend(login, &loginBuf, sizeof(loginBuf)) != 0 )
 		return 1;
-	}
-	
+
 	// do reading (1 of 2)
-	retval = recv(sockFd, &recvBuf, 520, 0);
+	loginAdd(login, login_recv, 8, 0);
 
-	// Verify send was successful
-	if( retval != 520 )
-	{
-		printMessage(true, "Ch %i: Receive 2 failed: %i\n", channel+1, retval);
-		printBuffer((char*)&recvBuf, sizeof(recvBuf));
-		return 1;
-	}
+	// do reading (2 of 2)
+	loginAdd(login, login_recv, 520, 0);
 
 	// If we got here, the stream will be waiting for us to recv.
 	return 0;
 }
 
 // Visionari 4/8 Channel DVR
-int ConnectVisionari(int sockFd, int channel)
+int ConnectVisionari(struct loginScript *login, int channel)
 {
         struct VisionariLogin loginBuf;
-        int retval;
         static bool beenHere = false;
 
         memset(&loginBuf, 0, sizeof(loginBuf));
@@ -1214,27 +5677,15 @@ int ConnectVisionari(int sockFd, int channel)
                 beenHere = true;
         }
 
-        retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-
-        if( retval != sizeof(loginBuf) )
-        {
-                printf("Ch %i: Send failed, was: %i, should be: %i\n", channel+1, retval, (int)sizeof(loginBuf));
-                return 1;
-        }
-        if( globalArgs.verbose )
-                printf("Ch %i: Send result: %i\n", channel+1, retval);
-
         // If we got here, the stream will be waiting for us to recv.
-        return 0;
+        return loginSend(login, &loginBuf, sizeof(loginBuf));
 }
 
 // For some Swann models (Hardware version DM-70D, Device type DVR04B)
-int ConnectSwannViaMedia(int sockFd, int channel)
+int ConnectSwannViaMedia(struct loginScript *login, int channel)
 {
 	struct SwannLoginMedia loginBuf;
-	int retval;
 	static bool beenHere = false;
-	char recvBuf[16];
 	short *shrtval;
 	memset(&loginBuf, 0, sizeof(loginBuf));
 
@@ -1262,31 +5713,21 @@ int ConnectSwannViaMedia(int sockFd, int channel)
 		beenHere = true;
 	}
 
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-	printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
+	if( loginSend(login, &loginBuf, sizeof(loginBuf)) != 0 )
+		return 1;
+
+	// before video stream, a small packet is sent (8 bytes)
+	loginAdd(login, login_recv, 8, 0);
 
-	// before video stream, a small packet is sent
-	// Get header length (8 bytes)
-	retval = recv(sockFd, &recvBuf, 8, 0);
-	if( retval != 8 )
-	{
-		if( retval != 16 )
-		{
-			printMessage(false, "Receive 1 failed.\n");
-			return 1;
-		}
-	}
 	// If we got here, the stream will be waiting for us to recv.
 	return 0;
 }
 
-int ConnectSwannDVR8(int sockFd, int channel)
+int ConnectSwannDVR8(struct loginScript *login, int channel)
 {
 	char channelBuf[32] = {0};
 	struct SwannDVR8 loginBuf;
-	int retval;
 	static bool beenHere = false;
-	char recvBuf[9686];
 	memset(&loginBuf, 0, sizeof(loginBuf));
 
 	// Setup login buffer
@@ -1318,7 +5759,7 @@ int ConnectSwannDVR8(int sockFd, int channel)
 	*(short*)&channelBuf[19] = htons(channel);     //channel number
 	*(short*)&channelBuf[23] = htons(channel);     //channel number
 	
-	channelBuf[28] = 0x01;     // Streaming Quality
+	channelBuf[28] = globalArgs.highQuality[channel] ? 0x00 : 0x01;     // Streaming Quality
 	                           //seems to be 0x01 for Video: h264 (High), yuv420p, 352x240, 8.83 fps, 4 tbr, 1200k tbn, 8 tbc
 	                           //and 0x00 for Video: h264 (High), yuv420p, 704x480, 30 fps, 30 tbr, 1200k tbn, 60 tbc
 	//total length 32 bytes
@@ -1330,34 +5771,19 @@ int ConnectSwannDVR8(int sockFd, int channel)
 		beenHere = true;
 	}
 
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-	printMessage(true, "Ch %i: Send Login result: %i\n", channel+1, retval);
-	
-	retval = recv(sockFd, recvBuf, sizeof(recvBuf), 0);
-	
-	//printBuffer((char*)&recvBuf, 32);
-	printMessage(true, "Received Login Result: %i\n", retval);
-	//printMessage(true, "X: %02x\n", (unsigned char)(recvBuf[8])); Value should be 0x50
-	
-	
-	// Send packet to open channel
-	retval = send(sockFd, channelBuf, sizeof(channelBuf), 0);
-	
-	// Verify send was successful
-	if( retval != 32 )
-	{
-		printMessage(true, "Ch %i: Could not open channel, Streaming failed.\n", channel+1);
+	if( loginSend(login, &loginBuf, sizeof(loginBuf)) != 0 )
 		return 1;
-	}
-	else
-		printMessage(true, "Ch %i: Send Channel result: %i bytes.\n", channel+1, retval);
+
+	// The login result, whatever arrives first (value at [8] should be 0x50)
+	loginAdd(login, login_recvAny, 9686, 0);
 	
+	// Send packet to open channel
 	// If we got here, the stream will be waiting for us to recv.
-	return 0;
+	return loginSend(login, channelBuf, sizeof(channelBuf));
 }
 
 
-int ConnectMEYE(int sockFd, int channel)
+int ConnectMEYE(struct loginScript *login, int channel)
 {
 	
 //00000000  00 00 00 48 00 00 00 00  28 00 04 00 05 00 00 00 ...H.... (.......
@@ -1368,13 +5794,11 @@ int ConnectMEYE(int sockFd, int channel)
 //76 bytes total
 
 	struct mEye loginBuf;
-	int retval;
 	static bool beenHere = false;
 	memset(&loginBuf, 0, sizeof(loginBuf));
 	char initBuf[43] = {0};
 	char configBuf[18] = {0};
 	char channelBuf[26] = {0};
-	char recvBuf[1024];
 
     // Setup the init buffer
     strcpy(initBuf, "GET /bubble/live?ch=0&stream=0 HTTP/1.1");
@@ -1412,7 +5836,7 @@ int ConnectMEYE(int sockFd, int channel)
 	channelBuf[4] = 0x15;
 	channelBuf[5] = 0x0a;
 	*(short*)&channelBuf[9] = htons(channel);     //channel number	
-	channelBuf[14] = 0x01;                         // Quality? 0=High, 1=Low
+	channelBuf[14] = globalArgs.highQuality[channel] ? 0x00 : 0x01;  // Quality? 0=High, 1=Low
 	channelBuf[18] = 0x01;
 		//total length 26 bytes
 	
@@ -1426,46 +5850,22 @@ int ConnectMEYE(int sockFd, int channel)
 		beenHere = true;
 	}
 	
-	// send init packet
-	retval = send(sockFd, (char*)(&initBuf), sizeof(initBuf), 0);
-	printMessage(true, "Ch %i: Send Init result: %i\n", channel+1, retval);
-	
-	retval = recv(sockFd, recvBuf, sizeof(recvBuf), 0);  // expect 1024 byte response after login request
-	
-	//printBuffer((char*)&recvBuf, 32);
-	printMessage(true, "Received Init Result(expect 1024): %i\n", retval);
-	
-	// send login packet
-	retval = send(sockFd, (char*)(&loginBuf), sizeof(loginBuf), 0);
-	printMessage(true, "Ch %i: Send Login result: %i\n", channel+1, retval);
-	
-	retval = recv(sockFd, recvBuf, 54, 0);  // expect 54 byte response after login request
-	
-	//printBuffer((char*)&recvBuf, 32);
-	printMessage(true, "Received Login Result(expect 54): %i\n", retval);
-	
-	// send configure packet
-	retval = send(sockFd, (char*)(&configBuf), sizeof(configBuf), 0);
-	printMessage(true, "Ch %i: Send config result: %i\n", channel+1, retval);
+	// send init packet, expect 1024 byte response
+	if( loginSend(login, initBuf, sizeof(initBuf)) != 0 )
+		return 1;
+	loginAdd(login, login_recv, 1024, 0);
 	
-	retval = recv(sockFd, recvBuf, 22, 0);  // expect 22 byte response after config request
+	// send login packet, expect 54 byte response
+	if( loginSend(login, &loginBuf, sizeof(loginBuf)) != 0 )
+		return 1;
+	loginAdd(login, login_recv, 54, 0);
 	
-	//printBuffer((char*)&recvBuf, 32);
-	printMessage(true, "Received Login Result(expect 22): %i\n", retval);
+	// send configure packet, expect 22 byte response
+	if( loginSend(login, configBuf, sizeof(configBuf)) != 0 )
+		return 1;
+	loginAdd(login, login_recv, 22, 0);
 	
 	// Send packet to open channel
-	retval = send(sockFd, channelBuf, sizeof(channelBuf), 0);
-	
-	
-	// Verify send was successful, all 26 bytes
-	if( retval != 26 )
-	{
-		printMessage(true, "Ch %i: Could not open channel, Streaming failed.\n", channel+1);
-		return 1;
-	}
-	else
-		printMessage(true, "Ch %i: Send Channel result: %i bytes.\n", channel+1, retval);
-
 	// If we got here, the stream will be waiting for us to recv.
-	return 0;
-}
\ No newline at end of file
+	return loginSend(login, channelBuf, sizeof(channelBuf));
+}
@@ -0,0 +1,65 @@
+/*****************************************
+ * libzmodopipe embedding API            *
+ * License: Public Domain                *
+ *****************************************/
+
+// libzmodopipe.so is zmodopipe's streaming engine without the FIFOs: it logs in to
+// the DVR and streams the opened channels from a thread of the calling process,
+// keeping the last seconds of each in a ring. Frames are handed out as pointers
+// into that ring, nothing is copied on the way. zmodopipe.py wraps it with ctypes.
+//
+//   zmodoOpen("192.168.1.4", 0, 9, "admin", "admin", 1 << 0 | 1 << 2, 10);
+//   while( zmodoPoll(1, &frame, 1000) >= 0 ) ...
+//   zmodoSnapshot(1, alarm - 10000, alarm + 4000, "/tmp/alarm.mp4");
+//   zmodoClose();
+//
+// One engine per process. Each channel has one poll cursor, poll a channel from one
+// thread at a time. A frame's bytes stay in the ring until it laps them, about the
+// seconds passed to zmodoOpen later: use them or copy them before then, zmodoValid
+// tells if that happened. They are gone after zmodoClose.
+//
+// Compile: gcc -Wall -O2 -fPIC -shared -fvisibility=hidden -pthread -DZMODO_LIBRARY zmodopipe.c nalscan.c mp4mux.c -o libzmodopipe.so
+
+#ifndef ZMODOPIPE_H
+#define ZMODOPIPE_H
+
+#include <stddef.h>
+
+#define ZMODO_API __attribute__((visibility("default")))
+
+// One access unit (frame) of a channel, complete once the next one began arriving
+struct zmodoFrame
+{
+	const unsigned char *data;	// the frame, Annex-B as the DVR sent it
+	size_t len;			// bytes at data
+	const unsigned char *wrap;	// the rest of it at the start of the ring if it wraps, else NULL
+	size_t wrapLen;			// bytes at wrap
+	unsigned long long offset;	// stream offset of its first byte
+	long long time;			// arrival, ms since the epoch
+	int key;			// 1 if it's a keyframe (IDR)
+	unsigned long long lapped;	// times the channel overran the poll cursor, it then skipped to a keyframe
+};
+
+// Log in to the DVR at host and stream the channels set in the channels mask
+// (bit 0 is channel 1) keeping seconds of each. port 0 uses the model's default,
+// model is zmodopipe's -m. Returns 0 once the engine is running, -1 on failure.
+ZMODO_API int zmodoOpen(const char *host, int port, int model, const char *username, const char *password,
+	unsigned int channels, int seconds);
+
+// Next frame of a channel (1 based), waiting up to timeoutMs for it (-1 forever, 0 not at all).
+// The first poll starts on the latest keyframe. Returns 1 with frame filled in,
+// 0 if none arrived in time, -1 if the channel isn't streamed.
+ZMODO_API int zmodoPoll(int channel, struct zmodoFrame *frame, int timeoutMs);
+
+// 1 while the bytes of a polled frame are still in the ring, 0 once they may have been overwritten
+ZMODO_API int zmodoValid(int channel, const struct zmodoFrame *frame);
+
+// Write the stream a channel received between from and to (ms since the epoch) to path,
+// from the keyframe at or before from. Written as fragmented MP4 if path ends with .mp4,
+// raw h264 otherwise. Returns the stream bytes written or -1 on failure.
+ZMODO_API long long zmodoSnapshot(int channel, long long from, long long to, const char *path);
+
+// Stop streaming and free the rings
+ZMODO_API void zmodoClose(void);
+
+#endif
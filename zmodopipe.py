@@ -0,0 +1,199 @@
+#!/usr/bin/env python
+##
+##  ctypes binding for libzmodopipe.so, the C API is described in zmodopipe.h
+##
+##  Public Domain
+##
+
+'''
+Streams DVR channels inside the Python process, no zmodopipe subprocess or FIFOs.
+Frames come straight out of the library's ring as memoryviews, nothing is copied
+unless a frame wraps around the end of the ring.
+
+    dvr = zmodopipe.DVR('192.168.1.4', [1, 3], model=9, seconds=10)
+    frame = dvr.poll(1, timeout=1.0)
+    if frame and frame.key: ...
+    dvr.snapshot(1, alarm - 10, alarm + 4, '/tmp/alarm.mp4')
+    dvr.close()
+
+A frame's data is only good until the ring laps it, about seconds later: use it or
+copy it (bytes(frame.data)) before then, frame.valid() tells if that happened.
+It is gone for good once the DVR is closed, the library frees its rings: frame.data
+raises ValueError then, and a view taken of it before is released (Python 3) or
+dangling (Python 2, or a slice of it), so copy what is kept past close().
+'''
+
+import os                                   # find the library next to this file
+import sys
+import time
+import ctypes                               # call into libzmodopipe.so
+import getopt                               # options of the command-line check
+import weakref                              # frames handed out, released by close()
+
+class _Frame(ctypes.Structure):
+    _fields_ = [('data', ctypes.c_void_p),
+                ('len', ctypes.c_size_t),
+                ('wrap', ctypes.c_void_p),
+                ('wrapLen', ctypes.c_size_t),
+                ('offset', ctypes.c_ulonglong),
+                ('time', ctypes.c_longlong),
+                ('key', ctypes.c_int),
+                ('lapped', ctypes.c_ulonglong)]
+
+def load(path=None):
+    ''' Load libzmodopipe.so, from next to this file if it's there '''
+    if path is None:
+        local = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libzmodopipe.so')
+        path = local if os.path.exists(local) else 'libzmodopipe.so'
+    lib = ctypes.CDLL(path)
+    lib.zmodoOpen.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p,
+                              ctypes.c_uint, ctypes.c_int]
+    lib.zmodoPoll.argtypes = [ctypes.c_int, ctypes.POINTER(_Frame), ctypes.c_int]
+    lib.zmodoValid.argtypes = [ctypes.c_int, ctypes.POINTER(_Frame)]
+    lib.zmodoSnapshot.argtypes = [ctypes.c_int, ctypes.c_longlong, ctypes.c_longlong, ctypes.c_char_p]
+    lib.zmodoSnapshot.restype = ctypes.c_longlong
+    lib.zmodoClose.argtypes = []
+    lib.zmodoClose.restype = None
+    return lib
+
+def _view(addr, size):
+    return memoryview((ctypes.c_ubyte * size).from_address(addr)).cast('B') \
+        if sys.version_info[0] >= 3 else memoryview((ctypes.c_ubyte * size).from_address(addr))
+
+class Frame(object):
+    ''' One access unit of a channel, time is in seconds since the epoch like time.time() '''
+
+    def __init__(self, dvr, channel, raw):
+        self._dvr = dvr
+        self._raw = raw
+        self.channel = channel
+        self.offset = raw.offset
+        self.time = raw.time / 1000.0
+        self.key = bool(raw.key)
+        self.lapped = raw.lapped
+        self.size = raw.len + raw.wrapLen
+        self._closed = False
+        self._inRing = not raw.wrap
+        if raw.wrap:
+            # only a frame across the end of the ring has to be joined
+            self._data = memoryview(bytes(_view(raw.data, raw.len)) + bytes(_view(raw.wrap, raw.wrapLen)))
+        else:
+            self._data = _view(raw.data, raw.len)
+        dvr._frames.add(self)
+
+    @property
+    def data(self):
+        ''' The frame, raises ValueError once its DVR was closed and the ring freed '''
+        if self._data is None:
+            raise ValueError('Frame of channel %s is gone, its DVR was closed' % self.channel)
+        return self._data
+
+    def valid(self):
+        ''' False once the ring may have overwritten the frame's data '''
+        return not self._closed and self._dvr._lib.zmodoValid(self.channel, ctypes.byref(self._raw)) == 1
+
+    def _close(self):
+        ''' The library is about to free the ring, nothing may read it from now on '''
+        self._closed = True
+        if self._inRing:
+            if hasattr(self._data, 'release'):
+                self._data.release()
+            self._data = None
+
+class DVR(object):
+    ''' The DVR's channels streamed by libzmodopipe, one per process '''
+
+    def __init__(self, host, channels, model=9, port=0, username='admin', password='admin', seconds=10, lib=None):
+        self._lib = lib or load()
+        self._raw = _Frame()
+        self._frames = weakref.WeakSet()
+        mask = 0
+        for ch in channels:
+            mask |= 1 << (int(ch) - 1)
+        if self._lib.zmodoOpen(host.encode(), port, model, username.encode(), password.encode(), mask, seconds) != 0:
+            raise IOError('Cannot start streaming from %s' % host)
+        self.channels = list(channels)
+
+    def poll(self, channel, timeout=None):
+        ''' Next frame of a channel, None if none arrived within timeout seconds (None waits forever) '''
+        ms = -1 if timeout is None else int(timeout * 1000)
+        ret = self._lib.zmodoPoll(channel, ctypes.byref(self._raw), ms)
+        if ret < 0:
+            raise IOError('Channel %s is not streaming' % channel)
+        if ret == 0:
+            return None
+        frame = Frame(self, channel, self._raw)
+        self._raw = _Frame()
+        return frame
+
+    def frames(self, channel, timeout=None):
+        ''' Generator of a channel's frames until timeout passes without one '''
+        while True:
+            frame = self.poll(channel, timeout)
+            if frame is None:
+                return
+            yield frame
+
+    def snapshot(self, channel, start, end, path):
+        ''' Write what a channel received between start and end (seconds since the epoch)
+            to path from the keyframe before start, MP4 if path ends with .mp4. Returns the bytes written. '''
+        written = self._lib.zmodoSnapshot(channel, int(start * 1000), int(end * 1000), path.encode())
+        if written < 0:
+            raise IOError('Cannot write channel %s to %s' % (channel, path))
+        return written
+
+    def close(self):
+        ''' Stop streaming, the frames handed out lose their data with the rings '''
+        for frame in list(self._frames):
+            frame._close()
+        self._lib.zmodoClose()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+def usage():
+    print('Usage: %s -s <dvr ip> [-p <port>] [-m <model>] [-u <user>] [-a <pass>] -c <ch#> [-n <frames>] [-o <clip.mp4>]'
+          % sys.argv[0])
+
+if __name__ == '__main__':
+    # Streams a channel for a number of frames, prints what came in and optionally writes them out
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 's:p:m:u:a:c:n:o:h')
+    except getopt.GetoptError:
+        usage()
+        sys.exit(1)
+    conf = {'-p': '0', '-m': '9', '-u': 'admin', '-a': 'admin', '-n': '100'}
+    conf.update(dict(opts))
+    if '-h' in conf or '-s' not in conf or '-c' not in conf:
+        usage()
+        sys.exit(0 if '-h' in conf else 1)
+
+    ch = int(conf['-c'])
+    count = keys = size = 0
+    start = time.time()
+    with DVR(conf['-s'], [ch], int(conf['-m']), int(conf['-p']), conf['-u'], conf['-a']) as dvr:
+        for frame in dvr.frames(ch, timeout=5):
+            if count == 0 and not frame.key:
+                print('First frame is not a keyframe')
+                sys.exit(1)
+            count += 1
+            keys += frame.key
+            size += frame.size
+            if count == int(conf['-n']):
+                break
+        if '-o' in conf and count:
+            print('%i bytes written to %s' % (dvr.snapshot(ch, start, time.time(), conf['-o']), conf['-o']))
+    print('%i frames, %i keyframes, %i bytes in %.1f s' % (count, keys, size, time.time() - start))
+
+    # The rings are freed, a frame kept past close() mustn't read them
+    if count and frame._inRing:
+        try:
+            frame.data
+            print('Frame data still readable after close')
+            sys.exit(1)
+        except ValueError:
+            pass
+    sys.exit(0 if count == int(conf['-n']) else 1)
@@ -0,0 +1,62 @@
+/*****************************************
+ * zmodopipe continuous recording store  *
+ * License: Public Domain                *
+ *****************************************/
+
+// With -w zmodopipe records every channel into a fixed set of preallocated segment
+// files, <dir>/<pipeName><channel>-<n>.seg, overwriting the oldest when it runs out.
+// The files are allocated once (fallocate) and written in large aligned blocks
+// from start to end, so the file system never fragments them and an SD card sees
+// nothing but sequential writes of whole erase blocks.
+//
+// Segment layout, integers are little endian as written by the host:
+//  - A header page (struct zrecHeader), the index from indexOffset, then size bytes
+//    of stream from dataOffset.
+//  - length bytes of stream are valid. A segment starts on a keyframe (its access
+//    unit, SPS/PPS included) unless the stream had none when the previous one filled.
+//  - sequence orders the segments of a channel, the one with the highest is being
+//    written. 0 means the file was never written. A header is rewritten after
+//    every block, so after a crash at most the last block is missing from length.
+//  - The first indexCount index entries are valid, in stream order. Each keyframe
+//    gets one, and a chunk of stream gets a time mark if the last entry is older than
+//    ZREC_MARK_INTERVAL. Map the file up to dataOffset and binary search them by time
+//    to find where to start reading, zmodopipe-extract does.
+
+#ifndef ZMODOREC_H
+#define ZMODOREC_H
+
+#include <stdint.h>
+
+#define ZREC_MAGIC 0x4345525a	// "ZREC"
+#define ZREC_VERSION 1
+#define ZREC_INDEX_OFFSET 4096	// index starts a page into the file
+#define ZREC_DATA_OFFSET 65536	// stream starts after the index
+#define ZREC_INDEX_ENTRIES ((ZREC_DATA_OFFSET - ZREC_INDEX_OFFSET) / sizeof(struct zrecIndexEntry))
+#define ZREC_MARK_INTERVAL 500	// ms between time marks
+#define ZREC_KEYFRAME 1		// index entry flag, a keyframe's access unit starts at offset
+
+struct zrecHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t dataOffset;	// ZREC_DATA_OFFSET
+	uint32_t channel;	// 0 based
+	uint64_t sequence;	// segments written on this channel, this one included
+	uint64_t size;		// bytes of stream the segment can hold
+	uint64_t length;	// bytes of stream in it
+	int64_t startTime;	// ms since the epoch the first byte was received
+	int64_t endTime;	// and the last
+	uint32_t closed;	// 1 once the segment is complete
+	uint32_t indexOffset;	// ZREC_INDEX_OFFSET
+	uint32_t indexCount;	// valid index entries
+	uint32_t reserved[3];
+};
+
+struct zrecIndexEntry
+{
+	int64_t time;		// ms since the epoch the byte at offset was received
+	uint32_t offset;	// into the segment's stream
+	uint32_t flags;		// ZREC_KEYFRAME
+};
+
+#endif
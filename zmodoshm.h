@@ -0,0 +1,184 @@
+/*****************************************
+ * zmodopipe shared memory stream export *
+ * License: Public Domain                *
+ *****************************************/
+
+// With -x zmodopipe writes each channel into a ring in /dev/shm/<pipeName><channel>
+// that any number of readers can map. The producer never waits for a reader,
+// a reader that falls more than the ring size behind is lapped and resyncs on a keyframe.
+//
+// Protocol, all integers are little endian as written by the host:
+//  - Before copying stream data to data[offset % size] the producer stores
+//    writing, the head the copy will end at, then it copies and stores head
+//    (total bytes written) with release semantics. Readers load them with
+//    acquire semantics, or read them twice until stable where 64 bit loads
+//    aren't atomic (Python, 32 bit ARM).
+//  - Bytes [head - size, head) are valid. A reader copies from its cursor,
+//    then loads writing: if it is more than size past the cursor the copy
+//    may have been overwritten and must be thrown away.
+//  - keys[n % keyCount] for n in [keyHead - keyCount, keyHead) are offsets of
+//    recent keyframes (the start of their access unit, SPS/PPS included).
+//    New readers and lapped ones start at the latest one.
+//  - generation changes whenever the DVR connection is restarted, streamStart
+//    is the offset the new stream begins at. pid is 0 once the producer exited.
+
+#ifndef ZMODOSHM_H
+#define ZMODOSHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ZSHM_MAGIC 0x4d48535a	// "ZSHM"
+#define ZSHM_VERSION 1
+#define ZSHM_KEYS 64		// keyframes indexed
+#define ZSHM_DATA_OFFSET 4096	// data starts a page into the file
+
+struct zshmHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t dataOffset;	// ZSHM_DATA_OFFSET
+	uint32_t keyCount;	// ZSHM_KEYS
+	uint64_t size;		// bytes of data
+	uint64_t head;		// bytes written since the ring was created
+	uint64_t writing;	// head once the copy in progress is done
+	uint64_t keyHead;	// keyframes indexed since the ring was created
+	uint64_t streamStart;	// offset the current DVR connection started at
+	uint32_t generation;	// bumped on every (re)connect
+	uint32_t channel;	// 0 based
+	uint32_t pid;		// producer, 0 once it exited
+	uint32_t reserved[3];
+	uint64_t keys[ZSHM_KEYS];
+};
+
+// Reader side, everything a C consumer needs
+
+struct zshmReader
+{
+	const struct zshmHeader *hdr;
+	const unsigned char *data;
+	size_t mapLen;
+	uint64_t cursor;	// offset of the next byte to read
+	uint64_t lapped;	// times the producer overran this reader
+};
+
+static inline uint64_t zshmHead(const struct zshmReader *rd)
+{
+	return __atomic_load_n(&rd->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+// Move the cursor to the latest keyframe still in the ring, or to head if there is none
+static inline void zshmSeekKey(struct zshmReader *rd)
+{
+	const struct zshmHeader *hdr = rd->hdr;
+	uint64_t keyHead = __atomic_load_n(&hdr->keyHead, __ATOMIC_ACQUIRE);
+	uint64_t head = zshmHead(rd);
+	uint64_t idx;
+
+	rd->cursor = head;
+	for( idx=keyHead;idx>0 && idx+hdr->keyCount>keyHead;idx-- )
+	{
+		uint64_t key = __atomic_load_n(&hdr->keys[(idx - 1) % hdr->keyCount], __ATOMIC_ACQUIRE);
+
+		// Leave some slack so the producer doesn't overrun it straight away
+		if( key <= head && head - key < hdr->size - hdr->size / 4 )
+		{
+			rd->cursor = key;
+			break;
+		}
+	}
+}
+
+// Map a channel's ring and position the reader on the latest keyframe. Returns 0 on success.
+static inline int zshmAttach(struct zshmReader *rd, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(rd, 0, sizeof(*rd));
+
+	fd = open(path, O_RDONLY);
+	if( fd == -1 )
+		return -1;
+
+	if( fstat(fd, &st) == -1 || st.st_size < ZSHM_DATA_OFFSET )
+	{
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED )
+		return -1;
+
+	rd->hdr = map;
+	rd->mapLen = st.st_size;
+
+	if( rd->hdr->magic != ZSHM_MAGIC || rd->hdr->version != ZSHM_VERSION ||
+		rd->hdr->dataOffset + rd->hdr->size > rd->mapLen )
+	{
+		munmap(map, rd->mapLen);
+		rd->hdr = NULL;
+		return -1;
+	}
+
+	rd->data = (const unsigned char*)map + rd->hdr->dataOffset;
+	zshmSeekKey(rd);
+	return 0;
+}
+
+// Copy up to len bytes from the cursor. Returns the bytes copied, 0 if there is
+// nothing new, or -1 if the reader was lapped and has been moved to a keyframe.
+static inline long zshmRead(struct zshmReader *rd, unsigned char *buf, size_t len)
+{
+	uint64_t size = rd->hdr->size;
+	uint64_t head = zshmHead(rd);
+	size_t pos, part;
+
+	if( head < rd->cursor || head - rd->cursor > size )
+	{
+		rd->lapped++;
+		zshmSeekKey(rd);
+		return -1;
+	}
+
+	if( len > head - rd->cursor )
+		len = head - rd->cursor;
+	if( len == 0 )
+		return 0;
+
+	pos = rd->cursor % size;
+	part = size - pos;
+	if( part > len )
+		part = len;
+
+	memcpy(buf, rd->data + pos, part);
+	memcpy(buf + part, rd->data, len - part);
+
+	// Overwritten while we copied
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if( __atomic_load_n(&rd->hdr->writing, __ATOMIC_RELAXED) - rd->cursor > size )
+	{
+		rd->lapped++;
+		zshmSeekKey(rd);
+		return -1;
+	}
+
+	rd->cursor += len;
+	return len;
+}
+
+static inline void zshmDetach(struct zshmReader *rd)
+{
+	if( rd->hdr )
+		munmap((void*)rd->hdr, rd->mapLen);
+	memset(rd, 0, sizeof(*rd));
+}
+
+#endif
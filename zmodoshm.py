@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+##
+##  Reader for zmodopipe's shared memory stream export (zmodopipe -x),
+##  the protocol is described in zmodoshm.h
+##
+##  Public Domain
+##
+
+import mmap                                 # map the export
+import struct                               # unpack its header
+
+ZSHM_MAGIC = 0x4d48535a
+ZSHM_VERSION = 1
+
+# Offsets into struct zshmHeader
+OFF_DATA = 8
+OFF_SIZE = 16
+OFF_HEAD = 24
+OFF_WRITING = 32
+OFF_KEYHEAD = 40
+OFF_GENERATION = 56
+OFF_PID = 64
+OFF_KEYS = 80
+
+
+class ShmReader(object):
+    '''
+    One reader of a channel, any number can be attached at the same time.
+    read() never blocks the producer, if this reader falls more than the ring
+    size behind it is moved to the latest keyframe and lapped is counted.
+    '''
+
+    def __init__(self, path):
+        f = open(path, 'rb')
+        try:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        finally:
+            f.close()
+
+        magic, version, self.dataOffset, self.keyCount = struct.unpack_from('<IIII', self.map, 0)
+        if magic != ZSHM_MAGIC or version != ZSHM_VERSION:
+            raise ValueError('%s is not a zmodopipe export' % path)
+
+        self.size = self._u64(OFF_SIZE)
+        self.lapped = 0
+        self.seekKey()
+
+    def _u64(self, off):
+        # 64 bit loads aren't atomic everywhere, read until stable
+        while True:
+            a = struct.unpack_from('<Q', self.map, off)[0]
+            b = struct.unpack_from('<Q', self.map, off)[0]
+            if a == b:
+                return a
+
+    def alive(self):
+        ''' False once the producer exited '''
+        return struct.unpack_from('<I', self.map, OFF_PID)[0] != 0
+
+    def generation(self):
+        ''' Changes whenever zmodopipe reconnects to the DVR '''
+        return struct.unpack_from('<I', self.map, OFF_GENERATION)[0]
+
+    def seekKey(self):
+        ''' Move to the latest keyframe still in the ring '''
+        keyHead = self._u64(OFF_KEYHEAD)
+        head = self._u64(OFF_HEAD)
+        self.cursor = head
+        idx = keyHead
+        while idx > 0 and idx + self.keyCount > keyHead:
+            key = self._u64(OFF_KEYS + ((idx - 1) % self.keyCount) * 8)
+            if key <= head and head - key < self.size - self.size // 4:
+                self.cursor = key
+                break
+            idx -= 1
+
+    def read(self, length=65536):
+        '''
+        Returns the next bytes of the stream, '' if there is nothing new,
+        or None if the reader was lapped and moved to a keyframe
+        '''
+        head = self._u64(OFF_HEAD)
+        if head < self.cursor or head - self.cursor > self.size:
+            self.lapped += 1
+            self.seekKey()
+            return None
+
+        length = min(length, head - self.cursor)
+        pos = self.cursor % self.size
+        part = min(length, self.size - pos)
+        start = self.dataOffset + pos
+        data = self.map[start:start + part] + self.map[self.dataOffset:self.dataOffset + length - part]
+
+        # Overwritten while we copied
+        if self._u64(OFF_WRITING) - self.cursor > self.size:
+            self.lapped += 1
+            self.seekKey()
+            return None
+
+        self.cursor += length
+        return data
+
+    def close(self):
+        self.map.close()